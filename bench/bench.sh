@@ -0,0 +1,186 @@
+#!/bin/bash -e
+# LIME benchmark driver
+# This file is part of LIME, the versatile line modeling engine
+#
+# Copyright (C) 2006-2014 Christian Brinch
+# Copyright (C) 2015 The LIME development team
+#
+# Builds LIME once with -DTEST (fixed random seeds), -DCOUNTERS and
+# -DNO_NCURSES, then links it against each synthetic model in bench/models
+# for each scale point and thread count, runs it and collects throughput,
+# peak memory and scaling from the LimeReport.json/csv of each run.
+
+function usage {
+    echo "Usage: bench.sh [OPTION]"
+    echo " "
+    echo "Options:"
+    echo "   -h           Display this message"
+    echo "   -m MODELS    Models to run (default: \"sphere envelope disk multispecies\")"
+    echo "   -s SCALES    Scale points pIntensity:nchan:pxls"
+    echo "                (default: \"1000:31:50 4000:61:100 16000:121:200\")"
+    echo "   -t NTHREADS  Largest thread count of the scaling runs (default: all cores)"
+    echo "   -S MODEL     Model of the strong and weak scaling runs (default: envelope)"
+    echo "   -o DIR       Output directory (default: bench/results)"
+    echo "   -f FLAGS     Extra cpp flags for the build, e.g. -DFASTEXP"
+}
+
+models="sphere envelope disk multispecies"
+scales="1000:31:50 4000:61:100 16000:121:200"
+maxthreads=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+scalemodel="envelope"
+extraflags=""
+
+export PATHTOLIME=$( cd "$( dirname "${BASH_SOURCE[0]}" )/.." && pwd )
+export LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:${PATHTOLIME}/lib
+outdir=${PATHTOLIME}/bench/results
+
+while getopts ":hm:s:t:S:o:f:" opt; do
+    case $opt in
+	h)
+	    usage
+	    exit 0
+	    ;;
+	m)
+	    models=${OPTARG}
+	    ;;
+	s)
+	    scales=${OPTARG}
+	    ;;
+	t)
+	    maxthreads=${OPTARG}
+	    if [[ ! $maxthreads =~ ^[1-9][0-9]*$ ]]; then
+		echo "bench.sh: error: invalid number of threads" >&2
+		exit 1
+	    fi
+	    ;;
+	S)
+	    scalemodel=${OPTARG}
+	    ;;
+	o)
+	    outdir=$(mkdir -p ${OPTARG} && cd ${OPTARG} && pwd)
+	    ;;
+	f)
+	    extraflags=${OPTARG}
+	    ;;
+	\?)
+	    echo "bench.sh: error: unknown option" >&2
+	    usage
+	    exit 1
+	    ;;
+    esac
+done
+
+engineflags="-DTEST -DCOUNTERS -DNO_NCURSES ${extraflags}"
+mkdir -p ${outdir}
+
+# Value of a top-level number in LimeReport.json
+function jval {
+    sed -n 's/^ *"'"$2"'": *\([0-9.eE+-]*\).*/\1/p' "$1" | head -n 1
+}
+
+# Wall time of a phase in LimeReport.csv, summed over all its records
+function pwall {
+    awk -F, -v p="$2" 'NR>1 && $1==p {s+=$3} END {printf "%.6e", s+0}' "$1"
+}
+
+# a/b, or 0 if b is 0
+function rate {
+    awk -v a="$1" -v b="$2" 'BEGIN {if(b>0) printf "%.6e", a/b; else printf "0"}'
+}
+
+# run MODEL PINTENSITY NCHAN PXLS NTHREADS
+# Links and runs one benchmark and appends a line to results.csv
+function run {
+    local model=$1 pint=$2 nchan=$3 pxls=$4 nthr=$5
+    local name=${model}_p${pint}_c${nchan}_x${pxls}_t${nthr}
+    local dir=${outdir}/${name}
+    local defs="-DBENCH_PINTENSITY=${pint} -DBENCH_NCHAN=${nchan} -DBENCH_PXLS=${pxls} -DBENCH_NTHREADS=${nthr}"
+
+    rm -rf ${dir}
+    mkdir -p ${dir}
+    cp ${PATHTOLIME}/example/hco+@xpol.dat ${PATHTOLIME}/example/jena_thin_e6.tab ${dir}
+
+    # The engine objects are built once; only the model is recompiled
+    pushd ${PATHTOLIME} >> /dev/null
+    rm -f src/model.o
+    make EXTRACPPFLAGS="${engineflags} ${defs}" MODELS=${PATHTOLIME}/bench/models/${model}.c TARGET=${dir}/bench.x
+    popd >> /dev/null
+
+    pushd ${dir} >> /dev/null
+    echo "    ${name}"
+    ./bench.x > lime.log 2>&1
+    popd >> /dev/null
+
+    local json=${dir}/LimeReport.json csv=${dir}/LimeReport.csv
+    local photons=$(jval ${json} levelPops.photons)
+    local stateqs=$(jval ${json} levelPops.stateq_calls)
+    local rays=$(jval ${json} raytrace.rays)
+    local cells=$(jval ${json} raytrace.ray_cells)
+    local tphot=$(pwall ${csv} photon) tstateq=$(pwall ${csv} stateq)
+    local tpops=$(pwall ${csv} levelPops) tray=$(pwall ${csv} raytrace)
+    local ttotal=$(pwall ${csv} total)
+
+    echo "${model},${pint},${nchan},${pxls},${nthr},$(jval ${json} ncell),${ttotal},${tpops},${tray},$(rate ${photons} ${tphot}),$(rate ${stateqs} ${tstateq}),$(rate ${rays} ${tray}),$(rate ${cells} ${tray}),$(jval ${json} peak_rss_kb)" >> ${outdir}/results.csv
+    lastTotal=${ttotal}
+}
+
+echo "model,pIntensity,nchan,pxls,threads,ncell,total_s,levelPops_s,raytrace_s,photons_per_s,stateq_per_s,rays_per_s,cells_per_s,peak_rss_kb" > ${outdir}/results.csv
+
+pushd ${PATHTOLIME} >> /dev/null
+make clean
+popd >> /dev/null
+
+echo "*** Throughput (${maxthreads} threads)"
+for model in ${models}; do
+    for s in ${scales}; do
+	IFS=: read pint nchan pxls <<< "${s}"
+	run ${model} ${pint} ${nchan} ${pxls} ${maxthreads}
+    done
+done
+
+# Scaling runs use the middle scale point
+scalelist=(${scales})
+IFS=: read pint nchan pxls <<< "${scalelist[$(( ${#scalelist[@]} / 2 ))]}"
+
+threadlist=""
+n=1
+while [ ${n} -lt ${maxthreads} ]; do
+    threadlist+="${n} "
+    n=$(( n * 2 ))
+done
+threadlist+="${maxthreads}"
+
+echo "*** Strong scaling (${scalemodel}, pIntensity=${pint})"
+echo "threads,total_s,speedup,efficiency" > ${outdir}/strong.csv
+for n in ${threadlist}; do
+    run ${scalemodel} ${pint} ${nchan} ${pxls} ${n}
+    if [ ${n} -eq 1 ]; then t1=${lastTotal}; fi
+    awk -v n=${n} -v t1=${t1} -v t=${lastTotal} 'BEGIN {printf "%d,%.6e,%.3f,%.3f\n", n, t, t1/t, t1/t/n}' >> ${outdir}/strong.csv
+done
+
+echo "*** Weak scaling (${scalemodel}, pIntensity=${pint} per thread)"
+echo "threads,pIntensity,total_s,efficiency" > ${outdir}/weak.csv
+for n in ${threadlist}; do
+    run ${scalemodel} $(( pint * n )) ${nchan} ${pxls} ${n}
+    if [ ${n} -eq 1 ]; then t1=${lastTotal}; fi
+    awk -v n=${n} -v p=$(( pint * n )) -v t1=${t1} -v t=${lastTotal} 'BEGIN {printf "%d,%d,%.6e,%.3f\n", n, p, t, t1/t}' >> ${outdir}/weak.csv
+done
+
+pushd ${PATHTOLIME} >> /dev/null
+make clean
+popd >> /dev/null
+
+# The tables are aligned with column where it is installed
+if command -v column > /dev/null; then
+    table="column -s, -t"
+else
+    table="cat"
+fi
+for f in results strong weak; do
+    echo ""
+    ${table} < ${outdir}/${f}.csv
+done
+echo ""
+echo "Results written to ${outdir}"
+
+exit 0
@@ -0,0 +1,50 @@
+/*
+ *  bench.h
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Scale parameters of the benchmark models. bench/bench.sh and regress/regress.sh set them with -D on the compile line of the model; the defaults below give a run of about a minute on one core.
+*/
+
+#ifndef BENCH_PINTENSITY
+#define BENCH_PINTENSITY        4000
+#endif
+#ifndef BENCH_SINKPOINTS
+#define BENCH_SINKPOINTS        (BENCH_PINTENSITY*3/4)
+#endif
+#ifndef BENCH_NCHAN
+#define BENCH_NCHAN             61
+#endif
+#ifndef BENCH_PXLS
+#define BENCH_PXLS              100
+#endif
+#ifndef BENCH_NTHREADS
+#define BENCH_NTHREADS          1
+#endif
+#ifdef BENCH_BINOUTPUT /* Set by regress/regress.sh */
+#define BENCH_BINOUTPUTFILE     "populations.bin"
+#else
+#define BENCH_BINOUTPUTFILE     NULL
+#endif
+
+/* Parameters which are the same for all benchmark models */
+#define BENCH_COMMON_INPUT(par) do{ \
+  (par)->pIntensity             = BENCH_PINTENSITY; \
+  (par)->sinkPoints             = BENCH_SINKPOINTS; \
+  (par)->nThreads               = BENCH_NTHREADS; \
+  (par)->writeReport            = 1; \
+  (par)->outputfile             = "populations.pop"; \
+  (par)->binoutputfile          = BENCH_BINOUTPUTFILE; \
+}while(0)
+
+#define BENCH_COMMON_IMAGE(img) do{ \
+  (img).nchan                   = BENCH_NCHAN; \
+  (img).pxls                    = BENCH_PXLS; \
+  (img).source_vel              = 0; \
+  (img).unit                    = 0; \
+}while(0)
@@ -0,0 +1,98 @@
+/*
+ *  disk.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Benchmark model: flared Keplerian disk seen at 45 degrees. The strong velocity gradients exercise the velocity splines, and the thin disk gives long rays through many small cells.
+*/
+
+#include "lime.h"
+#include "bench.h"
+
+#define MSTAR   (1.989e30)
+#define RC      (100*AU)
+
+/******************************************************************************/
+
+void
+input(inputPars *par, image *img){
+  BENCH_COMMON_INPUT(par);
+  par->radius                   = 500*AU;
+  par->minScale                 = 1.0*AU;
+  par->dust                     = "jena_thin_e6.tab";
+  par->moldatfile[0]            = "hco+@xpol.dat";
+  par->sampling                 = 0;
+
+  BENCH_COMMON_IMAGE(img[0]);
+  img[0].velres                 = 200.;
+  img[0].trans                  = 3;
+  img[0].imgres                 = 0.05;
+  img[0].theta                  = PI/4.;
+  img[0].distance               = 140*PC;
+  img[0].filename               = "disk.fits";
+}
+
+/******************************************************************************/
+
+static double
+scaleHeight(double rc){
+  return 0.1*RC*pow(rc/RC,1.25);
+}
+
+void
+density(double x, double y, double z, double *density){
+  double rc,h;
+
+  rc=sqrt(x*x+y*y);
+  if(rc<AU) rc=AU;
+  h=scaleHeight(rc);
+  density[0] = 1.e9*1e6*pow(rc/RC,-1.)*exp(-rc/RC)*exp(-0.5*z*z/h/h)+1e6;
+}
+
+/******************************************************************************/
+
+void
+temperature(double x, double y, double z, double *temperature){
+  double rc;
+
+  rc=sqrt(x*x+y*y);
+  if(rc<AU) rc=AU;
+  temperature[0] = 30.*pow(rc/RC,-0.5);
+  if(temperature[0]>300.) temperature[0]=300.;
+}
+
+/******************************************************************************/
+
+void
+abundance(double x, double y, double z, double *abundance){
+  abundance[0] = 1.e-10;
+}
+
+/******************************************************************************/
+
+void
+doppler(double x, double y, double z, double *doppler){
+  *doppler = 100.;
+}
+
+/******************************************************************************/
+
+void
+velocity(double x, double y, double z, double *vel){
+  double rc,vk;
+
+  rc=sqrt(x*x+y*y);
+  if(rc<AU) rc=AU;
+  vk=sqrt(GRAV*MSTAR/rc);
+
+  vel[0] = -y*vk/rc;
+  vel[1] =  x*vk/rc;
+  vel[2] = 0.;
+}
+
+/******************************************************************************/
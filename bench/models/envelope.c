@@ -0,0 +1,93 @@
+/*
+ *  envelope.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Benchmark model: infalling power-law envelope with dust, as example/model.c. The optically thick centre makes photon() and stateq() the dominant costs.
+*/
+
+#include "lime.h"
+#include "bench.h"
+
+/******************************************************************************/
+
+void
+input(inputPars *par, image *img){
+  BENCH_COMMON_INPUT(par);
+  par->radius                   = 2000*AU;
+  par->minScale                 = 0.5*AU;
+  par->dust                     = "jena_thin_e6.tab";
+  par->moldatfile[0]            = "hco+@xpol.dat";
+  par->antialias                = 4;
+  par->sampling                 = 2;
+
+  BENCH_COMMON_IMAGE(img[0]);
+  img[0].velres                 = 500.;
+  img[0].trans                  = 3;
+  img[0].imgres                 = 0.1;
+  img[0].theta                  = 0.0;
+  img[0].distance               = 140*PC;
+  img[0].filename               = "envelope.fits";
+}
+
+/******************************************************************************/
+
+void
+density(double x, double y, double z, double *density){
+  double r;
+  const double rMin = 0.1*AU;
+
+  r=sqrt(x*x+y*y+z*z);
+  if(r<rMin) r=rMin;
+  density[0] = 1.5e6*pow(r/(300*AU),-1.5)*1e6;
+}
+
+/******************************************************************************/
+
+void
+temperature(double x, double y, double z, double *temperature){
+  double r;
+  const double rMin = 0.1*AU;
+
+  r=sqrt(x*x+y*y+z*z);
+  if(r<rMin) r=rMin;
+  temperature[0] = 20.*pow(r/(300*AU),-0.4);
+  if(temperature[0]>300.) temperature[0]=300.;
+}
+
+/******************************************************************************/
+
+void
+abundance(double x, double y, double z, double *abundance){
+  abundance[0] = 1.e-9;
+}
+
+/******************************************************************************/
+
+void
+doppler(double x, double y, double z, double *doppler){
+  *doppler = 200.;
+}
+
+/******************************************************************************/
+
+void
+velocity(double x, double y, double z, double *vel){
+  double r, ffSpeed;
+  const double rMin = 0.1*AU;
+
+  r=sqrt(x*x+y*y+z*z);
+  if(r<rMin) r=rMin;
+  ffSpeed = sqrt(2*GRAV*1.989e30/r);
+
+  vel[0] = -x*ffSpeed/r;
+  vel[1] = -y*ffSpeed/r;
+  vel[2] = -z*ffSpeed/r;
+}
+
+/******************************************************************************/
@@ -0,0 +1,105 @@
+/*
+ *  multispecies.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Benchmark model: the power-law envelope with several species and images. Every species uses the full 31 levels of the HCO+ data file shipped in example/ (the largest one in the tree), with different abundances, so the cost of photon(), stateq() and raytrace() grows with BENCH_NSPECIES.
+*/
+
+#include "lime.h"
+#include "bench.h"
+
+#ifndef BENCH_NSPECIES
+#define BENCH_NSPECIES  3
+#endif
+
+/******************************************************************************/
+
+void
+input(inputPars *par, image *img){
+  int i;
+  static char filenames[BENCH_NSPECIES][32];
+
+  BENCH_COMMON_INPUT(par);
+  par->radius                   = 2000*AU;
+  par->minScale                 = 0.5*AU;
+  par->dust                     = "jena_thin_e6.tab";
+  par->sampling                 = 2;
+
+  for(i=0;i<BENCH_NSPECIES;i++){
+    par->moldatfile[i]          = "hco+@xpol.dat";
+
+    BENCH_COMMON_IMAGE(img[i]);
+    img[i].velres               = 500.;
+    img[i].trans                = 3+i;
+    img[i].imgres               = 0.1;
+    img[i].theta                = 0.0;
+    img[i].distance             = 140*PC;
+    sprintf(filenames[i],"multispecies%d.fits",i);
+    img[i].filename             = filenames[i];
+  }
+}
+
+/******************************************************************************/
+
+void
+density(double x, double y, double z, double *density){
+  double r;
+  const double rMin = 0.1*AU;
+
+  r=sqrt(x*x+y*y+z*z);
+  if(r<rMin) r=rMin;
+  density[0] = 1.5e6*pow(r/(300*AU),-1.5)*1e6;
+}
+
+/******************************************************************************/
+
+void
+temperature(double x, double y, double z, double *temperature){
+  double r;
+  const double rMin = 0.1*AU;
+
+  r=sqrt(x*x+y*y+z*z);
+  if(r<rMin) r=rMin;
+  temperature[0] = 20.*pow(r/(300*AU),-0.4);
+  if(temperature[0]>300.) temperature[0]=300.;
+}
+
+/******************************************************************************/
+
+void
+abundance(double x, double y, double z, double *abundance){
+  int i;
+
+  for(i=0;i<BENCH_NSPECIES;i++) abundance[i] = 1.e-9*pow(10.,-i);
+}
+
+/******************************************************************************/
+
+void
+doppler(double x, double y, double z, double *doppler){
+  *doppler = 200.;
+}
+
+/******************************************************************************/
+
+void
+velocity(double x, double y, double z, double *vel){
+  double r, ffSpeed;
+  const double rMin = 0.1*AU;
+
+  r=sqrt(x*x+y*y+z*z);
+  if(r<rMin) r=rMin;
+  ffSpeed = sqrt(2*GRAV*1.989e30/r);
+
+  vel[0] = -x*ffSpeed/r;
+  vel[1] = -y*ffSpeed/r;
+  vel[2] = -z*ffSpeed/r;
+}
+
+/******************************************************************************/
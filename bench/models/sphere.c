@@ -0,0 +1,73 @@
+/*
+ *  sphere.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Benchmark model: static isothermal sphere of uniform density. The cheapest case; mostly measures the fixed costs of gridding and ray tracing.
+*/
+
+#include "lime.h"
+#include "bench.h"
+
+/******************************************************************************/
+
+void
+input(inputPars *par, image *img){
+  BENCH_COMMON_INPUT(par);
+  par->radius                   = 1000*AU;
+  par->minScale                 = 1.0*AU;
+  par->moldatfile[0]            = "hco+@xpol.dat";
+  par->sampling                 = 1;
+
+  BENCH_COMMON_IMAGE(img[0]);
+  img[0].velres                 = 100.;
+  img[0].trans                  = 3;
+  img[0].imgres                 = 0.1;
+  img[0].theta                  = 0.0;
+  img[0].distance               = 140*PC;
+  img[0].filename               = "sphere.fits";
+}
+
+/******************************************************************************/
+
+void
+density(double x, double y, double z, double *density){
+  density[0] = 1.e5*1e6;
+}
+
+/******************************************************************************/
+
+void
+temperature(double x, double y, double z, double *temperature){
+  temperature[0] = 20.;
+}
+
+/******************************************************************************/
+
+void
+abundance(double x, double y, double z, double *abundance){
+  abundance[0] = 1.e-9;
+}
+
+/******************************************************************************/
+
+void
+doppler(double x, double y, double z, double *doppler){
+  *doppler = 200.;
+}
+
+/******************************************************************************/
+
+void
+velocity(double x, double y, double z, double *vel){
+  vel[0] = 0.;
+  vel[1] = 0.;
+  vel[2] = 0.;
+}
+
+/******************************************************************************/
@@ -29,7 +29,7 @@ input(inputPars *par, image *img){
 
   par->outputfile               = "populations.pop";
   par->binoutputfile            = "restart.pop";
-  par->gridfile                 = "grid.vtk";
+  par->gridfile                 = "grid.vtu";
 
   /*
    * Definitions for image #0. Add blocks with successive values of i for additional images.
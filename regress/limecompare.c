@@ -0,0 +1,329 @@
+/*
+ *  limecompare.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Compares a LIME output product against a golden reference and prints the maximum and RMS deviation:
+
+  limecompare.x pops REF NEW [maxtol rmstol]
+      Binary populations files (par->binoutputfile). The deviation is the difference of the fractional level populations, over all grid points, species and levels. The two runs must have the same grid, i.e. be made with -DTEST.
+
+  limecompare.x fits REF NEW [maxtol rmstol]
+      Image cubes. The deviation is the difference of the pixel values in units of the peak absolute value of the reference cube.
+
+With the same random numbers, i.e. the fixed seeds of -DTEST, a change of the arithmetic only (such as -DFASTEXP or -DSINGLE_STORE) moves the populations of the regression models by less than 1e-5 and their images by less than 1e-6 of the peak. The default tolerances, a maximum deviation of 1e-4 and an RMS deviation of 1e-6, allow for this and little more. As soon as a single random number is drawn differently the difference is that of two Monte Carlo runs, which is orders of magnitude larger, and is compared with the noise of the reference runs instead:
+
+  limecompare.x zpops|zfits NEW REF1 REF2 ... [-t ztol fractol]
+      The same products of k>=3 reference runs with other random seeds (regress.sh -g -k). Each value of NEW is given the z-score (new-mean)/sqrt(s^2*(1+1/k)+floor^2), where mean and s are the mean and sample standard deviation of the k references at that grid point and level, or pixel. The floor, the default maximum tolerance above, keeps values which are the same in all runs (sink points, empty pixels) from dividing by zero. For a run which differs from the references by Monte Carlo noise only the z-scores follow a Student t distribution with k-1 degrees of freedom, whose RMS is sqrt((k-1)/(k-3)) (1.15 for k=9) and of which 1.7% lie beyond |z|=3 for k=9. The default tolerances, an RMS z-score of 1.5 and a fraction of 5% beyond |z|=3, allow for that and for the correlation of the noise between neighbouring points; a systematic change of the populations or images by about the noise shows up in both.
+
+The exit status is 0 if both are within tolerance, 1 if not and 2 on errors.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#ifdef OLD_FITSIO
+#include <cfitsio/fitsio.h>
+#else
+#include <fitsio.h>
+#endif
+
+#define MAX_NSPECIES	100
+#define DEFAULT_MAXTOL	1e-4
+#define DEFAULT_RMSTOL	1e-6
+#define DEFAULT_ZRMSTOL	1.5
+#define DEFAULT_ZFRACTOL	0.05
+#define Z_CUT		3.
+#define MAX_REFS	64
+
+typedef struct {
+  int ncell,nSpecies,nlev[MAX_NSPECIES],totLev;
+  double *x,*pops;
+} popsFile;
+
+static void
+fail(const char *msg, const char *file){
+  fprintf(stderr,"limecompare: %s: %s\n",file,msg);
+  exit(2);
+}
+
+static void
+readOrFail(void *ptr, size_t size, FILE *fp, const char *file){
+  if(fread(ptr,size,1,fp)!=1) fail("unexpected end of file",file);
+}
+
+static void
+skip(long nbytes, FILE *fp, const char *file){
+  if(fseek(fp,nbytes,SEEK_CUR)) fail("unexpected end of file",file);
+}
+
+/* Reads the grid positions and level populations of a file written by binpopsout() */
+static void
+readPops(const char *file, popsFile *p){
+  FILE *fp;
+  int i,j,nline[MAX_NSPECIES],npart,off;
+  double radius;
+
+  if((fp=fopen(file,"rb"))==NULL) fail("cannot open",file);
+  readOrFail(&radius,sizeof(double),fp,file);
+  readOrFail(&p->ncell,sizeof(int),fp,file);
+  readOrFail(&p->nSpecies,sizeof(int),fp,file);
+  if(p->ncell<=0 || p->nSpecies<=0 || p->nSpecies>MAX_NSPECIES) fail("not a binary populations file",file);
+
+  p->totLev=0;
+  for(i=0;i<p->nSpecies;i++){
+    readOrFail(&p->nlev[i],sizeof(int),fp,file);
+    readOrFail(&nline[i],sizeof(int),fp,file);
+    readOrFail(&npart,sizeof(int),fp,file);
+    skip(sizeof(int)*(npart+2*nline[i])+sizeof(double)*(5*nline[i]+2),fp,file);
+    p->totLev+=p->nlev[i];
+  }
+
+  p->x=malloc(sizeof(double)*3*p->ncell);
+  p->pops=malloc(sizeof(double)*p->totLev*p->ncell);
+  for(i=0;i<p->ncell;i++){
+    skip(sizeof(int),fp,file);					/* id */
+    readOrFail(&p->x[3*i],3*sizeof(double),fp,file);
+    skip(3*sizeof(double)+sizeof(int)+sizeof(double)*(p->nSpecies+1),fp,file);	/* vel, sink, nmol, dopb */
+    off=i*p->totLev;
+    for(j=0;j<p->nSpecies;j++){
+      readOrFail(&p->pops[off],sizeof(double)*p->nlev[j],fp,file);
+      skip(sizeof(double)*(2*nline[j]+2),fp,file);		/* knu, dust, dopb, binv */
+      off+=p->nlev[j];
+    }
+    skip(3*sizeof(double),fp,file);				/* dens, t, abun */
+  }
+  fclose(fp);
+}
+
+static int
+report(const char *product, double maxDev, double rmsDev, double maxTol, double rmsTol){
+  int pass=(maxDev<=maxTol && rmsDev<=rmsTol);
+
+  printf("%-8s max %11.4e (tol %9.2e)   rms %11.4e (tol %9.2e)   %s\n",product,maxDev,maxTol,rmsDev,rmsTol,pass?"PASS":"FAIL");
+  return pass?0:1;
+}
+
+/* 1 if a and b have the same grid and species, else prints why not and returns 0 */
+static int
+sameGrid(popsFile *a, popsFile *b){
+  long i;
+
+  if(a->ncell!=b->ncell || a->nSpecies!=b->nSpecies || a->totLev!=b->totLev){
+    printf("pops     grids or species differ (%d/%d points, %d/%d species)   FAIL\n",a->ncell,b->ncell,a->nSpecies,b->nSpecies);
+    return 0;
+  }
+  for(i=0;i<3L*a->ncell;i++){
+    if(fabs(a->x[i]-b->x[i])>1e-9*(fabs(a->x[i])+1.)){
+      printf("pops     grid point %ld differs; not a -DTEST run, or another GSL?   FAIL\n",i/3);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int
+comparePops(const char *ref, const char *new, double maxTol, double rmsTol){
+  popsFile a,b;
+  long i,n;
+  double d,maxDev=0.,sum=0.;
+  int k;
+
+  readPops(ref,&a);
+  readPops(new,&b);
+  if(!sameGrid(&a,&b)) return 1;
+
+  n=(long)a.ncell*a.totLev;
+  for(i=0;i<n;i++){
+    d=fabs(a.pops[i]-b.pops[i]);
+    if(d>maxDev) maxDev=d;
+    sum+=d*d;
+  }
+  k=report("pops",maxDev,sqrt(sum/n),maxTol,rmsTol);
+
+  free(a.x);
+  free(a.pops);
+  free(b.x);
+  free(b.pops);
+  return k;
+}
+
+static float *
+readImage(const char *file, long *naxes){
+  fitsfile *fptr;
+  int status=0,naxis,anynul;
+  long i,n=1;
+  float *data;
+
+  naxes[0]=naxes[1]=naxes[2]=1;
+  fits_open_file(&fptr, file, READONLY, &status);
+  fits_get_img_dim(fptr, &naxis, &status);
+  if(status || naxis<1 || naxis>3) fail("cannot read image",file);
+  fits_get_img_size(fptr, naxis, naxes, &status);
+  for(i=0;i<naxis;i++) n*=naxes[i];
+  data=malloc(sizeof(float)*n);
+  fits_read_img(fptr, TFLOAT, 1, n, NULL, data, &anynul, &status);
+  fits_close_file(fptr, &status);
+  if(status) fail("cannot read image",file);
+  return data;
+}
+
+static int
+compareFits(const char *ref, const char *new, double maxTol, double rmsTol){
+  float *a,*b;
+  long na[3],nb[3],i,n;
+  double peak=0.,d,maxDev=0.,sum=0.;
+
+  a=readImage(ref,na);
+  b=readImage(new,nb);
+  if(na[0]!=nb[0] || na[1]!=nb[1] || na[2]!=nb[2]){
+    printf("fits     image sizes differ   FAIL\n");
+    return 1;
+  }
+  n=na[0]*na[1]*na[2];
+  for(i=0;i<n;i++) if(fabs(a[i])>peak) peak=fabs(a[i]);
+  if(peak==0.) peak=1.;
+
+  for(i=0;i<n;i++){
+    d=fabs((double)a[i]-(double)b[i])/peak;
+    if(d>maxDev) maxDev=d;
+    sum+=d*d;
+  }
+  free(a);
+  free(b);
+  return report("fits",maxDev,sqrt(sum/n),maxTol,rmsTol);
+}
+
+/* z-scores of the n values of new against the k references ref[0..k-1] (see the top of this file), with the spread floored at floor */
+static int
+zReport(const char *product, int k, double **ref, double *new, long n, double floor, double rmsTol, double fracTol){
+  long i,nOut=0;
+  int j;
+  double mean,var,z,zMax=0.,sum=0.,frac,rms;
+  int pass;
+
+  for(i=0;i<n;i++){
+    mean=0.;
+    for(j=0;j<k;j++) mean+=ref[j][i];
+    mean/=k;
+    var=0.;
+    for(j=0;j<k;j++) var+=(ref[j][i]-mean)*(ref[j][i]-mean);
+    var/=k-1;
+    z=fabs(new[i]-mean)/sqrt(var*(1.+1./k)+floor*floor);
+    if(z>zMax) zMax=z;
+    if(z>Z_CUT) nOut++;
+    sum+=z*z;
+  }
+  rms=sqrt(sum/n);
+  frac=(double)nOut/n;
+  pass=(rms<=rmsTol && frac<=fracTol);
+  printf("%-8s z rms %7.3f (tol %5.2f)   |z|>%.0f %7.4f (tol %5.3f)   max %7.2f   %d refs   %s\n",product,rms,rmsTol,Z_CUT,frac,fracTol,zMax,k,pass?"PASS":"FAIL");
+  return pass?0:1;
+}
+
+static int
+zPops(const char *new, int k, char **refs, double rmsTol, double fracTol){
+  popsFile a[MAX_REFS],b;
+  double *ref[MAX_REFS];
+  int j,res;
+
+  readPops(new,&b);
+  for(j=0;j<k;j++){
+    readPops(refs[j],&a[j]);
+    if(!sameGrid(&a[j],&b)) return 1;
+    ref[j]=a[j].pops;
+  }
+  res=zReport("pops",k,ref,b.pops,(long)b.ncell*b.totLev,DEFAULT_MAXTOL,rmsTol,fracTol);
+  for(j=0;j<k;j++){
+    free(a[j].x);
+    free(a[j].pops);
+  }
+  free(b.x);
+  free(b.pops);
+  return res;
+}
+
+static int
+zFits(const char *new, int k, char **refs, double rmsTol, double fracTol){
+  float *a,*b;
+  double *ref[MAX_REFS],*d,peak=0.,mean;
+  long na[3],nb[3],i,n;
+  int j,res;
+
+  b=readImage(new,nb);
+  n=nb[0]*nb[1]*nb[2];
+  for(j=0;j<k;j++){
+    a=readImage(refs[j],na);
+    if(na[0]!=nb[0] || na[1]!=nb[1] || na[2]!=nb[2]){
+      printf("fits     image sizes differ   FAIL\n");
+      return 1;
+    }
+    ref[j]=malloc(sizeof(double)*n);
+    for(i=0;i<n;i++) ref[j][i]=a[i];
+    free(a);
+  }
+  d=malloc(sizeof(double)*n);
+  for(i=0;i<n;i++){
+    d[i]=b[i];
+    mean=0.;
+    for(j=0;j<k;j++) mean+=ref[j][i];
+    if(fabs(mean/k)>peak) peak=fabs(mean/k);
+  }
+  if(peak==0.) peak=1.;
+  res=zReport("fits",k,ref,d,n,DEFAULT_MAXTOL*peak,rmsTol,fracTol);
+  for(j=0;j<k;j++) free(ref[j]);
+  free(d);
+  free(b);
+  return res;
+}
+
+static void
+usage(){
+  fprintf(stderr,"Usage: limecompare.x pops|fits REF NEW [maxtol rmstol]\n");
+  fprintf(stderr,"       limecompare.x zpops|zfits NEW REF1 REF2 ... [-t ztol fractol]\n");
+}
+
+int
+main(int argc, char *argv[]){
+  double maxTol=DEFAULT_MAXTOL,rmsTol=DEFAULT_RMSTOL;
+  int k;
+
+  if(argc>1 && (!strcmp(argv[1],"zpops") || !strcmp(argv[1],"zfits"))){
+    rmsTol=DEFAULT_ZRMSTOL;
+    maxTol=DEFAULT_ZFRACTOL;
+    k=argc-3;
+    if(argc>=4 && !strcmp(argv[argc-3],"-t")){
+      rmsTol=atof(argv[argc-2]);
+      maxTol=atof(argv[argc-1]);
+      k-=3;
+    }
+    if(k<3 || k>MAX_REFS){
+      usage();
+      fprintf(stderr,"limecompare: %s needs 3 to %d references\n",argv[1],MAX_REFS);
+      return 2;
+    }
+    if(!strcmp(argv[1],"zpops")) return zPops(argv[2],k,argv+3,rmsTol,maxTol);
+    return zFits(argv[2],k,argv+3,rmsTol,maxTol);
+  }
+
+  if(argc!=4 && argc!=6){
+    usage();
+    return 2;
+  }
+  if(argc==6){
+    maxTol=atof(argv[4]);
+    rmsTol=atof(argv[5]);
+  }
+
+  if(!strcmp(argv[1],"pops")) return comparePops(argv[2],argv[3],maxTol,rmsTol);
+  else if(!strcmp(argv[1],"fits")) return compareFits(argv[2],argv[3],maxTol,rmsTol);
+
+  fprintf(stderr,"limecompare: unknown product %s\n",argv[1]);
+  return 2;
+}
@@ -0,0 +1,199 @@
+/*
+ *  octreecheck.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Standalone check of the octree grids of octree.c, run by regress.sh:
+
+  octreecheck.x
+
+writes an octree that fills its root cube with cells of levels 1 to 4 (one octant refined to level 4 everywhere, so that the coarse cells next to it have more than 64 neighbours), reads it with octreeGrid() and checks that
+
+  - every cell is found by octreeLocate() at its centre, with the Doppler b and abundance of its line,
+  - the neighbours of every cell are exactly the cells that touch it across a face, edge or corner, found by comparing all pairs of cells, and the neighbour lists are symmetric,
+  - the path of a ray through the cells, summed over the steps of octreeStep() from octreeEnter(), equals the length of its chord through the root cube, for random rays.
+
+The exit status is 0 if all checks pass and 1 if not.
+*/
+
+#include "lime.h"
+
+#define CHECK_FILE	"octreecheck.grid"
+#define CHECK_NRAYS	10000
+
+/* Defined in main.c, which is not part of liblime.a */
+double EXP_TABLE_2D[128][10];
+double EXP_TABLE_3D[256][2][10];
+runOptions limeOpts={1, 0, 0, 0, 0, 1};
+
+static int nCell=0;
+
+static void
+writeCell(FILE *fp, double x, double y, double z, double size){
+  fprintf(fp,"%d %.17g %.17g %.17g %.17g 1e10 20 0 0 0 %d %.17g\n",nCell,x,y,z,size,100+nCell%7,1e-9*(1+nCell%3));
+  nCell++;
+}
+
+/* Cells of side size filling the cube of side n*size with lower corner c */
+static void
+writeBlock(FILE *fp, const double *c, double size, int n){
+  int i,j,k;
+
+  for(i=0;i<n;i++) for(j=0;j<n;j++) for(k=0;k<n;k++)
+    writeCell(fp,c[0]+(i+0.5)*size,c[1]+(j+0.5)*size,c[2]+(k+0.5)*size,size);
+}
+
+static void
+writeGrid(){
+  FILE *fp;
+  double c[3],sub[3];
+  int o,s,k;
+
+  if((fp=fopen(CHECK_FILE,"w"))==NULL){
+    fprintf(stderr,"octreecheck: cannot write %s\n",CHECK_FILE);
+    exit(1);
+  }
+  /* Root cube [-1,1]^3: octant 0 at level 4, octant 7 at level 2 with one cell at level 3, the others at level 1 */
+  for(o=0;o<8;o++){
+    for(k=0;k<3;k++) c[k]=((o>>k)&1) ? 0. : -1.;
+    if(o==0) writeBlock(fp,c,0.125,8);
+    else if(o==7){
+      for(s=0;s<8;s++){
+        for(k=0;k<3;k++) sub[k]=c[k]+(((s>>k)&1) ? 0.5 : 0.);
+        if(s==0) writeBlock(fp,sub,0.25,2);
+        else writeBlock(fp,sub,0.5,1);
+      }
+    }
+    else writeBlock(fp,c,1.,1);
+  }
+  fclose(fp);
+}
+
+/* 1 if the cubes of grid points a and b (of sides sa and sb) touch */
+static int
+touching(struct grid *g, int a, int b, double sa, double sb){
+  int k;
+  double gap;
+
+  for(k=0;k<3;k++){
+    gap=fabs(g[a].x[k]-g[b].x[k])-0.5*(sa+sb);
+    if(gap>1e-9) return 0;
+  }
+  return 1;
+}
+
+int
+main(){
+  inputPars par;
+  FILE *fp;
+  struct grid *g;
+  struct cell *dc=NULL;
+  unsigned long numCells=0;
+  double *side,x[3],x0[3],dx[3],norm,col,col0,ds,tmin,tmax,t1,t2,err,maxErr=0.;
+  int i,j,k,isNeigh,nposn,posn,steps,maxNeigh=0,failed=0,nBad;
+
+  writeGrid();
+
+  memset(&par,0,sizeof(par));
+  par.pregrid=CHECK_FILE;
+  par.doPregrid=1;
+  par.octree=1;
+  par.nSpecies=1;
+  par.tcmb=2.725;
+  octreeGrid(&par,&g,&dc,&numCells);
+
+  /* The side of each cell, as written */
+  side=malloc(sizeof(double)*par.pIntensity);
+  if((fp=fopen(CHECK_FILE,"r"))==NULL){
+    fprintf(stderr,"octreecheck: cannot read %s\n",CHECK_FILE);
+    exit(1);
+  }
+  for(i=0;i<par.pIntensity;i++){
+    if(fscanf(fp,"%*d %*f %*f %*f %lf %*f %*f %*f %*f %*f %*f %*f",&side[i])!=1){
+      fprintf(stderr,"octreecheck: cannot read %s\n",CHECK_FILE);
+      exit(1);
+    }
+  }
+  fclose(fp);
+
+  /* Location */
+  nBad=0;
+  for(i=0;i<par.pIntensity;i++){
+    if(octreeLocate(g[i].x)!=i || g[i].dopb!=100+i%7 || fabs(g[i].abun[0]/(1e-9*(1+i%3))-1.)>1e-12) nBad++;
+  }
+  printf("octreecheck: %d cells, %d sinks, %d cells not located or with other properties\n",par.pIntensity,par.sinkPoints,nBad);
+  if(nBad) failed=1;
+
+  /* Neighbours against all pairs of touching cells, and symmetry */
+  nBad=0;
+  for(i=0;i<par.pIntensity;i++){
+    maxNeigh=(g[i].numNeigh>maxNeigh) ? g[i].numNeigh : maxNeigh;
+    for(j=0;j<par.pIntensity;j++){
+      if(j==i) continue;
+      isNeigh=0;
+      for(k=0;k<g[i].numNeigh;k++) if(g[i].neigh[k]->id==j) isNeigh=1;
+      if(isNeigh!=touching(g,i,j,side[i],side[j])) nBad++;
+    }
+  }
+  for(i=0;i<par.ncell;i++){
+    for(k=0;k<g[i].numNeigh;k++){
+      isNeigh=0;
+      j=g[i].neigh[k]->id;
+      for(nposn=0;nposn<g[j].numNeigh;nposn++) if(g[j].neigh[nposn]->id==i) isNeigh=1;
+      if(!isNeigh) nBad++;
+    }
+  }
+  printf("octreecheck: largest number of neighbours %d, %d wrong or one-sided neighbour links\n",maxNeigh,nBad);
+  if(nBad) failed=1;
+
+  /* Chord lengths of random rays */
+  srand(12345);
+  for(i=0;i<CHECK_NRAYS;i++){
+    norm=0.;
+    for(k=0;k<3;k++){
+      dx[k]=rand()/(double)RAND_MAX-0.5;
+      norm+=dx[k]*dx[k];
+    }
+    norm=sqrt(norm);
+    for(k=0;k<3;k++){
+      dx[k]/=norm;
+      x[k]=-3.*dx[k]+1.5*(rand()/(double)RAND_MAX-0.5);
+      x0[k]=x[k];
+    }
+    col=0.;
+    posn=octreeEnter(x,dx,&col);
+    col0=col;
+    steps=0;
+    while(posn>=0 && steps<10000){
+      octreeStep(g,posn,x,dx,&ds,&nposn);
+      for(k=0;k<3;k++) x[k]+=ds*dx[k];
+      col+=ds;
+      posn=nposn;
+      steps++;
+    }
+    tmin=-1e300;
+    tmax=1e300;
+    for(k=0;k<3;k++){
+      t1=(-1.-x0[k])/dx[k];
+      t2=( 1.-x0[k])/dx[k];
+      tmin=gsl_max(tmin,gsl_min(t1,t2));
+      tmax=gsl_min(tmax,gsl_max(t1,t2));
+    }
+    if(tmax>tmin) err=fabs((col-col0)-(tmax-tmin));
+    else err=(col0>0.) ? col0 : 0.;
+    maxErr=gsl_max(maxErr,err);
+  }
+  printf("octreecheck: largest chord length error of %d rays %.3g\n",CHECK_NRAYS,maxErr);
+  if(maxErr>1e-6) failed=1;
+
+  octreeFree();
+  free(side);
+  remove(CHECK_FILE);
+  printf("octreecheck: %s\n",failed ? "FAILED" : "passed");
+  return failed;
+}
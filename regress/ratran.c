@@ -0,0 +1,92 @@
+/*
+ *  ratran.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Model of the plugin test of regress.sh: a collapsing envelope read from the RATRAN model ratran.mdl with ratranInput(). Loaded as a plugin, the model calls ratranInput() of lime-engine, which must therefore export it; the test compares the run with that of the same model linked in.
+*/
+
+#include "lime.h"
+
+#define RATRAN_MODEL    "ratran.mdl"
+
+/******************************************************************************/
+
+void
+input(inputPars *par, image *img){
+  par->radius                   = 1000*AU;
+  par->minScale                 = 0.5*AU;
+  par->pIntensity               = 500;
+  par->sinkPoints               = 300;
+  par->moldatfile[0]            = "hco+@xpol.dat";
+  par->sampling                 = 2;
+  par->nThreads                 = 1;
+  par->outputfile               = "populations.pop";
+  par->binoutputfile            = "populations.bin";
+
+  img[0].nchan                  = 21;
+  img[0].velres                 = 200.;
+  img[0].trans                  = 3;
+  img[0].pxls                   = 30;
+  img[0].imgres                 = 0.1;
+  img[0].theta                  = 0.0;
+  img[0].distance               = 140*PC;
+  img[0].source_vel             = 0;
+  img[0].unit                   = 0;
+  img[0].filename               = "ratran.fits";
+}
+
+/******************************************************************************/
+
+void
+density(double x, double y, double z, double *density){
+  density[0] = ratranInput(RATRAN_MODEL, "nh", x, y, z)*1e6;
+}
+
+/******************************************************************************/
+
+void
+temperature(double x, double y, double z, double *temperature){
+  temperature[0] = ratranInput(RATRAN_MODEL, "te", x, y, z);
+}
+
+/******************************************************************************/
+
+void
+abundance(double x, double y, double z, double *abundance){
+  double nh=ratranInput(RATRAN_MODEL, "nh", x, y, z);
+
+  abundance[0] = (nh>0.) ? ratranInput(RATRAN_MODEL, "nm", x, y, z)/nh : 0.;
+}
+
+/******************************************************************************/
+
+void
+doppler(double x, double y, double z, double *doppler){
+  *doppler = ratranInput(RATRAN_MODEL, "db", x, y, z)*1e3;
+}
+
+/******************************************************************************/
+
+void
+velocity(double x, double y, double z, double *vel){
+  double r=sqrt(x*x+y*y+z*z), vr;
+
+  if(r>0.){
+    vr = ratranInput(RATRAN_MODEL, "vr", x, y, z)*1e3;
+    vel[0] = vr*x/r;
+    vel[1] = vr*y/r;
+    vel[2] = vr*z/r;
+  } else {
+    vel[0] = 0.;
+    vel[1] = 0.;
+    vel[2] = 0.;
+  }
+}
+
+/******************************************************************************/
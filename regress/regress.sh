@@ -0,0 +1,272 @@
+#!/bin/bash -e
+# LIME numerical regression driver
+# This file is part of LIME, the versatile line modeling engine
+#
+# Copyright (C) 2006-2014 Christian Brinch
+# Copyright (C) 2015 The LIME development team
+#
+# Builds LIME with -DTEST (fixed random seeds) and runs the synthetic models
+# of bench/models at a small scale on one thread. The binary populations and
+# the image cubes of each model are compared with the golden outputs in
+# regress/golden by limecompare.x, which prints the maximum and RMS deviation
+# per product. The golden outputs are not part of the repository, since they
+# depend on the versions of GSL and qhull: they are made with -g, which has to
+# be run once with a trusted reference version of LIME, built against the
+# same libraries, before any comparison. The octree grids are checked first by
+# octreecheck.x, and a model run as a plugin of the prebuilt engine is
+# compared with the same model linked in; neither needs golden outputs.
+#
+# The default tolerances of limecompare.x are those of a run which draws the
+# same random numbers as the golden one. A run with other seeds (-s) or on
+# several MPI processes (-n) differs from it by the Monte Carlo noise instead.
+# It is compared value by value with the spread of the golden outputs and of
+# the noise references in regress/golden/MODEL/seeds/1..K, runs with the seed
+# offsets 1 to K which regress.sh -g -k K makes along with the golden outputs:
+# limecompare.x zpops and zfits print the RMS z-score and the fraction of
+# values beyond |z|=3 (see there). The seeds of such a run should not be one
+# of 1..K.
+
+function usage {
+    echo "Usage: regress.sh [OPTION]"
+    echo " "
+    echo "Options:"
+    echo "   -h           Display this message"
+    echo "   -g           Generate the golden outputs instead of comparing"
+    echo "   -k K         With -g, also generate noise references with the seeds 1 to K (default: ${noiseseeds})"
+    echo "   -m MODELS    Models to run (default: \"sphere envelope disk multispecies\")"
+    echo "   -f FLAGS     Extra cpp flags for the build, e.g. -DFASTEXP"
+    echo "   -s SEED      Offset of the random seeds of photons and rays (default: 0)"
+    echo "   -n NRANKS    Build with MPI and run each model on NRANKS processes"
+    echo "   -p \"MAX RMS\" Tolerances for the populations (default: \"1e-4 1e-6\")"
+    echo "   -i \"MAX RMS\" Tolerances for the images, relative to the peak (default: \"1e-4 1e-6\")"
+    echo "                With -s or -n both are \"ZRMS FRAC\", the RMS z-score and the fraction"
+    echo "                beyond |z|=3 against the noise references (default: \"${noisetol}\")"
+}
+
+models="sphere envelope disk multispecies"
+scale="-DBENCH_PINTENSITY=1000 -DBENCH_NCHAN=31 -DBENCH_PXLS=50 -DBENCH_NTHREADS=1 -DBENCH_NSPECIES=2"
+generate=0
+extraflags=""
+seed=0
+popstol=""
+imagetol=""
+noisetol="1.5 0.05"
+noiseseeds=8
+noise=0
+makeopts=""
+launcher=""
+
+export PATHTOLIME=$( cd "$( dirname "${BASH_SOURCE[0]}" )/.." && pwd )
+export LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:${PATHTOLIME}/lib
+golden=${PATHTOLIME}/regress/golden
+work=${PATHTOLIME}/regress/work
+compare=${PATHTOLIME}/regress/limecompare.x
+
+while getopts ":hgk:m:f:s:n:p:i:" opt; do
+    case $opt in
+	h)
+	    usage
+	    exit 0
+	    ;;
+	g)
+	    generate=1
+	    ;;
+	k)
+	    noiseseeds=${OPTARG}
+	    ;;
+	m)
+	    models=${OPTARG}
+	    ;;
+	f)
+	    extraflags=${OPTARG}
+	    ;;
+	s)
+	    seed=${OPTARG}
+	    ;;
+	n)
+	    makeopts="MPI=1"
+	    launcher="mpirun -np ${OPTARG}"
+	    ;;
+	p)
+	    popstol=${OPTARG}
+	    ;;
+	i)
+	    imagetol=${OPTARG}
+	    ;;
+	\?)
+	    echo "regress.sh: error: unknown option" >&2
+	    usage
+	    exit 1
+	    ;;
+    esac
+done
+
+if [ ${generate} -eq 0 ] && { [ ${seed} -ne 0 ] || [ -n "${launcher}" ]; }; then
+    noise=1
+    [ -n "${popstol}" ] || popstol=${noisetol}
+    [ -n "${imagetol}" ] || imagetol=${noisetol}
+fi
+engineflags="-DTEST -DTEST_SEED=${seed} -DNO_NCURSES -DBENCH_BINOUTPUT ${extraflags}"
+
+# The references are looked for before anything is built
+if [ ${generate} -eq 0 ]; then
+    for model in ${models}; do
+	if [ ! -f ${golden}/${model}/populations.bin ]; then
+	    echo "regress.sh: error: no golden outputs for ${model}; run regress.sh -g with a reference version first" >&2
+	    exit 1
+	fi
+	if [ ${noise} -eq 1 ] && [ $(ls -d ${golden}/${model}/seeds/* 2>/dev/null | wc -l) -lt 2 ]; then
+	    echo "regress.sh: error: no noise references for ${model}; run regress.sh -g -k K with a reference version first" >&2
+	    exit 1
+	fi
+    done
+fi
+
+# Builds model $1 against the engine objects in src, which must have been
+# built with the flags $2, and runs it in ${work}/$1; returns 1 if it fails
+function runModel {
+    local dir=${work}/$1
+    rm -rf ${dir}
+    mkdir -p ${dir}
+    cp ${PATHTOLIME}/example/hco+@xpol.dat ${PATHTOLIME}/example/jena_thin_e6.tab ${dir}
+
+    pushd ${PATHTOLIME} >> /dev/null
+    rm -f src/model.o
+    make ${makeopts} EXTRACPPFLAGS="$2 ${scale}" MODELS=${PATHTOLIME}/bench/models/$1.c TARGET=${dir}/regress.x
+    popd >> /dev/null
+
+    pushd ${dir} >> /dev/null
+    if ! ${launcher} ./regress.x > lime.log 2>&1; then
+	popd >> /dev/null
+	echo "$1   run failed, see ${dir}/lime.log   FAIL"
+	return 1
+    fi
+    popd >> /dev/null
+    return 0
+}
+
+pushd ${PATHTOLIME} >> /dev/null
+make clean
+# The engine objects built here for octreecheck.x are reused by the models
+make ${makeopts} EXTRACPPFLAGS="${engineflags}" regress/limecompare.x regress/octreecheck.x
+popd >> /dev/null
+
+failed=0
+mkdir -p ${work}
+pushd ${work} >> /dev/null
+if ! ${PATHTOLIME}/regress/octreecheck.x; then
+    failed=1
+fi
+popd >> /dev/null
+
+# A model loaded by lime-engine as a plugin, which calls ratranInput() of the
+# engine, against the same model linked in
+dir=${work}/plugin
+rm -rf ${dir}
+for run in engine linked; do
+    mkdir -p ${dir}/${run}
+    cp ${PATHTOLIME}/example/hco+@xpol.dat ${PATHTOLIME}/regress/ratran.mdl ${dir}/${run}
+done
+pushd ${PATHTOLIME} >> /dev/null
+make ${makeopts} EXTRACPPFLAGS="${engineflags}" ENGINE=${dir}/engine/lime-engine engine
+make ${makeopts} EXTRACPPFLAGS="${engineflags}" MODELS=${PATHTOLIME}/regress/ratran.c PLUGIN=${dir}/engine/ratran.so plugin
+rm -f src/model.o
+make ${makeopts} EXTRACPPFLAGS="${engineflags}" MODELS=${PATHTOLIME}/regress/ratran.c TARGET=${dir}/linked/ratran.x
+rm -f src/model.o
+popd >> /dev/null
+echo "*** plugin"
+pushd ${dir}/engine >> /dev/null
+if ! ${launcher} ./lime-engine ./ratran.so > lime.log 2>&1; then
+    echo "plugin   lime-engine failed, see ${dir}/engine/lime.log   FAIL"
+    failed=1
+fi
+popd >> /dev/null
+pushd ${dir}/linked >> /dev/null
+if ! ${launcher} ./ratran.x > lime.log 2>&1; then
+    echo "plugin   linked model failed, see ${dir}/linked/lime.log   FAIL"
+    failed=1
+fi
+popd >> /dev/null
+if [ -f ${dir}/engine/populations.bin ] && [ -f ${dir}/linked/populations.bin ]; then
+    if ! ${compare} pops ${dir}/linked/populations.bin ${dir}/engine/populations.bin; then
+	failed=1
+    fi
+    if ! ${compare} fits ${dir}/linked/ratran.fits ${dir}/engine/ratran.fits; then
+	failed=1
+    fi
+fi
+for model in ${models}; do
+    dir=${work}/${model}
+    if ! runModel ${model} "${engineflags}"; then
+	failed=1
+	continue
+    fi
+
+    if [ ${generate} -eq 1 ]; then
+	rm -rf ${golden}/${model}
+	mkdir -p ${golden}/${model}
+	cp ${dir}/populations.bin ${dir}/*.fits ${golden}/${model}
+	echo "*** ${model}: golden outputs written"
+	continue
+    fi
+
+    echo "*** ${model}"
+    if [ ${noise} -eq 1 ]; then
+	refs=$(ls -d ${golden}/${model}/seeds/*)
+	if ! ${compare} zpops ${dir}/populations.bin ${golden}/${model}/populations.bin \
+	    $(for r in ${refs}; do echo ${r}/populations.bin; done) -t ${popstol}; then
+	    failed=1
+	fi
+	for f in ${golden}/${model}/*.fits; do
+	    f=$(basename ${f})
+	    if ! ${compare} zfits ${dir}/${f} ${golden}/${model}/${f} \
+		$(for r in ${refs}; do echo ${r}/${f}; done) -t ${imagetol}; then
+		failed=1
+	    fi
+	done
+	continue
+    fi
+
+    if ! ${compare} pops ${golden}/${model}/populations.bin ${dir}/populations.bin ${popstol}; then
+	failed=1
+    fi
+    for f in ${golden}/${model}/*.fits; do
+	if ! ${compare} fits ${f} ${dir}/$(basename ${f}) ${imagetol}; then
+	    failed=1
+	fi
+    done
+done
+
+# The noise references: the same models with the seed offsets 1 to K, for
+# which the engine is built again
+if [ ${generate} -eq 1 ] && [ ${noiseseeds} -gt 0 ]; then
+    for s in $(seq 1 ${noiseseeds}); do
+	pushd ${PATHTOLIME} >> /dev/null
+	make clean
+	popd >> /dev/null
+	flags="-DTEST -DTEST_SEED=${s} -DNO_NCURSES -DBENCH_BINOUTPUT ${extraflags}"
+	for model in ${models}; do
+	    dir=${work}/${model}
+	    if ! runModel ${model} "${flags}"; then
+		failed=1
+		continue
+	    fi
+	    [ ${s} -gt 1 ] || rm -rf ${golden}/${model}/seeds
+	    mkdir -p ${golden}/${model}/seeds/${s}
+	    cp ${dir}/populations.bin ${dir}/*.fits ${golden}/${model}/seeds/${s}
+	done
+	echo "*** noise references with seed offset ${s} written"
+    done
+fi
+
+pushd ${PATHTOLIME} >> /dev/null
+make clean
+popd >> /dev/null
+
+if [ ${failed} -ne 0 ]; then
+    echo "*** Regression FAILED"
+    exit 1
+fi
+[ ${generate} -eq 1 ] || echo "*** Regression passed"
+
+exit 0
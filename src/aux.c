@@ -18,7 +18,7 @@ parseInput(inputPars *par, image **img, molData **m){
   FILE *fp;
   int i,id;
   double BB[3];
-  double cosPhi,sinPhi,cosTheta,sinTheta,dummyVel[DIM];
+  double dummyVel[DIM];
 
   /* Set default values */
   par->dust  	    = NULL;
@@ -28,10 +28,34 @@ parseInput(inputPars *par, image **img, molData **m){
   par->gridfile     = NULL;
   par->pregrid      = NULL;
   par->restart      = NULL;
+  par->gridShare    = NULL;
+  par->checkpoint   = NULL;
+  par->initPops     = NULL;
 
   par->tcmb = 2.728;
   par->lte_only=0;
   par->init_lte=0;
+  par->lvg_only=0;
+  par->init_lvg=0;
+  par->collRateTables=0;
+  par->molDataCache=0;
+  par->molDataCacheDir=NULL;
+  par->writeReport=0;
+  par->costMap=0;
+  par->nSweep=0;
+  par->nSweepParams=0;
+  par->sweepKeep=8;
+  par->sweepIter=SWEEP_ITERATIONS;
+  par->checkpointEvery=1;
+  par->initPopsIter=SWEEP_ITERATIONS;
+  par->multilevel=0;
+  par->symmetry=0;
+  par->symmetryPoints=0;
+  par->octree=0;
+  par->refine=0;
+  par->refinePoints=0;
+  par->refineTol=0.1;
+  par->gridSeed=0;
   par->sampling=2;
   par->blend=0;
   par->antialias=1;
@@ -96,7 +120,33 @@ parseInput(inputPars *par, image **img, molData **m){
   input(par,*img);
 
   if(par->nThreads == 0){ // Hmm. Really ought to have a separate boolean parameter.
-    par->nThreads = NTHREADS;
+    par->nThreads = limeOpts.nThreads;
+  }
+
+  /* A sweep keeps the collision rates in tables, so that they can be re-binned when the temperature changes */
+  if(par->nSweep>0){
+    if(par->nSweepParams<0 || par->nSweepParams>MAX_SWEEP_PARAMS){
+      if(!silent) bail_out("Error: par->nSweepParams is out of range");
+      exit(1);
+    }
+    if(par->sweepKeep<1) par->sweepKeep=1;
+    par->collRateTables=1;
+  }
+  if(par->checkpointEvery<1) par->checkpointEvery=1;
+  if(par->symmetry<0 || par->symmetry>2){
+    if(!silent) bail_out("Error: par->symmetry must be 0 (none), 1 (spherical) or 2 (axisymmetric)");
+    exit(1);
+  }
+
+  if(par->refine<0) par->refine=0;
+  if(par->octree && par->pregrid==NULL){
+    if(!silent) bail_out("Error: par->octree needs the cells in par->pregrid");
+    exit(1);
+  }
+  /* The coarse grid of multilevel.c is a Delaunay grid, which the octree photon steps cannot trace */
+  if(par->octree && par->multilevel>1){
+    if(!silent) bail_out("Error: par->multilevel cannot be used with par->octree");
+    exit(1);
   }
 
   par->ncell=par->pIntensity+par->sinkPoints;
@@ -176,35 +226,7 @@ The cutoff will be the value of abs(x) for which the error in the exact expressi
       (*img)[i].pixel[id].tau = malloc(sizeof(double)*(*img)[i].nchan);
     }
 
-    /* Rotation matrix
-
-            |1          0           0   |
-     R_x(a)=|0        cos(a)      sin(a)|
-            |0       -sin(a)      cos(a)|
-
-            |cos(b)     0       -sin(b)|
-     R_y(b)=|  0        1          0   |
-            |sin(b)     0        cos(b)|
-
-            |      cos(b)       0          -sin(b)|
-     Rot =  |sin(a)sin(b)     cos(a)  sin(a)cos(b)|
-            |cos(a)sin(b)    -sin(a)  cos(a)cos(b)|
-
-    */
-
-    cosPhi   = cos((*img)[i].phi);
-    sinPhi   = sin((*img)[i].phi);
-    cosTheta = cos((*img)[i].theta);
-    sinTheta = sin((*img)[i].theta);
-    (*img)[i].rotMat[0][0] =           cosPhi;
-    (*img)[i].rotMat[0][1] =  0.0;
-    (*img)[i].rotMat[0][2] =          -sinPhi;
-    (*img)[i].rotMat[1][0] =  sinTheta*sinPhi;
-    (*img)[i].rotMat[1][1] =  cosTheta;
-    (*img)[i].rotMat[1][2] =  sinTheta*cosPhi;
-    (*img)[i].rotMat[2][0] =  cosTheta*sinPhi;
-    (*img)[i].rotMat[2][1] = -sinTheta;
-    (*img)[i].rotMat[2][2] =  cosTheta*cosPhi;
+    rotationMatrix(&(*img)[i]);
   }
 
   /* Allocate moldata array */
@@ -226,9 +248,46 @@ The cutoff will be the value of abs(x) for which the error in the exact expressi
       (*m)[i].gstat = NULL;
       (*m)[i].cmb = NULL;
       (*m)[i].local_cmb = NULL;
+      (*m)[i].part = NULL;
+      (*m)[i].nmolMode = 0;
     }
 }
 
+void
+rotationMatrix(image *img){
+  double cosPhi,sinPhi,cosTheta,sinTheta;
+
+  /* Rotation matrix
+
+          |1          0           0   |
+   R_x(a)=|0        cos(a)      sin(a)|
+          |0       -sin(a)      cos(a)|
+
+          |cos(b)     0       -sin(b)|
+   R_y(b)=|  0        1          0   |
+          |sin(b)     0        cos(b)|
+
+          |      cos(b)       0          -sin(b)|
+   Rot =  |sin(a)sin(b)     cos(a)  sin(a)cos(b)|
+          |cos(a)sin(b)    -sin(a)  cos(a)cos(b)|
+
+  */
+
+  cosPhi   = cos(img->phi);
+  sinPhi   = sin(img->phi);
+  cosTheta = cos(img->theta);
+  sinTheta = sin(img->theta);
+  img->rotMat[0][0] =           cosPhi;
+  img->rotMat[0][1] =  0.0;
+  img->rotMat[0][2] =          -sinPhi;
+  img->rotMat[1][0] =  sinTheta*sinPhi;
+  img->rotMat[1][1] =  cosTheta;
+  img->rotMat[1][2] =  sinTheta*cosPhi;
+  img->rotMat[2][0] =  cosTheta*sinPhi;
+  img->rotMat[2][1] = -sinTheta;
+  img->rotMat[2][2] =  cosTheta*cosPhi;
+}
+
 void
 freeInput( inputPars *par, image* img, molData* mol )
 {
@@ -297,6 +356,17 @@ freeInput( inputPars *par, image* img, molData* mol )
             {
               free(mol[i].local_cmb);
             }
+          if( mol[i].part != NULL )
+            {
+              for(id=0;id<mol[i].npart;id++)
+                {
+                  free(mol[i].part[id].temp);
+                  free(mol[i].part[id].down);
+                  free(mol[i].part[id].gfac);
+                  free(mol[i].part[id].ediff);
+                }
+              free(mol[i].part);
+            }
         }
       free(mol);
     }
@@ -351,19 +421,12 @@ invSqrt(float x){
 
 void
 continuumSetup(int im, image *img, molData *m, inputPars *par, struct grid *g){
-  int id;
   img[im].trans=0;
   m[0].nline=1;
   m[0].freq= malloc(sizeof(double));
   m[0].freq[0]=img[im].freq;
-  for(id=0;id<par->ncell;id++) {
-    freePopulation( par, m, g[id].mol );
-    g[id].mol=malloc(sizeof(struct populations)*1);
-    g[id].mol[0].dust = malloc(sizeof(double)*m[0].nline);
-    g[id].mol[0].knu  = malloc(sizeof(double)*m[0].nline);
-    g[id].mol[0].pops = NULL;
-    g[id].mol[0].partner = NULL;
-  }
+  popsAlloc(par,g);
+  popsAllocSpecies(par,g,0,0,m[0].nline);
   if(par->outputfile) popsout(par,g,m);
   kappa(m,g,par,0);
 }
@@ -430,35 +493,29 @@ lineBlend(molData *m, inputPars *par, blend **matrix){
 
 }
 
-void
-levelPops(molData *m, inputPars *par, struct grid *g, int *popsdone){
-  int id,conv=0,iter,ilev,prog=0,ispec,c=0,n,i,threadI,nVerticesDone;
-  double percent=0.,*median,result1=0,result2=0,snr,delta_pop;
+static void
+solvePops(molData *m, inputPars *par, struct grid *g, int warmStart){
+  int id,conv=0,iter,ilev,prog=0,ispec,c=0,n,i,threadI,nVerticesDone,timer,nIter,nOwned,nConv,nPoints,resume=0,untilConv=0;
+  double percent=0.,*median,result1=0,result2=0,snr,delta_pop,r1=0,r2=0;
+  double *photonBusy,*stateqBusy,*threadBusy;
   blend *matrix;
-  struct statistics { double *pop, *ave, *sigma; } *stat;
+  struct popStats *stat;
+  inputPars wpar;
   const gsl_rng_type *ranNumGenType = gsl_rng_ranlxs2;
 
-  stat=malloc(sizeof(struct statistics)*par->pIntensity);
-
-  for(id=0;id<par->ncell;id++) {
-    freePopulation( par, m, g[id].mol );
-    g[id].mol=malloc(sizeof(struct populations)*par->nSpecies);
-    int i;
-    for( i=0; i<par->nSpecies; i++ )
-      {
-        g[id].mol[i].dust = NULL;
-        g[id].mol[i].knu  = NULL;
-        g[id].mol[i].pops = NULL;
-        g[id].mol[i].partner = NULL;
-      }
-  }
+  stat=malloc(sizeof(struct popStats)*par->pIntensity);
+
+  /* A warm start (see runSweep()) keeps the molecular data and starts from the populations already in the grid */
+  if(!warmStart) popsAlloc(par,g);
+  nIter = warmStart ? par->sweepIter : NITERATIONS;
+  if(par->initPops!=NULL && !warmStart) nIter=par->initPopsIter;
 
   /* Random number generator */
   gsl_rng *ran = gsl_rng_alloc(ranNumGenType);
 #ifdef TEST
-  gsl_rng_set(ran, 1237106) ;
+  gsl_rng_set(ran, 1237106+TEST_SEED+limeOpts.rank) ;
 #else 
-  gsl_rng_set(ran,time(0));
+  gsl_rng_set(ran,time(0)+limeOpts.rank);
 #endif
 
   gsl_rng **threadRans;
@@ -470,12 +527,32 @@ levelPops(molData *m, inputPars *par, struct grid *g, int *popsdone){
   }
 
   /* Read in all molecular data */
-  for(id=0;id<par->nSpecies;id++) molinit(m,par,g,id);
+  if(!warmStart) for(id=0;id<par->nSpecies;id++) molinit(m,par,g,id);
+  else for(id=0;id<par->nSpecies;id++) molUpdate(m,par,g,id);
 
   /* Check for blended lines */
   lineBlend(m,par,&matrix);
 
-  if(par->lte_only || par->init_lte) LTE(par,g,m);
+  if(par->lte_only || (par->init_lte && !warmStart)) LTE(par,g,m);
+
+  /* Local escape probability solution, from LTE (see lvg.c) */
+  if(!par->lte_only && (par->lvg_only || (par->init_lvg && !warmStart))){
+    if(!par->init_lte) LTE(par,g,m);
+    LVG(par,g,m);
+  }
+
+  /* A run that resumes from a checkpoint (see checkpoint.c) gets its populations from there */
+  if(par->checkpoint!=NULL && !warmStart) resume=checkpointFound(par,m,g,ran);
+
+  /* Start from the solution on the grid before its last refinement (see refine.c), or from the populations of an earlier run, interpolated onto this grid (see interppops.c) */
+  if(!warmStart && refinePops(m,par,g)) nIter=par->initPopsIter;
+  else if(par->initPops!=NULL && !par->lte_only && !warmStart){
+    if(!resume) interpPops(par,m,g);
+  }
+  /* or from a solution on a coarser grid (see multilevel.c), from where the iterations go on until they have converged */
+  else if(par->multilevel>1 && !par->lte_only && !par->lvg_only && !warmStart){
+    if(coarsePops(m,par,g,resume)) untilConv=1;
+  }
 
   for(id=0;id<par->pIntensity;id++){
     stat[id].pop=malloc(sizeof(double)*m[0].nlev*5);
@@ -486,19 +563,42 @@ levelPops(molData *m, inputPars *par, struct grid *g, int *popsdone){
     }
   }
 
-  if(par->outputfile) popsout(par,g,m);
+  if(par->outputfile && !warmStart) popsout(par,g,m);
 
 
-  /* Initialize convergence flag */
+  /* Each MPI rank solves its own share of the points (see ranks.c), or only their representatives in a symmetric model (see symmetry.c). A subdomain grid holds the share of one rank already (see subdomain.c), whose points come first. */
+  if(!isSubdomain(g)){
+    symmetryReduce(par,g);
+    splitPoints(par,g);
+  }
+  nOwned=0;
+  for(id=0;id<par->pIntensity;id++) if(g[id].rank==limeOpts.rank && g[id].rep==id) nOwned++;
+  nPoints=subdomainPoints(par,g);
+  wholeGrid(par,g,&wpar);
+
+  /* Initialize convergence flag and cost map */
   for(id=0;id<par->ncell;id++){
     g[id].conv=0;
+    g[id].cost.steps=0;
+    g[id].cost.iters=0;
+    g[id].cost.time=0.;
   }
 
-  if(par->lte_only==0){
+  /* Resume from the checkpoint of an interrupted run, if there is one (see checkpoint.c) */
+  if(par->checkpoint!=NULL && !warmStart){
+    conv=checkpointRead(par,m,g,stat,ran,threadRans);
+    prog=conv;
+  }
+
+  photonBusy=malloc(sizeof(double)*par->nThreads);
+  stateqBusy=malloc(sizeof(double)*par->nThreads);
+  threadBusy=malloc(sizeof(double)*par->nThreads);
+
+  if(par->lte_only==0 && par->lvg_only==0){
     do{
       if(!silent) progressbar2(0, prog++, 0, result1, result2);
 
-      for(id=0;id<par->ncell && !g[id].sink;id++){
+      for(id=0;id<nPoints;id++){
         for(ilev=0;ilev<m[0].nlev;ilev++) {
           for(iter=0;iter<4;iter++) stat[id].pop[ilev+m[0].nlev*iter]=stat[id].pop[ilev+m[0].nlev*(iter+1)];
           stat[id].pop[ilev+m[0].nlev*4]=g[id].mol[0].pops[ilev];
@@ -506,44 +606,77 @@ levelPops(molData *m, inputPars *par, struct grid *g, int *popsdone){
       }
 
       nVerticesDone=0;
-      omp_set_dynamic(0);
+      for(i=0;i<par->nThreads;i++){
+        photonBusy[i]=0.;
+        stateqBusy[i]=0.;
+      }
+      timer=timerBegin("levelPops");
+      if(isSubdomain(g)) sweepSubdomain(par,m,g,matrix,threadRans,nOwned,photonBusy,stateqBusy);
+      else {
+        omp_set_dynamic(0);
 #pragma omp parallel private(i,id,ispec,threadI) num_threads(par->nThreads)
-      {
-        threadI = omp_get_thread_num();
-
-        /* Declare and allocate thread-private variables */
-        gridPointData *mp;	// Could have declared them earlier
-        double *halfFirstDs;	// and included them in private() I guess.
-        mp=malloc(sizeof(gridPointData)*par->nSpecies);
-        for (i=0;i<par->nSpecies;i++){
-          mp[i].phot = malloc(sizeof(double)*m[i].nline*max_phot);
-          mp[i].vfac = malloc(sizeof(double)*           max_phot);
-          mp[i].jbar = malloc(sizeof(double)*m[i].nline);
-        }
-        halfFirstDs = malloc(sizeof(*halfFirstDs)*max_phot);
+        {
+          double t0,t1,t2;
+          threadI = omp_get_thread_num();
+
+          /* Declare and allocate thread-private variables */
+          gridPointData *mp;	// Could have declared them earlier
+          double *halfFirstDs;	// and included them in private() I guess.
+          mp=malloc(sizeof(gridPointData)*par->nSpecies);
+          for (i=0;i<par->nSpecies;i++){
+            mp[i].phot = malloc(sizeof(storeReal)*m[i].nline*max_phot);
+            mp[i].vfac = malloc(sizeof(double)*           max_phot);
+            mp[i].jbar = malloc(sizeof(double)*m[i].nline);
+            pointRatesAlloc(m,i,mp);
+          }
+          halfFirstDs = malloc(sizeof(*halfFirstDs)*max_phot);
 
 #pragma omp for
-        for(id=0;id<par->pIntensity;id++){
+          for(id=0;id<par->pIntensity;id++){
+            if(g[id].rank!=limeOpts.rank || g[id].rep!=id) continue;
 #pragma omp atomic
-          ++nVerticesDone;
+            ++nVerticesDone;
 
-          if (threadI == 0){ // i.e., is master thread
-            if(!silent) progressbar((double)nVerticesDone/par->pIntensity,10);
-          }
-          if(g[id].dens[0] > 0 && g[id].t[0] > 0){
-            photon(id,g,m,0,threadRans[threadI],par,matrix,mp,halfFirstDs);
-            for(ispec=0;ispec<par->nSpecies;ispec++) stateq(id,g,m,ispec,par,mp,halfFirstDs);
-          }
-          if (threadI == 0){ // i.e., is master thread
-            if(!silent) warning("");
+            if (threadI == 0){ // i.e., is master thread
+              if(!silent) progressbar((double)nVerticesDone/nOwned,10);
+            }
+            if(g[id].dens[0] > 0 && g[id].t[0] > 0){
+              t0=wallTime();
+              photon(id,g,m,0,threadRans[threadI],par,matrix,mp,halfFirstDs);
+              t1=wallTime();
+              for(ispec=0;ispec<par->nSpecies;ispec++) stateq(id,g,m,ispec,par,mp,halfFirstDs);
+              t2=wallTime();
+              photonBusy[threadI]+=t1-t0;
+              stateqBusy[threadI]+=t2-t1;
+              g[id].cost.time+=t2-t0;
+            }
+            if (threadI == 0){ // i.e., is master thread
+              if(!silent) warning("");
+            }
           }
-        }
 
-        freeGridPointData(par, mp);
-        free(halfFirstDs);
-      } // end parallel block.
+          for(i=0;i<par->nSpecies;i++) freePointRates(m,i,mp);
+          freeGridPointData(par, mp);
+          free(halfFirstDs);
+          MERGE_COUNTERS(PHASE_LEVELPOPS);
+        } // end parallel block.
+      }
+
+      timerEnd(timer);
+      for(i=0;i<par->nThreads;i++) threadBusy[i]=photonBusy[i]+stateqBusy[i];
+      timerThreads(timer, par->nThreads, threadBusy);
+      timerAddThreads("photon", par->nThreads, photonBusy);
+      timerAddThreads("stateq", par->nThreads, stateqBusy);
+
+      if(limeOpts.nRanks>1){
+        timer=timerBegin("exchange");
+        exchangePops(par,m,g);
+        timerEnd(timer);
+      }
+      symmetryFill(par,m,g);
 
-      for(id=0;id<par->ncell && !g[id].sink;id++){
+      nConv=0;
+      for(id=0;id<nPoints;id++){
         snr=0;
         n=0;
         for(ilev=0;ilev<m[0].nlev;ilev++) {
@@ -567,27 +700,42 @@ levelPops(molData *m, inputPars *par, struct grid *g, int *popsdone){
         else if(n==0) snr=1e6;
         if(snr > 3.) g[id].conv=2;
         if(snr <= 3 && g[id].conv==2) g[id].conv=1;
+        if(g[id].conv==2) nConv++;
       }
 
       median=malloc(sizeof(*median)*gsl_max(c,1));
       c=0;
-      for(id=0;id<par->pIntensity;id++){
+      for(id=0;id<nPoints;id++){
         for(ilev=0;ilev<m[0].nlev;ilev++){
           if(g[id].mol[0].pops[ilev] > 1e-12) median[c++]=g[id].mol[0].pops[ilev]/stat[id].sigma[ilev];
         }
       }
 
       gsl_sort(median, 1, c);
-      if(conv>1){
+      /* The ranks of a decomposed grid only see their own subdomains */
+      if(isSubdomain(g)){
+        sharedStats(median, c, &nConv, &r1, &r2);
+        if(conv>1){
+          result1=r1;
+          result2=r2;
+        }
+      } else if(conv>1){
         result1=median[0];
         result2 =gsl_stats_median_from_sorted_data(median, 1, c);
       }
       free(median);
 
       if(!silent) progressbar2(1, prog, percent, result1, result2);
-      if(par->outputfile) popsout(par,g,m);
-    } while(conv++<NITERATIONS);
-    if(par->binoutputfile) binpopsout(par,g,m);
+      if(par->outputfile && !warmStart) popsout(par,g,m);
+      if(par->checkpoint!=NULL && !warmStart && (conv+1)%par->checkpointEvery==0) checkpointWrite(par,m,g,stat,conv+1,ran,threadRans);
+
+      /* Once the statistics hold no copies of the starting populations, i.e. after five iterations */
+      if(untilConv && conv>=4 && conv+1>=par->initPopsIter
+         && (nConv>=CONV_FRACTION*wpar.pIntensity || result2>=CONV_SNR)) break;
+    } while(conv++<nIter);
+    if(par->checkpoint!=NULL && !warmStart) checkpointDone(par,g);
+    if(par->binoutputfile && !warmStart) binpopsout(par,g,m);
+    reduceCosts(par,g);
   }
 
   for (i=0;i<par->nThreads;i++){
@@ -595,12 +743,30 @@ levelPops(molData *m, inputPars *par, struct grid *g, int *popsdone){
   }
   free(threadRans);
   gsl_rng_free(ran);
+  free(photonBusy);
+  free(stateqBusy);
+  free(threadBusy);
   for(id=0;id<par->pIntensity;id++){
     free(stat[id].pop);
     free(stat[id].ave);
     free(stat[id].sigma);
   }
   free(stat);
+}
+
+/* Solves the level populations of grid g, with several MPI ranks on a subdomain of the grid each, unless it is an octree grid (see subdomain.c) */
+void
+levelPops(molData *m, inputPars *par, struct grid *g, int *popsdone, int warmStart){
+  inputPars lpar;
+  struct grid *lg;
+
+  if(limeOpts.nRanks>1 && !par->octree){
+    lg=subdomainGrid(par,m,g,&lpar,warmStart);
+    solvePops(m,&lpar,lg,warmStart);
+    mergeSubdomain(par,m,g);
+    if(par->outputfile && !warmStart) popsout(par,g,m);
+    if(par->binoutputfile && !warmStart && par->lte_only==0 && par->lvg_only==0) binpopsout(par,g,m);
+  } else solvePops(m,par,g,warmStart);
   *popsdone=1;
 }
 
@@ -0,0 +1,301 @@
+/*
+ *  checkpoint.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Checkpoints of levelPops (par->checkpoint). Every par->checkpointEvery iterations the state of the iteration is copied into a buffer: the populations of all species and the convergence flag of each grid point, the population history of the convergence statistics, the number of iterations done and the states of the random number generators. A separate thread then writes the buffer to a temporary file, which is renamed to par->checkpoint once it is complete, while the iterations go on.
+
+A run that finds a checkpoint of its model resumes from it. The grid is not stored: it is rebuilt from the random seed saved in the checkpoint (par->gridSeed), and a checksum of the positions of the points makes sure it is the same grid. The checkpoint is removed when levelPops has finished.
+
+With several MPI ranks (see ranks.c) an octree grid is checkpointed by rank 0 alone, since every rank holds all its populations, but the ranks of a decomposed grid (see subdomain.c) hold only their own subdomains, and each rank writes a checkpoint of its subdomain grid, par->checkpoint with the rank appended. Either way every rank reads a checkpoint, and a run resumes only if all of them have found one that belongs to it, from the same iteration.
+*/
+
+#include "lime.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHECKPOINT_MAGIC "LIMECKP"
+
+typedef struct {
+  char magic[8];
+  unsigned long gridSeed;
+  int ncell,pIntensity,nSpecies,nlevTot,nlev0;
+  double xsum;			/* checksum of the grid point positions */
+  int iter;			/* iterations done */
+  int nRngs;			/* number of generators saved: the main one and one per thread */
+  size_t rngSize;
+} checkpointHeader;
+
+typedef struct {
+  char *file;
+  char *buf;
+  size_t size;
+} checkpointJob;
+
+static pthread_t writer;
+static int writing=0;
+static int writeFailed=0;	/* set by writeJob(), reported by checkpointWait() in the main thread */
+
+/* Size of a checkpoint file with header h */
+static size_t
+checkpointSize(checkpointHeader *h){
+  return sizeof(*h)+sizeof(int)*(size_t)h->ncell
+    +sizeof(double)*((size_t)h->ncell*h->nlevTot+(size_t)h->pIntensity*5*h->nlev0)
+    +(size_t)h->nRngs*h->rngSize;
+}
+
+/* 1 if this rank keeps a checkpoint of g: rank 0, or every rank if g is a subdomain grid */
+static int
+keepsCheckpoint(struct grid *g){
+  return limeOpts.rank==0 || isSubdomain(g);
+}
+
+static double
+positionSum(inputPars *par, struct grid *g){
+  double s=0.;
+  int id;
+
+  for(id=0;id<par->ncell;id++) s+=g[id].x[0]+2.*g[id].x[1]+3.*g[id].x[2];
+  return s;
+}
+
+static void
+fillHeader(checkpointHeader *h, inputPars *par, molData *m, struct grid *g){
+  int ispec;
+
+  memset(h, 0, sizeof(checkpointHeader));
+  strcpy(h->magic, CHECKPOINT_MAGIC);
+  h->gridSeed=par->gridSeed;
+  h->ncell=par->ncell;
+  h->pIntensity=par->pIntensity;
+  h->nSpecies=par->nSpecies;
+  for(ispec=0;ispec<par->nSpecies;ispec++) h->nlevTot+=m[ispec].nlev;
+  h->nlev0=m[0].nlev;
+  h->xsum=positionSum(par,g);
+}
+
+static void *
+writeJob(void *arg){
+  checkpointJob *job=arg;
+  char *tmp;
+  FILE *fp;
+  int ok;
+
+  tmp=malloc(strlen(job->file)+8);
+  sprintf(tmp,"%s.tmp",job->file);
+  ok=((fp=fopen(tmp,"wb"))!=NULL);
+  if(ok){
+    ok=(fwrite(job->buf, 1, job->size, fp)==job->size);
+    ok=(fflush(fp)==0) && ok;
+    ok=(fsync(fileno(fp))==0) && ok;
+    ok=(fclose(fp)==0) && ok;
+  }
+  if(ok) ok=(rename(tmp, job->file)==0);
+  if(!ok){
+    unlink(tmp);
+    writeFailed=1;
+  }
+  free(tmp);
+  free(job->buf);
+  free(job);
+  return NULL;
+}
+
+/* Waits for the checkpoint being written, if any */
+void
+checkpointWait(){
+  if(writing) pthread_join(writer, NULL);
+  writing=0;
+  if(writeFailed && !silent) warning("The checkpoint could not be written; the previous one is kept");
+  writeFailed=0;
+}
+
+/* Takes a checkpoint after iter iterations and writes it in the background */
+void
+checkpointWrite(inputPars *par, molData *m, struct grid *g, struct popStats *stat, int iter, gsl_rng *ran, gsl_rng **threadRans){
+  checkpointHeader h;
+  checkpointJob *job;
+  char *p;
+  int id,ispec,ilev,i;
+  double d;
+
+  if(!keepsCheckpoint(g)) return;
+  checkpointWait();
+
+  fillHeader(&h,par,m,g);
+  h.iter=iter;
+  h.nRngs=1+par->nThreads;
+  h.rngSize=gsl_rng_size(ran);
+
+  job=malloc(sizeof(checkpointJob));
+  job->file=par->checkpoint;
+  job->size=checkpointSize(&h);
+  job->buf=malloc(job->size);
+
+  p=job->buf;
+  memcpy(p, &h, sizeof(h));
+  p+=sizeof(h);
+  for(id=0;id<par->ncell;id++){
+    memcpy(p, &g[id].conv, sizeof(int));
+    p+=sizeof(int);
+  }
+  /* The populations are stored as doubles, whatever storeReal is */
+  for(id=0;id<par->ncell;id++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(ilev=0;ilev<m[ispec].nlev;ilev++){
+        d=(g[id].mol[ispec].pops!=NULL) ? g[id].mol[ispec].pops[ilev] : 0.;
+        memcpy(p, &d, sizeof(double));
+        p+=sizeof(double);
+      }
+    }
+  }
+  for(id=0;id<par->pIntensity;id++){
+    memcpy(p, stat[id].pop, sizeof(double)*5*h.nlev0);
+    p+=sizeof(double)*5*h.nlev0;
+  }
+  memcpy(p, gsl_rng_state(ran), h.rngSize);
+  p+=h.rngSize;
+  for(i=0;i<par->nThreads;i++){
+    memcpy(p, gsl_rng_state(threadRans[i]), h.rngSize);
+    p+=h.rngSize;
+  }
+
+  if(pthread_create(&writer, NULL, writeJob, job)==0) writing=1;
+  else writeJob(job);
+}
+
+/* Opens par->checkpoint and reads its header into h; returns NULL if there is none, it does not belong to this run or it is not as long as its header says */
+static FILE *
+openCheckpoint(inputPars *par, molData *m, struct grid *g, gsl_rng *ran, checkpointHeader *h){
+  checkpointHeader mine;
+  struct stat st;
+  FILE *fp;
+
+  if((fp=fopen(par->checkpoint,"rb"))==NULL) return NULL;
+  fillHeader(&mine,par,m,g);
+  if(fread(h, sizeof(*h), 1, fp)!=1 || strcmp(h->magic, CHECKPOINT_MAGIC) || h->gridSeed!=mine.gridSeed
+     || h->ncell!=mine.ncell || h->pIntensity!=mine.pIntensity || h->nSpecies!=mine.nSpecies
+     || h->nlevTot!=mine.nlevTot || h->nlev0!=mine.nlev0 || h->xsum!=mine.xsum
+     || h->rngSize!=gsl_rng_size(ran) || h->nRngs<1 || h->iter<0
+     || fstat(fileno(fp), &st)!=0 || (size_t)st.st_size!=checkpointSize(h)){
+    fclose(fp);
+    return NULL;
+  }
+  return fp;
+}
+
+/* 1 if par->checkpoint belongs to this run, so that checkpointRead() will resume from it and any other starting populations are of no use */
+int
+checkpointFound(inputPars *par, molData *m, struct grid *g, gsl_rng *ran){
+  checkpointHeader h;
+  FILE *fp;
+  int found=0;
+
+  if((fp=openCheckpoint(par,m,g,ran,&h))!=NULL){
+    fclose(fp);
+    found=1;
+  }
+  /* The ranks must all resume, or none of them */
+  if(limeOpts.nRanks>1) found=minOverRanks(found);
+  return found;
+}
+
+/* Restores the state saved in par->checkpoint, if it belongs to this run, and returns the number of iterations it had done; returns 0 if there is nothing to resume */
+int
+checkpointRead(inputPars *par, molData *m, struct grid *g, struct popStats *stat, gsl_rng *ran, gsl_rng **threadRans){
+  checkpointHeader h;
+  FILE *fp;
+  int id,ispec,ilev,i,iter=-1;
+  double d;
+  char *buf=NULL,*p;
+  size_t size;
+
+  /* The whole body is read before any of it is used, so that a failed read leaves the grid as it was */
+  if(access(par->checkpoint, F_OK)==0){
+    if((fp=openCheckpoint(par,m,g,ran,&h))==NULL){
+      if(!silent) warning("The checkpoint does not match this model; starting afresh");
+    } else {
+      size=checkpointSize(&h)-sizeof(h);
+      buf=malloc(size);
+      if(fread(buf, 1, size, fp)!=size){
+        free(buf);
+        buf=NULL;
+        if(!silent) warning("The checkpoint could not be read; starting afresh");
+      } else iter=h.iter;
+      fclose(fp);
+    }
+  }
+  /* The ranks go on from the same iteration, so they all need a checkpoint of it: one of their own for a decomposed grid, else that of rank 0, which they may not all see */
+  if(limeOpts.nRanks>1 && (minOverRanks(iter)<0 || minOverRanks(-iter)!=-iter)){
+    if(buf!=NULL && !silent) warning("The checkpoints of the MPI processes do not match; starting afresh");
+    free(buf);
+    return 0;
+  }
+  if(buf==NULL) return 0;
+
+  p=buf;
+  for(id=0;id<par->ncell;id++){
+    memcpy(&g[id].conv, p, sizeof(int));
+    p+=sizeof(int);
+  }
+  for(id=0;id<par->ncell;id++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(ilev=0;ilev<m[ispec].nlev;ilev++){
+        memcpy(&d, p, sizeof(double));
+        p+=sizeof(double);
+        if(g[id].mol[ispec].pops!=NULL) g[id].mol[ispec].pops[ilev]=d;
+      }
+    }
+  }
+  for(id=0;id<par->pIntensity;id++){
+    memcpy(stat[id].pop, p, sizeof(double)*5*h.nlev0);
+    p+=sizeof(double)*5*h.nlev0;
+  }
+
+  /* The generators of ranks without a checkpoint of their own, or of threads the checkpointed run did not have, keep their fresh seeds */
+  if(keepsCheckpoint(g)){
+    for(i=0;i<h.nRngs;i++){
+      if(i==0) memcpy(gsl_rng_state(ran), p, h.rngSize);
+      else if(i-1<par->nThreads) memcpy(gsl_rng_state(threadRans[i-1]), p, h.rngSize);
+      p+=h.rngSize;
+    }
+  }
+  free(buf);
+  return h.iter;
+}
+
+/* Waits for the last checkpoint of g and removes it, once levelPops has finished */
+void
+checkpointDone(inputPars *par, struct grid *g){
+  checkpointWait();
+  if(keepsCheckpoint(g)) unlink(par->checkpoint);
+}
+
+/* Grid seed of the run that wrote par->checkpoint, or the checkpoint of rank 0 of a decomposed grid, so that a resumed run builds the same grid; 0 if there is no checkpoint. All ranks take the seed of rank 0. */
+unsigned long
+checkpointSeed(inputPars *par){
+  checkpointHeader h;
+  FILE *fp=NULL;
+  char *file;
+
+  h.gridSeed=0;
+  if(limeOpts.rank==0){
+    if((fp=fopen(par->checkpoint,"rb"))==NULL && limeOpts.nRanks>1){
+      file=malloc(strlen(par->checkpoint)+3);
+      sprintf(file,"%s.0",par->checkpoint);
+      fp=fopen(file,"rb");
+      free(file);
+    }
+    if(fp!=NULL){
+      if(fread(&h, sizeof(h), 1, fp)!=1 || strcmp(h.magic, CHECKPOINT_MAGIC)) h.gridSeed=0;
+      fclose(fp);
+    }
+  }
+  return (unsigned long)fromRankZero((long)h.gridSeed);
+}
@@ -0,0 +1,111 @@
+/*
+ *  counters.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Event counters for photon(), stateq(), traceray() and velocityspline(). They are only compiled in if LIME is built with -DCOUNTERS (lime -c); otherwise the COUNT/HIST/MERGE_COUNTERS macros are empty and writeCounters() and writeCountersJson() write nothing.
+*/
+
+#include "lime.h"
+
+#ifdef COUNTERS
+eventCounters threadCounters;
+static eventCounters phaseCounters[N_COUNTER_PHASES];
+
+static const char *phaseNames[N_COUNTER_PHASES]={"levelPops","raytrace"};
+static const char *counterNames[N_COUNTERS]={
+  "Photons", "Photon steps", "Maser clamps (tau < -30)", "stateq calls",
+  "stateq iterations", "SVD fallbacks", "velocityspline calls",
+  "velocityspline sub-samples", "Rays", "Cells crossed by rays"};
+static const char *counterKeys[N_COUNTERS]={
+  "photons", "photon_steps", "maser_clamps", "stateq_calls", "stateq_iterations",
+  "svd_fallbacks", "spline_calls", "spline_samples", "rays", "ray_cells"};
+static const char *histNames[N_HISTS]={
+  "Photon steps per photon", "Photon steps per vertex", "stateq iterations per call",
+  "velocityspline sub-samples per call", "Cells crossed per ray"};
+
+void
+countHist(int h, unsigned long long v){
+  int bin=0;
+
+  while(v>0 && bin<N_HIST_BINS-1){
+    v>>=1;
+    bin++;
+  }
+  threadCounters.hist[h][bin]++;
+}
+
+/* Called by every thread at the end of a parallel region */
+void
+mergeCounters(int phase){
+  int i,j;
+
+#pragma omp critical (mergeCounters)
+  {
+    for(i=0;i<N_COUNTERS;i++) phaseCounters[phase].count[i]+=threadCounters.count[i];
+    for(i=0;i<N_HISTS;i++)
+      for(j=0;j<N_HIST_BINS;j++) phaseCounters[phase].hist[i][j]+=threadCounters.hist[i][j];
+  }
+  memset(&threadCounters, 0, sizeof(threadCounters));
+}
+
+void
+writeCounters(FILE *fp){
+  int p,i,j,last;
+  unsigned long long total;
+
+  fprintf(fp,"\n***\n*** Event counters\n");
+  for(p=0;p<N_COUNTER_PHASES;p++){
+    fprintf(fp,"\n    %s\n",phaseNames[p]);
+    for(i=0;i<N_COUNTERS;i++){
+      if(phaseCounters[p].count[i]>0) fprintf(fp,"      %-32s %16llu\n",counterNames[i],phaseCounters[p].count[i]);
+    }
+    for(i=0;i<N_HISTS;i++){
+      total=0;
+      last=-1;
+      for(j=0;j<N_HIST_BINS;j++){
+        total+=phaseCounters[p].hist[i][j];
+        if(phaseCounters[p].hist[i][j]>0) last=j;
+      }
+      if(total==0) continue;
+      fprintf(fp,"\n      %s\n",histNames[i]);
+      for(j=0;j<=last;j++){
+        if(j==0) fprintf(fp,"        %12llu - %-12llu %10llu\n",0ULL,0ULL,phaseCounters[p].hist[i][j]);
+        else fprintf(fp,"        %12llu - %-12llu %10llu\n",1ULL<<(j-1),(1ULL<<j)-1,phaseCounters[p].hist[i][j]);
+      }
+    }
+  }
+}
+
+/* The counter totals as "phase.counter": value pairs, one per line, for LimeReport.json */
+void
+writeCountersJson(FILE *fj){
+  int p,i;
+
+  fprintf(fj,"  \"counters\": {\n");
+  for(p=0;p<N_COUNTER_PHASES;p++){
+    for(i=0;i<N_COUNTERS;i++){
+      fprintf(fj,"    \"%s.%s\": %llu%s\n",phaseNames[p],counterKeys[i],phaseCounters[p].count[i],(p<N_COUNTER_PHASES-1 || i<N_COUNTERS-1)?",":"");
+    }
+  }
+  fprintf(fj,"  },\n");
+}
+
+#else
+
+void
+writeCounters(FILE *fp){
+  return;
+}
+
+void
+writeCountersJson(FILE *fj){
+  return;
+}
+
+#endif
@@ -7,45 +7,185 @@
  *
  */
 
+/*
+The model functions called by LIME. Each is a weak symbol which calls the function of the model loaded with loadModel(), or the default below if the model does not define it. If model.c is linked in (as by the lime script without a prebuilt engine), its functions replace the weak ones at link time.
+*/
+
 #include "lime.h"
 #include "assert.h"
+#include <dlfcn.h>
+#include <limits.h>
+
+static void
+defaultInput(inputPars *par, image *img){
+  if(!silent) bail_out("No model: input() is not defined, or no model file was given");
+  exit(1);
+}
+
+static void
+defaultDensity(double x, double y, double z, double *density){
+  if(!silent) bail_out("Density is not defined in model.c but is needed by LIME!");
+  exit(1);
+}
+
+static void
+defaultTemperature(double x, double y, double z, double *temperature){
+  if(!silent) bail_out("Temperature is not defined in model.c but is needed by LIME!");
+  exit(1);
+}
+
+static void
+defaultAbundance(double x, double y, double z, double *abundance){
+  if(!silent) bail_out("Abundance is not defined in model.c but is needed by LIME!");
+  exit(1);
+}
+
+static void
+defaultDoppler(double x, double y, double z, double *doppler){
+  if(!silent) bail_out("Doppler velocity is not defined in model.c but is needed by LIME!");
+  exit(1);
+}
 
+static void
+defaultVelocity(double x, double y, double z, double *vel){
+  if(!silent) bail_out("Velocity field is not defined in model.c but is needed by LIME!");
+  exit(1);
+}
+
+static int
+defaultSweepSet(int iset, double *params, image *img){
+  if(!silent) bail_out("par->nSweep is set but sweepSet() is not defined in model.c");
+  exit(1);
+}
+
+static void
+defaultVelocityGradient(double x, double y, double z, double *grad){
+}
+
+static void
+defaultMagfield(double x, double y, double z, double *B){
+}
+
+static void
+defaultGasIIdust(double x, double y, double z, double *gas2dust){
+  *gas2dust=100.;
+}
+
+typedef void (*modelFunc)(double, double, double, double *);
+
+static void *modelHandle=NULL;
+static void (*inputFunc)(inputPars *, image *)=defaultInput;
+static modelFunc densityFunc=defaultDensity;
+static modelFunc temperatureFunc=defaultTemperature;
+static modelFunc abundanceFunc=defaultAbundance;
+static modelFunc dopplerFunc=defaultDoppler;
+static modelFunc velocityFunc=defaultVelocity;
+static modelFunc velocityGradientFunc=defaultVelocityGradient;
+static modelFunc magfieldFunc=defaultMagfield;
+static modelFunc gasIIdustFunc=defaultGasIIdust;
+static int (*sweepSetFunc)(int, double *, image *)=defaultSweepSet;
+
+void __attribute__((weak))
+    input(inputPars *par, image *img){
+      inputFunc(par,img);
+    }
 
 void __attribute__((weak))
     density(double x, double y, double z, double *density){
-      if(!silent) bail_out("Density is not defined in model.c but is needed by LIME!");
-      exit(1);
+      densityFunc(x,y,z,density);
     }
 
 void __attribute__((weak))
     temperature(double x, double y, double z, double *temperature){
-      if(!silent) bail_out("Temperature is not defined in model.c but is needed by LIME!");
-      exit(1);
+      temperatureFunc(x,y,z,temperature);
     }
 
 void __attribute__((weak))
     abundance(double x, double y, double z, double *abundance){
-      if(!silent) bail_out("Abundance is not defined in model.c but is needed by LIME!");
-      exit(1);
+      abundanceFunc(x,y,z,abundance);
     }
 
 void __attribute__((weak))
     doppler(double x, double y, double z, double *doppler){
-      if(!silent) bail_out("Doppler velocity is not defined in model.c but is needed by LIME!");
-      exit(1);
+      dopplerFunc(x,y,z,doppler);
     }
 
 void __attribute__((weak))
     velocity(double x, double y, double z, double *vel){
-      if(!silent) bail_out("Velocity field is not defined in model.c but is needed by LIME!");
-      exit(1);
+      velocityFunc(x,y,z,vel);
     }
 
+/* An alias, so that modelVelocityGradient() can tell whether a linked model has replaced it */
+static void
+callVelocityGradient(double x, double y, double z, double *grad){
+  velocityGradientFunc(x,y,z,grad);
+}
+void velocityGradient(double, double, double, double *) __attribute__((weak, alias("callVelocityGradient")));
+
 void __attribute__((weak))
     magfield(double x, double y, double z, double *B){
+      magfieldFunc(x,y,z,B);
     }
 
 void __attribute__((weak))
     gasIIdust(double x, double y, double z, double *gas2dust){
-      *gas2dust=100.;
+      gasIIdustFunc(x,y,z,gas2dust);
     }
+
+int __attribute__((weak))
+    sweepSet(int iset, double *params, image *img){
+      return sweepSetFunc(iset,params,img);
+    }
+
+static void
+lookup(const char *name, modelFunc *func){
+  void *sym;
+
+  if((sym=dlsym(modelHandle,name))!=NULL) *func=(modelFunc)sym;
+}
+
+/* Loads a model compiled as a shared object (e.g. gcc -shared -fPIC -o model.so model.c) */
+void
+loadModel(const char *file){
+  char path[PATH_MAX], message[80];
+  void *sym;
+
+  /* dlopen() searches the library path unless the name contains a slash */
+  if(strchr(file,'/')==NULL) snprintf(path,sizeof(path),"./%s",file);
+  else snprintf(path,sizeof(path),"%s",file);
+
+  if((modelHandle=dlopen(path, RTLD_NOW|RTLD_LOCAL))==NULL){
+    fprintf(stderr,"%s\n",dlerror());
+    snprintf(message,sizeof(message),"Could not load the model %.50s",file);
+    if(!silent) bail_out(message);
+    exit(1);
+  }
+
+  if((sym=dlsym(modelHandle,"input"))==NULL){
+    snprintf(message,sizeof(message),"The model %.40s does not define input()",file);
+    if(!silent) bail_out(message);
+    exit(1);
+  }
+  inputFunc=(void (*)(inputPars *, image *))sym;
+  lookup("density", &densityFunc);
+  lookup("temperature", &temperatureFunc);
+  lookup("abundance", &abundanceFunc);
+  lookup("doppler", &dopplerFunc);
+  lookup("velocity", &velocityFunc);
+  lookup("velocityGradient", &velocityGradientFunc);
+  lookup("magfield", &magfieldFunc);
+  lookup("gasIIdust", &gasIIdustFunc);
+  if((sym=dlsym(modelHandle,"sweepSet"))!=NULL) sweepSetFunc=(int (*)(int, double *, image *))sym;
+}
+
+/* 1 if the model defines velocityGradient(), either linked in or loaded by loadModel() */
+int
+modelVelocityGradient(){
+  return velocityGradient!=callVelocityGradient || velocityGradientFunc!=defaultVelocityGradient;
+}
+
+void
+unloadModel(){
+  if(modelHandle!=NULL) dlclose(modelHandle);
+  modelHandle=NULL;
+}
@@ -8,6 +8,9 @@
  */
 
 #include "lime.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 void
@@ -46,52 +49,99 @@ gridAlloc(inputPars *par, struct grid **g){
   }
 }
 
+/*
+The per-species data of the grid points are not allocated point by point but
+from one block (arena) per kind of data: the populations structs of all points,
+and for each species the levels [point][level], the opacities [point][line],
+the partner structs [point][partner] and the collision rates [point][transition].
+g[id].mol and its arrays point into these blocks. The first grid point holds
+the start of each block, from which freePopulation() frees the lot.
+*/
 void
-freePopulation(const inputPars *par, const molData* m, struct populations* pop ) {
-  if( pop !=NULL )
-    {
-      int j,k;
-      for( j=0; j<par->nSpecies; j++ )
-        {
-          if( pop[j].pops != NULL )
-            {
-              free( pop[j].pops );
-            }
-          if( pop[j].knu != NULL )
-            {
-              free( pop[j].knu );
-            }
-          if( pop[j].dust != NULL )
-            {
-              free( pop[j].dust );
-            }
-          if( pop[j].partner != NULL )
-            {
-              if( m != NULL )
-                {
-                  for(k=0; k<m[j].npart; k++)
-                    {
-                      if( pop[j].partner[k].up != NULL )
-                        {
-                          free(pop[j].partner[k].up);
-                        }
-                      if( pop[j].partner[k].down != NULL )
-                        {
-                          free(pop[j].partner[k].down);
-                        }
-                    }
-                }
-              free( pop[j].partner );
-            }
-        }
-      free(pop);
+popsAlloc(const inputPars *par, struct grid *g){
+  struct populations *block;
+  int id,ispec;
+
+  freePopulation(par, g);
+  block=malloc(sizeof(struct populations)*par->ncell*par->nSpecies);
+  for(id=0;id<par->ncell;id++){
+    g[id].mol=block+id*par->nSpecies;
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      g[id].mol[ispec].pops = NULL;
+      g[id].mol[ispec].knu  = NULL;
+      g[id].mol[ispec].dust = NULL;
+      g[id].mol[ispec].partner = NULL;
     }
+  }
 }
+
+/* Populations (nlev of them, none if nlev is 0, zeroed) and opacities of species ispec for all grid points */
+void
+popsAllocSpecies(const inputPars *par, struct grid *g, int ispec, int nlev, int nline){
+  storeReal *pops=NULL,*knu,*dust;
+  int id;
+
+  if(nlev>0) pops=calloc((size_t)par->ncell*nlev, sizeof(storeReal));
+  knu =malloc(sizeof(storeReal)*par->ncell*nline);
+  dust=malloc(sizeof(storeReal)*par->ncell*nline);
+  for(id=0;id<par->ncell;id++){
+    g[id].mol[ispec].pops = (nlev>0) ? pops+(size_t)id*nlev : NULL;
+    g[id].mol[ispec].knu  = knu +(size_t)id*nline;
+    g[id].mol[ispec].dust = dust+(size_t)id*nline;
+  }
+}
+
+/* Partner structs of species ispec for all grid points, with room for the collision rates unless they are kept in tables */
+void
+ratesAlloc(const inputPars *par, const molData *m, struct grid *g, int ispec, int withRates){
+  struct rates *partner;
+  storeReal *up=NULL,*down=NULL;
+  int id,ipart;
+  size_t ntot=0,off;
+
+  if(m[ispec].npart<1) return;
+  partner=malloc(sizeof(struct rates)*par->ncell*m[ispec].npart);
+  for(ipart=0;ipart<m[ispec].npart;ipart++) ntot+=m[ispec].ntrans[ipart];
+  if(withRates){
+    up  =malloc(sizeof(storeReal)*(size_t)par->ncell*ntot);
+    down=malloc(sizeof(storeReal)*(size_t)par->ncell*ntot);
+  }
+  for(id=0;id<par->ncell;id++){
+    g[id].mol[ispec].partner=partner+id*m[ispec].npart;
+    off=(size_t)id*ntot;
+    for(ipart=0;ipart<m[ispec].npart;ipart++){
+      g[id].mol[ispec].partner[ipart].up   = withRates ? up+off : NULL;
+      g[id].mol[ispec].partner[ipart].down = withRates ? down+off : NULL;
+      off+=m[ispec].ntrans[ipart];
+    }
+  }
+}
+
+void
+freePopulation(const inputPars *par, struct grid *g){
+  int id,ispec;
+
+  if( g==NULL || g[0].mol==NULL ) return;
+  for(ispec=0;ispec<par->nSpecies;ispec++){
+    free(g[0].mol[ispec].pops);
+    free(g[0].mol[ispec].knu);
+    free(g[0].mol[ispec].dust);
+    if( g[0].mol[ispec].partner != NULL ){
+      free(g[0].mol[ispec].partner[0].up);
+      free(g[0].mol[ispec].partner[0].down);
+      free(g[0].mol[ispec].partner);
+    }
+  }
+  free(g[0].mol);
+  for(id=0;id<par->ncell;id++) g[id].mol=NULL;
+}
+
 void
 freeGrid(const inputPars *par, const molData* m ,struct grid* g){
   int i;
   if( g != NULL )
     {
+      freePopulation( par, g );
       for(i=0;i<(par->pIntensity+par->sinkPoints); i++){
         if(g[i].a0 != NULL)
           {
@@ -141,18 +191,18 @@ freeGrid(const inputPars *par, const molData* m ,struct grid* g){
           {
             free(g[i].ds);
           }
-        if(g[i].mol != NULL)
-          {
-            freePopulation( par, m, g[i].mol );
-          }
       }
       free(g);
     }
 }
 
 void
-qhull(inputPars *par, struct grid *g){
+qhull(inputPars *par, struct grid *g, struct cell **dc, unsigned long *numCells){
+  /*
+Triangulates the grid points and fills in the neighbour lists. If dc is not NULL, the Delaunay cells (tetrahedra) are also returned, so that the caller does not need to repeat the triangulation e.g. to write the grid file. Any previous list in *dc is freed.
+  */
   int i,j,k,id;
+  unsigned long icell;
   char flags[255];
   boolT ismalloc = False;
   facetT *facet;
@@ -160,6 +210,7 @@ qhull(inputPars *par, struct grid *g){
   coordT *pt_array;
   int simplex[DIM+1];
   int curlong, totlong;
+  int timer=timerBegin("qhull");
 
   pt_array=malloc(DIM*sizeof(coordT)*par->ncell);
 
@@ -185,6 +236,23 @@ qhull(inputPars *par, struct grid *g){
       }
     }
     
+    if(dc!=NULL){
+      free(*dc);
+      *numCells=0;
+      FORALLfacets {
+        if (!facet->upperdelaunay && qh_setsize(facet->vertices)==DIM+1) (*numCells)++;
+      }
+      *dc=malloc(sizeof(struct cell)*(*numCells));
+      icell=0;
+      FORALLfacets {
+        if (!facet->upperdelaunay && qh_setsize(facet->vertices)==DIM+1){
+          j=0;
+          FOREACHvertex_ (facet->vertices) (*dc)[icell].vertx[j++]=qh_pointid(vertex->point);
+          icell++;
+        }
+      }
+    }
+
     /* Identify neighbors */
     FORALLfacets {
       if (!facet->upperdelaunay) {
@@ -221,125 +289,264 @@ qhull(inputPars *par, struct grid *g){
   qh_freeqhull(!qh_ALL);
   qh_memfreeshort (&curlong, &totlong);
   free(pt_array);
+  timerEnd(timer);
 }
 
+/* Edge vectors and lengths of grid point i, from the positions of its neighbours */
 void
-distCalc(inputPars *par, struct grid *g){
-  int i,k,l;
+distCalcPoint(struct grid *g, int i){
+  int k,l;
 
-  for(i=0;i<par->ncell;i++){
-    if( g[i].dir != NULL )
-      {
-        free( g[i].dir );
-      }
-    if( g[i].ds != NULL )
-      {
-        free( g[i].ds );
-      }
-    g[i].dir=malloc(sizeof(point)*g[i].numNeigh);
-    g[i].ds =malloc(sizeof(double)*g[i].numNeigh);
-    memset(g[i].dir, 0., sizeof(point) * g[i].numNeigh);
-    memset(g[i].ds, 0., sizeof(double) * g[i].numNeigh);
-    for(k=0;k<g[i].numNeigh;k++){
-      for(l=0;l<3;l++) g[i].dir[k].x[l] = g[i].neigh[k]->x[l] - g[i].x[l];
-      g[i].ds[k]=sqrt(g[i].dir[k].x[0]*g[i].dir[k].x[0]+g[i].dir[k].x[1]*g[i].dir[k].x[1]+g[i].dir[k].x[2]*g[i].dir[k].x[2]);
-      for(l=0;l<3;l++) g[i].dir[k].xn[l] = g[i].dir[k].x[l]/g[i].ds[k];
+  if( g[i].dir != NULL )
+    {
+      free( g[i].dir );
+    }
+  if( g[i].ds != NULL )
+    {
+      free( g[i].ds );
     }
-    g[i].nphot=ininphot*g[i].numNeigh;
+  g[i].dir=malloc(sizeof(point)*g[i].numNeigh);
+  g[i].ds =malloc(sizeof(double)*g[i].numNeigh);
+  memset(g[i].dir, 0., sizeof(point) * g[i].numNeigh);
+  memset(g[i].ds, 0., sizeof(double) * g[i].numNeigh);
+  for(k=0;k<g[i].numNeigh;k++){
+    for(l=0;l<3;l++) g[i].dir[k].x[l] = g[i].neigh[k]->x[l] - g[i].x[l];
+    g[i].ds[k]=sqrt(g[i].dir[k].x[0]*g[i].dir[k].x[0]+g[i].dir[k].x[1]*g[i].dir[k].x[1]+g[i].dir[k].x[2]*g[i].dir[k].x[2]);
+    for(l=0;l<3;l++) g[i].dir[k].xn[l] = g[i].dir[k].x[l]/g[i].ds[k];
   }
+  g[i].nphot=ininphot*g[i].numNeigh;
 }
 
-
 void
-write_VTK_unstructured_Points(inputPars *par, struct grid *g){
-  FILE *fp;
-  double length;
-  int i,j,l=0;
-  char flags[255];
-  boolT ismalloc = False;
-  facetT *facet;
-  vertexT *vertex,**vertexp;
-  coordT *pt_array;
-  int curlong, totlong;
+distCalc(inputPars *par, struct grid *g){
+  int i;
 
-  pt_array=malloc(sizeof(coordT)*DIM*par->ncell);
+  for(i=0;i<par->ncell;i++) distCalcPoint(g,i);
+}
 
-  for(i=0;i<par->ncell;i++) {
-    for(j=0;j<DIM;j++) {
-      pt_array[i*DIM+j]=g[i].x[j];
-    }
+
+void
+vtuAppendBlock(int fd, off_t *offset, void *buf, unsigned long nbytes, int nThreads){
+  /*
+Writes one block of the VTU appended-data section, i.e. the byte count as a UInt64 followed by the raw data. The data are written in parallel, in chunks, at their known offsets in the file.
+  */
+  const unsigned long chunk=1<<22;
+  unsigned long nchunks,ic;
+  uint64_t header=nbytes;
+  int failed=0;
+
+  if(pwrite(fd,&header,sizeof(header),*offset)!=(ssize_t)sizeof(header)) failed=1;
+  *offset+=sizeof(header);
+
+  nchunks=(nbytes+chunk-1)/chunk;
+  omp_set_dynamic(0);
+#pragma omp parallel for private(ic) num_threads(nThreads) schedule(dynamic,1) reduction(+:failed)
+  for(ic=0;ic<nchunks;ic++){
+    unsigned long n=(ic==nchunks-1) ? nbytes-ic*chunk : chunk;
+    if(pwrite(fd,(char*)buf+ic*chunk,n,*offset+ic*chunk)!=(ssize_t)n) failed++;
   }
+  *offset+=nbytes;
 
-  if((fp=fopen(par->gridfile, "w"))==NULL){
+  if(failed){
     if(!silent) bail_out("Error writing grid file!");
     exit(1);
   }
-  fprintf(fp,"# vtk DataFile Version 3.0\n");
-  fprintf(fp,"Lime grid\n");
-  fprintf(fp,"ASCII\n");
-  fprintf(fp,"DATASET UNSTRUCTURED_GRID\n");
-  fprintf(fp,"POINTS %d float\n",par->ncell);
-  for(i=0; i<par->ncell; i++) {
-    fprintf(fp,"%e %e %e\n", g[i].x[0], g[i].x[1], g[i].x[2]);
+}
+
+void
+write_VTK_unstructured_Points(inputPars *par, struct grid *g, molData *m, struct cell *dc, unsigned long numCells){
+  /*
+Writes the grid as a VTK XML unstructured grid (.vtu) with the data in a raw binary appended section. The cells are the Delaunay tetrahedra returned by the main triangulation. Level populations (of the first species) and convergence flags are included if they have been calculated, and with par->costMap also the work done per vertex in levelPops().
+  */
+  FILE *fp;
+  int fd,i,j,nlev=0,doPops,doCost,nBlocks,ib;
+  unsigned long icell,maxBytes;
+  off_t offset;
+  unsigned long nbytes[13];
+  char *buf;
+  float *fbuf;
+  double *dbuf;
+  int64_t *ibuf;
+  int32_t *i32buf;
+  unsigned char *cbuf;
+  double length;
+  const int one=1;
+  const char *byteOrder = (*(const char*)&one==1) ? "LittleEndian" : "BigEndian";
+
+  doPops = (m!=NULL && g[0].mol!=NULL && g[0].mol[0].pops!=NULL);
+  if(doPops) nlev=m[0].nlev;
+  doCost = (doPops && par->costMap);
+
+  /* Sizes of the appended blocks, in the order they are written below. */
+  nbytes[0]=sizeof(float)*3*par->ncell;		/* points */
+  nbytes[1]=sizeof(int64_t)*(DIM+1)*numCells;	/* connectivity */
+  nbytes[2]=sizeof(int64_t)*numCells;		/* offsets */
+  nbytes[3]=sizeof(unsigned char)*numCells;	/* types */
+  nbytes[4]=sizeof(float)*par->ncell;		/* H2 density */
+  nbytes[5]=sizeof(float)*par->ncell;		/* molecular density */
+  nbytes[6]=sizeof(float)*par->ncell;		/* gas temperature */
+  nbytes[7]=sizeof(float)*3*par->ncell;		/* velocity */
+  nBlocks=8;
+  if(doPops){
+    nbytes[8]=sizeof(float)*nlev*par->ncell;	/* populations */
+    nbytes[9]=sizeof(int32_t)*par->ncell;	/* convergence flags */
+    nBlocks=10;
+  }
+  if(doCost){
+    nbytes[10]=sizeof(double)*par->ncell;	/* photon steps */
+    nbytes[11]=sizeof(int32_t)*par->ncell;	/* stateq iterations */
+    nbytes[12]=sizeof(double)*par->ncell;	/* wall time */
+    nBlocks=13;
   }
-  fprintf(fp, "\n");
 
-  sprintf(flags,"qhull d Qbb T0");
+  if((fp=fopen(par->gridfile, "w"))==NULL){
+    if(!silent) bail_out("Error writing grid file!");
+    exit(1);
+  }
 
-  if (!qh_new_qhull(DIM, par->ncell, pt_array, ismalloc, flags, NULL, NULL)) {
-    FORALLfacets {
-      if (!facet->upperdelaunay) l++;
-    }
-    fprintf(fp,"CELLS %d %d\n",l, 5*l);
-    FORALLfacets {
-      if (!facet->upperdelaunay) {
-        fprintf(fp,"4 ");
-        FOREACHvertex_ (facet->vertices) {
-          fprintf(fp, "%d ", qh_pointid(vertex->point));
-        }
-        fprintf(fp, "\n");
-      }
-    }
+  offset=0;
+  fprintf(fp,"<?xml version=\"1.0\"?>\n");
+  fprintf(fp,"<VTKFile type=\"UnstructuredGrid\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\">\n", byteOrder);
+  fprintf(fp,"  <UnstructuredGrid>\n");
+  fprintf(fp,"    <Piece NumberOfPoints=\"%d\" NumberOfCells=\"%lu\">\n", par->ncell, numCells);
+  fprintf(fp,"      <Points>\n");
+  fprintf(fp,"        <DataArray type=\"Float32\" NumberOfComponents=\"3\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[0];
+  fprintf(fp,"      </Points>\n");
+  fprintf(fp,"      <Cells>\n");
+  fprintf(fp,"        <DataArray type=\"Int64\" Name=\"connectivity\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[1];
+  fprintf(fp,"        <DataArray type=\"Int64\" Name=\"offsets\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[2];
+  fprintf(fp,"        <DataArray type=\"UInt8\" Name=\"types\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[3];
+  fprintf(fp,"      </Cells>\n");
+  fprintf(fp,"      <PointData Scalars=\"H2_density\" Vectors=\"velocity\">\n");
+  fprintf(fp,"        <DataArray type=\"Float32\" Name=\"H2_density\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[4];
+  fprintf(fp,"        <DataArray type=\"Float32\" Name=\"Mol_density\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[5];
+  fprintf(fp,"        <DataArray type=\"Float32\" Name=\"Gas_temperature\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[6];
+  fprintf(fp,"        <DataArray type=\"Float32\" Name=\"velocity\" NumberOfComponents=\"3\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+  offset+=sizeof(uint64_t)+nbytes[7];
+  if(doPops){
+    fprintf(fp,"        <DataArray type=\"Float32\" Name=\"Level_populations\" NumberOfComponents=\"%d\" format=\"appended\" offset=\"%lld\"/>\n",nlev,(long long)offset);
+    offset+=sizeof(uint64_t)+nbytes[8];
+    fprintf(fp,"        <DataArray type=\"Int32\" Name=\"Convergence\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+    offset+=sizeof(uint64_t)+nbytes[9];
   }
-  qh_freeqhull(!qh_ALL);
-  qh_memfreeshort (&curlong, &totlong);
-  fprintf(fp,"\nCELL_TYPES %d\n",l);
-  for(i=0;i<l;i++){
-    fprintf(fp, "10\n");
+  if(doCost){
+    fprintf(fp,"        <DataArray type=\"Float64\" Name=\"Cost_photon_steps\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+    offset+=sizeof(uint64_t)+nbytes[10];
+    fprintf(fp,"        <DataArray type=\"Int32\" Name=\"Cost_stateq_iterations\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+    offset+=sizeof(uint64_t)+nbytes[11];
+    fprintf(fp,"        <DataArray type=\"Float64\" Name=\"Cost_time\" format=\"appended\" offset=\"%lld\"/>\n",(long long)offset);
+    offset+=sizeof(uint64_t)+nbytes[12];
   }
-  fprintf(fp,"POINT_DATA %d\n",par->ncell);
-  fprintf(fp,"SCALARS H2_density float 1\n");
-  fprintf(fp,"LOOKUP_TABLE default\n");
-  for(i=0;i<par->ncell;i++){
-    fprintf(fp, "%e\n", g[i].dens[0]);
+  fprintf(fp,"      </PointData>\n");
+  fprintf(fp,"    </Piece>\n");
+  fprintf(fp,"  </UnstructuredGrid>\n");
+  fprintf(fp,"  <AppendedData encoding=\"raw\">\n_");
+  fclose(fp);
+
+  if((fd=open(par->gridfile, O_WRONLY))<0 || (offset=lseek(fd,0,SEEK_END))<0){
+    if(!silent) bail_out("Error writing grid file!");
+    exit(1);
   }
-  fprintf(fp,"SCALARS Mol_density float 1\n");
-  fprintf(fp,"LOOKUP_TABLE default\n");
+
+  maxBytes=0;
+  for(ib=0;ib<nBlocks;ib++) if(nbytes[ib]>maxBytes) maxBytes=nbytes[ib];
+  buf=malloc(maxBytes>0 ? maxBytes : 1);
+  fbuf=(float*)buf;
+  dbuf=(double*)buf;
+  ibuf=(int64_t*)buf;
+  i32buf=(int32_t*)buf;
+  cbuf=(unsigned char*)buf;
+
+  omp_set_dynamic(0);
+#pragma omp parallel for private(i,j) num_threads(par->nThreads)
   for(i=0;i<par->ncell;i++){
-    fprintf(fp, "%e\n", g[i].abun[0]*g[i].dens[0]);
+    for(j=0;j<3;j++) fbuf[3*i+j]=(float)g[i].x[j];
   }
-  fprintf(fp,"SCALARS Gas_temperature float 1\n");
-  fprintf(fp,"LOOKUP_TABLE default\n");
-  for(i=0;i<par->ncell;i++){
-    fprintf(fp, "%e\n", g[i].t[0]);
+  vtuAppendBlock(fd,&offset,buf,nbytes[0],par->nThreads);
+
+#pragma omp parallel for private(icell,j) num_threads(par->nThreads)
+  for(icell=0;icell<numCells;icell++){
+    for(j=0;j<DIM+1;j++) ibuf[(DIM+1)*icell+j]=dc[icell].vertx[j];
   }
-  fprintf(fp,"VECTORS velocity float\n");
+  vtuAppendBlock(fd,&offset,buf,nbytes[1],par->nThreads);
+
+#pragma omp parallel for private(icell) num_threads(par->nThreads)
+  for(icell=0;icell<numCells;icell++) ibuf[icell]=(DIM+1)*(icell+1);
+  vtuAppendBlock(fd,&offset,buf,nbytes[2],par->nThreads);
+
+  for(icell=0;icell<numCells;icell++) cbuf[icell]=10; /* VTK_TETRA */
+  vtuAppendBlock(fd,&offset,buf,nbytes[3],par->nThreads);
+
+#pragma omp parallel for private(i) num_threads(par->nThreads)
+  for(i=0;i<par->ncell;i++) fbuf[i]=(g[i].dens!=NULL) ? (float)g[i].dens[0] : 0.;
+  vtuAppendBlock(fd,&offset,buf,nbytes[4],par->nThreads);
+
+#pragma omp parallel for private(i) num_threads(par->nThreads)
+  for(i=0;i<par->ncell;i++) fbuf[i]=(g[i].dens!=NULL && g[i].abun!=NULL) ? (float)(g[i].abun[0]*g[i].dens[0]) : 0.;
+  vtuAppendBlock(fd,&offset,buf,nbytes[5],par->nThreads);
+
+#pragma omp parallel for private(i) num_threads(par->nThreads)
+  for(i=0;i<par->ncell;i++) fbuf[i]=(float)g[i].t[0];
+  vtuAppendBlock(fd,&offset,buf,nbytes[6],par->nThreads);
+
+#pragma omp parallel for private(i,j,length) num_threads(par->nThreads)
   for(i=0;i<par->ncell;i++){
     length=sqrt(g[i].vel[0]*g[i].vel[0]+g[i].vel[1]*g[i].vel[1]+g[i].vel[2]*g[i].vel[2]);
-    if(length > 0.){
-      fprintf(fp, "%e %e %e\n", g[i].vel[0]/length,g[i].vel[1]/length,g[i].vel[2]/length);
-    } else {
-      fprintf(fp, "%e %e %e\n", g[i].vel[0],g[i].vel[1],g[i].vel[2]);
+    for(j=0;j<3;j++) fbuf[3*i+j]=(length>0.) ? (float)(g[i].vel[j]/length) : (float)g[i].vel[j];
+  }
+  vtuAppendBlock(fd,&offset,buf,nbytes[7],par->nThreads);
+
+  if(doPops){
+#pragma omp parallel for private(i,j) num_threads(par->nThreads)
+    for(i=0;i<par->ncell;i++){
+      for(j=0;j<nlev;j++) fbuf[nlev*i+j]=(float)g[i].mol[0].pops[j];
     }
+    vtuAppendBlock(fd,&offset,buf,nbytes[8],par->nThreads);
+
+    for(i=0;i<par->ncell;i++) i32buf[i]=g[i].conv;
+    vtuAppendBlock(fd,&offset,buf,nbytes[9],par->nThreads);
+  }
+
+  if(doCost){
+    for(i=0;i<par->ncell;i++) dbuf[i]=(double)g[i].cost.steps;
+    vtuAppendBlock(fd,&offset,buf,nbytes[10],par->nThreads);
+
+    for(i=0;i<par->ncell;i++) i32buf[i]=g[i].cost.iters;
+    vtuAppendBlock(fd,&offset,buf,nbytes[11],par->nThreads);
+
+    for(i=0;i<par->ncell;i++) dbuf[i]=g[i].cost.time;
+    vtuAppendBlock(fd,&offset,buf,nbytes[12],par->nThreads);
   }
 
+  free(buf);
+  close(fd);
+
+  if((fp=fopen(par->gridfile, "a"))==NULL){
+    if(!silent) bail_out("Error writing grid file!");
+    exit(1);
+  }
+  fprintf(fp,"\n  </AppendedData>\n</VTKFile>\n");
   fclose(fp);
-  free(pt_array);
 }
 
 void
-dumpGrid(inputPars *par, struct grid *g){
-  if(par->gridfile) write_VTK_unstructured_Points(par, g);
+dumpGrid(inputPars *par, struct grid *g, molData *m, struct cell *dc, unsigned long numCells){
+  int timer;
+
+  /* Only rank 0 writes the output of an MPI run (see ranks.c) */
+  if(limeOpts.rank!=0) return;
+  if(par->gridfile && dc!=NULL){
+    timer=timerBegin("grid_dump");
+    write_VTK_unstructured_Points(par, g, m, dc, numCells);
+    timerEnd(timer);
+  }
 }
 
 void
@@ -515,19 +722,21 @@ getMass(inputPars *par, struct grid *g, const gsl_rng *ran){
 
 
 void
-buildGrid(inputPars *par, struct grid *g){
+buildGrid(inputPars *par, struct grid *g, struct cell **dc, unsigned long *numCells){
   double lograd;		/* The logarithm of the model radius		*/
   double logmin;	    /* Logarithm of par->minScale				*/
   double r,theta,phi,sinPhi,x,y,z,semiradius;	/* Coordinates								*/
   double temp;
   int k=0,i;            /* counters									*/
   int flag;
+  int timer=timerBegin("sampling");
 
   gsl_rng *ran = gsl_rng_alloc(gsl_rng_ranlxs2);	/* Random number generator */
 #ifdef TEST
   gsl_rng_set(ran,342971);
 #else
-  gsl_rng_set(ran,time(0));
+  if(par->gridSeed==0) par->gridSeed=(unsigned long)sharedTime();
+  gsl_rng_set(ran,par->gridSeed);
 #endif  
   
   lograd=log10(par->radius);
@@ -612,6 +821,7 @@ buildGrid(inputPars *par, struct grid *g){
     g[k++].dopb=0.;
   }
   /* end grid allocation */
+  timerEnd(timer);
 
   /* Check that the user has supplied all necessary functions:
   */
@@ -621,9 +831,9 @@ buildGrid(inputPars *par, struct grid *g){
   abundance(  0.0,0.0,0.0, g[0].abun);
   /* Note that velocity() is the only one of the 5 mandatory functions which is still needed (in raytrace) even if par->pregrid or par->restart. Therefore we test it already in parseInput(). */
 
-  qhull(par, g);
+  qhull(par, g, dc, numCells);
   distCalc(par, g);
-  smooth(par,g);
+  smooth(par, g, dc, numCells);
 
   for(i=0;i<par->pIntensity;i++){
     density(    g[i].x[0],g[i].x[1],g[i].x[2], g[i].dens);
@@ -635,7 +845,6 @@ buildGrid(inputPars *par, struct grid *g){
   //	getArea(par,g, ran);
   //	getMass(par,g, ran);
   getVelosplines(par,g);
-  dumpGrid(par,g);
 
   gsl_rng_free(ran);
   if(!silent) done(5);
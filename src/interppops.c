@@ -0,0 +1,249 @@
+/*
+ *  interppops.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Starting populations interpolated from an earlier run (par->initPops) or from a coarse grid (par->multilevel, see multilevel.c). The grid points and level populations of a binoutputfile are triangulated with qhull, as for a new grid; the coarse grid comes with the triangulation it was solved on, sink points included, which is used as it is. Each point of the new grid is then located: a greedy walk over the Delaunay neighbours of the old grid ends at the nearest old point, and of the tetrahedra that have that point as a vertex the one that contains the new point (or, outside the old grid, comes closest to it) gives the barycentric weights. Negative weights, and those of sink points, which carry no populations, are set to zero, so the interpolated populations are a convex combination of old ones and still sum to one.
+*/
+
+#include "lime.h"
+
+/* Barycentric coordinates w of point p in the tetrahedron v; returns 0 if the tetrahedron is degenerate */
+static int
+barycentric(const double *p, double v[DIM+1][DIM], double *w){
+  double a[DIM][DIM],b[DIM],det;
+  int i,k;
+
+  for(i=0;i<DIM;i++){
+    for(k=0;k<DIM;k++) a[i][k]=v[i+1][k]-v[0][k];
+    b[i]=p[i]-v[0][i];
+  }
+  det=a[0][0]*(a[1][1]*a[2][2]-a[1][2]*a[2][1])
+     -a[1][0]*(a[0][1]*a[2][2]-a[0][2]*a[2][1])
+     +a[2][0]*(a[0][1]*a[1][2]-a[0][2]*a[1][1]);
+  if(fabs(det)<1e-300) return 0;
+
+  /* Cramer's rule for b = sum_i w[i+1] a[i] */
+  w[1]=(b[0]*(a[1][1]*a[2][2]-a[1][2]*a[2][1])-a[1][0]*(b[1]*a[2][2]-b[2]*a[2][1])+a[2][0]*(b[1]*a[1][2]-b[2]*a[1][1]))/det;
+  w[2]=(a[0][0]*(b[1]*a[2][2]-b[2]*a[2][1])-b[0]*(a[0][1]*a[2][2]-a[0][2]*a[2][1])+a[2][0]*(a[0][1]*b[2]-a[0][2]*b[1]))/det;
+  w[3]=(a[0][0]*(a[1][1]*b[2]-a[1][2]*b[1])-a[1][0]*(a[0][1]*b[2]-a[0][2]*b[1])+b[0]*(a[0][1]*a[1][2]-a[0][2]*a[1][1]))/det;
+  w[0]=1.-w[1]-w[2]-w[3];
+  return 1;
+}
+
+static double
+dist2(const double *x, const double *y){
+  return (x[0]-y[0])*(x[0]-y[0])+(x[1]-y[1])*(x[1]-y[1])+(x[2]-y[2])*(x[2]-y[2]);
+}
+
+static void
+truncated(){
+  if(!silent) bail_out("Error: the populations file of par->initPops is truncated");
+  exit(1);
+}
+
+/* Reads n items of the given size from the binoutputfile, which must have them */
+static void
+readItems(void *ptr, size_t size, size_t n, FILE *fp){
+  if(fread(ptr, size, n, fp)!=n) truncated();
+}
+
+/* Skips n items of the given size in the binoutputfile, which must not end before them */
+static void
+skip(FILE *fp, size_t size, long n){
+  if(n>0 && fseek(fp, (long)size*n, SEEK_CUR)!=0) truncated();
+}
+
+/* Interpolates the populations oldPops of the n points og (with positions, ids and sink flags set, and the levels of all species of point id at oldPops[id*nlevTot]) onto the grid points of g. The numCells tetrahedra dc of og, with its neighbours, are those of an earlier qhull() run, or with dc NULL they are made here. */
+void
+interpolatePops(inputPars *par, molData *m, struct grid *g, int n, struct grid *og, double *oldPops, struct cell *dc, unsigned long numCells){
+  inputPars old;
+  unsigned long icell;
+  int i,j,k,id,ispec,nc,nlevTot=0,ownCells=(dc==NULL);
+  int *cellStart,*cellList,*next,hint0=-1;
+
+  for(ispec=0;ispec<par->nSpecies;ispec++) nlevTot+=m[ispec].nlev;
+  if(ownCells){
+    old=*par;
+    old.ncell=n;
+    qhull(&old, og, &dc, &numCells);
+  }
+
+  /* Tetrahedra of each old point: those of point id are cellList[cellStart[id]..cellStart[id+1]-1] */
+  cellStart=calloc(n+1, sizeof(int));
+  cellList=malloc(sizeof(int)*(DIM+1)*numCells);
+  next=malloc(sizeof(int)*n);
+  for(icell=0;icell<numCells;icell++) for(k=0;k<DIM+1;k++) cellStart[dc[icell].vertx[k]+1]++;
+  for(id=0;id<n;id++) cellStart[id+1]+=cellStart[id];
+  for(id=0;id<n;id++) next[id]=cellStart[id];
+  for(icell=0;icell<numCells;icell++) for(k=0;k<DIM+1;k++) cellList[next[dc[icell].vertx[k]]++]=(int)icell;
+  for(id=0;id<n && hint0<0;id++) if(og[id].numNeigh>0 && !og[id].sink) hint0=id;
+  if(hint0<0){
+    if(!silent) bail_out("Error: the points to interpolate the populations from have no neighbours");
+    exit(1);
+  }
+
+#pragma omp parallel private(i,j,k,id,nc) num_threads(par->nThreads)
+  {
+    int best,moved,cell,ibest;
+    double d,dn,v[DIM+1][DIM],w[DIM+1],wbest[DIM+1],wmin,wminBest,sum;
+    storeReal *pops;
+
+    /* Successive points of the new grid tend to be close, so each walk starts where the last one ended */
+    best=hint0;
+#pragma omp for schedule(static)
+    for(id=0;id<par->pIntensity;id++){
+      d=dist2(g[id].x, og[best].x);
+      do{
+        moved=0;
+        for(k=0;k<og[best].numNeigh;k++){
+          if(og[best].neigh[k]->sink) continue;
+          dn=dist2(g[id].x, og[best].neigh[k]->x);
+          if(dn<d){
+            d=dn;
+            best=og[best].neigh[k]->id;
+            moved=1;
+            break;
+          }
+        }
+      } while(moved);
+
+      /* The tetrahedron around the nearest old point whose smallest barycentric weight is largest */
+      ibest=-1;
+      wminBest=-1e300;
+      for(nc=cellStart[best];nc<cellStart[best+1];nc++){
+        cell=cellList[nc];
+        for(k=0;k<DIM+1;k++) for(j=0;j<DIM;j++) v[k][j]=og[dc[cell].vertx[k]].x[j];
+        if(!barycentric(g[id].x, v, w)) continue;
+        wmin=w[0];
+        for(k=1;k<DIM+1;k++) if(w[k]<wmin) wmin=w[k];
+        if(wmin>wminBest){
+          wminBest=wmin;
+          ibest=cell;
+          for(k=0;k<DIM+1;k++) wbest[k]=w[k];
+        }
+      }
+      if(ibest>=0){
+        sum=0.;
+        for(k=0;k<DIM+1;k++){
+          if(wbest[k]<0. || og[dc[ibest].vertx[k]].sink) wbest[k]=0.;
+          sum+=wbest[k];
+        }
+        if(sum>0.) for(k=0;k<DIM+1;k++) wbest[k]/=sum;
+        else ibest=-1;
+      }
+      /* With no usable tetrahedron, the populations of the nearest old point */
+
+      i=0;
+      for(j=0;j<par->nSpecies;j++){
+        pops=g[id].mol[j].pops;
+        if(pops!=NULL){
+          for(k=0;k<m[j].nlev;k++){
+            if(ibest<0) pops[k]=oldPops[(size_t)best*nlevTot+i+k];
+            else{
+              sum=0.;
+              for(nc=0;nc<DIM+1;nc++) sum+=wbest[nc]*oldPops[(size_t)dc[ibest].vertx[nc]*nlevTot+i+k];
+              pops[k]=sum;
+            }
+          }
+        }
+        i+=m[j].nlev;
+      }
+    }
+  }
+
+  if(ownCells){
+    for(id=0;id<n;id++){
+      free(og[id].neigh);
+      og[id].neigh=NULL;
+    }
+    free(dc);
+  }
+  free(cellStart);
+  free(cellList);
+  free(next);
+}
+
+void
+interpPops(inputPars *par, molData *m, struct grid *g){
+  FILE *fp;
+  struct grid *og;
+  int i,k,n,ispec,nOld,nSpecies,nlevTot,sink,nlev,nline,npart;
+  double *oldPops,radius,x[DIM];
+  long end=0;
+  int timer;
+
+  if((fp=fopen(par->initPops, "rb"))==NULL){
+    if(!silent) bail_out("Error reading the populations file of par->initPops");
+    exit(1);
+  }
+  timer=timerBegin("interpPops");
+
+  /* Header and molecular data; the species must have the same levels as those of this model */
+  readItems(&radius,   sizeof(double), 1, fp);
+  readItems(&nOld,     sizeof(int), 1, fp);
+  readItems(&nSpecies, sizeof(int), 1, fp);
+  if(nOld<1){
+    if(!silent) bail_out("Error: the populations file of par->initPops has no grid points");
+    exit(1);
+  }
+  if(nSpecies!=par->nSpecies){
+    if(!silent) bail_out("Error: the populations file of par->initPops has a different number of species");
+    exit(1);
+  }
+  nlevTot=0;
+  for(ispec=0;ispec<nSpecies;ispec++){
+    readItems(&nlev,  sizeof(int), 1, fp);
+    readItems(&nline, sizeof(int), 1, fp);
+    readItems(&npart, sizeof(int), 1, fp);
+    if(nlev!=m[ispec].nlev || nline<0 || npart<0){
+      if(!silent) bail_out("Error: the populations file of par->initPops has different energy levels");
+      exit(1);
+    }
+    skip(fp, sizeof(int), npart+2*nline);
+    skip(fp, sizeof(double), 5*nline+2);
+    nlevTot+=nlev;
+  }
+
+  /* The grid points with their populations; sink points carry no populations */
+  og=malloc(sizeof(struct grid)*nOld);
+  memset(og, 0, sizeof(struct grid)*nOld);
+  oldPops=malloc(sizeof(double)*(size_t)nOld*nlevTot);
+  n=0;
+  for(i=0;i<nOld;i++){
+    skip(fp, sizeof(int), 1);
+    readItems(x, sizeof(double), DIM, fp);
+    skip(fp, sizeof(double), DIM);
+    readItems(&sink, sizeof(int), 1, fp);
+    skip(fp, sizeof(double), par->nSpecies+1);
+    k=0;
+    for(ispec=0;ispec<nSpecies;ispec++){
+      readItems(oldPops+(size_t)n*nlevTot+k, sizeof(double), m[ispec].nlev, fp);
+      k+=m[ispec].nlev;
+      skip(fp, sizeof(double), 2*m[ispec].nline+2);
+    }
+    skip(fp, sizeof(double), 3);
+    end=ftell(fp);
+    if(sink) continue;
+    og[n].id=n;
+    for(k=0;k<DIM;k++) og[n].x[k]=x[k];
+    n++;
+  }
+  /* fseek() may go past the end of the file, which the last point must not */
+  if(fseek(fp, 0, SEEK_END)!=0 || ftell(fp)<end) truncated();
+  fclose(fp);
+  if(n<DIM+1){
+    if(!silent) bail_out("Error: the populations file of par->initPops has too few grid points");
+    exit(1);
+  }
+
+  interpolatePops(par,m,g,n,og,oldPops,NULL,0);
+  free(og);
+  free(oldPops);
+  timerEnd(timer);
+}
@@ -38,13 +38,46 @@
 #define omp_set_dynamic(int) 0
 #endif
 
+#ifdef USE_MPI
+#define silent (limeOpts.rank!=0)	/* only rank 0 reports (see ranks.c) */
+#else
 #define silent 0
+#endif
 #define DIM 3
 #define VERSION	"1.5"
 #define DEFAULT_NTHREADS 1
 #ifndef NTHREADS /* Value passed from the LIME script */
 #define NTHREADS DEFAULT_NTHREADS
 #endif
+#ifdef FASTEXP
+#define DEFAULT_FASTEXP 1
+#else
+#define DEFAULT_FASTEXP 0
+#endif
+#ifndef TEST_SEED /* Added to the fixed random seeds of photons and rays in a -DTEST build (regress.sh -s) */
+#define TEST_SEED 0
+#endif
+#ifdef NO_NCURSES
+#define DEFAULT_NCURSES 0
+#else
+#define DEFAULT_NCURSES 1
+#endif
+
+/* Storage type of the bulk per-point arrays: populations, opacities, per-vertex collision rates, velocity splines and the photon buffers of levelPops. With -DSINGLE_STORE they are kept in single precision, which halves their memory footprint and traffic; arithmetic and accumulation stay in double, and the output files are unchanged. */
+#ifdef SINGLE_STORE
+typedef float storeReal;
+#else
+typedef double storeReal;
+#endif
+
+/* Instruction sets of the vector kernels in vecmath.c, in increasing order */
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+#define IMG_TILE 16		/* Side in pixels of the image tiles dealt out to the MPI ranks */
+#define VEC_BLOCK 32		/* Length of the local buffers passed to the vector kernels */
+#define FNV_OFFSET 14695981039346656037ULL	/* start of an FNV-1a hash, see hashBytes() */
 
 /* Physical constants */
 // - NIST values as of 23 Sept 2015:
@@ -82,6 +115,16 @@
 #define FAST_EXP_MAX_TAYLOR     3
 #define FAST_EXP_NUM_BITS       8
 #define N_SMOOTH_ITERS          20
+#define MAX_SWEEP_PARAMS        16
+#define SWEEP_ITERATIONS        4
+#define CONV_FRACTION           0.95		/* levelPops after a coarse start stops when this fraction of the points has converged, */
+#define CONV_SNR                100.		/* or when the median signal to noise ratio of the populations is this high */
+
+/* Model fields which sweepSet() reports as changed */
+#define SWEEP_DENSITY           1
+#define SWEEP_TEMPERATURE       2
+#define SWEEP_ABUNDANCE         4
+#define SWEEP_DOPPLER           8
 
 
 /* input parameters */
@@ -92,24 +135,109 @@ typedef struct {
   char *gridfile;
   char *pregrid;
   char *restart;
+  char *gridShare;
+  char *checkpoint;
+  char *initPops;
   char *dust;
   int sampling,collPart,lte_only,init_lte,antialias,polarization,doPregrid,nThreads;
+  int lvg_only,init_lvg;
+  int collRateTables,molDataCache,writeReport,costMap;
+  int nSweep,nSweepParams,sweepKeep,sweepIter;
+  int checkpointEvery,initPopsIter,multilevel;
+  int symmetry,symmetryPoints,octree;
+  int refine,refinePoints;
+  double refineTol;
+  unsigned long gridSeed;	/* random seed of the grid sampling, set by LIME (see checkpoint.c) */
+  char *molDataCacheDir;
   char **moldatfile;
 } inputPars;
 
+/* Collision rates of one partner tabulated in temperature: row itemp of down[] holds the ntrans downward rates at temp[itemp]. */
+struct rateTable {
+  int ntemp;
+  double *temp, *down, *gfac, *ediff;
+};
+
 /* Molecular data: shared attributes */
 typedef struct {
   int nlev,nline,*ntrans,npart;
   int *lal,*lau,*lcl,*lcu;
   double *aeinst,*freq,*beinstu,*beinstl,*up,*down,*eterm,*gstat;
   double norm,norminv,*cmb,*local_cmb;
+  struct rateTable *part;
+  double amass;		/* molecular mass [kg] */
+  int nmolMode;		/* nmol from abun times 0: nothing, 1: dens[0], 2: dens[0]+dens[1] */
 } molData;
 
+/* Run-time options, set on the command line of the LIME executable (see main.c). The compile-time flags NTHREADS, FASTEXP and NO_NCURSES only give their defaults. simd is the widest instruction set the vector kernels may use. rank and nRanks are those of this process in an MPI run (see ranks.c), 0 and 1 otherwise. */
+typedef struct {
+  int nThreads,fastExp,ncurses,simd;
+  int rank,nRanks;
+} runOptions;
+
+extern runOptions limeOpts;
+
+/* Timing of one phase of the run; busy and idle are summed over threads, in seconds */
+typedef struct {
+  char phase[32];
+  int index,nThreads;
+  double start,wall,busy,idle;
+} timerRecord;
+
+/* Event counters for the hot loops, compiled in with -DCOUNTERS. Each thread counts into its own copy of threadCounters, which is merged into the totals of the current phase (levelPops or raytrace) at the end of the parallel region. Histograms have logarithmic bins: bin 0 counts zeros, bin k values in [2^(k-1), 2^k). */
+enum {CNT_PHOTONS, CNT_PHOTON_STEPS, CNT_MASER_CLAMPS, CNT_STATEQ_CALLS, CNT_STATEQ_ITERS, CNT_SVD_FALLBACKS, CNT_SPLINE_CALLS, CNT_SPLINE_SAMPLES, CNT_RAYS, CNT_RAY_CELLS, N_COUNTERS};
+enum {HIST_PHOTON_STEPS, HIST_VERTEX_STEPS, HIST_STATEQ_ITERS, HIST_SPLINE_SAMPLES, HIST_RAY_CELLS, N_HISTS};
+enum {PHASE_LEVELPOPS, PHASE_RAYTRACE, N_COUNTER_PHASES};
+#define N_HIST_BINS 40
+
+typedef struct {
+  unsigned long long count[N_COUNTERS];
+  unsigned long long hist[N_HISTS][N_HIST_BINS];
+} eventCounters;
+
+#ifdef COUNTERS
+extern eventCounters threadCounters;
+#pragma omp threadprivate(threadCounters)
+#define COUNT(c,n)          (threadCounters.count[(c)]+=(n))
+#define HIST(h,v)           countHist((h),(v))
+#define MERGE_COUNTERS(p)   mergeCounters(p)
+#else
+#define COUNT(c,n)
+#define HIST(h,v)
+#define MERGE_COUNTERS(p)
+#endif
+
+/* Contents of a LAMDA molecular data file, either parsed from the text or mapped from the binary cache (map!=NULL). Collision data per partner. */
+typedef struct {
+  char specref[90];
+  double amass;
+  int nlev,nline,npart,hasColl;
+  double *eterm,*gstat,*aeinst,*freq;
+  int *lau,*lal;
+  int *partnerId,*ntrans,*ntemp;
+  int **lcu,**lcl;
+  double **temp,**colld;
+  unsigned long long hash,srcSize;
+  void *map;
+  size_t mapSize;
+} lamdaData;
+
 /* Data concerning a single grid vertex which is passed from photon() to stateq(). This data needs to be thread-safe. */
 typedef struct {
-  double *jbar,*phot,*vfac;
+  double *jbar,*vfac;
+  storeReal *phot;
+  struct rates *rate;		/* collision rates interpolated from the tables, see pointRatesAlloc() */
+  double *collScratch;
 } gridPointData;
 
+/* A photon of levelPops on its way through the grid (see photon.c): the point it is at, the edge it follows and the point at its end, its direction, velocity offset and position (octree), the number of steps so far and the inverse line widths of the point that sent it; per line its intensity, optical depth and exp(-tau), and room for the source functions of a step. */
+typedef struct {
+  int here,dir,there,nlinetot,*counta,*countb;
+  unsigned long long nsteps;
+  double deltav,inidir[3],x[3],*binv;
+  double *phot,*tau,*expTau,*dtauLine,*jnuLine,*remnantLine,*expDTauLine;
+} photonState;
+
 typedef struct {
   double *intensity;
 } surfRad;
@@ -120,23 +248,38 @@ typedef struct {
   double xn[3];
 } point;
 
+/* Collision rates at a grid vertex. With par->collRateTables up/down are NULL and the rates are interpolated from molData.part on demand. */
 struct rates {
-  double *up, *down;
+  storeReal *up, *down;
+  int t_binlow;
+  double interp_coeff;
 };
 
 
 struct populations {
-  double * pops, *knu, *dust;
+  storeReal *pops, *knu, *dust;
   double dopb, binv;
   struct rates *partner;
 };
 
+/* Work done for a grid vertex, summed over all levelPops iterations */
+struct vertexCost {
+  unsigned long long steps;	/* photon steps */
+  int iters;			/* stateq iterations, summed over species */
+  double time;			/* wall time of photon() and stateq() [s] */
+};
+
+/* History of the populations of the first species at a grid point, over the last 5 iterations of levelPops, with their mean and spread */
+struct popStats {
+  double *pop, *ave, *sigma;
+};
+
 /* Grid properties */
 struct grid {
   int id;
   double x[3];
   double vel[3];
-  double *a0,*a1,*a2,*a3,*a4;
+  storeReal *a0,*a1,*a2,*a3,*a4;	/* velocity spline of each edge, in t=d/ds (see velospline.c) */
   int numNeigh;
   point *dir;
   struct grid **neigh;
@@ -147,12 +290,22 @@ struct grid {
   double *dens,t[2],*nmol,*abun, dopb;
   double *ds;
   struct populations* mol;
+  struct vertexCost cost;
+  int rank;			/* MPI rank whose subdomain the point is in (see ranks.c) */
+  int rep;			/* point whose populations this one takes (see symmetry.c) */
+};
+
+/* Delaunay cell (tetrahedron), given by the ids of its vertices */
+struct cell {
+  int vertx[DIM+1];
 };
 
 typedef struct {
   double *intense;
   double *tau;
   double stokes[3];
+  unsigned long cells;	/* grid cells crossed by the rays of this pixel */
+  double time;		/* wall time spent tracing them [s] */
 } spec;
 
 /* Image information */
@@ -187,72 +340,164 @@ void temperature(double,double,double,double *);
 void abundance(double,double,double,double *);
 void doppler(double,double,double, double *);
 void velocity(double,double,double,double *);
+void velocityGradient(double,double,double,double *);
 void magfield(double,double,double,double *);
 void gasIIdust(double,double,double,double *);
+int sweepSet(int,double *,image *);
 
 /* More functions */
 
+int	attachGrid(inputPars *, struct grid **, molData **);
 void   	binpopsout(inputPars *, struct grid *, molData *);
-void   	buildGrid(inputPars *, struct grid *);
+void   	buildGrid(inputPars *, struct grid *, struct cell **, unsigned long *);
 void	calcFastExpRange(const int, const int, int*, int*, int*);
 void    calcSourceFn(double, const inputPars*, double*, double*);
 void	calcTableEntries(const int, const int);
+void	checkpointDone(inputPars*, struct grid*);
+int	checkpointFound(inputPars*, molData*, struct grid*, gsl_rng*);
+int	checkpointRead(inputPars*, molData*, struct grid*, struct popStats*, gsl_rng*, gsl_rng**);
+unsigned long	checkpointSeed(inputPars*);
+void	checkpointWait();
+void	checkpointWrite(inputPars*, molData*, struct grid*, struct popStats*, int, gsl_rng*, gsl_rng**);
+int	coarsePops(molData *, inputPars *, struct grid *, int);
 void	continuumSetup(int, image*, molData*, inputPars*, struct grid*);
+void	countHist(int, unsigned long long);
+void	detachGrid();
 void	distCalc(inputPars*, struct grid*);
+void	distCalcPoint(struct grid *, int);
+void	dumpGrid(inputPars *, struct grid *, molData *, struct cell *, unsigned long);
+void	exchangePops(inputPars *, molData *, struct grid *);
+void	exchangeGhosts(inputPars *, molData *, struct grid *);
 int	factorial(const int);
 double	FastExp(const float);
 void	fit_d1fi(double, double, double*);
 void    fit_fi(double, double, double*);
 void    fit_rr(double, double, double*);
 void   	freeGrid(const inputPars*, const molData*, struct grid*);
+void	fitEdgeSpline(struct grid *, int, int, double *, double *, double *, double *, int, double *, double *);
 void    freeInput(inputPars*, image*, molData*);
-void   	freePopulation(const inputPars*, const molData*, struct populations*);
+void	freeLamda(lamdaData *);
+long	fromRankZero(long);
+void	freeTimers();
+void    freePointRates(molData *, int, gridPointData *);
+void   	freePopulation(const inputPars*, struct grid*);
 double 	gaussline(double, double);
 void    getArea(inputPars *, struct grid *, const gsl_rng *);
 void	getclosest(double, double, double, long *, long *, double *, double *, double *);
 void    getjbar(int, molData*, struct grid*, inputPars*, gridPointData*, double*);
 void    getMass(inputPars *, struct grid *, const gsl_rng *);
-void   	getmatrix(int, gsl_matrix *, molData *, struct grid *, int, gridPointData *);
+void   	getmatrix(int, gsl_matrix *, molData *, struct grid *, int, gridPointData *, struct rates *);
+void	gatherImage(image *, int);
 void	getVelosplines(inputPars *, struct grid *);
 void	getVelosplines_lin(inputPars *, struct grid *);
 void	gridAlloc(inputPars *, struct grid **);
+unsigned long long hashBytes(unsigned long long, const void *, size_t);
+int     hashFile(char *, unsigned long long *, unsigned long long *);
 void   	input(inputPars *, image *);
+void	interpCollRates(molData *, int, struct rates *, double, struct rates *, double *);
+void	interpolatePops(inputPars *, molData *, struct grid *, int, struct grid *, double *, struct cell *, unsigned long);
+void	interpPops(inputPars *, molData *, struct grid *);
 float  	invSqrt(float);
+int	isSubdomain(struct grid *);
 void   	kappa(molData *, struct grid *, inputPars *,int);
-void	levelPops(molData *, inputPars *, struct grid *, int *);
+void	levelPops(molData *, inputPars *, struct grid *, int *, int);
+void	loadModel(const char *);
 void	line_plane_intersect(struct grid *, double *, int , int *, double *, double *, double);
 void	lineBlend(molData *, inputPars *, blend **);
 void    lineCount(int,molData *,int **, int **, int *);
+int	loadMolDataCache(inputPars *, int, lamdaData *);
 void	LTE(inputPars *, struct grid *, molData *);
+void	LVG(inputPars *, struct grid *, molData *);
+void	mergeCounters(int);
+void	mergeSubdomain(inputPars *, molData *, struct grid *);
+int	minOverRanks(int);
+int	modelVelocityGradient();
+void	mpiFinalize();
+void	mpiInit(int *, char ***);
+void	octreeFree();
+void	octreeGrid(inputPars *, struct grid **, struct cell **, unsigned long *);
+void	octreeStep(struct grid *, int, const double *, const double *, double *, int *);
 void   	molinit(molData *, inputPars *, struct grid *,int);
+void	molUpdate(molData *, inputPars *, struct grid *, int);
+void	molGrid(molData *, inputPars *, struct grid *, int);
 void    openSocket(inputPars *par, int);
 void	parseInput(inputPars *, image **, molData **);
+int	octreeEnter(double *, const double *, double *);
+int	octreeLocate(const double *);
+int	pixelRank(int, int);
+int	refinePops(molData *, inputPars *, struct grid *);
 void  	photon(int, struct grid*, molData*, int, const gsl_rng*, inputPars*, blend*, gridPointData*, double*);
+void	photonAlloc(inputPars *, molData *, photonState *);
+int	photonContinue(photonState *, struct grid *, molData *, const gsl_rng *, inputPars *, blend *);
+void	photonFinish(photonState *, molData *);
+void	photonFree(photonState *);
+void	photonLaunch(int, int, struct grid *, const gsl_rng *, inputPars *, photonState *);
+int	photonTrace(photonState *, int, int, struct grid *, molData *, const gsl_rng *, inputPars *, blend *, gridPointData *, double *);
+void    pointRatesAlloc(molData *, int, gridPointData *);
 double 	planckfunc(int, double, molData *, int);
 int     pointEvaluation(inputPars*, double, double, double, double);
-void   	popsin(inputPars *, struct grid **, molData **, int *);
+void	popsAlloc(const inputPars *, struct grid *);
+void	popsAllocSpecies(const inputPars *, struct grid *, int, int, int);
+void   	popsin(inputPars *, struct grid **, molData **, int *, struct cell **, unsigned long *);
 void   	popsout(inputPars *, struct grid *, molData *);
-void	predefinedGrid(inputPars *, struct grid *);
-void	qhull(inputPars *, struct grid *);
+void	publishGrid(inputPars *, struct grid *, molData *);
+void	predefinedGrid(inputPars *, struct grid *, struct cell **, unsigned long *);
+void	qhull(inputPars *, struct grid *, struct cell **, unsigned long *);
+void	rateTableBin(struct rateTable *, double, int *, double *);
+void	ratesAlloc(const inputPars *, const molData *, struct grid *, int, int);
 double 	ratranInput(char *, char *, double, double, double);
 void   	raytrace(int, inputPars *, struct grid *, molData *, image *);
+void	readLamda(inputPars *, int, lamdaData *);
+void	reduceCosts(inputPars *, struct grid *);
+void	refineGrid(inputPars *, struct grid **, struct cell **, unsigned long *);
+void	setSplineCoeffs(struct grid *, int, double *);
 void	report(int, inputPars *, struct grid *);
-void	smooth(inputPars *, struct grid *);
+void	rotationMatrix(image *);
+void	runSweep(inputPars *, struct grid *, molData *, image *, struct cell *, unsigned long);
+time_t	sharedTime();
+void	sharedStats(double *, int, int *, double *, double *);
+void	smooth(inputPars *, struct grid *, struct cell **, unsigned long *);
 int     sortangles(double *, int, struct grid *, const gsl_rng *);
 void	sourceFunc(double*, double*, double, molData*, double, struct grid*, int, int, int, int);
 void    sourceFunc_cont(double*, double*, struct grid*, int, int, int);
 void    sourceFunc_line(double*, double*, molData*, double, struct grid*, int, int, int);
 void    sourceFunc_pol(double*, double*, double, molData*, double, struct grid*, int, int, int, double);
+int	splitPoints(inputPars *, struct grid *);
 void   	stateq(int, struct grid*, molData*, int, inputPars*, gridPointData*, double*);
 void	statistics(int, molData *, struct grid *, int *, double *, double *, int *);
 void    stokesangles(double, double, double, double, double *);
+struct grid *subdomainGrid(inputPars *, molData *, struct grid *, inputPars *, int);
+int	subdomainPoints(inputPars *, struct grid *);
+void	sweepSubdomain(inputPars *, molData *, struct grid *, blend *, gsl_rng **, int, double *, double *);
+void	symmetryFill(inputPars *, molData *, struct grid *);
+void	symmetryReduce(inputPars *, struct grid *);
 double	taylor(const int, const float);
-void    traceray(rayData, int, int, inputPars *, struct grid *, molData *, image *, int, int *, int *, double);
+void	timerAddThreads(const char *, int, double *);
+int	timerBegin(const char *);
+int	timerCount();
+void	timerEnd(int);
+timerRecord *timerGet(int);
+void	timerThreads(int, int, double *);
+unsigned long traceray(rayData, int, int, inputPars *, struct grid *, molData *, image *, int, int *, int *, double);
+void	unloadModel();
+void	vecExp(const double *, double *, int);
+void	vecGauss(const double *, double, double *, int);
+int	vecmathLevel(const char *);
+const char *vecmathName();
+void	vecmathInit();
+void	vecSourceFn(const double *, double, double *, double *, int);
 void   	velocityspline(struct grid *, int, int, double, double, double*);
 void   	velocityspline2(double *, double *, double, double, double, double*);
 double 	veloproject(double *, double *);
+double	wallTime();
+struct grid *wholeGrid(inputPars *, struct grid *, inputPars *);
+int	wholeId(struct grid *, int);
+void	writeCounters(FILE *);
+void	writeCountersJson(FILE *);
+void	writeMolDataCache(inputPars *, int, lamdaData *);
+void	writeTimers(FILE *, inputPars *);
 void	writefits(int, inputPars *, molData *, image *);
-void    write_VTK_unstructured_Points(inputPars *, struct grid *);
+void    write_VTK_unstructured_Points(inputPars *, struct grid *, molData *, struct cell *, unsigned long);
 
 
 /* Curses functions */
@@ -266,6 +511,7 @@ void 	progressbar2(int,int,double,double,double);
 void	casaStyleProgressBar(const int,int);
 void 	goodnight(int, char *);
 void	quotemass(double);
+void	sweepmesg(int, int);
 void 	warning(char *);
 void	bail_out(char *);
 void    collpartmesg(char *, int);
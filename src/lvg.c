@@ -0,0 +1,126 @@
+/*
+ *  lvg.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Local escape probability (Sobolev or LVG) solution of the level populations, either as the starting point of levelPops (par->init_lvg) or instead of it (par->lvg_only). In the Sobolev approximation the mean intensity of a line at a grid point is
+
+  Jbar = (1-beta) S + beta I_bg,
+
+where S is the line source function, I_bg the background (CMB) intensity and beta the probability that a photon escapes. For optical depth tau along a direction, beta = (1-exp(-tau))/tau, and
+
+  tau = h c/(4 pi) nmol (n_l B_lu - n_u B_ul) / |dv/ds|.
+
+The velocity gradient along each Delaunay edge of a grid point is the first spline coefficient a1, which is dv/dt at the point, divided by the length of the edge (see velospline.c). beta is averaged over the edges, which gives a direction average without any assumption about the velocity field. So that beta stays finite where the velocity does not change, |dv/ds| is at least the local line width dopb over the edge length. Masing lines (tau < 0) are given beta=1.
+
+The populations and Jbar are iterated to convergence at each point with the same statistical equilibrium matrix as stateq(). There is no coupling between grid points and no dust, so the solution is only approximate, but it takes a fraction of the time of one levelPops iteration.
+*/
+
+#include "lime.h"
+#include <gsl/gsl_permutation.h>
+
+static double
+escapeProb(double tau){
+  if(tau<=0.) return 1.;
+  if(tau<1e-4) return 1.-0.5*tau;
+  return (1.-exp(-tau))/tau;
+}
+
+/* LVG solution of species ispec at grid point id, starting from the populations already there */
+static void
+lvgPoint(int id, struct grid *g, molData *m, int ispec, gridPointData *mp, gsl_matrix *matrix, gsl_matrix *reduc, gsl_vector *rhs, gsl_vector *newpop, gsl_permutation *p){
+  int iter,iline,k,ilev,s,nlev=m[ispec].nlev;
+  double diff,tau,beta,snu,nl,nu,dvds,tauFac,pop;
+  struct rates *rate;
+
+  if(m[ispec].part!=NULL){
+    rate=mp[ispec].rate;
+    interpCollRates(m,ispec,g[id].mol[ispec].partner,g[id].t[0],rate,mp[ispec].collScratch);
+  } else rate=g[id].mol[ispec].partner;
+
+  tauFac=HPLANCK*CLIGHT/(4.*PI)*g[id].nmol[ispec];
+  for(iter=0;iter<MAXITER;iter++){
+    for(iline=0;iline<m[ispec].nline;iline++){
+      nl=g[id].mol[ispec].pops[m[ispec].lal[iline]];
+      nu=g[id].mol[ispec].pops[m[ispec].lau[iline]];
+      beta=0.;
+      for(k=0;k<g[id].numNeigh;k++){
+        dvds=gsl_max(fabs(g[id].a1[k]), g[id].mol[ispec].dopb)/g[id].ds[k];
+        tau=tauFac*(nl*m[ispec].beinstl[iline]-nu*m[ispec].beinstu[iline])/dvds;
+        beta+=escapeProb(tau);
+      }
+      beta/=gsl_max(g[id].numNeigh,1);
+      if(nl*m[ispec].beinstl[iline]-nu*m[ispec].beinstu[iline]>0.) snu=nu*m[ispec].aeinst[iline]/(nl*m[ispec].beinstl[iline]-nu*m[ispec].beinstu[iline]);
+      else snu=0.;
+      mp[ispec].jbar[iline]=(1.-beta)*snu+beta*m[ispec].cmb[iline]*m[ispec].norm;
+    }
+
+    getmatrix(id,matrix,m,g,ispec,mp,rate);
+    for(s=0;s<nlev;s++){
+      for(ilev=0;ilev<nlev-1;ilev++) gsl_matrix_set(reduc,ilev,s,gsl_matrix_get(matrix,ilev,s));
+      gsl_matrix_set(reduc,nlev-1,s,1.);
+    }
+    gsl_linalg_LU_decomp(reduc,p,&s);
+    if(gsl_linalg_LU_det(reduc,s)==0) break;
+    gsl_linalg_LU_solve(reduc,p,rhs,newpop);
+
+    /* Half steps keep the iteration from oscillating in optically thick lines */
+    diff=0.;
+    for(ilev=0;ilev<nlev;ilev++){
+      pop=gsl_max(gsl_vector_get(newpop,ilev),1e-30);
+      if(iter>0) pop=0.5*(pop+g[id].mol[ispec].pops[ilev]);
+      if(pop>minpop) diff=gsl_max(diff,fabs(pop-g[id].mol[ispec].pops[ilev])/pop);
+      g[id].mol[ispec].pops[ilev]=pop;
+    }
+    if(diff<TOL) break;
+  }
+}
+
+void
+LVG(inputPars *par, struct grid *g, molData *m){
+  int id,ispec,timer=timerBegin("LVG");
+
+  omp_set_dynamic(0);
+#pragma omp parallel private(id,ispec) num_threads(par->nThreads)
+  {
+    gridPointData *mp=malloc(sizeof(gridPointData)*par->nSpecies);
+
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      mp[ispec].jbar=malloc(sizeof(double)*m[ispec].nline);
+      pointRatesAlloc(m,ispec,mp);
+    }
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      int ilev,nlev=m[ispec].nlev;
+      gsl_matrix *matrix=gsl_matrix_alloc(nlev+1, nlev+1);
+      gsl_matrix *reduc =gsl_matrix_alloc(nlev, nlev);
+      gsl_vector *rhs   =gsl_vector_alloc(nlev);
+      gsl_vector *newpop=gsl_vector_alloc(nlev);
+      gsl_permutation *p=gsl_permutation_alloc(nlev);
+
+      for(ilev=0;ilev<nlev;ilev++) gsl_vector_set(rhs,ilev,0.);
+      gsl_vector_set(rhs,nlev-1,1.);
+#pragma omp for schedule(dynamic)
+      for(id=0;id<par->pIntensity;id++){
+        if(g[id].mol[ispec].pops!=NULL && g[id].nmol[ispec]>0.) lvgPoint(id,g,m,ispec,mp,matrix,reduc,rhs,newpop,p);
+      }
+
+      gsl_matrix_free(matrix);
+      gsl_matrix_free(reduc);
+      gsl_vector_free(rhs);
+      gsl_vector_free(newpop);
+      gsl_permutation_free(p);
+    }
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      free(mp[ispec].jbar);
+      freePointRates(m,ispec,mp);
+    }
+    free(mp);
+  }
+  timerEnd(timer);
+  if(par->outputfile) popsout(par,g,m);
+}
@@ -8,66 +8,175 @@
  */
 
 #include "lime.h"
+#include <unistd.h>
 
-#ifdef FASTEXP
 double EXP_TABLE_2D[128][10];
 double EXP_TABLE_3D[256][2][10];
 /* I've hard-wired the dimensions of these arrays, but it would be better perhaps to declare them as pointers, and calculate the dimensions with the help of the function call:
   calcFastExpRange(FAST_EXP_MAX_TAYLOR, FAST_EXP_NUM_BITS, &numMantissaFields, &lowestExponent, &numExponentsUsed)
 */
-#else
-double EXP_TABLE_2D[1][1]; // nominal definitions so the fastexp.c module will compile.
-double EXP_TABLE_3D[1][1][1];
-#endif
 
-int main () {
-  int i;
+runOptions limeOpts={NTHREADS, DEFAULT_FASTEXP, DEFAULT_NCURSES, SIMD_AVX512, 0, 1};
+
+static void
+usage(const char *prog){
+  printf("Usage: %s [OPTION] [MODEL]\n\n",prog);
+  printf("   MODEL        Model compiled as a shared object (not needed if it is linked in)\n\n");
+  printf("   -f           Use fast exponential computation\n");
+  printf("   -i ISA       Widest instruction set of the vector kernels: scalar, sse2,\n");
+  printf("                avx2 or avx512 (default: the widest the CPU supports)\n");
+  printf("   -n           Turn off ncurses output\n");
+  printf("   -p NTHREADS  Run in parallel with NTHREADS threads, unless par->nThreads is set\n");
+  printf("   -h           Display this message\n");
+}
+
+/* Sets limeOpts from the command line and returns the model file, if one is given */
+static char *
+parseOptions(int argc, char *argv[]){
+  int opt;
+
+  while((opt=getopt(argc,argv,"fi:np:h"))!=-1){
+    switch(opt){
+    case 'f':
+      limeOpts.fastExp=1;
+      break;
+    case 'i':
+      if((limeOpts.simd=vecmathLevel(optarg))<0){
+        fprintf(stderr,"%s: unknown instruction set %s\n",argv[0],optarg);
+        exit(1);
+      }
+      break;
+    case 'n':
+      limeOpts.ncurses=0;
+      break;
+    case 'p':
+      limeOpts.nThreads=atoi(optarg);
+      if(limeOpts.nThreads<1){
+        fprintf(stderr,"%s: invalid number of threads\n",argv[0]);
+        exit(1);
+      }
+      break;
+    case 'h':
+      usage(argv[0]);
+      exit(0);
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  if(optind<argc-1){
+    usage(argv[0]);
+    exit(1);
+  }
+  return (optind==argc-1) ? argv[optind] : NULL;
+}
+
+int main (int argc, char *argv[]) {
+  int i,nLineImages=0,attached=0;
   int initime=time(0);
   int popsdone=0;
   molData*     m = NULL;
+  molData*     ms = NULL;
   inputPars    par;
   struct grid* g = NULL;
   image*       img = NULL;
+  struct cell* dc = NULL;
+  unsigned long numCells=0;
+  int timer;
+  char *modelFile;
+
+  mpiInit(&argc,&argv);
+  modelFile=parseOptions(argc,argv);
+  vecmathInit();
+  timer=timerBegin("total");
 
   if(!silent) greetings();
   if(!silent) screenInfo();
 
-#ifdef FASTEXP
-  calcTableEntries(FAST_EXP_MAX_TAYLOR, FAST_EXP_NUM_BITS);
-#endif
+  if(modelFile!=NULL) loadModel(modelFile);
+
+  if(limeOpts.fastExp) calcTableEntries(FAST_EXP_MAX_TAYLOR, FAST_EXP_NUM_BITS);
 
   parseInput(&par,&img,&m);
+  for(i=0;i<par.nImages;i++) if(img[i].doline==1) nLineImages++;
 
-  if(par.doPregrid)
+  /* New grid points are placed with the model functions (see refine.c) */
+  if(par.refine>0 && (par.nSweep>0 || par.doPregrid || par.restart)){
+    if(!silent) warning("Grid refinement needs a grid built from the model functions, and no sweep");
+    par.refine=0;
+  }
+
+  /* A run that resumes from a checkpoint builds the grid of the run that wrote it (see checkpoint.c) */
+  if(par.checkpoint!=NULL && (par.nSweep>0 || par.restart || par.refine>0)){
+    if(!silent) warning("Checkpoints are not taken for sweeps, refined grids or restarted runs");
+    par.checkpoint=NULL;
+  }
+  if(par.checkpoint!=NULL) par.gridSeed=checkpointSeed(&par);
+
+  /* A grid published by an earlier run of the model is attached read-only, and only the images are made (see share.c). Continuum images need a grid of their own. */
+  if(par.gridShare!=NULL && par.nSweep==0 && nLineImages==par.nImages && attachGrid(&par,&g,&ms))
+    {
+      attached=1;
+      par.octree=0;
+    }
+  else if(par.doPregrid && par.octree)
+    {
+      octreeGrid(&par,&g,&dc,&numCells);
+    }
+  else if(par.doPregrid)
     {
       gridAlloc(&par,&g);
-      predefinedGrid(&par,g);
+      predefinedGrid(&par,g,&dc,&numCells);
     }
   else if(par.restart)
     {
-      popsin(&par,&g,&m,&popsdone);
+      popsin(&par,&g,&m,&popsdone,&dc,&numCells);
     }
   else
     {
       gridAlloc(&par,&g);
-      buildGrid(&par,g);
+      buildGrid(&par,g,&dc,&numCells);
+      if(par.refine>0 && nLineImages>0) refineGrid(&par,&g,&dc,&numCells);
     }
 
-  for(i=0;i<par.nImages;i++){
-    if(img[i].doline==1 && popsdone==0) {
-      levelPops(m,&par,g,&popsdone);
-    }
-    if(img[i].doline==0) {
-      continuumSetup(i,img,m,&par,g);
+  if(attached){
+    for(i=0;i<par.nImages;i++){
+      raytrace(i,&par,g,ms,img);
+      writefits(i,&par,ms,img);
     }
+  } else if(par.nSweep>0){
+    runSweep(&par,g,m,img,dc,numCells);
+  } else {
+    /* The grid file is written once the populations are known, or straight away if none are needed. */
+    if(popsdone || nLineImages==0) dumpGrid(&par,g,m,dc,numCells);
+    if(popsdone && par.gridShare!=NULL) publishGrid(&par,g,m);
 
-    raytrace(i,&par,g,m,img);
-    writefits(i,&par,m,img);
+    for(i=0;i<par.nImages;i++){
+      if(img[i].doline==1 && popsdone==0) {
+        levelPops(m,&par,g,&popsdone,0);
+        dumpGrid(&par,g,m,dc,numCells);
+        if(par.gridShare!=NULL) publishGrid(&par,g,m);
+      }
+      if(img[i].doline==0) {
+        continuumSetup(i,img,m,&par,g);
+      }
+
+      raytrace(i,&par,g,m,img);
+      writefits(i,&par,m,img);
+    }
   }
 
+  timerEnd(timer);
+  if(par.writeReport && !attached) report(1,&par,g);
   if(!silent) goodnight(initime,img[0].filename);
 
-  freeGrid( &par, m, g);
+  if(attached) detachGrid();
+  else freeGrid( &par, m, g);
   freeInput(&par, img, m);
+  free(dc);
+  if(par.octree) octreeFree();
+  freeTimers();
+  unloadModel();
+  mpiFinalize();
   return 0;
 }
@@ -0,0 +1,264 @@
+/*
+ *  moldatcache.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Binary cache of parsed LAMDA molecular data files. The cache holds a fixed header followed by a table of collision partners and the data arrays, each aligned to 8 bytes:
+
+  eterm[nlev], gstat[nlev], aeinst[nline], freq[nline], lau[nline], lal[nline],
+  and per partner: temp[ntemp], colld[ntrans*ntemp], lcu[ntrans], lcl[ntrans].
+
+All values are stored as molinit() uses them (indices from 0, frequencies in Hz, rates in m^3 s^-1), in the native byte order of the machine that wrote the cache. The file is keyed by a 64-bit FNV-1a hash of the data file, and is mapped read-only when loaded, so the arrays of the lamdaData struct point directly into the map.
+*/
+
+#include "lime.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC     "LIMEMOLC"
+#define CACHE_VERSION   1
+#define CACHE_ENDIAN    0x01020304
+#define CACHE_ALIGN     8
+
+struct cacheHeader {
+  char magic[8];
+  uint32_t version, endian, sizeofInt, sizeofDouble;
+  uint64_t hash, srcSize, totalSize;
+  double amass;
+  int32_t nlev, nline, npart, hasColl;
+  char specref[96];
+};
+
+struct cachePartner {
+  int32_t partnerId, ntrans, ntemp, pad;
+};
+
+static size_t
+alignUp(size_t n){
+  return (n+CACHE_ALIGN-1)/CACHE_ALIGN*CACHE_ALIGN;
+}
+
+/* FNV-1a hash of n bytes, continuing from h (FNV_OFFSET for a new hash) */
+unsigned long long
+hashBytes(unsigned long long h, const void *p, size_t n){
+  const unsigned char *c=p;
+  size_t k;
+
+  for(k=0;k<n;k++){
+    h^=c[k];
+    h*=1099511628211ULL;
+  }
+  return h;
+}
+
+/* FNV-1a hash of the whole data file */
+int
+hashFile(char *filename, unsigned long long *hash, unsigned long long *size){
+  FILE *fp;
+  unsigned char buf[65536];
+  size_t n;
+  unsigned long long h=FNV_OFFSET;
+
+  if((fp=fopen(filename, "rb"))==NULL) return 1;
+  *size=0;
+  while((n=fread(buf, 1, sizeof(buf), fp))>0){
+    h=hashBytes(h, buf, n);
+    *size+=n;
+  }
+  fclose(fp);
+  *hash=h;
+  return 0;
+}
+
+/* The cache lives next to the data file, or in par->molDataCacheDir with the hash in its name */
+static void
+cacheName(inputPars *par, int i, unsigned long long hash, char *name, size_t len){
+  char *base;
+
+  if(par->molDataCacheDir!=NULL){
+    base=strrchr(par->moldatfile[i], '/');
+    base=(base==NULL) ? par->moldatfile[i] : base+1;
+    snprintf(name, len, "%s/%s.%016llx.cache", par->molDataCacheDir, base, hash);
+  } else {
+    snprintf(name, len, "%s.cache", par->moldatfile[i]);
+  }
+}
+
+/* Total size of a cache with the given counts, or 0 if the counts are not sane */
+static size_t
+cacheSize(struct cacheHeader *hdr, struct cachePartner *cp){
+  size_t size;
+  int ipart;
+
+  if(hdr->nlev<=0 || hdr->nline<0 || hdr->npart<0) return 0;
+  size=alignUp(sizeof(struct cacheHeader));
+  size+=alignUp(sizeof(struct cachePartner)*hdr->npart);
+  size+=2*alignUp(sizeof(double)*hdr->nlev);
+  size+=2*alignUp(sizeof(double)*hdr->nline);
+  size+=2*alignUp(sizeof(int)*hdr->nline);
+  for(ipart=0;ipart<hdr->npart;ipart++){
+    if(cp[ipart].ntrans<0 || cp[ipart].ntemp<=0) return 0;
+    size+=alignUp(sizeof(double)*cp[ipart].ntemp);
+    size+=alignUp(sizeof(double)*cp[ipart].ntrans*cp[ipart].ntemp);
+    size+=2*alignUp(sizeof(int)*cp[ipart].ntrans);
+  }
+  return size;
+}
+
+/* Returns 1 and fills ld if a valid cache of molecular data file i exists, 0 otherwise. On return ld->hash and ld->srcSize identify the data file either way. */
+int
+loadMolDataCache(inputPars *par, int i, lamdaData *ld){
+  char name[1024];
+  int fd,ipart;
+  struct stat st;
+  struct cacheHeader *hdr;
+  struct cachePartner *cp;
+  char *base,*p;
+
+  if(hashFile(par->moldatfile[i], &ld->hash, &ld->srcSize)) return 0;
+  cacheName(par, i, ld->hash, name, sizeof(name));
+
+  if((fd=open(name, O_RDONLY))<0) return 0;
+  if(fstat(fd, &st) || (size_t)st.st_size<alignUp(sizeof(struct cacheHeader))){
+    close(fd);
+    return 0;
+  }
+  base=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(base==MAP_FAILED) return 0;
+
+  /* Validate the layout before trusting any of the counts */
+  hdr=(struct cacheHeader *)base;
+  cp=(struct cachePartner *)(base+alignUp(sizeof(struct cacheHeader)));
+  if(memcmp(hdr->magic, CACHE_MAGIC, 8) || hdr->version!=CACHE_VERSION || hdr->endian!=CACHE_ENDIAN
+     || hdr->sizeofInt!=sizeof(int) || hdr->sizeofDouble!=sizeof(double)
+     || hdr->hash!=ld->hash || hdr->srcSize!=ld->srcSize || hdr->totalSize!=(uint64_t)st.st_size
+     || hdr->npart<0 || alignUp(sizeof(struct cacheHeader))+sizeof(struct cachePartner)*(size_t)hdr->npart>(size_t)st.st_size
+     || cacheSize(hdr, cp)!=(size_t)st.st_size
+     || (!hdr->hasColl && par->lte_only==0)){
+    munmap(base, st.st_size);
+    return 0;
+  }
+
+  memcpy(ld->specref, hdr->specref, sizeof(ld->specref));
+  ld->specref[sizeof(ld->specref)-1]='\0';
+  ld->amass=hdr->amass;
+  ld->nlev=hdr->nlev;
+  ld->nline=hdr->nline;
+  ld->npart=hdr->npart;
+  ld->hasColl=hdr->hasColl;
+
+  p=(char *)cp+alignUp(sizeof(struct cachePartner)*ld->npart);
+  ld->eterm =(double *)p; p+=alignUp(sizeof(double)*ld->nlev);
+  ld->gstat =(double *)p; p+=alignUp(sizeof(double)*ld->nlev);
+  ld->aeinst=(double *)p; p+=alignUp(sizeof(double)*ld->nline);
+  ld->freq  =(double *)p; p+=alignUp(sizeof(double)*ld->nline);
+  ld->lau   =(int *)p;    p+=alignUp(sizeof(int)*ld->nline);
+  ld->lal   =(int *)p;    p+=alignUp(sizeof(int)*ld->nline);
+
+  if(ld->hasColl){
+    ld->partnerId=malloc(sizeof(int)*ld->npart);
+    ld->ntrans   =malloc(sizeof(int)*ld->npart);
+    ld->ntemp    =malloc(sizeof(int)*ld->npart);
+    ld->lcu      =malloc(sizeof(int *)*ld->npart);
+    ld->lcl      =malloc(sizeof(int *)*ld->npart);
+    ld->temp     =malloc(sizeof(double *)*ld->npart);
+    ld->colld    =malloc(sizeof(double *)*ld->npart);
+    for(ipart=0;ipart<ld->npart;ipart++){
+      ld->partnerId[ipart]=cp[ipart].partnerId;
+      ld->ntrans[ipart]=cp[ipart].ntrans;
+      ld->ntemp[ipart]=cp[ipart].ntemp;
+      ld->temp[ipart] =(double *)p; p+=alignUp(sizeof(double)*ld->ntemp[ipart]);
+      ld->colld[ipart]=(double *)p; p+=alignUp(sizeof(double)*ld->ntrans[ipart]*ld->ntemp[ipart]);
+      ld->lcu[ipart]  =(int *)p;    p+=alignUp(sizeof(int)*ld->ntrans[ipart]);
+      ld->lcl[ipart]  =(int *)p;    p+=alignUp(sizeof(int)*ld->ntrans[ipart]);
+    }
+  }
+
+  ld->map=base;
+  ld->mapSize=st.st_size;
+  return 1;
+}
+
+static int
+writeBlock(FILE *fp, void *buf, size_t n){
+  static const char pad[CACHE_ALIGN]={0};
+
+  if(n>0 && fwrite(buf, 1, n, fp)!=n) return 1;
+  if(alignUp(n)>n && fwrite(pad, 1, alignUp(n)-n, fp)!=alignUp(n)-n) return 1;
+  return 0;
+}
+
+/* Writes the parsed data ld of molecular data file i to its cache. The file is written under a temporary name and renamed, so readers never see a partial cache. Failure only costs the next run a re-parse. */
+void
+writeMolDataCache(inputPars *par, int i, lamdaData *ld){
+  char name[1024], tmpname[1100];
+  struct cacheHeader hdr;
+  struct cachePartner *cp;
+  int ipart,err=0;
+  FILE *fp;
+
+  if(ld->srcSize==0 && hashFile(par->moldatfile[i], &ld->hash, &ld->srcSize)) return;
+  cacheName(par, i, ld->hash, name, sizeof(name));
+  snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", name, (int)getpid());
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CACHE_MAGIC, 8);
+  hdr.version=CACHE_VERSION;
+  hdr.endian=CACHE_ENDIAN;
+  hdr.sizeofInt=sizeof(int);
+  hdr.sizeofDouble=sizeof(double);
+  hdr.hash=ld->hash;
+  hdr.srcSize=ld->srcSize;
+  hdr.amass=ld->amass;
+  hdr.nlev=ld->nlev;
+  hdr.nline=ld->nline;
+  hdr.npart=ld->npart;
+  hdr.hasColl=ld->hasColl;
+  strncpy(hdr.specref, ld->specref, sizeof(hdr.specref)-1);
+
+  cp=malloc(sizeof(struct cachePartner)*(ld->npart>0 ? ld->npart : 1));
+  for(ipart=0;ipart<ld->npart;ipart++){
+    cp[ipart].partnerId=ld->partnerId[ipart];
+    cp[ipart].ntrans=ld->ntrans[ipart];
+    cp[ipart].ntemp=ld->ntemp[ipart];
+    cp[ipart].pad=0;
+  }
+  hdr.totalSize=cacheSize(&hdr, cp);
+
+  if(hdr.totalSize==0 || (fp=fopen(tmpname, "wb"))==NULL){
+    if(!silent) warning("Could not write molecular data cache");
+    free(cp);
+    return;
+  }
+
+  err|=writeBlock(fp, &hdr, sizeof(hdr));
+  err|=writeBlock(fp, cp, sizeof(struct cachePartner)*ld->npart);
+  err|=writeBlock(fp, ld->eterm,  sizeof(double)*ld->nlev);
+  err|=writeBlock(fp, ld->gstat,  sizeof(double)*ld->nlev);
+  err|=writeBlock(fp, ld->aeinst, sizeof(double)*ld->nline);
+  err|=writeBlock(fp, ld->freq,   sizeof(double)*ld->nline);
+  err|=writeBlock(fp, ld->lau,    sizeof(int)*ld->nline);
+  err|=writeBlock(fp, ld->lal,    sizeof(int)*ld->nline);
+  for(ipart=0;ipart<ld->npart;ipart++){
+    err|=writeBlock(fp, ld->temp[ipart],  sizeof(double)*ld->ntemp[ipart]);
+    err|=writeBlock(fp, ld->colld[ipart], sizeof(double)*ld->ntrans[ipart]*ld->ntemp[ipart]);
+    err|=writeBlock(fp, ld->lcu[ipart],   sizeof(int)*ld->ntrans[ipart]);
+    err|=writeBlock(fp, ld->lcl[ipart],   sizeof(int)*ld->ntrans[ipart]);
+  }
+  err|=fclose(fp);
+  free(cp);
+
+  if(err || rename(tmpname, name)){
+    remove(tmpname);
+    if(!silent) warning("Could not write molecular data cache");
+  }
+}
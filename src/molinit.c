@@ -8,48 +8,81 @@
  */
 
 #include "lime.h"
+#include <sys/mman.h>
 
-void
-kappa(molData *m, struct grid *g, inputPars *par, int s){
+/* Dust opacity table, read once per run and shared by all species and continuum images */
+static struct {
+  char *filename;
+  int n;
+  double *lam, *kap;
+} dustTable = {NULL, 0, NULL, NULL};
+
+static void
+readDustTable(inputPars *par){
   FILE *fp;
   char string[80];
-  int i=0,k,j,iline,id;
-  double loglam, *lamtab, *kaptab, *kappatab, gtd;
-  gsl_spline *spline;
+  int i=0,k;
 
-  kappatab   	 = malloc(sizeof(*kappatab)*m[s].nline);
-  m[s].cmb	 = malloc(sizeof(double)*m[s].nline);
-  m[s].local_cmb = malloc(sizeof(double)*m[s].nline);
+  if(dustTable.filename!=NULL && !strcmp(dustTable.filename, par->dust)) return;
+  free(dustTable.filename);
+  free(dustTable.lam);
+  free(dustTable.kap);
+
+  if((fp=fopen(par->dust, "r"))==NULL){
+    if(!silent) bail_out("Error opening dust opacity data file!");
+    exit(1);
+  }
+  while(fgetc(fp) != EOF){
+    fgets(string,80,fp);
+    i++;
+  }
+  rewind(fp);
+  if(i>0){
+    dustTable.lam=malloc(sizeof(double)*i);
+    dustTable.kap=malloc(sizeof(double)*i);
+  } else {
+    if(!silent) bail_out("No opacities read");
+    exit(1);
+  }
+  for(k=0;k<i;k++){
+    fscanf(fp,"%lf %lf\n", &dustTable.lam[k], &dustTable.kap[k]);
+    dustTable.lam[k]=log10(dustTable.lam[k]/1e6);
+    dustTable.kap[k]=log10(dustTable.kap[k]);
+  }
+  fclose(fp);
+  dustTable.n=i;
+  dustTable.filename=malloc(strlen(par->dust)+1);
+  strcpy(dustTable.filename, par->dust);
+}
+
+void
+kappa(molData *m, struct grid *g, inputPars *par, int s){
+  int i,j,iline,id,nline;
+  double loglam, *lamtab, *kaptab, *kappatab, *pfac, *hnuk;
+  gsl_spline *spline;
+  int timer=timerBegin("kappa");
+
+  nline=m[s].nline;
+  kappatab   	 = malloc(sizeof(*kappatab)*nline);
+  pfac       	 = malloc(sizeof(*pfac)*nline);
+  hnuk       	 = malloc(sizeof(*hnuk)*nline);
+  /* Called again for each set of a sweep (molUpdate()) */
+  free(m[s].cmb);
+  free(m[s].local_cmb);
+  m[s].cmb	 = malloc(sizeof(double)*nline);
+  m[s].local_cmb = malloc(sizeof(double)*nline);
 
   if(par->dust == NULL){
-    for(i=0;i<m[s].nline;i++) kappatab[i]=0.;
+    for(j=0;j<nline;j++) kappatab[j]=0.;
   } else {
     gsl_interp_accel *acc=gsl_interp_accel_alloc();
-    if((fp=fopen(par->dust, "r"))==NULL){
-      if(!silent) bail_out("Error opening dust opacity data file!");
-      exit(1);
-    }
-    while(fgetc(fp) != EOF){
-      fgets(string,80,fp);
-      i++;
-    }
-    rewind(fp);
-    if(i>0){
-      lamtab=malloc(sizeof(*lamtab)*i);
-      kaptab=malloc(sizeof(*kaptab)*i);
-    } else {
-      if(!silent) bail_out("No opacities read");
-      exit(1);
-    }
-    for(k=0;k<i;k++){
-      fscanf(fp,"%lf %lf\n", &lamtab[k], &kaptab[k]);
-      lamtab[k]=log10(lamtab[k]/1e6);
-      kaptab[k]=log10(kaptab[k]);
-    }
-    fclose(fp);
+    readDustTable(par);
+    i=dustTable.n;
+    lamtab=dustTable.lam;
+    kaptab=dustTable.kap;
     spline=gsl_spline_alloc(gsl_interp_cspline,i);
     gsl_spline_init(spline,lamtab,kaptab,i);
-    for(j=0;j<m[s].nline;j++) {
+    for(j=0;j<nline;j++) {
       loglam=log10(CLIGHT/m[s].freq[j]);
       if(loglam < lamtab[0]){
         kappatab[j]=0.1*pow(10.,kaptab[0] + (loglam-lamtab[0]) * (kaptab[1]-kaptab[0])/(lamtab[1]-lamtab[0]));
@@ -59,30 +92,54 @@ kappa(molData *m, struct grid *g, inputPars *par, int s){
     }
     gsl_spline_free(spline);
     gsl_interp_accel_free(acc);
-    free(kaptab);
-    free(lamtab);
   }
 
-  for(iline=0;iline<m[s].nline;iline++){
-    for(id=0;id<par->ncell;id++){
-      gasIIdust(g[id].x[0],g[id].x[1],g[id].x[2],&gtd);
-      g[id].mol[s].knu[iline]=kappatab[iline]*2.4*AMU/gtd*g[id].dens[0];
-      //Check if input model supplies a dust temperature. Otherwise use the kinetic temperature
-      if(g[id].t[1]==-1) {
-        g[id].mol[s].dust[iline]=planckfunc(iline,g[id].t[0],m,s);
-      } else {
-        g[id].mol[s].dust[iline]=planckfunc(iline,g[id].t[1],m,s);
+  /* Frequency-dependent factors of the Planck function, so that B_nu(T) = pfac/(exp(hnuk/T)-1) */
+  for(iline=0;iline<nline;iline++){
+    pfac[iline]=2.*HPLANCK*m[s].freq[iline]*m[s].freq[iline]*m[s].freq[iline]/CLIGHT/CLIGHT;
+    hnuk[iline]=HPLANCK*m[s].freq[iline]/KBOLTZ;
+  }
+
+  /* One pass per vertex: the gas-to-dust ratio is evaluated once and the Planck function for all lines in a vectorizable loop. */
+  omp_set_dynamic(0);
+#pragma omp parallel for private(id,iline) schedule(static) num_threads(par->nThreads)
+  for(id=0;id<par->ncell;id++){
+    double gtd,knufac,tdust,tinv,e;
+    storeReal *knu=g[id].mol[s].knu, *dust=g[id].mol[s].dust;
+
+    gasIIdust(g[id].x[0],g[id].x[1],g[id].x[2],&gtd);
+    knufac=2.4*AMU/gtd*g[id].dens[0];
+    //Check if input model supplies a dust temperature. Otherwise use the kinetic temperature
+    tdust=(g[id].t[1]==-1) ? g[id].t[0] : g[id].t[1];
+
+#pragma omp simd
+    for(iline=0;iline<nline;iline++) knu[iline]=kappatab[iline]*knufac;
+
+    if(tdust<eps){
+      for(iline=0;iline<nline;iline++) dust[iline]=0.;
+    } else {
+      tinv=1./tdust;
+#pragma omp simd private(e)
+      for(iline=0;iline<nline;iline++){
+        e=exp(-hnuk[iline]*tinv);
+        dust[iline]=pfac[iline]*e/(1.-e);
       }
     }
-    // fix the normalization at 230GHz
-    m[s].norm=planckfunc(0,par->tcmb,m,0);
-    m[s].norminv=1./m[s].norm;
+  }
+
+  // fix the normalization at 230GHz
+  m[s].norm=planckfunc(0,par->tcmb,m,0);
+  m[s].norminv=1./m[s].norm;
+  for(iline=0;iline<nline;iline++){
     if(par->tcmb>0.) m[s].cmb[iline]=planckfunc(iline,par->tcmb,m,s)/m[s].norm;
     else m[s].cmb[iline]=0.;
     m[s].local_cmb[iline]=planckfunc(iline,2.728,m,s)/m[s].norm;
   }
 
   free(kappatab);
+  free(pfac);
+  free(hnuk);
+  timerEnd(timer);
   return;
 }
 
@@ -101,14 +158,36 @@ planckfunc(int iline, double temp, molData *m,int s){
   return bb;
 }
 
+/* Locate temp in the temperature table: rates are then interpolated between rows *binlow and *binlow+1 with weight *coeff on the latter. Values outside the table are clamped to its ends. */
 void
-molinit(molData *m, inputPars *par, struct grid *g,int i){
-  int id, ilev, iline, itrans, ispec, itemp, *ntemp, tnint=-1, idummy, ipart, *count,flag=0;
-  char *collpartname[] = {"H2","p-H2","o-H2","electrons","H","He","H+"}; /* definition from LAMDA */
-  double fac, uprate, downrate=0, dummy, amass;
-  struct data { double *colld, *temp; } *part;
+rateTableBin(struct rateTable *tab, double temp, int *binlow, double *coeff){
+  int lo,hi,mid;
+
+  if(tab->ntemp<2 || temp<=tab->temp[0]){
+    *binlow=0;
+    *coeff=0.;
+  } else if(temp>=tab->temp[tab->ntemp-1]){
+    *binlow=tab->ntemp-2;
+    *coeff=1.;
+  } else {
+    lo=0;
+    hi=tab->ntemp-1;
+    while(hi-lo>1){
+      mid=(lo+hi)/2;
+      if(temp>tab->temp[mid]) lo=mid;
+      else hi=mid;
+    }
+    *binlow=lo;
+    *coeff=(temp-tab->temp[lo])/(tab->temp[lo+1]-tab->temp[lo]);
+  }
+}
 
-  char string[200], specref[90], partstr[90];
+/* Parses a LAMDA-format molecular data file. Collision data are read unless lte_only is set and no cache is going to be written. */
+void
+readLamda(inputPars *par, int i, lamdaData *ld){
+  int ilev, iline, itrans, itemp, ipart, idummy;
+  double dummy;
+  char string[200];
   FILE *fp;
 
   if((fp=fopen(par->moldatfile[i], "r"))==NULL) {
@@ -118,41 +197,187 @@ molinit(molData *m, inputPars *par, struct grid *g,int i){
 
   /* Read the header of the data file */
   fgets(string, 80, fp);
-  fgets(specref, 90, fp);
+  fgets(ld->specref, 90, fp);
   fgets(string, 80, fp);
-  fscanf(fp, "%lf\n", &amass);
+  fscanf(fp, "%lf\n", &ld->amass);
   fgets(string, 80, fp);
-  fscanf(fp, "%d\n", &m[i].nlev);
+  fscanf(fp, "%d\n", &ld->nlev);
   fgets(string, 80, fp);
 
-  m[i].eterm=malloc(sizeof(double)*m[i].nlev);
-  m[i].gstat=malloc(sizeof(double)*m[i].nlev);
+  ld->eterm=malloc(sizeof(double)*ld->nlev);
+  ld->gstat=malloc(sizeof(double)*ld->nlev);
 
   /* Read the level energies and statistical weights */
-  for(ilev=0;ilev<m[i].nlev;ilev++){
-    fscanf(fp, "%d %lf %lf", &idummy, &m[i].eterm[ilev], &m[i].gstat[ilev]);
+  for(ilev=0;ilev<ld->nlev;ilev++){
+    fscanf(fp, "%d %lf %lf", &idummy, &ld->eterm[ilev], &ld->gstat[ilev]);
     fgets(string, 80, fp);
   }
 
   /* Read the number of transitions and allocate array space */
   fgets(string, 80, fp);
-  fscanf(fp, "%d\n", &m[i].nline);
+  fscanf(fp, "%d\n", &ld->nline);
   fgets(string, 80, fp);
 
+  ld->lal    = malloc(sizeof(int)*ld->nline);
+  ld->lau    = malloc(sizeof(int)*ld->nline);
+  ld->aeinst = malloc(sizeof(double)*ld->nline);
+  ld->freq   = malloc(sizeof(double)*ld->nline);
+
+  /* Read transitions, Einstein A, and frequencies */
+  for(iline=0;iline<ld->nline;iline++){
+    fscanf(fp, "%d %d %d %lf %lf %lf\n", &idummy, &ld->lau[iline], &ld->lal[iline], &ld->aeinst[iline], &ld->freq[iline], &dummy);
+    ld->freq[iline]*=1e9;
+    ld->lau[iline]-=1;
+    ld->lal[iline]-=1;
+  }
+
+  ld->npart=0;
+  ld->hasColl=(par->lte_only==0 || par->molDataCache);
+  if(ld->hasColl){
+    fgets(string, 80, fp);
+    fscanf(fp,"%d\n", &ld->npart);
+
+    ld->partnerId = malloc(sizeof(int)*ld->npart);
+    ld->ntrans    = malloc(sizeof(int)*ld->npart);
+    ld->ntemp     = malloc(sizeof(int)*ld->npart);
+    ld->lcu       = malloc(sizeof(int *)*ld->npart);
+    ld->lcl       = malloc(sizeof(int *)*ld->npart);
+    ld->temp      = malloc(sizeof(double *)*ld->npart);
+    ld->colld     = malloc(sizeof(double *)*ld->npart);
+
+    for(ipart=0;ipart<ld->npart;ipart++){
+      fgets(string, 80, fp);
+      fscanf(fp,"%d\n", &ld->partnerId[ipart]);
+      fgets(string, 80, fp);
+      fgets(string, 80, fp);
+      fscanf(fp,"%d\n", &ld->ntrans[ipart]);
+      fgets(string, 80, fp);
+      fscanf(fp,"%d\n", &ld->ntemp[ipart]);
+      fgets(string, 80, fp);
+
+      ld->temp[ipart]=malloc(sizeof(double)*ld->ntemp[ipart]);
+      for(itemp=0;itemp<ld->ntemp[ipart];itemp++){
+        fscanf(fp, "%lf", &ld->temp[ipart][itemp]);
+      }
+
+      fscanf(fp,"\n");
+      fgets(string, 80, fp);
+
+      ld->lcu[ipart]=malloc(sizeof(int)*ld->ntrans[ipart]);
+      ld->lcl[ipart]=malloc(sizeof(int)*ld->ntrans[ipart]);
+      ld->colld[ipart]=malloc(sizeof(double)*ld->ntrans[ipart]*ld->ntemp[ipart]);
+
+      for(itrans=0;itrans<ld->ntrans[ipart];itrans++){
+        fscanf(fp, "%d %d %d", &idummy, &ld->lcu[ipart][itrans], &ld->lcl[ipart][itrans]);
+        ld->lcu[ipart][itrans]-=1;
+        ld->lcl[ipart][itrans]-=1;
+        for(itemp=0;itemp<ld->ntemp[ipart];itemp++){
+          fscanf(fp, "%lf", &ld->colld[ipart][itrans*ld->ntemp[ipart]+itemp]);
+          ld->colld[ipart][itrans*ld->ntemp[ipart]+itemp]/=1.e6;
+        }
+        fscanf(fp,"\n");
+      }
+    }
+  }
+  fclose(fp);
+  ld->map=NULL;
+  ld->mapSize=0;
+}
+
+void
+freeLamda(lamdaData *ld){
+  int ipart;
+
+  if(ld->hasColl){
+    for(ipart=0;ipart<ld->npart && ld->map==NULL;ipart++){
+      free(ld->lcu[ipart]);
+      free(ld->lcl[ipart]);
+      free(ld->temp[ipart]);
+      free(ld->colld[ipart]);
+    }
+    free(ld->lcu);
+    free(ld->lcl);
+    free(ld->temp);
+    free(ld->colld);
+    if(ld->map==NULL){
+      free(ld->partnerId);
+      free(ld->ntrans);
+      free(ld->ntemp);
+    }
+  }
+  if(ld->map!=NULL){
+    munmap(ld->map, ld->mapSize);
+  } else {
+    free(ld->eterm);
+    free(ld->gstat);
+    free(ld->lal);
+    free(ld->lau);
+    free(ld->aeinst);
+    free(ld->freq);
+  }
+}
+
+static void
+lineWidths(molData *m, inputPars *par, struct grid *g, int i){
+  int id;
+
+  for(id=0;id<par->ncell;id++) {
+    g[id].mol[i].dopb=sqrt(g[id].dopb*g[id].dopb+2.*KBOLTZ/m[i].amass*g[id].t[0]);
+    g[id].mol[i].binv=1./g[id].mol[i].dopb;
+  }
+}
+
+/* Molecular densities as set up by species i (the last species read decides, as it always has) */
+static void
+molDensity(molData *m, inputPars *par, struct grid *g, int i){
+  int id,ispec;
+
+  if(m[i].nmolMode==0) return;
+  for(id=0;id<par->ncell; id++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      if(m[i].nmolMode==1) g[id].nmol[ispec]=g[id].abun[ispec]*g[id].dens[0];
+      else g[id].nmol[ispec]=g[id].abun[ispec]*(g[id].dens[0]+g[id].dens[1]);
+    }
+  }
+}
+
+void
+molinit(molData *m, inputPars *par, struct grid *g,int i){
+  int id, iline, itrans, itemp, tnint=-1, ipart, *ntemp, *count,flag=0;
+  char *collpartname[] = {"H2","p-H2","o-H2","electrons","H","He","H+"}; /* definition from LAMDA */
+  double fac, uprate, downrate=0, amass;
+  struct data { double *colld, *temp; } *part;
+  char partstr[90];
+  lamdaData ld;
+  int timer=timerBegin("molinit");
+
+  /* Get the molecular data, from the binary cache if there is a valid one */
+  ld.hash=0;
+  ld.srcSize=0;
+  if(!par->molDataCache || !loadMolDataCache(par, i, &ld)){
+    readLamda(par, i, &ld);
+    if(par->molDataCache) writeMolDataCache(par, i, &ld);
+  }
+
+  m[i].nlev=ld.nlev;
+  m[i].nline=ld.nline;
+  amass=ld.amass;
+
+  m[i].eterm=malloc(sizeof(double)*m[i].nlev);
+  m[i].gstat=malloc(sizeof(double)*m[i].nlev);
+  memcpy(m[i].eterm, ld.eterm, sizeof(double)*m[i].nlev);
+  memcpy(m[i].gstat, ld.gstat, sizeof(double)*m[i].nlev);
+
   m[i].lal     = malloc(sizeof(int)*m[i].nline);
   m[i].lau     = malloc(sizeof(int)*m[i].nline);
   m[i].aeinst  = malloc(sizeof(double)*m[i].nline);
   m[i].freq    = malloc(sizeof(double)*m[i].nline);
   m[i].beinstu = malloc(sizeof(double)*m[i].nline);
   m[i].beinstl = malloc(sizeof(double)*m[i].nline);
-
-  /* Read transitions, Einstein A, and frequencies */
-  for(iline=0;iline<m[i].nline;iline++){
-    fscanf(fp, "%d %d %d %lf %lf %lf\n", &idummy, &m[i].lau[iline], &m[i].lal[iline], &m[i].aeinst[iline], &m[i].freq[iline], &dummy);
-    m[i].freq[iline]*=1e9;
-    m[i].lau[iline]-=1;
-    m[i].lal[iline]-=1;
-  }
+  memcpy(m[i].lal,    ld.lal,    sizeof(int)*m[i].nline);
+  memcpy(m[i].lau,    ld.lau,    sizeof(int)*m[i].nline);
+  memcpy(m[i].aeinst, ld.aeinst, sizeof(double)*m[i].nline);
+  memcpy(m[i].freq,   ld.freq,   sizeof(double)*m[i].nline);
 
   /* Calculate Einsten B's */
   for(iline=0;iline<m[i].nline;iline++){
@@ -162,16 +387,12 @@ molinit(molData *m, inputPars *par, struct grid *g,int i){
   }
 
   /* Calculate Doppler and thermal line broadening */
-  amass*=AMU;
-  for(id=0;id<par->ncell;id++) {
-    g[id].mol[i].dopb=sqrt(g[id].dopb*g[id].dopb+2.*KBOLTZ/amass*g[id].t[0]);
-    g[id].mol[i].binv=1./g[id].mol[i].dopb;
-  }
+  m[i].amass=amass*AMU;
+  lineWidths(m,par,g,i);
 
   /* Collision rates below here */
   if(par->lte_only==0){
-    fgets(string, 80, fp);
-    fscanf(fp,"%d\n", &m[i].npart);
+    m[i].npart=ld.npart;
     count=malloc(sizeof(*count)*m[i].npart);
     /* collision partner sanity check */
 
@@ -187,43 +408,25 @@ molinit(molData *m, inputPars *par, struct grid *g,int i){
     part = malloc(sizeof(struct data) * m[i].npart);
 
     for(ipart=0;ipart<m[i].npart;ipart++){
-      fgets(string, 80, fp);
-      fscanf(fp,"%d\n", &count[ipart]);
-      fgets(string, 80, fp);
-      fgets(string, 80, fp);
-      fscanf(fp,"%d\n", &m[i].ntrans[ipart]);
-      fgets(string, 80, fp);
-      fscanf(fp,"%d\n", &ntemp[ipart]);
-      fgets(string, 80, fp);
+      count[ipart]=ld.partnerId[ipart];
+      m[i].ntrans[ipart]=ld.ntrans[ipart];
+      ntemp[ipart]=ld.ntemp[ipart];
 
       part[ipart].temp=malloc(sizeof(double)*ntemp[ipart]);
+      memcpy(part[ipart].temp, ld.temp[ipart], sizeof(double)*ntemp[ipart]);
 
+      /* The transition indices are shared by all partners, sized by the first one */
       if(ipart==0){
         m[i].lcl = malloc(sizeof(int)*m[i].ntrans[ipart]);
         m[i].lcu = malloc(sizeof(int)*m[i].ntrans[ipart]);
       }
-
-      for(itemp=0;itemp<ntemp[ipart];itemp++){
-        fscanf(fp, "%lf", &part[ipart].temp[itemp]);
+      for(itrans=0;itrans<m[i].ntrans[ipart] && itrans<m[i].ntrans[0];itrans++){
+        m[i].lcu[itrans]=ld.lcu[ipart][itrans];
+        m[i].lcl[itrans]=ld.lcl[ipart][itrans];
       }
 
-      fscanf(fp,"\n");
-      fgets(string, 80, fp);
-
-      part[ipart].colld=malloc(sizeof(double)*m[i].ntrans[ipart]*ntemp[ipart]);
-
-      for(itrans=0;itrans<m[i].ntrans[ipart];itrans++){
-        fscanf(fp, "%d %d %d", &idummy, &m[i].lcu[itrans], &m[i].lcl[itrans]);
-        m[i].lcu[itrans]-=1;
-        m[i].lcl[itrans]-=1;
-        for(itemp=0;itemp<ntemp[ipart];itemp++){
-          fscanf(fp, "%lf", &part[ipart].colld[itrans*ntemp[ipart]+itemp]);
-          part[ipart].colld[itrans*ntemp[ipart]+itemp]/=1.e6;
-        }
-        fscanf(fp,"\n");
-      }
+      part[ipart].colld=ld.colld[ipart];
     }
-    fclose(fp);
 
     /* Print out collision partner information */
     strcpy(partstr, collpartname[count[0]-1]);
@@ -232,79 +435,119 @@ molinit(molData *m, inputPars *par, struct grid *g,int i){
       strcat( partstr, collpartname[count[ipart]-1]);
     }
     if(!silent) {
-      collpartmesg(specref, m[i].npart);
+      collpartmesg(ld.specref, m[i].npart);
       collpartmesg2(partstr, ipart);
       collpartmesg3(par->collPart, flag);
     }
 
     /* Calculate molecular density */
-    for(id=0;id<par->ncell; id++){
-      for(ispec=0;ispec<par->nSpecies;ispec++){
-        if(m[i].npart == 1 && (count[0] == 1 || count[0] == 2 || count[0] == 3)){
-          g[id].nmol[ispec]=g[id].abun[ispec]*g[id].dens[0];
-        } else if(m[i].npart == 2 && (count[0] == 2 || count[0] == 3) && (count[1] == 2 || count[1] == 3)){
-          if(!flag){
-            g[id].nmol[ispec]=g[id].abun[ispec]*(g[id].dens[0]+g[id].dens[1]);
-          } else {
-            g[id].nmol[ispec]=g[id].abun[ispec]*g[id].dens[0];
-            if(!silent) warning("Calculating molecular density with respect to first collision partner only");
-          }
-        } else if(m[i].npart > 2 && !flag){
-          g[id].nmol[ispec]=g[id].abun[ispec]*(g[id].dens[0]+g[id].dens[1]);
-          if(!silent) warning("Calculating molecular density with respect first and second collision partner");
-        }
+    if(m[i].npart == 1 && (count[0] == 1 || count[0] == 2 || count[0] == 3)){
+      m[i].nmolMode=1;
+    } else if(m[i].npart == 2 && (count[0] == 2 || count[0] == 3) && (count[1] == 2 || count[1] == 3)){
+      if(!flag){
+        m[i].nmolMode=2;
+      } else {
+        m[i].nmolMode=1;
+        if(!silent) warning("Calculating molecular density with respect to first collision partner only");
       }
+    } else if(m[i].npart > 2 && !flag){
+      m[i].nmolMode=2;
+      if(!silent) warning("Calculating molecular density with respect first and second collision partner");
+    } else {
+      m[i].nmolMode=0;
     }
+    molDensity(m,par,g,i);
 
-    for(id=0;id<par->ncell;id++){
-      g[id].mol[i].partner=malloc(sizeof(struct rates)*m[i].npart);
+    if(par->collRateTables){
+      /* Keep one copy of the rate tables and store only the temperature bin of each vertex. */
+      m[i].part=malloc(sizeof(struct rateTable)*m[i].npart);
       for(ipart=0;ipart<m[i].npart;ipart++){
-        g[id].mol[i].partner[ipart].up = malloc(sizeof(double)*m[i].ntrans[ipart]);
-        g[id].mol[i].partner[ipart].down = malloc(sizeof(double)*m[i].ntrans[ipart]);
+        m[i].part[ipart].ntemp=ntemp[ipart];
+        m[i].part[ipart].temp=part[ipart].temp;
+        m[i].part[ipart].down=malloc(sizeof(double)*m[i].ntrans[ipart]*ntemp[ipart]);
+        m[i].part[ipart].gfac=malloc(sizeof(double)*m[i].ntrans[ipart]);
+        m[i].part[ipart].ediff=malloc(sizeof(double)*m[i].ntrans[ipart]);
+        for(itrans=0;itrans<m[i].ntrans[ipart];itrans++){
+          for(itemp=0;itemp<ntemp[ipart];itemp++)
+            m[i].part[ipart].down[itemp*m[i].ntrans[ipart]+itrans]=part[ipart].colld[itrans*ntemp[ipart]+itemp];
+          m[i].part[ipart].gfac[itrans]=m[i].gstat[m[i].lcu[itrans]]/m[i].gstat[m[i].lcl[itrans]];
+          m[i].part[ipart].ediff[itrans]=HCKB*(m[i].eterm[m[i].lcu[itrans]]-m[i].eterm[m[i].lcl[itrans]]);
+        }
+        part[ipart].temp=NULL;
       }
-    }
 
-    for(id=0;id<par->ncell;id++){
-      for(ipart=0;ipart<m[i].npart;ipart++){
-        for(itrans=0;itrans<m[i].ntrans[ipart];itrans++){
-          if((g[id].t[0]>part[ipart].temp[0])&&(g[id].t[0]<part[ipart].temp[ntemp[ipart]-1])){
-            for(itemp=0;itemp<ntemp[ipart]-1;itemp++){
-              if((g[id].t[0]>part[ipart].temp[itemp])&&(g[id].t[0]<=part[ipart].temp[itemp+1])){
-                tnint=itemp;
+      ratesAlloc(par,m,g,i,0);
+      for(id=0;id<par->ncell;id++){
+        for(ipart=0;ipart<m[i].npart;ipart++){
+          rateTableBin(&m[i].part[ipart], g[id].t[0], &g[id].mol[i].partner[ipart].t_binlow, &g[id].mol[i].partner[ipart].interp_coeff);
+        }
+      }
+    } else {
+      ratesAlloc(par,m,g,i,1);
+
+      for(id=0;id<par->ncell;id++){
+        for(ipart=0;ipart<m[i].npart;ipart++){
+          for(itrans=0;itrans<m[i].ntrans[ipart];itrans++){
+            if((g[id].t[0]>part[ipart].temp[0])&&(g[id].t[0]<part[ipart].temp[ntemp[ipart]-1])){
+              for(itemp=0;itemp<ntemp[ipart]-1;itemp++){
+                if((g[id].t[0]>part[ipart].temp[itemp])&&(g[id].t[0]<=part[ipart].temp[itemp+1])){
+                  tnint=itemp;
+                }
               }
+              fac=(g[id].t[0]-part[ipart].temp[tnint])/(part[ipart].temp[tnint+1]-part[ipart].temp[tnint]);
+              downrate=part[ipart].colld[itrans*ntemp[ipart]+tnint]+fac*(part[ipart].colld[itrans*ntemp[ipart]+tnint+1]-part[ipart].colld[itrans*ntemp[ipart]+tnint]);
+            } else {
+              if(g[id].t[0]<=part[ipart].temp[0]) downrate=part[ipart].colld[itrans*ntemp[ipart]];
+              if(g[id].t[0]>=part[ipart].temp[ntemp[ipart]-1]) downrate=part[ipart].colld[itrans*ntemp[ipart]+ntemp[ipart]-1];
             }
-            fac=(g[id].t[0]-part[ipart].temp[tnint])/(part[ipart].temp[tnint+1]-part[ipart].temp[tnint]);
-            downrate=part[ipart].colld[itrans*ntemp[ipart]+tnint]+fac*(part[ipart].colld[itrans*ntemp[ipart]+tnint+1]-part[ipart].colld[itrans*ntemp[ipart]+tnint]);
-          } else {
-            if(g[id].t[0]<=part[ipart].temp[0]) downrate=part[ipart].colld[itrans*ntemp[ipart]];
-            if(g[id].t[0]>=part[ipart].temp[ntemp[ipart]-1]) downrate=part[ipart].colld[itrans*ntemp[ipart]+ntemp[ipart]-1];
+            uprate=m[i].gstat[m[i].lcu[itrans]]/m[i].gstat[m[i].lcl[itrans]]*downrate*exp(-HCKB*(m[i].eterm[m[i].lcu[itrans]]-m[i].eterm[m[i].lcl[itrans]])/g[id].t[0]);
+            g[id].mol[i].partner[ipart].up[itrans]=uprate;
+            g[id].mol[i].partner[ipart].down[itrans]=downrate;
           }
-          uprate=m[i].gstat[m[i].lcu[itrans]]/m[i].gstat[m[i].lcl[itrans]]*downrate*exp(-HCKB*(m[i].eterm[m[i].lcu[itrans]]-m[i].eterm[m[i].lcl[itrans]])/g[id].t[0]);
-          g[id].mol[i].partner[ipart].up[itrans]=uprate;
-          g[id].mol[i].partner[ipart].down[itrans]=downrate;
         }
       }
     }
     for(ipart=0;ipart<m[i].npart;ipart++){
-      free(part[ipart].colld);
-      free(part[ipart].temp);
+      if(part[ipart].temp!=NULL) free(part[ipart].temp);
     }
     free(ntemp);
     free(part);
     free(count);
   }
   /* End of collision rates */
+  freeLamda(&ld);
 
   /* Allocate space for populations and opacities */
-  for(id=0;id<par->ncell; id++){
-    g[id].mol[i].pops = malloc(sizeof(double)*m[i].nlev);
-    g[id].mol[i].dust = malloc(sizeof(double)*m[i].nline);
-    g[id].mol[i].knu  = malloc(sizeof(double)*m[i].nline);
-    for(ilev=0;ilev<m[i].nlev;ilev++) g[id].mol[i].pops[ilev]=0.0;
-  }
+  popsAllocSpecies(par,g,i,m[i].nlev,m[i].nline);
+
+  timerEnd(timer);
 
   /* Get dust opacities */
   kappa(m,g,par,i);
 }
 
+/* Recalculates everything molinit() derived from the grid fields (line widths, molecular densities, collision rate bins and dust opacities) for species i, after the model fields have changed, without reading the molecular data again. The collision rates must have been kept in tables (par->collRateTables). */
+void
+molUpdate(molData *m, inputPars *par, struct grid *g, int i){
+  int id,ipart;
+
+  lineWidths(m,par,g,i);
+
+  if(par->lte_only==0){
+    molDensity(m,par,g,i);
+    for(id=0;id<par->ncell;id++){
+      for(ipart=0;ipart<m[i].npart;ipart++)
+        rateTableBin(&m[i].part[ipart], g[id].t[0], &g[id].mol[i].partner[ipart].t_binlow, &g[id].mol[i].partner[ipart].interp_coeff);
+    }
+  }
+
+  kappa(m,g,par,i);
+}
 
+/* Sets up the per-point data of species i, whose molecular data molinit() has read for another grid, on grid g: room for the populations and opacities, the line widths and the dust opacities. The molecular densities are those already in the grid, and there are no collision rates. This is what the whole grid needs for the ray-tracer after a solution on subdomain grids (see subdomain.c). */
+void
+molGrid(molData *m, inputPars *par, struct grid *g, int i){
+  popsAllocSpecies(par,g,i,m[i].nlev,m[i].nline);
+  lineWidths(m,par,g,i);
+  kappa(m,g,par,i);
+}
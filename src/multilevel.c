@@ -0,0 +1,100 @@
+/*
+ *  multilevel.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Coarse-to-fine solution of the level populations (par->multilevel). Before the iterations on the full grid, the populations are solved on a coarse grid made of every par->multilevel'th grid point and all the sink points, with a triangulation and velocity splines of its own. Since the coarse points are a subset of the full grid, their model fields are simply copied. The coarse populations are then interpolated onto the full grid (see interppops.c), within the tetrahedra of the coarse triangulation itself, and levelPops iterates on the full grid only until the small scales have converged (see CONV_FRACTION and CONV_SNR in lime.h).
+
+The coarse solve is a complete levelPops() run on the coarse grid, with its own copy of the molecular data, and without any output. It is skipped when levelPops is about to resume from a checkpoint, whose populations would replace the coarse ones anyway. On a subdomain grid of an MPI run (see subdomain.c) the coarse grid is made from the whole grid, solved by all ranks together, and interpolated onto the subdomain grid.
+*/
+
+#include "lime.h"
+
+#define MIN_COARSE_POINTS 1000	/* smallest coarse grid worth solving */
+
+/* Copies the position and model fields of grid point src into the coarse grid point dst */
+static void
+copyPoint(inputPars *par, struct grid *dst, struct grid *src, int id){
+  dst->id=id;
+  memcpy(dst->x,   src->x,   sizeof(src->x));
+  memcpy(dst->vel, src->vel, sizeof(src->vel));
+  memcpy(dst->dens,src->dens,sizeof(double)*par->collPart);
+  memcpy(dst->abun,src->abun,sizeof(double)*par->nSpecies);
+  memcpy(dst->nmol,src->nmol,sizeof(double)*par->nSpecies);
+  dst->t[0]=src->t[0];
+  dst->t[1]=src->t[1];
+  dst->dopb=src->dopb;
+  dst->sink=src->sink;
+}
+
+/* Solves the populations on a grid of every par->multilevel'th point of g, or of its whole grid, and interpolates them onto g, whose molecular data m must be set up. Returns 0 if the coarse grid would be too small to be of use. With resume set nothing is solved, and the return value only tells whether the run that wrote the checkpoint did. */
+int
+coarsePops(molData *m, inputPars *par, struct grid *g, int resume){
+  inputPars cpar,wpar;
+  struct grid *cg,*wg;
+  struct cell *dc=NULL;
+  unsigned long numCells=0;
+  molData *mc;
+  double *oldPops;
+  int id,i,k,ispec,nlevTot=0,popsdone=0,timer;
+
+  wg=wholeGrid(par,g,&wpar);
+  cpar=wpar;
+  cpar.pIntensity=(wpar.pIntensity+par->multilevel-1)/par->multilevel;
+  cpar.ncell=cpar.pIntensity+wpar.sinkPoints;
+  if(cpar.pIntensity<MIN_COARSE_POINTS){
+    if(!silent) warning("The coarse grid of par->multilevel is too small; solving on the full grid only");
+    return 0;
+  }
+  if(resume) return 1;
+  timer=timerBegin("multilevel");
+
+  /* The coarse run has no output of its own, and does not recurse */
+  cpar.outputfile=NULL;
+  cpar.binoutputfile=NULL;
+  cpar.gridfile=NULL;
+  cpar.checkpoint=NULL;
+  cpar.initPops=NULL;
+  cpar.multilevel=0;
+  cpar.nImages=0;
+
+  gridAlloc(&cpar,&cg);
+  cpar.collPart=par->collPart;
+  for(id=0;id<cpar.pIntensity;id++) copyPoint(par, &cg[id], &wg[id*par->multilevel], id);
+  for(i=0;i<wpar.sinkPoints;i++) copyPoint(par, &cg[cpar.pIntensity+i], &wg[wpar.pIntensity+i], cpar.pIntensity+i);
+
+  qhull(&cpar, cg, &dc, &numCells);
+  distCalc(&cpar, cg);
+  if(par->doPregrid) getVelosplines_lin(&cpar, cg);
+  else getVelosplines(&cpar, cg);
+
+  mc=calloc(par->nSpecies, sizeof(molData));
+  timerEnd(timer);
+  levelPops(mc, &cpar, cg, &popsdone, 0);
+  timer=timerBegin("multilevel");
+
+  /* Interpolate onto the full grid, within the coarse tetrahedra; the sink points get no weight */
+  for(ispec=0;ispec<par->nSpecies;ispec++) nlevTot+=m[ispec].nlev;
+  oldPops=calloc((size_t)cpar.ncell*nlevTot, sizeof(double));
+  for(id=0;id<cpar.pIntensity;id++){
+    k=0;
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(i=0;i<m[ispec].nlev;i++) oldPops[(size_t)id*nlevTot+k+i]=cg[id].mol[ispec].pops[i];
+      k+=m[ispec].nlev;
+    }
+  }
+  interpolatePops(par, m, g, cpar.ncell, cg, oldPops, dc, numCells);
+
+  free(dc);
+  free(oldPops);
+  freeGrid(&cpar, mc, cg);
+  cpar.moldatfile=NULL;
+  freeInput(&cpar, NULL, mc);
+  timerEnd(timer);
+  return 1;
+}
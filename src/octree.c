@@ -0,0 +1,311 @@
+/*
+ *  octree.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Octree grids (par->octree), e.g. from AMR hydrodynamics. The par->pregrid file then lists the leaf cells of an octree, one per line:
+
+  id x y z size dens temp vx vy vz [dopb abun_1 ... abun_nSpecies]
+
+with the centre and the side of each cubic cell. Without the optional columns, the Doppler b and the abundances are those of doppler() and abundance() of the model at the centre of the cell. The cells are kept as cubes: each is a grid point at its centre, and the root cube is the smallest one around all cells, centred on the origin. A cell of level l (side 2L/2^l for a root of half side L) is found from its integer coordinates (l,ix,iy,iz) in a hash table, so the cell that contains a point is found with one lookup per level, independent of the number of cells.
+
+No triangulation is needed. The neighbours of a cell, which the velocity splines join, are the cells that touch it across its 6 faces, 12 edges and 8 corners, whatever their level: each cell looks just beyond its faces, edges and corners, and every neighbour found is also made a neighbour of the cell that found it, which gives a coarse cell all the finer cells along its faces. Beyond the faces of the root cube sink points are placed, one per boundary face of a cell.
+
+traceray() and photon() cross the cells with the slab method: the distance to the exit face of a cube along the ray is the smallest of the distances to its three exit planes, and the next cell is the one that contains the exit point (octreeStep()).
+*/
+
+#include "lime.h"
+
+#define OCTREE_MAX_LEVEL 19	/* the cell coordinates are packed 19 bits each in the hash key */
+#define OCTREE_COLUMNS   10	/* columns of a cell line without the optional dopb and abundances */
+
+static struct {
+  double half;			/* half side L of the root cube */
+  int maxLevel;
+  int *level;			/* level of each cell */
+  unsigned long long *keys;	/* hash table of the cells, open addressing */
+  int *ids;
+  unsigned long long mask;
+} tree={0.,0,NULL,NULL,NULL,0};
+
+static unsigned long long
+cellKey(int l, unsigned long long ix, unsigned long long iy, unsigned long long iz){
+  return ((unsigned long long)(l+1)<<57) | (ix<<38) | (iy<<19) | iz;
+}
+
+static unsigned long long
+hashSlot(unsigned long long key){
+  key^=key>>33;
+  key*=0xff51afd7ed558ccdULL;
+  key^=key>>33;
+  return key&tree.mask;
+}
+
+static void
+hashInsert(unsigned long long key, int id){
+  unsigned long long s=hashSlot(key);
+
+  while(tree.keys[s]!=0) s=(s+1)&tree.mask;
+  tree.keys[s]=key;
+  tree.ids[s]=id;
+}
+
+static int
+hashFind(unsigned long long key){
+  unsigned long long s=hashSlot(key);
+
+  while(tree.keys[s]!=0){
+    if(tree.keys[s]==key) return tree.ids[s];
+    s=(s+1)&tree.mask;
+  }
+  return -1;
+}
+
+static double
+cellHalf(int id){
+  return tree.half/(double)(1<<tree.level[id]);
+}
+
+/* Leaf cell that contains x, or -1 outside the root cube */
+int
+octreeLocate(const double *x){
+  int l,k,id;
+  unsigned long long ic[3];
+  double u;
+
+  for(k=0;k<3;k++) if(fabs(x[k])>=tree.half) return -1;
+  for(l=0;l<=tree.maxLevel;l++){
+    for(k=0;k<3;k++){
+      u=(x[k]+tree.half)/(2.*tree.half)*(double)(1<<l);
+      ic[k]=(unsigned long long)u;
+    }
+    if((id=hashFind(cellKey(l,ic[0],ic[1],ic[2])))>=0) return id;
+  }
+  return -1;
+}
+
+/* Adds b to the neighbours of a, unless it is there; the list grows as needed, since a coarse cell can touch any number of finer ones */
+static void
+addNeigh(int *nNeigh, int *maxNeigh, int **neigh, int a, int b){
+  int k;
+
+  for(k=0;k<nNeigh[a];k++) if(neigh[a][k]==b) return;
+  if(nNeigh[a]==maxNeigh[a]){
+    maxNeigh[a]=(maxNeigh[a]>0) ? 2*maxNeigh[a] : 32;
+    neigh[a]=realloc(neigh[a],sizeof(int)*maxNeigh[a]);
+  }
+  neigh[a][nNeigh[a]++]=b;
+}
+
+/* Reads the leaf cells of par->pregrid and sets up the grid, its neighbours and sink points, without qhull */
+void
+octreeGrid(inputPars *par, struct grid **gp, struct cell **dc, unsigned long *numCells){
+  FILE *fp;
+  struct grid *g;
+  int i,k,id,nb,n,nSink,maxSink,d[3],nd,**neigh,*nNeigh,*maxNeigh,nCol,nRead,pos,fromFile;
+  double *cell,(*sinkX)[DIM],p[3],h,u;
+  unsigned long long ic[3],size;
+  char line[4096];
+
+  if((fp=fopen(par->pregrid,"r"))==NULL){
+    if(!silent) bail_out("Error opening the octree grid file");
+    exit(1);
+  }
+  n=0;
+  while(fgets(line,sizeof(line),fp)!=NULL) n++;
+  rewind(fp);
+
+  /* Cell i is cell[i*nCol..], with the dopb and abundances in the last 1+nSpecies columns if the file has them */
+  nCol=OCTREE_COLUMNS+1+par->nSpecies;
+  cell=malloc(sizeof(double)*nCol*n);
+  fromFile=-1;
+  for(i=0;i<n;i++){
+    if(fgets(line,sizeof(line),fp)==NULL){
+      if(!silent) bail_out("Reading Grid File error");
+      exit(1);
+    }
+    for(nRead=0,pos=0;nRead<nCol && sscanf(line+pos,"%lf%n",&cell[i*nCol+nRead],&k)==1;nRead++) pos+=k;
+    if(fromFile<0) fromFile=(nRead==nCol);
+    if(nRead!=(fromFile ? nCol : OCTREE_COLUMNS) || cell[i*nCol+4]<=0.){
+      if(!silent) bail_out("Reading Grid File error");
+      exit(1);
+    }
+  }
+  fclose(fp);
+
+  /* The root cube, and the level and position of each cell in it */
+  tree.half=0.;
+  for(i=0;i<n;i++) for(k=0;k<3;k++) tree.half=gsl_max(tree.half,fabs(cell[i*nCol+k+1])+cell[i*nCol+4]/2.);
+  tree.maxLevel=0;
+  tree.level=malloc(sizeof(int)*n);
+  for(size=1;size<2*(unsigned long long)n;size<<=1);
+  tree.mask=size-1;
+  tree.keys=calloc(size,sizeof(unsigned long long));
+  tree.ids=malloc(sizeof(int)*size);
+  for(i=0;i<n;i++){
+    tree.level[i]=(int)floor(log2(2.*tree.half/cell[i*nCol+4])+0.5);
+    if(tree.level[i]<0 || tree.level[i]>OCTREE_MAX_LEVEL){
+      if(!silent) bail_out("Error: octree cell size out of range");
+      exit(1);
+    }
+    tree.maxLevel=gsl_max(tree.maxLevel,tree.level[i]);
+    for(k=0;k<3;k++){
+      u=(cell[i*nCol+k+1]+tree.half)/(2.*tree.half)*(double)(1<<tree.level[i]);
+      ic[k]=(unsigned long long)u;
+      if(fabs(u-ic[k]-0.5)>1e-3){
+        if(!silent) bail_out("Error: the octree cells are not aligned with a common root cube");
+        exit(1);
+      }
+    }
+    hashInsert(cellKey(tree.level[i],ic[0],ic[1],ic[2]),i);
+  }
+
+  /* Neighbours across faces, edges and corners, and the sinks beyond the faces of the root cube */
+  maxSink=n;
+  neigh=calloc(n+maxSink,sizeof(int *));
+  nNeigh=calloc(n+maxSink,sizeof(int));
+  maxNeigh=calloc(n+maxSink,sizeof(int));
+  sinkX=malloc(sizeof(*sinkX)*maxSink);
+  nSink=0;
+  for(i=0;i<n;i++){
+    h=cellHalf(i);
+    for(d[0]=-1;d[0]<=1;d[0]++) for(d[1]=-1;d[1]<=1;d[1]++) for(d[2]=-1;d[2]<=1;d[2]++){
+      nd=abs(d[0])+abs(d[1])+abs(d[2]);
+      if(nd==0) continue;
+      for(k=0;k<3;k++) p[k]=cell[i*nCol+k+1]+d[k]*h*(1.+1e-6);
+      if((nb=octreeLocate(p))>=0 && nb!=i){
+        addNeigh(nNeigh,maxNeigh,neigh,i,nb);
+        addNeigh(nNeigh,maxNeigh,neigh,nb,i);
+      } else if(nb<0 && nd==1){
+        /* A sink is the mirror image of the cell in its face on the root cube */
+        if(nSink==maxSink){
+          maxSink*=2;
+          neigh=realloc(neigh,sizeof(int *)*(n+maxSink));
+          nNeigh=realloc(nNeigh,sizeof(int)*(n+maxSink));
+          maxNeigh=realloc(maxNeigh,sizeof(int)*(n+maxSink));
+          sinkX=realloc(sinkX,sizeof(*sinkX)*maxSink);
+        }
+        for(k=0;k<3;k++) sinkX[nSink][k]=cell[i*nCol+k+1]+2.*d[k]*h;
+        neigh[n+nSink]=NULL;
+        nNeigh[n+nSink]=0;
+        maxNeigh[n+nSink]=0;
+        addNeigh(nNeigh,maxNeigh,neigh,i,n+nSink);
+        addNeigh(nNeigh,maxNeigh,neigh,n+nSink,i);
+        nSink++;
+      }
+    }
+  }
+
+  par->pIntensity=n;
+  par->sinkPoints=nSink;
+  par->ncell=n+nSink;
+  par->radius=sqrt(3.)*tree.half;
+  par->radiusSqu=par->radius*par->radius;
+  gridAlloc(par,gp);
+  g=*gp;
+
+  for(id=0;id<par->ncell;id++){
+    g[id].id=id;
+    if(id<n){
+      for(k=0;k<3;k++) g[id].x[k]=cell[id*nCol+k+1];
+      g[id].dens[0]=cell[id*nCol+5];
+      g[id].t[0]=cell[id*nCol+6];
+      g[id].t[1]=g[id].t[0];
+      for(k=0;k<3;k++) g[id].vel[k]=cell[id*nCol+k+7];
+      if(fromFile){
+        g[id].dopb=cell[id*nCol+OCTREE_COLUMNS];
+        for(k=0;k<par->nSpecies;k++) g[id].abun[k]=cell[id*nCol+OCTREE_COLUMNS+1+k];
+      } else {
+        doppler(    g[id].x[0],g[id].x[1],g[id].x[2],&g[id].dopb);
+        abundance(  g[id].x[0],g[id].x[1],g[id].x[2], g[id].abun);
+      }
+      for(k=0;k<par->nSpecies;k++) g[id].nmol[k]=g[id].abun[k]*g[id].dens[0];
+      g[id].sink=0;
+    } else {
+      for(k=0;k<3;k++) g[id].x[k]=sinkX[id-n][k];
+      g[id].sink=1;
+      for(k=0;k<par->nSpecies;k++){
+        g[id].abun[k]=0.;
+        g[id].nmol[k]=0.;
+      }
+      g[id].dens[0]=1e-30;
+      g[id].t[0]=par->tcmb;
+      g[id].t[1]=par->tcmb;
+      g[id].dopb=0.;
+    }
+    g[id].numNeigh=nNeigh[id];
+    g[id].neigh=malloc(sizeof(struct grid *)*nNeigh[id]);
+    for(k=0;k<nNeigh[id];k++) g[id].neigh[k]=&g[neigh[id][k]];
+    free(neigh[id]);
+  }
+  free(cell);
+  free(sinkX);
+  free(neigh);
+  free(nNeigh);
+  free(maxNeigh);
+
+  /* No Delaunay cells to write to the grid file */
+  free(*dc);
+  *dc=NULL;
+  *numCells=0;
+
+  distCalc(par,g);
+  getVelosplines_lin(par,g);
+}
+
+/* Moves x along the ray dx to where it enters the root cube, adding the distance to *col, and returns the cell there; -1 if the ray misses the cube */
+int
+octreeEnter(double *x, const double *dx, double *col){
+  double tmin=0.,tmax=1e300,t1,t2;
+  int k;
+
+  for(k=0;k<3;k++){
+    if(fabs(dx[k])<1e-300){
+      if(fabs(x[k])>=tree.half) return -1;
+      continue;
+    }
+    t1=(-tree.half-x[k])/dx[k];
+    t2=( tree.half-x[k])/dx[k];
+    tmin=gsl_max(tmin,gsl_min(t1,t2));
+    tmax=gsl_min(tmax,gsl_max(t1,t2));
+  }
+  if(tmax<=tmin) return -1;
+  for(k=0;k<3;k++) x[k]+=tmin*dx[k];
+  *col+=tmin;
+  for(k=0;k<3;k++) x[k]+=1e-9*tree.half*dx[k];
+  *col+=1e-9*tree.half;
+  return octreeLocate(x);
+}
+
+/* Distance *ds from x to where the ray dx leaves cell posn, and the cell *nposn it enters there (-1 outside the root cube) */
+void
+octreeStep(struct grid *g, int posn, const double *x, const double *dx, double *ds, int *nposn){
+  double h=cellHalf(posn),t,p[3];
+  int k;
+
+  *ds=1e300;
+  for(k=0;k<3;k++){
+    if(dx[k]>1e-300) t=(g[posn].x[k]+h-x[k])/dx[k];
+    else if(dx[k]<-1e-300) t=(g[posn].x[k]-h-x[k])/dx[k];
+    else continue;
+    if(t<*ds) *ds=t;
+  }
+  *ds=gsl_max(*ds,0.);
+  for(k=0;k<3;k++) p[k]=x[k]+(*ds+1e-6*h)*dx[k];
+  *nposn=octreeLocate(p);
+}
+
+void
+octreeFree(){
+  free(tree.level);
+  free(tree.keys);
+  free(tree.ids);
+  tree.level=NULL;
+  tree.keys=NULL;
+  tree.ids=NULL;
+}
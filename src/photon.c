@@ -49,10 +49,21 @@ sortangles(double *inidir, int id, struct grid *g, const gsl_rng *ran) {
 
 
 
+/* Sum of w[i]*exp(-(v[i]*binv)^2) over the n sub-samples buffered by the velocity splines */
+static double
+gaussSum(const double *v, const double *w, int n, double binv){
+  double y[VEC_BLOCK],sum=0.;
+  int i;
+
+  vecGauss(v,binv,y,n);
+  for(i=0;i<n;i++) sum+=w[i]*y[i];
+  return sum;
+}
+
 void
 velocityspline(struct grid *g, int id, int k, double binv, double deltav, double *vfac){
-  int nspline,ispline,naver,iaver;
-  double v1,v2,s1,s2,sd,v,vfacsub,d;
+  int nspline,ispline,naver,iaver,nsamples=0,nbuf=0;
+  double v1,v2,s1,s2,sd,vbuf[VEC_BLOCK],wbuf[VEC_BLOCK];
   
   v1=deltav-veloproject(g[id].dir[k].xn,g[id].vel);
   v2=deltav-veloproject(g[id].dir[k].xn,g[id].neigh[k]->vel);
@@ -66,26 +77,32 @@ velocityspline(struct grid *g, int id, int k, double binv, double deltav, double
     s1=s2;
     s2=((double)(ispline+1))/(double)nspline;
     v1=v2;
-    d=s2*g[id].ds[k];
-    v2=deltav-((((g[id].a4[k]*d+g[id].a3[k])*d+g[id].a2[k])*d+g[id].a1[k])*d+g[id].a0[k]);
+    v2=deltav-((((g[id].a4[k]*s2+g[id].a3[k])*s2+g[id].a2[k])*s2+g[id].a1[k])*s2+g[id].a0[k]);
     naver=(1 > fabs(v1-v2)*binv) ? 1 : (int)(fabs(v1-v2)*binv);
     for(iaver=0;iaver<naver;iaver++){
       sd=s1+(s2-s1)*((double)iaver+0.5)/(double)naver;
-      d=sd*g[id].ds[k];
-      v=deltav-((((g[id].a4[k]*d+g[id].a3[k])*d+g[id].a2[k])*d+g[id].a1[k])*d+g[id].a0[k]);
-      vfacsub=gaussline(v,binv);
-      *vfac+=vfacsub/(double)naver;
+      vbuf[nbuf]=deltav-((((g[id].a4[k]*sd+g[id].a3[k])*sd+g[id].a2[k])*sd+g[id].a1[k])*sd+g[id].a0[k]);
+      wbuf[nbuf]=1./(double)naver;
+      if(++nbuf==VEC_BLOCK){
+        *vfac+=gaussSum(vbuf,wbuf,nbuf,binv);
+        nbuf=0;
+      }
     }
+    nsamples+=naver;
   }
+  *vfac+=gaussSum(vbuf,wbuf,nbuf,binv);
   *vfac= *vfac/(double)nspline;
+  COUNT(CNT_SPLINE_CALLS, 1);
+  COUNT(CNT_SPLINE_SAMPLES, nsamples);
+  HIST(HIST_SPLINE_SAMPLES, nsamples);
   return;
 }
 
 
 void
 velocityspline_lin(struct grid *g, int id, int k, double binv, double deltav, double *vfac){
-  int nspline,ispline,naver,iaver;
-  double v1,v2,s1,s2,sd,v,vfacsub,d;
+  int nspline,ispline,naver,iaver,nsamples=0,nbuf=0;
+  double v1,v2,s1,s2,sd,vbuf[VEC_BLOCK],wbuf[VEC_BLOCK];
   
   v1=deltav-veloproject(g[id].dir[k].xn,g[id].vel);
   v2=deltav-veloproject(g[id].dir[k].xn,g[id].neigh[k]->vel);
@@ -99,18 +116,24 @@ velocityspline_lin(struct grid *g, int id, int k, double binv, double deltav, do
     s1=s2;
     s2=((double)(ispline+1))/(double)nspline;
     v1=v2;
-    d=s2*g[id].ds[k];
-    v2=deltav-(g[id].a1[k]*d+g[id].a0[k]);
+    v2=deltav-(g[id].a1[k]*s2+g[id].a0[k]);
     naver=(1 > fabs(v1-v2)*binv) ? 1 : (int)(fabs(v1-v2)*binv);
     for(iaver=0;iaver<naver;iaver++){
       sd=s1+(s2-s1)*((double)iaver+0.5)/(double)naver;
-      d=sd*g[id].ds[k];
-      v=deltav-(g[id].a1[k]*d+g[id].a0[k]);
-      vfacsub=gaussline(v,binv);
-      *vfac+=vfacsub/(double)naver;
+      vbuf[nbuf]=deltav-(g[id].a1[k]*sd+g[id].a0[k]);
+      wbuf[nbuf]=1./(double)naver;
+      if(++nbuf==VEC_BLOCK){
+        *vfac+=gaussSum(vbuf,wbuf,nbuf,binv);
+        nbuf=0;
+      }
     }
+    nsamples+=naver;
   }
+  *vfac+=gaussSum(vbuf,wbuf,nbuf,binv);
   *vfac= *vfac/(double)nspline;
+  COUNT(CNT_SPLINE_CALLS, 1);
+  COUNT(CNT_SPLINE_SAMPLES, nsamples);
+  HIST(HIST_SPLINE_SAMPLES, nsamples);
   return;
 }
 
@@ -123,11 +146,8 @@ double gaussline(double v, double oneOnSigma){
   double val;
 
   val = v*v*oneOnSigma*oneOnSigma;
-#ifdef FASTEXP
-  return FastExp(val);
-#else
-  return exp(-val);
-#endif
+  if(limeOpts.fastExp) return FastExp(val);
+  else return exp(-val);
 }
 
 
@@ -145,168 +165,287 @@ void calcSourceFn(double dTau, const inputPars *par, double *remnantSnu, double
   exp(-dTau) by its Taylor expansion to 3rd order.
   */
 
-#ifdef FASTEXP
-  *expDTau = FastExp(dTau);
-  if (fabs(dTau)<par->taylorCutoff){
-    *remnantSnu = 1. - dTau*(1. - dTau/3.)/2.;
-  } else {
-    *remnantSnu = (1.-(*expDTau))/dTau;
-  }
-#else
-  if (fabs(dTau)<par->taylorCutoff){
-    *remnantSnu = 1. - dTau*(1. - dTau/3.)/2.;
-    *expDTau = 1. - dTau*(*remnantSnu);
+  if(limeOpts.fastExp){
+    *expDTau = FastExp(dTau);
+    if (fabs(dTau)<par->taylorCutoff){
+      *remnantSnu = 1. - dTau*(1. - dTau/3.)/2.;
+    } else {
+      *remnantSnu = (1.-(*expDTau))/dTau;
+    }
   } else {
-    *expDTau = exp(-dTau);
-    *remnantSnu = (1.-(*expDTau))/dTau;
+    if (fabs(dTau)<par->taylorCutoff){
+      *remnantSnu = 1. - dTau*(1. - dTau/3.)/2.;
+      *expDTau = 1. - dTau*(*remnantSnu);
+    } else {
+      *expDTau = exp(-dTau);
+      *remnantSnu = (1.-(*expDTau))/dTau;
+    }
   }
-#endif
 }
 
 
+/* Line profile in octree cell here, whose velocity is that of its centre throughout, along the direction dx of the photon (as in traceray()) */
+static double
+cellProfile(struct grid *g, int here, double *dx, double binv, double deltav){
+  return gaussline(deltav-veloproject(dx,g[here].vel),binv);
+}
+
+/* Room for the state of a photon and the source functions of its steps, for the lines of all species */
 void
-photon(int id, struct grid *g, molData *m, int iter, const gsl_rng *ran,inputPars *par,blend *matrix, gridPointData *mp, double *halfFirstDs){
-  int iphot,iline,jline,here,there,firststep,dir,np_per_line,ip_at_line,l;
-  int *counta, *countb,nlinetot;
-  double deltav,segment,vblend,dtau,expDTau,jnu,alpha,ds,vfac[par->nSpecies],pt_theta,pt_z,semiradius;
-  double *tau,*expTau,x[3],inidir[3];
-  double remnantSnu;
+photonAlloc(inputPars *par, molData *m, photonState *p){
+  lineCount(par->nSpecies, m, &p->counta, &p->countb, &p->nlinetot);
+  p->binv=malloc(sizeof(double)*par->nSpecies);
+  p->tau=malloc(sizeof(double)*p->nlinetot);
+  p->expTau=malloc(sizeof(double)*p->nlinetot);
+  /* The source function of all lines of a step is evaluated in one call of the vector kernel. The intensity of each photon is summed in phot (double) and stored in mp[0].phot (storeReal) at the end. */
+  p->dtauLine=malloc(sizeof(double)*5*p->nlinetot);
+  p->jnuLine=p->dtauLine+p->nlinetot;
+  p->remnantLine=p->jnuLine+p->nlinetot;
+  p->expDTauLine=p->remnantLine+p->nlinetot;
+  p->phot=p->expDTauLine+p->nlinetot;
+}
+
+void
+photonFree(photonState *p){
+  free(p->dtauLine);
+  free(p->expTau);
+  free(p->tau);
+  free(p->binv);
+  free(p->counta);
+  free(p->countb);
+}
+
+/* Sends photon iphot of grid point id off in a random direction, with a velocity offset from the line centre in the segment of iphot; it starts along the Delaunay edge p->dir */
+void
+photonLaunch(int id, int iphot, struct grid *g, const gsl_rng *ran, inputPars *par, photonState *p){
+  int iline,iter,np_per_line,ip_at_line,l;
+  double segment,pt_theta,pt_z,semiradius;
 
-  lineCount(par->nSpecies, m, &counta, &countb, &nlinetot);
-  tau=malloc(sizeof(*tau)*nlinetot);
-  expTau=malloc(sizeof(*expTau)*nlinetot);
-  
   np_per_line=(int) g[id].nphot/g[id].numNeigh; // Works out to be equal to ininphot. :-/
 
-  for(iphot=0;iphot<g[id].nphot;iphot++){
-    firststep=1;
-    for(iline=0;iline<nlinetot;iline++){
-      mp[0].phot[iline+iphot*m[0].nline]=0.;
-      tau[iline]=0.;
-      expTau[iline]=1.;
-    }
-    
-    /* Initial velocity, direction and frequency offset  */		
-    pt_theta=gsl_rng_uniform(ran)*2*PI;
-    pt_z=2*gsl_rng_uniform(ran)-1;
-    semiradius = sqrt(1.-pt_z*pt_z);
-    inidir[0]=semiradius*cos(pt_theta);
-    inidir[1]=semiradius*sin(pt_theta);
-    inidir[2]=pt_z;
-    
-    iter=(int) (gsl_rng_uniform(ran)*(double)N_RAN_PER_SEGMENT); // can have values in [0,1,..,N_RAN_PER_SEGMENT-1]
-    ip_at_line=(int) iphot/g[id].numNeigh;
-    segment=(N_RAN_PER_SEGMENT*(ip_at_line-np_per_line/2.)+iter)/(double)(np_per_line*N_RAN_PER_SEGMENT);
-    /*
-    Values of segment should be evenly distributed (considering the
-    entire ensemble of photons) between -0.5 and +0.5, and are chosen
-    from a sequence of possible values separated by
-    1/(N_RAN_PER_SEGMENT*ininphot).
-    */
-    
-    dir=sortangles(inidir,id,g,ran);
-    here=g[id].id;
-    there=g[here].neigh[dir]->id;
-    deltav=segment*4.3*g[id].dopb+veloproject(g[id].dir[dir].xn,g[id].vel);
-    
-    /* Photon propagation loop */
-    do{
+  for(iline=0;iline<p->nlinetot;iline++){
+    p->phot[iline]=0.;
+    p->tau[iline]=0.;
+    p->expTau[iline]=1.;
+  }
+  for(l=0;l<par->nSpecies;l++) p->binv[l]=g[id].mol[l].binv;
+  p->nsteps=0;
+
+  /* Initial velocity, direction and frequency offset  */		
+  pt_theta=gsl_rng_uniform(ran)*2*PI;
+  pt_z=2*gsl_rng_uniform(ran)-1;
+  semiradius = sqrt(1.-pt_z*pt_z);
+  p->inidir[0]=semiradius*cos(pt_theta);
+  p->inidir[1]=semiradius*sin(pt_theta);
+  p->inidir[2]=pt_z;
+
+  iter=(int) (gsl_rng_uniform(ran)*(double)N_RAN_PER_SEGMENT); // can have values in [0,1,..,N_RAN_PER_SEGMENT-1]
+  ip_at_line=(int) iphot/g[id].numNeigh;
+  segment=(N_RAN_PER_SEGMENT*(ip_at_line-np_per_line/2.)+iter)/(double)(np_per_line*N_RAN_PER_SEGMENT);
+  /*
+  Values of segment should be evenly distributed (considering the
+  entire ensemble of photons) between -0.5 and +0.5, and are chosen
+  from a sequence of possible values separated by
+  1/(N_RAN_PER_SEGMENT*ininphot).
+  */
+
+  if(par->octree){
+    p->dir=-1;
+    p->here=id;
+    for(l=0;l<3;l++) p->x[l]=g[id].x[l];
+    p->deltav=segment*4.3*g[id].dopb+veloproject(p->inidir,g[id].vel);
+  } else {
+    p->dir=sortangles(p->inidir,id,g,ran);
+    p->here=g[id].id;
+    p->there=g[p->here].neigh[p->dir]->id;
+    p->deltav=segment*4.3*g[id].dopb+veloproject(g[id].dir[p->dir].xn,g[id].vel);
+  }
+}
+
+/*
+In an octree grid (par->octree) the photons cross the cells through their faces, as the rays of traceray() do, instead of walking from grid point to grid point: each step is the chord of a cube from the point where the photon entered it, found by octreeStep(), and the first one starts at the centre of cell id. The photons leave the model where they leave the root cube.
+
+In a Delaunay grid a photon steps from p->here along edge p->dir to p->there, and goes on from there until the next point would be a sink point. The first step, from the point that sent the photon (firststep), is only half an edge long; its length and line profiles are kept for stateq() in halfFirstDs[iphot] and mp[].vfac[iphot]. Returns 1 once the photon has left the model, and 0 if it has come to a grid point whose edges this grid does not hold, p->here, i.e. a halo point of a subdomain grid (see subdomain.c), from where it has to be continued by the rank of that point.
+*/
+int
+photonTrace(photonState *p, int firststep, int iphot, struct grid *g, molData *m, const gsl_rng *ran, inputPars *par, blend *matrix, gridPointData *mp, double *halfFirstDs){
+  int iline,jline,here,there,dir,l;
+  double vblend,dtau,expDTau,jnu,alpha,ds,vfac[par->nSpecies];
+  double remnantSnu,*tau=p->tau,*expTau=p->expTau,*x=p->x,*inidir=p->inidir,deltav=p->deltav;
+  int *counta=p->counta,*countb=p->countb,nlinetot=p->nlinetot;
+
+  here=p->here;
+  there=p->there;
+  dir=p->dir;
+  
+  /* Photon propagation loop */
+  do{
+    p->nsteps++;
+    if(par->octree){
+      octreeStep(g,here,x,inidir,&ds,&there);
+      for(l=0;l<par->nSpecies;l++) vfac[l]=cellProfile(g,here,inidir,g[here].mol[l].binv,deltav);
       if(firststep){
-        firststep=0;				
-        ds=g[here].ds[dir]/2.;
+        firststep=0;
         halfFirstDs[iphot]=ds;
-        for(l=0;l<par->nSpecies;l++){
-          if(!par->doPregrid) velocityspline(g,here,dir,g[id].mol[l].binv,deltav,&vfac[l]);
-          else velocityspline_lin(g,here,dir,g[id].mol[l].binv,deltav,&vfac[l]);
-          mp[l].vfac[iphot]=vfac[0];
-        }
-        for(l=0;l<3;l++) x[l]=g[here].x[l]+(g[here].dir[dir].xn[l] * g[id].ds[dir]/2.);
-      } else {
-        ds=g[here].ds[dir];
-        for(l=0;l<3;l++) x[l]=g[here].x[l];
+        for(l=0;l<par->nSpecies;l++) mp[l].vfac[iphot]=vfac[l];
       }
-      
+    } else if(firststep){
+      firststep=0;				
+      ds=g[here].ds[dir]/2.;
+      halfFirstDs[iphot]=ds;
       for(l=0;l<par->nSpecies;l++){
-        if(!par->doPregrid) velocityspline(g,here,dir,g[id].mol[l].binv,deltav,&vfac[l]);
-        else velocityspline_lin(g,here,dir,g[id].mol[l].binv,deltav,&vfac[l]);
+        if(!par->doPregrid) velocityspline(g,here,dir,p->binv[l],deltav,&vfac[l]);
+        else velocityspline_lin(g,here,dir,p->binv[l],deltav,&vfac[l]);
+        mp[l].vfac[iphot]=vfac[0];
+      }
+      for(l=0;l<3;l++) x[l]=g[here].x[l]+(g[here].dir[dir].xn[l] * g[here].ds[dir]/2.);
+    } else {
+      ds=g[here].ds[dir];
+      for(l=0;l<3;l++) x[l]=g[here].x[l];
+    }
+    
+    if(!par->octree){
+      for(l=0;l<par->nSpecies;l++){
+        if(!par->doPregrid) velocityspline(g,here,dir,p->binv[l],deltav,&vfac[l]);
+        else velocityspline_lin(g,here,dir,p->binv[l],deltav,&vfac[l]);
+      }
+    }
+    
+    for(iline=0;iline<nlinetot;iline++){
+      jnu=0.;
+      alpha=0.;
+      
+      sourceFunc_line(&jnu,&alpha,m,vfac[counta[iline]],g,here,counta[iline],countb[iline]);
+      sourceFunc_cont(&jnu,&alpha,g,here,counta[iline],countb[iline]);
+
+      dtau=alpha*ds;
+      if(dtau < -30) dtau = -30;
+      p->dtauLine[iline]=dtau;
+      p->jnuLine[iline]=jnu;
+    }
+    vecSourceFn(p->dtauLine, par->taylorCutoff, p->remnantLine, p->expDTauLine, nlinetot);
+
+    for(iline=0;iline<nlinetot;iline++){
+      dtau=p->dtauLine[iline];
+      remnantSnu=p->remnantLine[iline]*p->jnuLine[iline]*m[0].norminv*ds;
+
+      p->phot[iline]+=expTau[iline]*remnantSnu;
+      tau[iline]+=dtau;
+      expTau[iline]*=p->expDTauLine[iline];
+      if(tau[iline] < -30.){
+        COUNT(CNT_MASER_CLAMPS, 1);
+        if(!silent) warning("Maser warning: optical depth has dropped below -30");
+        tau[iline]= -30.; 
+        expTau[iline]=exp(-tau[iline]);
       }
       
-      for(iline=0;iline<nlinetot;iline++){
+      /* Line blending part */
+      if(par->blend){
         jnu=0.;
         alpha=0.;
-        
-        sourceFunc_line(&jnu,&alpha,m,vfac[counta[iline]],g,here,counta[iline],countb[iline]);
-        sourceFunc_cont(&jnu,&alpha,g,here,counta[iline],countb[iline]);
-
-        dtau=alpha*ds;
-        if(dtau < -30) dtau = -30;
-        calcSourceFn(dtau, par, &remnantSnu, &expDTau);
-        remnantSnu *= jnu*m[0].norminv*ds;
-
-        mp[0].phot[iline+iphot*m[0].nline]+=expTau[iline]*remnantSnu;
-        tau[iline]+=dtau;
-        expTau[iline]*=expDTau;
-        if(tau[iline] < -30.){
-          if(!silent) warning("Maser warning: optical depth has dropped below -30");
-          tau[iline]= -30.; 
-          expTau[iline]=exp(-tau[iline]);
-        }
-        
-        /* Line blending part */
-        if(par->blend){
-          jnu=0.;
-          alpha=0.;
-          for(jline=0;jline<sizeof(matrix)/sizeof(blend);jline++){
-            if(matrix[jline].line1 == jline || matrix[jline].line2 == jline){	
-              if(!par->doPregrid) velocityspline(g,here,dir,g[id].mol[counta[jline]].binv,deltav-matrix[jline].deltav,&vblend);
-              else velocityspline_lin(g,here,dir,g[id].mol[counta[jline]].binv,deltav-matrix[jline].deltav,&vblend);	
-              sourceFunc_line(&jnu,&alpha,m,vblend,g,here,counta[jline],countb[jline]);
-              dtau=alpha*ds;
-              if(dtau < -30) dtau = -30;
-              calcSourceFn(dtau, par, &remnantSnu, &expDTau);
-              remnantSnu *= jnu*m[0].norminv*ds;
-
-              mp[0].phot[jline+iphot*m[0].nline]+=expTau[jline]*remnantSnu;
-              tau[jline]+=dtau;
-              expTau[jline]*=expDTau;
-              if(tau[jline] < -30.){
-                if(!silent) warning("Optical depth has dropped below -30");
-                tau[jline]= -30.; 
-                expTau[jline]=exp(-tau[jline]);
-              }
+        for(jline=0;jline<sizeof(matrix)/sizeof(blend);jline++){
+          if(matrix[jline].line1 == jline || matrix[jline].line2 == jline){	
+            if(par->octree) vblend=cellProfile(g,here,inidir,g[here].mol[counta[jline]].binv,deltav-matrix[jline].deltav);
+            else if(!par->doPregrid) velocityspline(g,here,dir,p->binv[counta[jline]],deltav-matrix[jline].deltav,&vblend);
+            else velocityspline_lin(g,here,dir,p->binv[counta[jline]],deltav-matrix[jline].deltav,&vblend);	
+            sourceFunc_line(&jnu,&alpha,m,vblend,g,here,counta[jline],countb[jline]);
+            dtau=alpha*ds;
+            if(dtau < -30) dtau = -30;
+            calcSourceFn(dtau, par, &remnantSnu, &expDTau);
+            remnantSnu *= jnu*m[0].norminv*ds;
+
+            p->phot[jline]+=expTau[jline]*remnantSnu;
+            tau[jline]+=dtau;
+            expTau[jline]*=expDTau;
+            if(tau[jline] < -30.){
+              COUNT(CNT_MASER_CLAMPS, 1);
+              if(!silent) warning("Optical depth has dropped below -30");
+              tau[jline]= -30.; 
+              expTau[jline]=exp(-tau[jline]);
             }
           }
         }
-        /* End of line blending part */
       }
-      
+      /* End of line blending part */
+    }
+    
+    if(par->octree){
+      for(l=0;l<3;l++) x[l]+=ds*inidir[l];
+      here=there;
+    } else {
+      if(g[there].numNeigh==0 && !g[there].sink){
+        p->here=there;
+        return 0;
+      }
       dir=sortangles(inidir,there,g,ran);
       here=there;
       there=g[here].neigh[dir]->id;
-    } while(!g[there].sink);
-    
-    /* Add cmb contribution */
-    if(m[0].cmb[0]>0.){
-      for(iline=0;iline<nlinetot;iline++){
-        mp[0].phot[iline+iphot*m[0].nline]+=expTau[iline]*m[counta[iline]].cmb[countb[iline]];
-      }
+    }
+  } while(par->octree ? here>=0 : !g[there].sink);
+  return 1;
+}
+
+/* Continues a photon that has come to grid point p->here of this grid from another subdomain; returns as photonTrace() */
+int
+photonContinue(photonState *p, struct grid *g, molData *m, const gsl_rng *ran, inputPars *par, blend *matrix){
+  p->dir=sortangles(p->inidir,p->here,g,ran);
+  p->there=g[p->here].neigh[p->dir]->id;
+  if(g[p->there].sink) return 1;
+  return photonTrace(p,0,0,g,m,ran,par,matrix,NULL,NULL);
+}
+
+/* Adds the cmb to a photon that has left the model */
+void
+photonFinish(photonState *p, molData *m){
+  int iline;
+
+  HIST(HIST_PHOTON_STEPS, p->nsteps);
+  if(m[0].cmb[0]>0.){
+    for(iline=0;iline<p->nlinetot;iline++){
+      p->phot[iline]+=p->expTau[iline]*m[p->counta[iline]].cmb[p->countb[iline]];
     }
   }
-  free(expTau);
-  free(tau);
-  free(counta);
-  free(countb);
+}
+
+void
+photon(int id, struct grid *g, molData *m, int iter, const gsl_rng *ran,inputPars *par,blend *matrix, gridPointData *mp, double *halfFirstDs){
+  int iphot,iline;
+  unsigned long long vertexSteps=0;
+  photonState p;
+
+  photonAlloc(par,m,&p);
+  for(iphot=0;iphot<g[id].nphot;iphot++){
+    photonLaunch(id,iphot,g,ran,par,&p);
+    photonTrace(&p,1,iphot,g,m,ran,par,matrix,mp,halfFirstDs);
+    photonFinish(&p,m);
+    vertexSteps+=p.nsteps;
+    for(iline=0;iline<p.nlinetot;iline++) mp[0].phot[iline+iphot*m[0].nline]=p.phot[iline];
+  }
+  COUNT(CNT_PHOTONS, g[id].nphot);
+  COUNT(CNT_PHOTON_STEPS, vertexSteps);
+  HIST(HIST_VERTEX_STEPS, vertexSteps);
+  g[id].cost.steps+=vertexSteps;
+  photonFree(&p);
 }
 
 void
 getjbar(int posn, molData *m, struct grid *g, inputPars *par, gridPointData *mp, double *halfFirstDs){
   int iline,iphot;
-  double tau, expTau, remnantSnu, vsum=0., jnu, alpha;
+  double remnantSnu, vsum=0., jnu, alpha;
+  double *tau,*jnuLine,*remnantLine,*expTau,*comp,term,y,t;
   int *counta, *countb,nlinetot;
 
   lineCount(par->nSpecies, m, &counta, &countb, &nlinetot);
+  tau=malloc(sizeof(double)*5*m[0].nline);
+  jnuLine=tau+m[0].nline;
+  remnantLine=jnuLine+m[0].nline;
+  expTau=remnantLine+m[0].nline;
+  comp=expTau+m[0].nline;
   
-  for(iline=0;iline<m[0].nline;iline++) mp[0].jbar[iline]=0.;
+  for(iline=0;iline<m[0].nline;iline++){
+    mp[0].jbar[iline]=0.;
+    comp[iline]=0.;
+  }
   for(iphot=0;iphot<g[posn].nphot;iphot++){
     if(mp[0].vfac[iphot]>0){
       for(iline=0;iline<m[0].nline;iline++){
@@ -315,16 +454,26 @@ getjbar(int posn, molData *m, struct grid *g, inputPars *par, gridPointData *mp,
         
         sourceFunc_line(&jnu,&alpha,m,mp[0].vfac[iphot],g,posn,counta[iline],countb[iline]);
         sourceFunc_cont(&jnu,&alpha,g,posn,counta[iline],countb[iline]);
-        tau=alpha*halfFirstDs[iphot];
-        calcSourceFn(tau, par, &remnantSnu, &expTau);
-        remnantSnu *= jnu*m[0].norminv*halfFirstDs[iphot];
+        tau[iline]=alpha*halfFirstDs[iphot];
+        jnuLine[iline]=jnu;
+      }
+      vecSourceFn(tau, par->taylorCutoff, remnantLine, expTau, m[0].nline);
 
-        mp[0].jbar[iline]+=mp[0].vfac[iphot]*(expTau*mp[0].phot[iline+iphot*m[0].nline]+remnantSnu);
+      for(iline=0;iline<m[0].nline;iline++){
+        remnantSnu=remnantLine[iline]*jnuLine[iline]*m[0].norminv*halfFirstDs[iphot];
+        term=mp[0].vfac[iphot]*(expTau[iline]*mp[0].phot[iline+iphot*m[0].nline]+remnantSnu);
+
+        /* Compensated (Kahan) sum over the photons */
+        y=term-comp[iline];
+        t=mp[0].jbar[iline]+y;
+        comp[iline]=(t-mp[0].jbar[iline])-y;
+        mp[0].jbar[iline]=t;
       }
       vsum+=mp[0].vfac[iphot];
     }
   }
   for(iline=0;iline<m[0].nline;iline++) mp[0].jbar[iline] *= m[0].norm/vsum;
+  free(tau);
   free(counta);
   free(countb);
 }
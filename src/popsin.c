@@ -11,7 +11,7 @@
 
 
 void
-popsin(inputPars *par, struct grid **g, molData **m, int *popsdone){
+popsin(inputPars *par, struct grid **g, molData **m, int *popsdone, struct cell **dc, unsigned long *numCells){
   FILE *fp;
   int i,j,k;
   double dummy;
@@ -65,6 +65,9 @@ popsin(inputPars *par, struct grid **g, molData **m, int *popsdone){
   }
 
   *g=malloc(sizeof(struct grid)*par->ncell);
+  memset(*g, 0, sizeof(struct grid)*par->ncell);
+  popsAlloc(par,*g);
+  for(j=0;j<par->nSpecies;j++) popsAllocSpecies(par,*g,j,(*m)[j].nlev,(*m)[j].nline);
 
   for(i=0;i<par->ncell;i++){
     (*g)[i].a0 = NULL;
@@ -86,25 +89,26 @@ popsin(inputPars *par, struct grid **g, molData **m, int *popsdone){
     (*g)[i].nmol=malloc(par->nSpecies*sizeof(double));
     for(j=0;j<par->nSpecies;j++) fread(&(*g)[i].nmol[j], sizeof(double), 1, fp);
     fread(&(*g)[i].dopb, sizeof (*g)[i].dopb, 1, fp);
-    (*g)[i].mol=malloc(par->nSpecies*sizeof(struct populations));
     for(j=0;j<par->nSpecies;j++){
-      (*g)[i].mol[j].pops=malloc(sizeof(double)*(*m)[j].nlev);
-      for(k=0;k<(*m)[j].nlev;k++) fread(&(*g)[i].mol[j].pops[k], sizeof(double), 1, fp);
-      (*g)[i].mol[j].knu=malloc(sizeof(double)*(*m)[j].nline);
-      for(k=0;k<(*m)[j].nline;k++) fread(&(*g)[i].mol[j].knu[k], sizeof(double), 1, fp);
-      (*g)[i].mol[j].dust=malloc(sizeof(double)*(*m)[j].nline);
-      for(k=0;k<(*m)[j].nline;k++) fread(&(*g)[i].mol[j].dust[k],sizeof(double), 1, fp);
+      /* The file holds doubles, whatever storeReal is */
+      for(k=0;k<(*m)[j].nlev;k++){ fread(&dummy, sizeof(double), 1, fp); (*g)[i].mol[j].pops[k]=dummy; }
+      for(k=0;k<(*m)[j].nline;k++){ fread(&dummy, sizeof(double), 1, fp); (*g)[i].mol[j].knu[k]=dummy; }
+      for(k=0;k<(*m)[j].nline;k++){ fread(&dummy, sizeof(double), 1, fp); (*g)[i].mol[j].dust[k]=dummy; }
       fread(&(*g)[i].mol[j].dopb,sizeof(double), 1, fp);
       fread(&(*g)[i].mol[j].binv,sizeof(double), 1, fp);
-      (*g)[i].mol[j].partner=NULL;
     }
-    fread(&dummy, sizeof(double), 1, fp);
-    fread(&dummy, sizeof(double), 1, fp);
-    fread(&dummy, sizeof(double), 1, fp);
+    (*g)[i].dens=malloc(sizeof(double)*par->collPart);
+    (*g)[i].abun=malloc(sizeof(double)*par->nSpecies);
+    for(j=1;j<par->nSpecies;j++) (*g)[i].abun[j]=0.;
+    fread(&(*g)[i].dens[0], sizeof(double), 1, fp);
+    fread(&(*g)[i].t[0],    sizeof(double), 1, fp);
+    fread(&(*g)[i].abun[0], sizeof(double), 1, fp);
+    (*g)[i].t[1]=-1;
+    (*g)[i].conv=0;
   }
   fclose(fp);
 
-  qhull(par, *g);
+  qhull(par, *g, dc, numCells);
   distCalc(par, *g);
   getVelosplines(par,*g);
   *popsdone=1;
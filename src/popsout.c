@@ -17,6 +17,8 @@ popsout(inputPars *par, struct grid *g, molData *m){
   /* int i,mi,c,q=0,best; */
   /* double vel[3],ra[100],rb[100],za[100],zb[100],min; */
   
+  /* Only rank 0 writes the output of an MPI run (see ranks.c) */
+  if(limeOpts.rank!=0) return;
   if((fp=fopen(par->outputfile, "w"))==NULL){
     if(!silent) bail_out("Error writing output populations file!");
     exit(1);
@@ -34,11 +36,25 @@ popsout(inputPars *par, struct grid *g, molData *m){
 }
 
 
+/* The binary file always holds doubles, so that it does not depend on how LIME was built */
+static void
+writeStore(storeReal *x, int n, FILE *fp){
+  int k;
+  double d;
+
+  for(k=0;k<n;k++){
+    d=x[k];
+    fwrite(&d, sizeof(double), 1, fp);
+  }
+}
+
 void
 binpopsout(inputPars *par, struct grid *g, molData *m){
   FILE *fp;
   int i,j;
   
+  /* Only rank 0 writes the output of an MPI run (see ranks.c) */
+  if(limeOpts.rank!=0) return;
   if((fp=fopen(par->binoutputfile, "wb"))==NULL){
     if(!silent) bail_out("Error writing binary output populations file!");
     exit(1);
@@ -72,9 +88,9 @@ binpopsout(inputPars *par, struct grid *g, molData *m){
     fwrite(g[i].nmol,  sizeof(double)*par->nSpecies,1, fp);
     fwrite(&g[i].dopb, sizeof g[i].dopb, 1, fp);
     for(j=0;j<par->nSpecies;j++){
-      fwrite(g[i].mol[j].pops,  sizeof(double)*m[j].nlev, 1, fp);
-      fwrite(g[i].mol[j].knu,   sizeof(double)*m[j].nline,1, fp);
-      fwrite(g[i].mol[j].dust,  sizeof(double)*m[j].nline,1, fp);
+      writeStore(g[i].mol[j].pops, m[j].nlev, fp);
+      writeStore(g[i].mol[j].knu,  m[j].nline,fp);
+      writeStore(g[i].mol[j].dust, m[j].nline,fp);
       fwrite(&g[i].mol[j].dopb, sizeof(double),           1, fp);
       fwrite(&g[i].mol[j].binv, sizeof(double),           1, fp);
     }
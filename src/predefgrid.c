@@ -10,7 +10,7 @@
 #include "lime.h"
 
 void
-predefinedGrid(inputPars *par, struct grid *g){
+predefinedGrid(inputPars *par, struct grid *g, struct cell **dc, unsigned long *numCells){
   FILE *fp;
   int i;
   double x,y,z,scale;
@@ -18,7 +18,8 @@ predefinedGrid(inputPars *par, struct grid *g){
 #ifdef TEST
   gsl_rng_set(ran,6611304);
 #else
-  gsl_rng_set(ran,time(0));
+  if(par->gridSeed==0) par->gridSeed=(unsigned long)sharedTime();
+  gsl_rng_set(ran,par->gridSeed);
 #endif
 	
   fp=fopen(par->pregrid,"r");
@@ -69,11 +70,10 @@ predefinedGrid(inputPars *par, struct grid *g){
   }
   fclose(fp);
 
-  qhull(par,g);
+  qhull(par,g,dc,numCells);
   distCalc(par,g);
   //  getArea(par,g, ran);
   //  getMass(par,g, ran);
   getVelosplines_lin(par,g);
-  if(par->gridfile) write_VTK_unstructured_Points(par, g);
   gsl_rng_free(ran);
 }
@@ -0,0 +1,331 @@
+/*
+ *  ranks.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Sharing of the work of levelPops and raytrace over MPI ranks (build with make MPI=1, which defines USE_MPI). Every rank builds the same grid, from a random seed shared by rank 0. The grid points are split into one spatially compact subdomain per rank by recursive coordinate bisection (splitPoints()), and levelPops is solved by domain decomposition (see subdomain.c): each rank holds the edges, splines and populations of its own subdomain and a halo around it only, and the photons that leave a subdomain are continued by the rank they come to. The grid itself is still built, and in the end put back together, on every rank, so the model has to fit into one address space. An octree grid (par->octree) is not decomposed: there every rank holds the whole grid, solves the points of its own subdomain, and the populations of all points are exchanged at the end of each iteration (exchangePops()). The images are split too: they are cut into square tiles of IMG_TILE pixels on a side, which are dealt out to the ranks in turn (pixelRank()), so that each rank gets a share of the expensive centre of the image. Each rank traces the pixels of its own tiles and gatherImage() collects them on rank 0, which writes the images.
+
+Without USE_MPI there is one rank, which owns every point and pixel, and the exchanges do nothing.
+*/
+
+#include "lime.h"
+#include <gsl/gsl_statistics.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+/* Points solved by the ranks, grouped by rank: those of rank r are order[first[r]..first[r+1]-1] */
+static int *order=NULL, *first=NULL;
+
+void
+mpiInit(int *argc, char ***argv){
+#ifdef USE_MPI
+  int provided;
+
+  MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &limeOpts.rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &limeOpts.nRanks);
+  /* Only rank 0 talks to the terminal */
+  if(limeOpts.rank!=0) limeOpts.ncurses=0;
+#else
+  limeOpts.rank=0;
+  limeOpts.nRanks=1;
+#endif
+}
+
+void
+mpiFinalize(){
+  free(order);
+  free(first);
+  order=NULL;
+  first=NULL;
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
+}
+
+/* time(0) of rank 0, for the random seeds that must be the same on all ranks (the grid sampling) */
+time_t
+sharedTime(){
+  long t=(long)time(0);
+
+#ifdef USE_MPI
+  MPI_Bcast(&t, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+#endif
+  return (time_t)t;
+}
+
+/* v of rank 0 */
+long
+fromRankZero(long v){
+#ifdef USE_MPI
+  MPI_Bcast(&v, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+#endif
+  return v;
+}
+
+/* Smallest v of all ranks */
+int
+minOverRanks(int v){
+#ifdef USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, &v, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+#endif
+  return v;
+}
+
+static struct grid *sortGrid;
+static int sortDim;
+
+static int
+compareCoord(const void *a, const void *b){
+  double xa=sortGrid[*(const int *)a].x[sortDim], xb=sortGrid[*(const int *)b].x[sortDim];
+
+  if(xa<xb) return -1;
+  if(xa>xb) return 1;
+  return *(const int *)a-*(const int *)b;
+}
+
+/* Splits the n points ids[] over the ranks rank0..rank0+nRanks-1, in proportion to the number of ranks on each side, across the widest extent of the points */
+static void
+bisect(struct grid *g, int *ids, int n, int rank0, int nRanks){
+  double lo[DIM],hi[DIM];
+  int i,k,nLeft;
+
+  if(nRanks==1){
+    for(i=0;i<n;i++) g[ids[i]].rank=rank0;
+    return;
+  }
+  for(k=0;k<DIM;k++){
+    lo[k]=1e300;
+    hi[k]=-1e300;
+  }
+  for(i=0;i<n;i++){
+    for(k=0;k<DIM;k++){
+      if(g[ids[i]].x[k]<lo[k]) lo[k]=g[ids[i]].x[k];
+      if(g[ids[i]].x[k]>hi[k]) hi[k]=g[ids[i]].x[k];
+    }
+  }
+  sortDim=0;
+  for(k=1;k<DIM;k++) if(hi[k]-lo[k] > hi[sortDim]-lo[sortDim]) sortDim=k;
+  sortGrid=g;
+  qsort(ids, n, sizeof(int), compareCoord);
+
+  nLeft=(int)((long)n*(nRanks/2)/nRanks);
+  bisect(g, ids, nLeft, rank0, nRanks/2);
+  bisect(g, ids+nLeft, n-nLeft, rank0+nRanks/2, nRanks-nRanks/2);
+}
+
+/* Assigns every grid point to a rank (g[id].rank) and returns the number of points this rank solves. Sink points belong to rank 0; they are never solved. Points that take the populations of a representative point (see symmetry.c) belong to a rank, whose subdomain they are part of, but are not solved. */
+int
+splitPoints(inputPars *par, struct grid *g){
+  int id,r,*ids;
+
+  free(order);
+  free(first);
+  order=malloc(sizeof(int)*par->pIntensity);
+  first=malloc(sizeof(int)*(limeOpts.nRanks+1));
+
+  ids=malloc(sizeof(int)*par->pIntensity);
+  for(id=0;id<par->pIntensity;id++) ids[id]=id;
+  if(limeOpts.nRanks>1) bisect(g, ids, par->pIntensity, 0, limeOpts.nRanks);
+  else for(id=0;id<par->pIntensity;id++) g[id].rank=0;
+  for(id=par->pIntensity;id<par->ncell;id++) g[id].rank=0;
+  free(ids);
+
+  /* Group the points by rank, in order of their id */
+  for(r=0;r<=limeOpts.nRanks;r++) first[r]=0;
+  for(id=0;id<par->pIntensity;id++) if(g[id].rep==id) first[g[id].rank+1]++;
+  for(r=0;r<limeOpts.nRanks;r++) first[r+1]+=first[r];
+  {
+    int next[limeOpts.nRanks];
+    for(r=0;r<limeOpts.nRanks;r++) next[r]=first[r];
+    for(id=0;id<par->pIntensity;id++) if(g[id].rep==id) order[next[g[id].rank]++]=id;
+  }
+
+  return first[limeOpts.rank+1]-first[limeOpts.rank];
+}
+
+/* Replaces the populations of the points of the other ranks by the ones they have just solved, or, on a subdomain grid, those of its ghost points only (see subdomain.c). The populations of a point travel as one block of nlevTot values, so that the counts of MPI_Allgatherv are numbers of points. */
+void
+exchangePops(inputPars *par, molData *m, struct grid *g){
+#ifdef USE_MPI
+  int r,i,ispec,ilev,nlevTot=0,*counts,*displs;
+  storeReal *sendBuf,*recvBuf,*p;
+  MPI_Datatype type=(sizeof(storeReal)==sizeof(float)) ? MPI_FLOAT : MPI_DOUBLE, pointType;
+
+  if(limeOpts.nRanks==1) return;
+  if(isSubdomain(g)){
+    exchangeGhosts(par,m,g);
+    return;
+  }
+  for(ispec=0;ispec<par->nSpecies;ispec++) nlevTot+=m[ispec].nlev;
+  MPI_Type_contiguous(nlevTot, type, &pointType);
+  MPI_Type_commit(&pointType);
+
+  counts=malloc(sizeof(int)*limeOpts.nRanks);
+  displs=malloc(sizeof(int)*limeOpts.nRanks);
+  for(r=0;r<limeOpts.nRanks;r++){
+    counts[r]=first[r+1]-first[r];
+    displs[r]=first[r];
+  }
+  sendBuf=malloc(sizeof(storeReal)*((size_t)counts[limeOpts.rank]*nlevTot+1));
+  recvBuf=malloc(sizeof(storeReal)*(size_t)first[limeOpts.nRanks]*nlevTot);
+
+  p=sendBuf;
+  for(i=first[limeOpts.rank];i<first[limeOpts.rank+1];i++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(ilev=0;ilev<m[ispec].nlev;ilev++) *p++=g[order[i]].mol[ispec].pops[ilev];
+    }
+  }
+  MPI_Allgatherv(sendBuf, counts[limeOpts.rank], pointType, recvBuf, counts, displs, pointType, MPI_COMM_WORLD);
+
+  p=recvBuf;
+  for(i=0;i<first[limeOpts.nRanks];i++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(ilev=0;ilev<m[ispec].nlev;ilev++) g[order[i]].mol[ispec].pops[ilev]=*p++;
+    }
+  }
+
+  MPI_Type_free(&pointType);
+  free(sendBuf);
+  free(recvBuf);
+  free(counts);
+  free(displs);
+#endif
+}
+
+/* Sums the cost map over the ranks, onto rank 0 which writes it. The costs of a subdomain grid are gathered by mergeSubdomain() instead. */
+void
+reduceCosts(inputPars *par, struct grid *g){
+#ifdef USE_MPI
+  int id;
+  double *buf;
+
+  if(limeOpts.nRanks==1 || isSubdomain(g)) return;
+  buf=malloc(sizeof(double)*3*par->ncell);
+  for(id=0;id<par->ncell;id++){
+    buf[3*id]  =(double)g[id].cost.steps;
+    buf[3*id+1]=(double)g[id].cost.iters;
+    buf[3*id+2]=g[id].cost.time;
+  }
+  MPI_Reduce((limeOpts.rank==0) ? MPI_IN_PLACE : buf, buf, 3*par->ncell, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  if(limeOpts.rank==0){
+    for(id=0;id<par->ncell;id++){
+      g[id].cost.steps=(unsigned long long)buf[3*id];
+      g[id].cost.iters=(int)buf[3*id+1];
+      g[id].cost.time =buf[3*id+2];
+    }
+  }
+  free(buf);
+#endif
+}
+
+/*
+Convergence statistics of levelPops on subdomain grids, over all ranks: the number of converged points nConv is summed, result1 becomes the smallest of the c signal-to-noise ratios median[] (sorted) of all ranks, and result2 the median of the medians of the ranks, weighted by their c. This is close to, but not quite, the median of all ratios, which would need them all on one rank.
+*/
+void
+sharedStats(double *median, int c, int *nConv, double *result1, double *result2){
+#ifdef USE_MPI
+  int r,n=0,sum=0;
+  double local[2],*all;
+
+  local[0]=(c>0) ? gsl_stats_median_from_sorted_data(median, 1, c) : 0.;
+  local[1]=(double)c;
+  MPI_Allreduce(MPI_IN_PLACE, nConv, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+  *result1=(c>0) ? median[0] : 1e300;
+  MPI_Allreduce(MPI_IN_PLACE, result1, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+
+  all=malloc(sizeof(double)*2*limeOpts.nRanks);
+  MPI_Allgather(local, 2, MPI_DOUBLE, all, 2, MPI_DOUBLE, MPI_COMM_WORLD);
+  for(r=0;r<limeOpts.nRanks;r++) n+=(int)all[2*r+1];
+  *result2=0.;
+  /* Take the ranks in order of their medians until half of the ratios are passed */
+  while(n>0 && 2*sum<n){
+    int best=-1;
+    for(r=0;r<limeOpts.nRanks;r++){
+      if(all[2*r+1]>0 && (best<0 || all[2*r]<all[2*best])) best=r;
+    }
+    *result2=all[2*best];
+    sum+=(int)all[2*best+1];
+    all[2*best+1]=0;
+  }
+  free(all);
+#else
+  if(c>0){
+    *result1=median[0];
+    *result2=gsl_stats_median_from_sorted_data(median, 1, c);
+  }
+#endif
+}
+
+/* Rank that traces pixel px of an image of pxls by pxls pixels */
+int
+pixelRank(int pxls, int px){
+  int nTiles=(pxls+IMG_TILE-1)/IMG_TILE;
+
+  return (((px/pxls)/IMG_TILE)*nTiles+(px%pxls)/IMG_TILE)%limeOpts.nRanks;
+}
+
+/* Collects the pixels of image im onto rank 0: each rank sends only the pixels of its own tiles, one block of 2*nchan+2 values per pixel, so that the counts of MPI_Gatherv are numbers of pixels */
+void
+gatherImage(image *img, int im){
+#ifdef USE_MPI
+  int px,ichan,r,nOwn=0,npx=img[im].pxls*img[im].pxls,nchan=img[im].nchan,*counts=NULL,*displs=NULL,*next=NULL;
+  double *sendBuf,*recvBuf=NULL,*p;
+  MPI_Datatype pixelType;
+
+  if(limeOpts.nRanks==1) return;
+  MPI_Type_contiguous(2*nchan+2, MPI_DOUBLE, &pixelType);
+  MPI_Type_commit(&pixelType);
+
+  for(px=0;px<npx;px++) if(pixelRank(img[im].pxls,px)==limeOpts.rank) nOwn++;
+  sendBuf=malloc(sizeof(double)*((size_t)nOwn*(2*nchan+2)+1));
+  p=sendBuf;
+  for(px=0;px<npx;px++){
+    if(pixelRank(img[im].pxls,px)!=limeOpts.rank) continue;
+    for(ichan=0;ichan<nchan;ichan++){
+      *p++=img[im].pixel[px].intense[ichan];
+      *p++=img[im].pixel[px].tau[ichan];
+    }
+    *p++=(double)img[im].pixel[px].cells;
+    *p++=img[im].pixel[px].time;
+  }
+
+  if(limeOpts.rank==0){
+    counts=calloc(limeOpts.nRanks, sizeof(int));
+    displs=malloc(sizeof(int)*limeOpts.nRanks);
+    next=malloc(sizeof(int)*limeOpts.nRanks);
+    for(px=0;px<npx;px++) counts[pixelRank(img[im].pxls,px)]++;
+    displs[0]=0;
+    for(r=1;r<limeOpts.nRanks;r++) displs[r]=displs[r-1]+counts[r-1];
+    recvBuf=malloc(sizeof(double)*(size_t)npx*(2*nchan+2));
+  }
+  MPI_Gatherv(sendBuf, nOwn, pixelType, recvBuf, counts, displs, pixelType, 0, MPI_COMM_WORLD);
+
+  if(limeOpts.rank==0){
+    /* The pixels of each rank arrive in the order of px */
+    for(r=0;r<limeOpts.nRanks;r++) next[r]=displs[r];
+    for(px=0;px<npx;px++){
+      p=recvBuf+(size_t)(next[pixelRank(img[im].pxls,px)]++)*(2*nchan+2);
+      for(ichan=0;ichan<nchan;ichan++){
+        img[im].pixel[px].intense[ichan]=*p++;
+        img[im].pixel[px].tau[ichan]=*p++;
+      }
+      img[im].pixel[px].cells=(unsigned long)*p++;
+      img[im].pixel[px].time=*p++;
+    }
+  }
+
+  MPI_Type_free(&pixelType);
+  free(sendBuf);
+  free(recvBuf);
+  free(counts);
+  free(displs);
+  free(next);
+#endif
+}
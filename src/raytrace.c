@@ -16,22 +16,17 @@ velocityspline2(double x[3], double dx[3], double ds, double binv, double deltav
 The bulk velocity of the model material can vary significantly with position, thus so can the value of the line-shape function at a given frequency and direction. The present function calculates 'vfac', an approximate average of the line-shape function along a path of length ds in the direction of the line of sight.
   */
   int i,steps=10;
-  double v,d,val,vel[3];
+  double v[10],y[10],d,vel[3];
 
   *vfac=0.;
   for(i=0;i<steps;i++){
     d=i*ds/steps;
     velocity(x[0]+(dx[0]*d),x[1]+(dx[1]*d),x[2]+(dx[2]*d),vel);
-    v=deltav-veloproject(dx,vel); /* veloproject returns the component of the local bulk velocity in the direction of dx, whereas deltav is the recession velocity of the channel we are interested in (corrected for bulk source velocity and line displacement from the nominal frequency). Remember also that, since dx points away from the observer, positive values of the projected velocity also represent recessions. Line centre occurs when v==0, i.e. when deltav==veloproject(dx,vel). That is the reason for the subtraction here. */
-    val=fabs(v)*binv;
-    if(val <=  2500.){
-#ifdef FASTEXP
-      *vfac+= FastExp(val*val);
-#else
-      *vfac+=   exp(-(val*val));
-#endif
-    }
+    v[i]=deltav-veloproject(dx,vel); /* veloproject returns the component of the local bulk velocity in the direction of dx, whereas deltav is the recession velocity of the channel we are interested in (corrected for bulk source velocity and line displacement from the nominal frequency). Remember also that, since dx points away from the observer, positive values of the projected velocity also represent recessions. Line centre occurs when v==0, i.e. when deltav==veloproject(dx,vel). That is the reason for the subtraction here. */
   }
+  /* Samples further than 2500 line widths from the line centre give 0 also in vecGauss() */
+  vecGauss(v,binv,y,steps);
+  for(i=0;i<steps;i++) *vfac+=y[i];
   *vfac=*vfac/steps;
   return;
 }
@@ -67,18 +62,22 @@ This function returns ds as the (always positive-valued) distance between the pr
 }
 
 
-void
+unsigned long
 traceray(rayData ray, int tmptrans, int im, inputPars *par, struct grid *g, molData *m, image *img, int nlinetot, int *counta, int *countb, double cutoff){
   /*
 For a given image pixel position, this function evaluates the intensity of the total light emitted/absorbed along that line of sight through the (possibly rotated) model. The calculation is performed for several frequencies, one per channel of the output image.
 
 Note that the algorithm employed here is similar to that employed in the function photon() which calculates the average radiant flux impinging on a grid cell: namely the notional photon is started at the side of the model near the observer and 'propagated' in the receding direction until it 'reaches' the far side. This is rather non-physical in conception but it makes the calculation easier.
   */
-  int ichan,posn,nposn,i,iline,molI,lineI;
+  int ichan,posn,nposn,i,iline,molI,lineI,nchan=img[im].nchan;
+  unsigned long long ncells=0;
   double vfac=0.,x[3],dx[3],vThisChan;
-  double deltav,ds,dist2,ndist2,xp,yp,zp,col,lineRedShift,jnu,alpha,remnantSnu,dtau,expDTau,snu_pol[3];
+  double deltav,ds,dist2,ndist2,xp,yp,zp,col,lineRedShift,jnu,alpha,snu_pol[3],y,t;
+  /* Per-channel values of a cell, for the vector kernels, and the compensation terms of the intensity sums */
+  double dtauChan[nchan],jnuChan[nchan],remnantChan[nchan],expDTauChan[nchan],expTauChan[nchan],compChan[nchan];
 
   for(ichan=0;ichan<img[im].nchan;ichan++){
+    compChan[ichan]=0.0;
     ray.tau[ichan]=0.0;
     ray.intensity[ichan]=0.0;
   }
@@ -95,32 +94,38 @@ Note that the algorithm employed here is similar to that employed in the functio
       dx[i]= img[im].rotMat[i][2]; /* This points away from the observer. */
     }
 
-    /* Find the grid point nearest to the starting x. */
-    i=0;
-    dist2=(x[0]-g[i].x[0])*(x[0]-g[i].x[0]) + (x[1]-g[i].x[1])*(x[1]-g[i].x[1]) + (x[2]-g[i].x[2])*(x[2]-g[i].x[2]);
-    posn=i;
-    for(i=1;i<par->ncell;i++){
-      ndist2=(x[0]-g[i].x[0])*(x[0]-g[i].x[0]) + (x[1]-g[i].x[1])*(x[1]-g[i].x[1]) + (x[2]-g[i].x[2])*(x[2]-g[i].x[2]);
-      if(ndist2<dist2){
-        posn=i;
-        dist2=ndist2;
+    /* Find the grid point nearest to the starting x; in an octree grid, the cell where the ray enters the root cube (-1 if it misses it). */
+    col=0;
+    if(par->octree) posn=octreeEnter(x,dx,&col);
+    else {
+      i=0;
+      dist2=(x[0]-g[i].x[0])*(x[0]-g[i].x[0]) + (x[1]-g[i].x[1])*(x[1]-g[i].x[1]) + (x[2]-g[i].x[2])*(x[2]-g[i].x[2]);
+      posn=i;
+      for(i=1;i<par->ncell;i++){
+        ndist2=(x[0]-g[i].x[0])*(x[0]-g[i].x[0]) + (x[1]-g[i].x[1])*(x[1]-g[i].x[1]) + (x[2]-g[i].x[2])*(x[2]-g[i].x[2]);
+        if(ndist2<dist2){
+          posn=i;
+          dist2=ndist2;
+        }
       }
     }
 
-    col=0;
-    do{
+    while(posn>=0 && col < 2.0*fabs(zp)){
+      ncells++;
       ds=-2.*zp-col; /* This default value is chosen to be as large as possible given the spherical model boundary. */
       nposn=-1;
-      line_plane_intersect(g,&ds,posn,&nposn,dx,x,cutoff); /* Returns a new ds equal to the distance to the next Voronoi face, and nposn, the ID of the grid cell that abuts that face. */ 
+      if(par->octree) octreeStep(g,posn,x,dx,&ds,&nposn); /* The distance to the exit face of the cube, and the cell beyond it (-1 outside the root cube). */
+      else line_plane_intersect(g,&ds,posn,&nposn,dx,x,cutoff); /* Returns a new ds equal to the distance to the next Voronoi face, and nposn, the ID of the grid cell that abuts that face. */ 
       if(par->polarization){
-        for(ichan=0;ichan<img[im].nchan;ichan++){
-          sourceFunc_pol(snu_pol,&dtau,ds,m,vfac,g,posn,0,0,img[im].theta);
-#ifdef FASTEXP
-          ray.intensity[ichan]+=FastExp(ray.tau[ichan])*(1.-exp(-dtau))*snu_pol[ichan];
-#else
-          ray.intensity[ichan]+=   exp(-ray.tau[ichan])*(1.-exp(-dtau))*snu_pol[ichan];
-#endif
-          ray.tau[ichan]+=dtau;
+        for(ichan=0;ichan<nchan;ichan++){
+          sourceFunc_pol(snu_pol,&dtauChan[ichan],ds,m,vfac,g,posn,0,0,img[im].theta);
+          jnuChan[ichan]=snu_pol[ichan];
+        }
+        vecExp(ray.tau,expTauChan,nchan);
+        vecExp(dtauChan,expDTauChan,nchan);
+        for(ichan=0;ichan<nchan;ichan++){
+          jnuChan[ichan]*=expTauChan[ichan]*(1.-expDTauChan[ichan]);
+          ray.tau[ichan]+=dtauChan[ichan];
         }
       } else {
         for(ichan=0;ichan<img[im].nchan;ichan++){
@@ -155,51 +160,58 @@ Note that the algorithm employed here is similar to that employed in the functio
           if(img[im].doline && img[im].trans > -1) sourceFunc_cont(&jnu,&alpha,g,posn,0,img[im].trans);
           else if(img[im].doline && img[im].trans == -1) sourceFunc_cont(&jnu,&alpha,g,posn,0,tmptrans);
           else sourceFunc_cont(&jnu,&alpha,g,posn,0,0);
-          dtau=alpha*ds;
-          calcSourceFn(dtau, par, &remnantSnu, &expDTau);
-          remnantSnu *= jnu*m[0].norminv*ds;
-#ifdef FASTEXP
-          ray.intensity[ichan]+=FastExp(ray.tau[ichan])*remnantSnu;
-#else
-          ray.intensity[ichan]+=   exp(-ray.tau[ichan])*remnantSnu;
-#endif
-          ray.tau[ichan]+=dtau;
+          dtauChan[ichan]=alpha*ds;
+          jnuChan[ichan]=jnu;
+        }
+
+        vecSourceFn(dtauChan, par->taylorCutoff, remnantChan, expDTauChan, nchan);
+        vecExp(ray.tau,expTauChan,nchan);
+        for(ichan=0;ichan<nchan;ichan++){
+          jnuChan[ichan]*=expTauChan[ichan]*remnantChan[ichan]*m[0].norminv*ds;
+          ray.tau[ichan]+=dtauChan[ichan];
         }
       }
 
+      /* Add the emission of the cell, jnuChan, to the intensity by a compensated (Kahan) sum along the ray */
+      for(ichan=0;ichan<nchan;ichan++){
+        y=jnuChan[ichan]-compChan[ichan];
+        t=ray.intensity[ichan]+y;
+        compChan[ichan]=(t-ray.intensity[ichan])-y;
+        ray.intensity[ichan]=t;
+      }
+
       /* Move the working point to the edge of the next Voronoi cell. */
       for(i=0;i<3;i++) x[i]+=ds*dx[i];
       col+=ds;
       posn=nposn;
-    } while(col < 2.0*fabs(zp));
-
-    /* Add or subtract cmb. */
-#ifdef FASTEXP
-    for(ichan=0;ichan<img[im].nchan;ichan++){
-      ray.intensity[ichan]+=FastExp(ray.tau[ichan])*m[0].local_cmb[tmptrans];
     }
-#else
-    for(ichan=0;ichan<img[im].nchan;ichan++){
-      ray.intensity[ichan]+=exp(-ray.tau[ichan])*m[0].local_cmb[tmptrans];
+    COUNT(CNT_RAYS, 1);
+    COUNT(CNT_RAY_CELLS, ncells);
+    HIST(HIST_RAY_CELLS, ncells);
+
+    /* Add or subtract cmb, together with the remaining compensation of the sums. */
+    vecExp(ray.tau,expTauChan,nchan);
+    for(ichan=0;ichan<nchan;ichan++){
+      ray.intensity[ichan]+=expTauChan[ichan]*m[0].local_cmb[tmptrans]-compChan[ichan];
     }
-#endif
   }
+  return ncells;
 }
 
 
 void
 raytrace(int im, inputPars *par, struct grid *g, molData *m, image *img){
   int *counta, *countb,nlinetot,aa;
-  int ichan,px,iline,tmptrans,i,threadI,nRaysDone;
-  double size,minfreq,absDeltaFreq,totalNumPixelsMinus1=(double)(img[im].pxls*img[im].pxls-1);
-  double cutoff;
+  int ichan,px,iline,tmptrans,i,threadI,nRaysDone,timer,nOwned=0;
+  double size,minfreq,absDeltaFreq;
+  double cutoff,*threadBusy;
   const gsl_rng_type *ranNumGenType = gsl_rng_ranlxs2;
 
   gsl_rng *ran = gsl_rng_alloc(ranNumGenType);	/* Random number generator */
 #ifdef TEST
-  gsl_rng_set(ran,178490);
+  gsl_rng_set(ran,178490+TEST_SEED+limeOpts.rank);
 #else
-  gsl_rng_set(ran,time(0));
+  gsl_rng_set(ran,time(0)+limeOpts.rank);
 #endif
 
   gsl_rng **threadRans;
@@ -244,12 +256,20 @@ raytrace(int im, inputPars *par, struct grid *g, molData *m, image *img){
       img[im].pixel[px].intense[ichan]=0.0;
       img[im].pixel[px].tau[ichan]=0.0;
     }
+    img[im].pixel[px].cells=0;
+    img[im].pixel[px].time=0.;
+    /* In an MPI run each rank traces the pixels of its own tiles of the image (see ranks.c) */
+    if(pixelRank(img[im].pxls,px)==limeOpts.rank) nOwned++;
   }
 
   nRaysDone=0;
+  threadBusy=malloc(sizeof(double)*par->nThreads);
+  for(i=0;i<par->nThreads;i++) threadBusy[i]=0.;
+  timer=timerBegin("raytrace");
   omp_set_dynamic(0);
   #pragma omp parallel private(px,aa,threadI) num_threads(par->nThreads)
   {
+    double t0;
     threadI = omp_get_thread_num();
 
     /* Declaration of thread-private pointers. */
@@ -260,14 +280,16 @@ raytrace(int im, inputPars *par, struct grid *g, molData *m, image *img){
     #pragma omp for
     /* Main loop through pixel grid. */
     for(px=0;px<(img[im].pxls*img[im].pxls);px++){
+      if(pixelRank(img[im].pxls,px)!=limeOpts.rank) continue;
       #pragma omp atomic
       ++nRaysDone;
 
+      t0=wallTime();
       for(aa=0;aa<par->antialias;aa++){
         ray.x = -size*(gsl_rng_uniform(threadRans[threadI]) + px%img[im].pxls - 0.5*img[im].pxls);
         ray.y =  size*(gsl_rng_uniform(threadRans[threadI]) + px/img[im].pxls - 0.5*img[im].pxls);
 
-        traceray(ray, tmptrans, im, par, g, m, img, nlinetot, counta, countb, cutoff);
+        img[im].pixel[px].cells+=traceray(ray, tmptrans, im, par, g, m, img, nlinetot, counta, countb, cutoff);
 
         #pragma omp critical
         {
@@ -277,14 +299,22 @@ raytrace(int im, inputPars *par, struct grid *g, molData *m, image *img){
           }
         }
       }
+      t0=wallTime()-t0;
+      img[im].pixel[px].time=t0;
+      threadBusy[threadI]+=t0;
       if (threadI == 0){ /* i.e., is master thread */
-        if(!silent) progressbar((double)(nRaysDone)/totalNumPixelsMinus1, 13);
+        if(!silent) progressbar((double)(nRaysDone)/gsl_max(nOwned-1,1), 13);
       }
     }
 
     free(ray.tau);
     free(ray.intensity);
+    MERGE_COUNTERS(PHASE_RAYTRACE);
   } /* End of parallel block. */
+  timerEnd(timer);
+  timerThreads(timer, par->nThreads, threadBusy);
+  free(threadBusy);
+  gatherImage(img,im);
 
   img[im].trans=tmptrans;
 
@@ -316,7 +346,7 @@ kept it.
 
   gsl_rng *ran = gsl_rng_alloc(gsl_rng_ranlxs2);	/* Random number generator */
 #ifdef TEST
-  gsl_rng_set(ran,178490);
+  gsl_rng_set(ran,178490+TEST_SEED);
 #else
   gsl_rng_set(ran,time(0));
 #endif
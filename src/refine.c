@@ -0,0 +1,738 @@
+/*
+ *  refine.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Error-driven refinement of the grid (par->refine). The grid of pointEvaluation() follows the density, so steep temperature or velocity gradients can be under-resolved while smooth dense regions get more points than they need. With par->refine set, the populations are first solved on the grid as built, and the error of the solution along each Delaunay edge between two grid points is estimated as the largest of
+
+  - the relative jump of the level populations between its ends,
+  - the jump of the velocity projected on the edge, in units of the local line width,
+  - the change of the line centre opacity between its ends times the edge length, i.e. the error in optical depth of taking the opacity of one end for the whole edge.
+
+The par->refinePoints edges with the largest errors above par->refineTol get a new grid point at their middle. The grid is not triangulated again: each new point is inserted into the Delaunay triangulation of the last grid (*dc) by the Bowyer-Watson method, i.e. the tetrahedra whose circumspheres contain it are removed and the hole is filled with tetrahedra that have the new point as a vertex (insertPoint()). Only the points of the removed tetrahedra get new neighbour lists; those of all others, with their edge vectors and velocity splines, are copied, and only the new edges are fitted (fitEdgeSpline(), see velospline.c). The model functions are evaluated at the new points only. Should a point not fit in (which takes a degenerate configuration, such as a new point on the circumsphere of a flat tetrahedron), the grid is triangulated again by qhull instead.
+
+Each new point starts with the mean of the populations of the ends of its edge, which is the linear interpolation of the last solution at the middle of the edge, and the old points keep theirs (refinePops()). The next solution starts from there with par->initPopsIter iterations. This is repeated par->refine times, and the last solution is the starting point of the main levelPops run on the final grid.
+
+Each solution is a complete levelPops() run with its own copy of the molecular data and no output, as in multilevel.c.
+*/
+
+#include "lime.h"
+
+#define ORIENT_TOL 1e-12	/* orientWith() below which a point counts as on a face */
+
+/* The solution on the grid before its last refinement, for refinePops() */
+static struct {
+  int n,nAdd;
+  int (*edge)[2];		/* the ends of the edge of each new point */
+  double *pops;
+} saved={0,0,NULL,NULL};
+
+static double *sortKey;
+
+static int
+compareError(const void *a, const void *b){
+  double ka=sortKey[*(const int *)a], kb=sortKey[*(const int *)b];
+
+  if(ka>kb) return -1;
+  if(ka<kb) return 1;
+  return *(const int *)a-*(const int *)b;
+}
+
+/* Line centre opacity of line iline of species ispec at grid point id */
+static double
+lineOpacity(molData *m, struct grid *g, int id, int ispec, int iline){
+  return HPIP*g[id].mol[ispec].binv*g[id].nmol[ispec]*(g[id].mol[ispec].pops[m[ispec].lal[iline]]*m[ispec].beinstl[iline]
+                                                      -g[id].mol[ispec].pops[m[ispec].lau[iline]]*m[ispec].beinstu[iline]);
+}
+
+/* Error estimate of the solution along the edge from grid point id to its k'th neighbour */
+static double
+edgeError(inputPars *par, molData *m, struct grid *g, int id, int k){
+  int j=g[id].neigh[k]->id,ispec,ilev,iline;
+  double err=0.,ni,nj,mean,dv;
+
+  dv=fabs(veloproject(g[id].dir[k].xn,g[j].vel)-veloproject(g[id].dir[k].xn,g[id].vel));
+  for(ispec=0;ispec<par->nSpecies;ispec++){
+    if(g[id].mol[ispec].pops==NULL || g[j].mol[ispec].pops==NULL) continue;
+    for(ilev=0;ilev<m[ispec].nlev;ilev++){
+      ni=g[id].mol[ispec].pops[ilev];
+      nj=g[j].mol[ispec].pops[ilev];
+      mean=0.5*(ni+nj);
+      if(mean>minpop) err=gsl_max(err,fabs(ni-nj)/mean);
+    }
+    err=gsl_max(err,dv*0.5*(g[id].mol[ispec].binv+g[j].mol[ispec].binv));
+    for(iline=0;iline<m[ispec].nline;iline++)
+      err=gsl_max(err,fabs(lineOpacity(m,g,id,ispec,iline)-lineOpacity(m,g,j,ispec,iline))*g[id].ds[k]);
+  }
+  return err;
+}
+
+/* Chooses the edges to refine and returns their number; the ends of the i'th are edge[i][0] < edge[i][1] */
+static int
+selectEdges(inputPars *par, molData *m, struct grid *g, int (**edge)[2]){
+  int id,k,l,lo,hi,n=0,nAdd,*start,*order;
+  double *err;
+
+  start=malloc(sizeof(int)*(par->pIntensity+1));
+  start[0]=0;
+  for(id=0;id<par->pIntensity;id++) start[id+1]=start[id]+g[id].numNeigh;
+  err=malloc(sizeof(double)*start[par->pIntensity]);
+
+  /* Each edge between two grid points is counted once, from its lower end; edges shorter than twice par->minScale are not split */
+#pragma omp parallel for private(id,k) schedule(dynamic) num_threads(par->nThreads)
+  for(id=0;id<par->pIntensity;id++){
+    for(k=0;k<g[id].numNeigh;k++){
+      if(g[id].neigh[k]->sink || g[id].neigh[k]->id<id || g[id].ds[k]<2.*par->minScale) err[start[id]+k]=-1.;
+      else err[start[id]+k]=edgeError(par,m,g,id,k);
+    }
+  }
+
+  order=malloc(sizeof(int)*start[par->pIntensity]);
+  for(l=0;l<start[par->pIntensity];l++) if(err[l]>par->refineTol) order[n++]=l;
+  sortKey=err;
+  qsort(order, n, sizeof(int), compareError);
+  nAdd=(par->refinePoints>0) ? par->refinePoints : par->pIntensity/4;
+  if(nAdd>n) nAdd=n;
+
+  *edge=malloc(sizeof(**edge)*(nAdd+1));
+  for(l=0;l<nAdd;l++){
+    lo=0;
+    hi=par->pIntensity;
+    while(hi-lo>1){
+      id=(lo+hi)/2;
+      if(start[id]<=order[l]) lo=id;
+      else hi=id;
+    }
+    k=order[l]-start[lo];
+    (*edge)[l][0]=lo;
+    (*edge)[l][1]=g[lo].neigh[k]->id;
+  }
+
+  free(start);
+  free(err);
+  free(order);
+  return nAdd;
+}
+
+/* Keeps the populations of the grid points of g, and the edges of the nAdd new points, for refinePops() */
+static void
+savePops(inputPars *par, molData *m, struct grid *g, int nAdd, int (*edge)[2]){
+  int id,i,k,ispec,nlevTot=0;
+
+  for(ispec=0;ispec<par->nSpecies;ispec++) nlevTot+=m[ispec].nlev;
+  saved.n=par->pIntensity;
+  saved.nAdd=nAdd;
+  saved.edge=malloc(sizeof(*saved.edge)*(nAdd+1));
+  memcpy(saved.edge, edge, sizeof(*saved.edge)*nAdd);
+  saved.pops=malloc(sizeof(double)*(size_t)saved.n*nlevTot);
+  for(id=0;id<saved.n;id++){
+    k=0;
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(i=0;i<m[ispec].nlev;i++) saved.pops[(size_t)id*nlevTot+k+i]=g[id].mol[ispec].pops[i];
+      k+=m[ispec].nlev;
+    }
+  }
+}
+
+/* Tetrahedron of the triangulation being refined: its vertices, positively oriented, the tetrahedron across the face opposite each vertex (-1 on the hull) and its circumsphere */
+typedef struct {
+  int v[DIM+1],nb[DIM+1];
+  double cc[DIM],r2;
+  int dead;
+} tetra;
+
+typedef struct {
+  struct grid *g;		/* the vertices */
+  tetra *t;
+  int n,max;
+  int *vtet;			/* a live tetrahedron at each vertex */
+  int *tmark,*vface,stamp;	/* cavity tetrahedra and the vertices of its boundary, by stamp */
+  int *cav,nCav,maxCav;		/* tetrahedra removed by the current insertion */
+} tetMesh;
+
+static double
+dist2(const double *x, const double *y){
+  return (x[0]-y[0])*(x[0]-y[0])+(x[1]-y[1])*(x[1]-y[1])+(x[2]-y[2])*(x[2]-y[2]);
+}
+
+/* Six times the signed volume of the tetrahedron abcd */
+static double
+orient(const double *a, const double *b, const double *c, const double *d){
+  double u[DIM],v[DIM],w[DIM];
+  int i;
+
+  for(i=0;i<DIM;i++){
+    u[i]=b[i]-a[i];
+    v[i]=c[i]-a[i];
+    w[i]=d[i]-a[i];
+  }
+  return u[0]*(v[1]*w[2]-v[2]*w[1])+u[1]*(v[2]*w[0]-v[0]*w[2])+u[2]*(v[0]*w[1]-v[1]*w[0]);
+}
+
+/* orient() of tetrahedron it with vertex k replaced by p, relative to the product of the distances of p to the other three vertices: negative if p is beyond the face opposite vertex k */
+static double
+orientWith(tetMesh *tm, int it, int k, const double *p){
+  const double *x[DIM+1];
+  double scale=1.;
+  int j;
+
+  for(j=0;j<DIM+1;j++){
+    if(j==k) x[j]=p;
+    else {
+      x[j]=tm->g[tm->t[it].v[j]].x;
+      scale*=sqrt(dist2(p,x[j]));
+    }
+  }
+  if(scale==0.) return 0.;
+  return orient(x[0],x[1],x[2],x[3])/scale;
+}
+
+static void
+setSphere(tetMesh *tm, int it){
+  tetra *t=&tm->t[it];
+  const double *a=tm->g[t->v[0]].x;
+  double b[DIM],c[DIM],d[DIM],cd[DIM],db[DIM],bc[DIM],bb=0.,cc=0.,dd=0.,den;
+  int i;
+
+  for(i=0;i<DIM;i++){
+    b[i]=tm->g[t->v[1]].x[i]-a[i];
+    c[i]=tm->g[t->v[2]].x[i]-a[i];
+    d[i]=tm->g[t->v[3]].x[i]-a[i];
+    bb+=b[i]*b[i];
+    cc+=c[i]*c[i];
+    dd+=d[i]*d[i];
+  }
+  for(i=0;i<DIM;i++){
+    cd[i]=c[(i+1)%3]*d[(i+2)%3]-c[(i+2)%3]*d[(i+1)%3];
+    db[i]=d[(i+1)%3]*b[(i+2)%3]-d[(i+2)%3]*b[(i+1)%3];
+    bc[i]=b[(i+1)%3]*c[(i+2)%3]-b[(i+2)%3]*c[(i+1)%3];
+  }
+  den=2.*(b[0]*cd[0]+b[1]*cd[1]+b[2]*cd[2]);
+  if(den==0.){
+    /* A flat tetrahedron is removed by any insertion next to it */
+    for(i=0;i<DIM;i++) t->cc[i]=a[i];
+    t->r2=HUGE_VAL;
+    return;
+  }
+  t->r2=0.;
+  for(i=0;i<DIM;i++){
+    t->cc[i]=(bb*cd[i]+cc*db[i]+dd*bc[i])/den;
+    t->r2+=t->cc[i]*t->cc[i];
+    t->cc[i]+=a[i];
+  }
+}
+
+static int
+inSphere(tetMesh *tm, int it, const double *p){
+  double d2=0.;
+  int i;
+
+  for(i=0;i<DIM;i++) d2+=(p[i]-tm->t[it].cc[i])*(p[i]-tm->t[it].cc[i]);
+  return d2<tm->t[it].r2;
+}
+
+static int
+newTetra(tetMesh *tm){
+  if(tm->n==tm->max){
+    tm->max*=2;
+    tm->t=realloc(tm->t, sizeof(tetra)*tm->max);
+    tm->tmark=realloc(tm->tmark, sizeof(int)*tm->max);
+  }
+  tm->tmark[tm->n]=0;
+  tm->t[tm->n].dead=0;
+  return tm->n++;
+}
+
+static void
+addToCavity(tetMesh *tm, int it){
+  if(tm->nCav==tm->maxCav){
+    tm->maxCav*=2;
+    tm->cav=realloc(tm->cav, sizeof(int)*tm->maxCav);
+  }
+  tm->tmark[it]=tm->stamp;
+  tm->cav[tm->nCav++]=it;
+}
+
+typedef struct {
+  int v[DIM],t,k;
+} faceRec;
+
+static int
+compareFace(const void *a, const void *b){
+  const faceRec *fa=a,*fb=b;
+  int i;
+
+  for(i=0;i<DIM;i++) if(fa->v[i]!=fb->v[i]) return fa->v[i]-fb->v[i];
+  return 0;
+}
+
+/* Sets up the mesh of the cells dc of the old grid on the vertices g of the new one, where old point id is id if id<nOld (the grid points) and id+nAdd otherwise (the sink points) */
+static void
+buildMesh(tetMesh *tm, struct grid *g, int nVert, struct cell *dc, unsigned long numCells, int nOld, int nAdd){
+  faceRec *f;
+  unsigned long i;
+  int j,k,l,m,tmp;
+
+  tm->g=g;
+  tm->n=numCells;
+  tm->max=2*numCells+64;
+  tm->t=malloc(sizeof(tetra)*tm->max);
+  tm->tmark=calloc(tm->max, sizeof(int));
+  tm->vface=calloc(nVert, sizeof(int));
+  tm->vtet=malloc(sizeof(int)*nVert);
+  for(j=0;j<nVert;j++) tm->vtet[j]=-1;
+  tm->stamp=0;
+  tm->maxCav=64;
+  tm->nCav=0;
+  tm->cav=malloc(sizeof(int)*tm->maxCav);
+
+  f=malloc(sizeof(faceRec)*(DIM+1)*numCells);
+  for(i=0;i<numCells;i++){
+    for(j=0;j<DIM+1;j++){
+      tm->t[i].v[j]=(dc[i].vertx[j]<nOld) ? dc[i].vertx[j] : dc[i].vertx[j]+nAdd;
+      tm->t[i].nb[j]=-1;
+    }
+    if(orient(g[tm->t[i].v[0]].x,g[tm->t[i].v[1]].x,g[tm->t[i].v[2]].x,g[tm->t[i].v[3]].x)<0.){
+      tmp=tm->t[i].v[0];
+      tm->t[i].v[0]=tm->t[i].v[1];
+      tm->t[i].v[1]=tmp;
+    }
+    tm->t[i].dead=0;
+    setSphere(tm,i);
+    for(j=0;j<DIM+1;j++){
+      tm->vtet[tm->t[i].v[j]]=i;
+      /* The face opposite vertex j, its vertices sorted */
+      m=0;
+      for(k=0;k<DIM+1;k++) if(k!=j) f[i*(DIM+1)+j].v[m++]=tm->t[i].v[k];
+      for(k=1;k<DIM;k++){
+        for(l=k;l>0 && f[i*(DIM+1)+j].v[l-1]>f[i*(DIM+1)+j].v[l];l--){
+          tmp=f[i*(DIM+1)+j].v[l];
+          f[i*(DIM+1)+j].v[l]=f[i*(DIM+1)+j].v[l-1];
+          f[i*(DIM+1)+j].v[l-1]=tmp;
+        }
+      }
+      f[i*(DIM+1)+j].t=i;
+      f[i*(DIM+1)+j].k=j;
+    }
+  }
+
+  qsort(f, (DIM+1)*numCells, sizeof(faceRec), compareFace);
+  for(i=0;i+1<(DIM+1)*numCells;i++){
+    if(compareFace(&f[i],&f[i+1])==0){
+      tm->t[f[i].t].nb[f[i].k]=f[i+1].t;
+      tm->t[f[i+1].t].nb[f[i+1].k]=f[i].t;
+      i++;
+    }
+  }
+  free(f);
+}
+
+static void
+freeMesh(tetMesh *tm){
+  free(tm->t);
+  free(tm->tmark);
+  free(tm->vface);
+  free(tm->vtet);
+  free(tm->cav);
+}
+
+/* Walks from tetrahedron it towards p and returns the tetrahedron that contains it; -1 if the walk does not end. A point on a face, as the middle of an edge is on those around it, can be found on either side by rounding, so a face is only crossed if p is clearly beyond it. */
+static int
+locate(tetMesh *tm, int it, const double *p){
+  int step,k,nb,moved;
+
+  for(step=0;step<tm->n;step++){
+    moved=0;
+    for(k=0;k<DIM+1 && !moved;k++){
+      nb=tm->t[it].nb[k];
+      if(nb>=0 && orientWith(tm,it,k,p)<-ORIENT_TOL){
+        it=nb;
+        moved=1;
+      }
+    }
+    if(!moved) return it;
+  }
+  return -1;
+}
+
+/* Inserts vertex ip, which lies next to vertex near, into the triangulation and marks the vertices whose neighbours change as touched; returns 0, and leaves the triangulation as it was, if it does not fit in */
+static int
+insertPoint(tetMesh *tm, int ip, int near, char *touched){
+  const double *p=tm->g[ip].x;
+  int it,i,j,k,l,nb,nNew,*newT,(*link)[4],nLink,e0,e1=-1;
+
+  it=(tm->vtet[near]>=0) ? locate(tm,tm->vtet[near],p) : -1;
+  if(it<0 || !inSphere(tm,it,p)){
+    for(it=0;it<tm->n;it++) if(!tm->t[it].dead && inSphere(tm,it,p)) break;
+    if(it==tm->n) return 0;
+  }
+
+  /* The cavity: the tetrahedra whose circumspheres contain p, all connected */
+  tm->stamp++;
+  tm->nCav=0;
+  addToCavity(tm,it);
+  for(i=0;i<tm->nCav;i++){
+    for(k=0;k<DIM+1;k++){
+      nb=tm->t[tm->cav[i]].nb[k];
+      if(nb>=0 && tm->tmark[nb]!=tm->stamp && inSphere(tm,nb,p)) addToCavity(tm,nb);
+    }
+  }
+
+  /* Each face on its boundary must see p on its inner side, or the new tetrahedra would overlap; rounding can break this, and the tetrahedron beyond such a face is added to the cavity */
+  nNew=0;
+  for(i=0;i<tm->nCav;i++){
+    for(k=0;k<DIM+1;k++){
+      nb=tm->t[tm->cav[i]].nb[k];
+      if(nb>=0 && tm->tmark[nb]==tm->stamp) continue;
+      if(orientWith(tm,tm->cav[i],k,p)<=ORIENT_TOL){
+        if(nb<0) return 0;
+        addToCavity(tm,nb);
+      }
+    }
+  }
+
+  /* Every vertex of the cavity must stay a vertex of the triangulation */
+  for(i=0;i<tm->nCav;i++){
+    for(k=0;k<DIM+1;k++){
+      nb=tm->t[tm->cav[i]].nb[k];
+      if(nb>=0 && tm->tmark[nb]==tm->stamp) continue;
+      nNew++;
+      for(j=0;j<DIM+1;j++) if(j!=k) tm->vface[tm->t[tm->cav[i]].v[j]]=tm->stamp;
+    }
+  }
+  for(i=0;i<tm->nCav;i++){
+    for(k=0;k<DIM+1;k++) if(tm->vface[tm->t[tm->cav[i]].v[k]]!=tm->stamp) return 0;
+  }
+
+  /* A new tetrahedron on each boundary face; the faces between them are found by their two vertices other than p */
+  newT=malloc(sizeof(int)*nNew);
+  link=malloc(sizeof(*link)*nNew*DIM);
+  nNew=0;
+  nLink=0;
+  for(i=0;i<tm->nCav;i++){
+    for(k=0;k<DIM+1;k++){
+      nb=tm->t[tm->cav[i]].nb[k];
+      if(nb>=0 && tm->tmark[nb]==tm->stamp) continue;
+      it=newTetra(tm);
+      newT[nNew++]=it;
+      memcpy(tm->t[it].v, tm->t[tm->cav[i]].v, sizeof(tm->t[it].v));
+      tm->t[it].v[k]=ip;
+      for(j=0;j<DIM+1;j++) tm->t[it].nb[j]=-1;
+      tm->t[it].nb[k]=nb;
+      if(nb>=0){
+        for(j=0;j<DIM+1;j++) if(tm->t[nb].nb[j]==tm->cav[i]) tm->t[nb].nb[j]=it;
+      }
+      setSphere(tm,it);
+      for(j=0;j<DIM+1;j++){
+        if(j==k) continue;
+        e0=-1;
+        for(l=0;l<DIM+1;l++){
+          if(l==j || l==k) continue;
+          if(e0<0) e0=tm->t[it].v[l];
+          else e1=tm->t[it].v[l];
+        }
+        link[nLink][0]=(e0<e1) ? e0 : e1;
+        link[nLink][1]=(e0<e1) ? e1 : e0;
+        link[nLink][2]=it;
+        link[nLink][3]=j;
+        nLink++;
+      }
+    }
+  }
+  for(i=0;i<nLink;i++){
+    for(j=i+1;j<nLink;j++){
+      if(link[i][0]==link[j][0] && link[i][1]==link[j][1]){
+        tm->t[link[i][2]].nb[link[i][3]]=link[j][2];
+        tm->t[link[j][2]].nb[link[j][3]]=link[i][2];
+        break;
+      }
+    }
+  }
+
+  for(i=0;i<tm->nCav;i++){
+    tm->t[tm->cav[i]].dead=1;
+    for(k=0;k<DIM+1;k++) touched[tm->t[tm->cav[i]].v[k]]=1;
+  }
+  touched[ip]=1;
+  for(i=0;i<nNew;i++){
+    for(k=0;k<DIM+1;k++) tm->vtet[tm->t[newT[i]].v[k]]=newT[i];
+  }
+  free(newT);
+  free(link);
+  return 1;
+}
+
+static void
+addNeighbour(int **list, int *n, int *max, int id){
+  int i;
+
+  for(i=0;i<*n;i++) if((*list)[i]==id) return;
+  if(*n==*max){
+    *max=(*max>0) ? 2*(*max) : 16;
+    *list=realloc(*list, sizeof(int)**max);
+  }
+  (*list)[(*n)++]=id;
+}
+
+/* Sets the neighbours, edges and splines of the grid ng from the mesh: the points that are not touched copy theirs from the old grid g */
+static void
+meshNeighbours(inputPars *par, tetMesh *tm, struct grid *g, struct grid *ng, char *touched, int nOld, int nAdd){
+  int id,o,i,j,k,kr,l,useGrad,**list,*n,*max,*old;
+  double (*vertVel)[3],(*vertGrad)[9]=NULL;
+
+  list=calloc(par->ncell, sizeof(int *));
+  n=calloc(par->ncell, sizeof(int));
+  max=calloc(par->ncell, sizeof(int));
+  for(i=0;i<tm->n;i++){
+    if(tm->t[i].dead) continue;
+    for(j=0;j<DIM+1;j++){
+      id=tm->t[i].v[j];
+      if(!touched[id]) continue;
+      for(k=0;k<DIM+1;k++) if(k!=j) addNeighbour(&list[id],&n[id],&max[id],tm->t[i].v[k]);
+    }
+  }
+
+  /* The old id of each point, -1 for the new ones */
+  old=malloc(sizeof(int)*par->ncell);
+  for(id=0;id<par->ncell;id++) old[id]=(id<nOld) ? id : ((id<nOld+nAdd) ? -1 : id-nAdd);
+
+  for(id=0;id<par->ncell;id++){
+    o=old[id];
+    if(!touched[id]){
+      ng[id].numNeigh=g[o].numNeigh;
+      ng[id].neigh=malloc(sizeof(struct grid *)*ng[id].numNeigh);
+      ng[id].dir=malloc(sizeof(point)*ng[id].numNeigh);
+      ng[id].ds=malloc(sizeof(double)*ng[id].numNeigh);
+      for(k=0;k<ng[id].numNeigh;k++){
+        j=g[o].neigh[k]->id;
+        ng[id].neigh[k]=&ng[(j<nOld) ? j : j+nAdd];
+      }
+      memcpy(ng[id].dir, g[o].dir, sizeof(point)*ng[id].numNeigh);
+      memcpy(ng[id].ds, g[o].ds, sizeof(double)*ng[id].numNeigh);
+    } else {
+      ng[id].numNeigh=n[id];
+      ng[id].neigh=malloc(sizeof(struct grid *)*ng[id].numNeigh);
+      ng[id].dir=malloc(sizeof(point)*ng[id].numNeigh);
+      ng[id].ds=malloc(sizeof(double)*ng[id].numNeigh);
+      for(k=0;k<ng[id].numNeigh;k++){
+        ng[id].neigh[k]=&ng[list[id][k]];
+        for(l=0;l<3;l++) ng[id].dir[k].x[l]=ng[id].neigh[k]->x[l]-ng[id].x[l];
+        ng[id].ds[k]=sqrt(ng[id].dir[k].x[0]*ng[id].dir[k].x[0]+ng[id].dir[k].x[1]*ng[id].dir[k].x[1]+ng[id].dir[k].x[2]*ng[id].dir[k].x[2]);
+        for(l=0;l<3;l++) ng[id].dir[k].xn[l]=ng[id].dir[k].x[l]/ng[id].ds[k];
+      }
+    }
+    ng[id].nphot=ininphot*ng[id].numNeigh;
+    ng[id].a0=malloc(ng[id].numNeigh*sizeof(storeReal));
+    ng[id].a1=malloc(ng[id].numNeigh*sizeof(storeReal));
+    ng[id].a2=malloc(ng[id].numNeigh*sizeof(storeReal));
+    ng[id].a3=malloc(ng[id].numNeigh*sizeof(storeReal));
+    ng[id].a4=malloc(ng[id].numNeigh*sizeof(storeReal));
+    if(!touched[id] || id>=par->pIntensity){
+      for(k=0;k<ng[id].numNeigh;k++){
+        ng[id].a0[k]=touched[id] ? 0. : g[o].a0[k];
+        ng[id].a1[k]=touched[id] ? 0. : g[o].a1[k];
+        ng[id].a2[k]=touched[id] ? 0. : g[o].a2[k];
+        ng[id].a3[k]=touched[id] ? 0. : g[o].a3[k];
+        ng[id].a4[k]=touched[id] ? 0. : g[o].a4[k];
+      }
+    }
+  }
+
+  /* The splines of the touched grid points: those of the edges that were there before are copied, the others fitted as in getVelosplines() */
+  useGrad=modelVelocityGradient();
+  vertVel=malloc(sizeof(*vertVel)*par->ncell);
+  if(useGrad) vertGrad=malloc(sizeof(*vertGrad)*par->ncell);
+  for(id=0;id<par->ncell;id++){
+    if(!touched[id]) continue;
+    velocity(ng[id].x[0],ng[id].x[1],ng[id].x[2],vertVel[id]);
+    if(useGrad) velocityGradient(ng[id].x[0],ng[id].x[1],ng[id].x[2],vertGrad[id]);
+  }
+
+  omp_set_dynamic(0);
+#pragma omp parallel for private(id,o,i,j,k,kr) num_threads(par->nThreads) schedule(dynamic,64)
+  for(id=0;id<par->pIntensity;id++){
+    double c[5],cr[5];
+
+    if(!touched[id]) continue;
+    o=old[id];
+    for(k=0;k<ng[id].numNeigh;k++){
+      j=ng[id].neigh[k]->id;
+      i=-1;
+      if(o>=0 && old[j]>=0){
+        for(i=g[o].numNeigh-1;i>=0;i--) if(g[o].neigh[i]->id==old[j]) break;
+      }
+      if(i>=0){
+        ng[id].a0[k]=g[o].a0[i];
+        ng[id].a1[k]=g[o].a1[i];
+        ng[id].a2[k]=g[o].a2[i];
+        ng[id].a3[k]=g[o].a3[i];
+        ng[id].a4[k]=g[o].a4[i];
+        continue;
+      }
+      if(j<par->pIntensity && j<id) continue; /* This edge is done from the other end. */
+
+      fitEdgeSpline(ng,id,k,vertVel[id],vertVel[j],useGrad ? vertGrad[id] : NULL,useGrad ? vertGrad[j] : NULL,useGrad,c,cr);
+      setSplineCoeffs(&ng[id],k,c);
+      if(j<par->pIntensity){
+        kr=0;
+        while(kr<ng[j].numNeigh && ng[j].neigh[kr]->id!=id) kr++;
+        if(kr==ng[j].numNeigh){
+          if(!silent) bail_out("Velocity spline error: Delaunay neighbours are not symmetric");
+          exit(1);
+        }
+        setSplineCoeffs(&ng[j],kr,cr);
+      }
+    }
+  }
+
+  for(id=0;id<par->ncell;id++) free(list[id]);
+  free(list);
+  free(n);
+  free(max);
+  free(old);
+  free(vertVel);
+  if(useGrad) free(vertGrad);
+}
+
+/* Sets up the grid of the points of g and the nAdd new points at the middle of the edges edge, with the same sink points; *dc, the triangulation of g, is replaced by that of the new grid */
+static struct grid *
+refinedGrid(inputPars *par, struct grid *g, int nAdd, int (*edge)[2], struct cell **dc, unsigned long *numCells){
+  struct grid *ng;
+  tetMesh tm;
+  char *touched;
+  int id,o,i,l,nOld=par->pIntensity,fitted=0;
+  unsigned long ic;
+
+  par->pIntensity=nOld+nAdd;
+  par->ncell=par->pIntensity+par->sinkPoints;
+  gridAlloc(par,&ng);
+
+  /* The old points keep their model values */
+  for(id=0;id<par->ncell;id++){
+    ng[id].id=id;
+    if(id>=nOld && id<par->pIntensity){
+      l=id-nOld;
+      for(i=0;i<DIM;i++) ng[id].x[i]=0.5*(g[edge[l][0]].x[i]+g[edge[l][1]].x[i]);
+      ng[id].sink=0;
+      density(    ng[id].x[0],ng[id].x[1],ng[id].x[2], ng[id].dens);
+      temperature(ng[id].x[0],ng[id].x[1],ng[id].x[2], ng[id].t);
+      doppler(    ng[id].x[0],ng[id].x[1],ng[id].x[2],&ng[id].dopb);
+      abundance(  ng[id].x[0],ng[id].x[1],ng[id].x[2], ng[id].abun);
+      velocity(   ng[id].x[0],ng[id].x[1],ng[id].x[2], ng[id].vel);
+      continue;
+    }
+    o=(id<nOld) ? id : id-nAdd;
+    memcpy(ng[id].x, g[o].x, sizeof(ng[id].x));
+    memcpy(ng[id].vel, g[o].vel, sizeof(ng[id].vel));
+    memcpy(ng[id].dens, g[o].dens, sizeof(double)*par->collPart);
+    memcpy(ng[id].abun, g[o].abun, sizeof(double)*par->nSpecies);
+    memcpy(ng[id].nmol, g[o].nmol, sizeof(double)*par->nSpecies);
+    ng[id].t[0]=g[o].t[0];
+    ng[id].t[1]=g[o].t[1];
+    ng[id].dopb=g[o].dopb;
+    ng[id].sink=g[o].sink;
+  }
+
+  /* The new points, inserted one by one into the old triangulation */
+  if(*dc!=NULL && *numCells>0){
+    touched=calloc(par->ncell, sizeof(char));
+    buildMesh(&tm,ng,par->ncell,*dc,*numCells,nOld,nAdd);
+    fitted=1;
+    for(l=0;l<nAdd && fitted;l++) fitted=insertPoint(&tm,nOld+l,edge[l][0],touched);
+    if(fitted){
+      meshNeighbours(par,&tm,g,ng,touched,nOld,nAdd);
+      free(*dc);
+      *numCells=0;
+      for(i=0;i<tm.n;i++) if(!tm.t[i].dead) (*numCells)++;
+      *dc=malloc(sizeof(struct cell)*(*numCells));
+      ic=0;
+      for(i=0;i<tm.n;i++){
+        if(tm.t[i].dead) continue;
+        memcpy((*dc)[ic++].vertx, tm.t[i].v, sizeof((*dc)[0].vertx));
+      }
+    } else if(!silent) warning("A refinement point does not fit into the grid; triangulating it again");
+    freeMesh(&tm);
+    free(touched);
+  }
+
+  if(!fitted){
+    qhull(par, ng, dc, numCells);
+    distCalc(par, ng);
+    getVelosplines(par, ng);
+  }
+  return ng;
+}
+
+/* Refines the grid *gp par->refine times, solving the populations on each grid to find where; *dc and *numCells, the triangulation of *gp, are replaced by that of the final grid */
+void
+refineGrid(inputPars *par, struct grid **gp, struct cell **dc, unsigned long *numCells){
+  inputPars cpar;
+  struct grid *og;
+  molData *mc;
+  int (*edge)[2];
+  int pass,nAdd,popsdone=0,timer;
+
+  for(pass=0;pass<par->refine;pass++){
+    /* The solutions on the grids before the last have no output of their own */
+    cpar=*par;
+    cpar.outputfile=NULL;
+    cpar.binoutputfile=NULL;
+    cpar.gridfile=NULL;
+    cpar.checkpoint=NULL;
+    cpar.nImages=0;
+    mc=calloc(par->nSpecies, sizeof(molData));
+    levelPops(mc, &cpar, *gp, &popsdone, 0);
+
+    timer=timerBegin("refine");
+    nAdd=selectEdges(&cpar, mc, *gp, &edge);
+    savePops(&cpar, mc, *gp, nAdd, edge);
+    if(nAdd>0){
+      og=*gp;
+      *gp=refinedGrid(par, og, nAdd, edge, dc, numCells);
+      freeGrid(&cpar, mc, og);
+    }
+    free(edge);
+    cpar.moldatfile=NULL;
+    freeInput(&cpar, NULL, mc);
+    timerEnd(timer);
+    if(nAdd==0){
+      if(!silent) warning("No more edges of the grid to refine");
+      break;
+    }
+  }
+}
+
+/* Sets the populations of g, whose molecular data m must be set up, from the solution kept by refineGrid() and returns 1; 0 if there is none. g may be a subdomain grid of the refined grid (see subdomain.c). */
+int
+refinePops(molData *m, inputPars *par, struct grid *g){
+  int id,gid,ispec,i,k,a,b,nlevTot=0,used=0;
+  inputPars wpar;
+
+  if(saved.pops==NULL) return 0;
+  wholeGrid(par,g,&wpar);
+  if(!par->lte_only && !par->lvg_only && wpar.pIntensity==saved.n+saved.nAdd){
+    for(ispec=0;ispec<par->nSpecies;ispec++) nlevTot+=m[ispec].nlev;
+    for(id=0;id<par->pIntensity;id++){
+      gid=wholeId(g,id);
+      a=(gid<saved.n) ? gid : saved.edge[gid-saved.n][0];
+      b=(gid<saved.n) ? gid : saved.edge[gid-saved.n][1];
+      k=0;
+      for(ispec=0;ispec<par->nSpecies;ispec++){
+        for(i=0;i<m[ispec].nlev;i++)
+          g[id].mol[ispec].pops[i]=0.5*(saved.pops[(size_t)a*nlevTot+k+i]+saved.pops[(size_t)b*nlevTot+k+i]);
+        k+=m[ispec].nlev;
+      }
+    }
+    used=1;
+  }
+  free(saved.edge);
+  free(saved.pops);
+  saved.edge=NULL;
+  saved.pops=NULL;
+  return used;
+}
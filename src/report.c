@@ -10,6 +10,7 @@
 #include "lime.h"
 #include <gsl/gsl_histogram.h>
 #include <gsl/gsl_fit.h>
+#include <sys/resource.h>
 
 
 void
@@ -22,6 +23,9 @@ report(int i, inputPars *par, struct grid *g){
   double hx[bins],hy[bins],hw[bins];
   double c0, c1, cov00, cov01, cov11, chisq1,b0, b1, chisq2;
 
+  /* Only rank 0 writes the output of an MPI run (see ranks.c) */
+  if(limeOpts.rank!=0) return;
+
   gsl_histogram * h = gsl_histogram_alloc (n);
   gsl_histogram * f = gsl_histogram_alloc (n);
 
@@ -100,6 +104,58 @@ report(int i, inputPars *par, struct grid *g){
   }
   /*    gsl_histogram_fprintf (stdout, h, "%g", "%g");	 */
 
+  writeTimers(fp, par);
+  writeCounters(fp);
+
   gsl_histogram_free (h);
+  gsl_histogram_free (f);
   fclose(fp);
 }
+
+/* Appends the phase timings to the text report, and writes them also as LimeReport.json and LimeReport.csv for scripts which size jobs or compare versions. */
+void
+writeTimers(FILE *fp, inputPars *par){
+  FILE *fj,*fc;
+  int i,n;
+  timerRecord *t;
+  double busy=0.,idle=0.;
+  struct rusage usage;
+  long peakRSS=0;
+
+  n=timerCount();
+  if(getrusage(RUSAGE_SELF, &usage)==0) peakRSS=usage.ru_maxrss; /* kB on Linux, bytes on OS X */
+
+  fprintf(fp,"\n***\n*** Timing (seconds; busy and idle summed over threads)\n\n");
+  fprintf(fp,"    %-20s %5s %12s %12s %12s %7s\n","Phase","Index","Wall","Busy","Idle","Threads");
+  for(i=0;i<n;i++){
+    t=timerGet(i);
+    fprintf(fp,"    %-20s %5d %12.4f %12.4f %12.4f %7d\n",t->phase,t->index,t->wall,t->busy,t->idle,t->nThreads);
+    if(t->nThreads>1 && strcmp(t->phase,"photon") && strcmp(t->phase,"stateq")){
+      busy+=t->busy;
+      idle+=t->idle;
+    }
+  }
+  if(busy+idle>0.) fprintf(fp,"\n    Thread utilisation in parallel phases: %5.1f%%\n", 100.*busy/(busy+idle));
+  fprintf(fp,"    Peak resident set size: %ld kB\n", peakRSS);
+  fprintf(fp,"    Vector kernels: %s\n", vecmathName());
+  fprintf(fp,"    Per-point storage: %s\n", (sizeof(storeReal)==sizeof(float)) ? "single" : "double");
+
+  if((fj=fopen("LimeReport.json","w"))==NULL || (fc=fopen("LimeReport.csv","w"))==NULL){
+    if(fj!=NULL) fclose(fj);
+    if(!silent) warning("Could not write the timing report");
+    return;
+  }
+
+  fprintf(fj,"{\n  \"version\": \"%s\",\n  \"nThreads\": %d,\n  \"ncell\": %d,\n  \"nSpecies\": %d,\n  \"peak_rss_kb\": %ld,\n  \"simd\": \"%s\",\n  \"store\": \"%s\",\n",VERSION,par->nThreads,par->ncell,par->nSpecies,peakRSS,vecmathName(),(sizeof(storeReal)==sizeof(float)) ? "single" : "double");
+  writeCountersJson(fj);
+  fprintf(fj,"  \"phases\": [\n");
+  fprintf(fc,"phase,index,wall,busy,idle,threads\n");
+  for(i=0;i<n;i++){
+    t=timerGet(i);
+    fprintf(fj,"    {\"phase\": \"%s\", \"index\": %d, \"wall\": %.6e, \"busy\": %.6e, \"idle\": %.6e, \"threads\": %d}%s\n",t->phase,t->index,t->wall,t->busy,t->idle,t->nThreads,(i<n-1)?",":"");
+    fprintf(fc,"%s,%d,%.6e,%.6e,%.6e,%d\n",t->phase,t->index,t->wall,t->busy,t->idle,t->nThreads);
+  }
+  fprintf(fj,"  ]\n}\n");
+  fclose(fj);
+  fclose(fc);
+}
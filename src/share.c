@@ -0,0 +1,284 @@
+/*
+ *  share.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Shared read-only grid (par->gridShare). Once the populations are known, publishGrid() copies what raytrace() needs of the grid and the molecular data (positions, Voronoi neighbours, densities, abundances, populations, opacities and line data) into a file, which is mapped into memory at the fixed address SHARE_BASE so that the pointers in it stay valid. Later runs of the same model attach the file read-only at that address with attachGrid() and go straight to the images: the pages are shared by all the processes that map the file, and nothing is read or built. With a file in /dev/shm the segment lives in memory only.
+
+The file is written under a temporary name and renamed when complete, so that a run never attaches a half-written grid. Its header holds a checksum of the model (modelChecksum()): the parameters which shape the grid and the populations, the contents of the molecular data and dust files and, for a grid built from the model functions, their values at a few fixed points. A run attaches the grid only if its own checksum is the same, so an edited model.c or data file is not imaged with the populations of the old one.
+*/
+
+#include "lime.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0	/* the address is then only a hint, which is checked */
+#endif
+
+#define SHARE_MAGIC "LIMESHM"
+#define SHARE_BASE 0x600000000000UL	/* address of the segment in every process */
+#define SHARE_NSAMPLE 8			/* points at which the model functions are sampled for the checksum */
+#define SHARE_NVAL 99			/* room for the values of one model function, as in gridAlloc() */
+
+typedef struct {
+  char magic[8];
+  int sizeGrid,sizeMol,sizeStore;	/* layout of the structs, which must match the reading LIME */
+  size_t size;
+  void *base;
+  int ncell,pIntensity,sinkPoints,nSpecies,collPart;
+  double radius;
+  unsigned long long checksum;		/* of the model, see modelChecksum() */
+  struct grid *g;
+  molData *m;
+} shareHeader;
+
+/* Bump allocator over the segment; with base NULL it only counts, for the size of the segment */
+typedef struct {
+  char *base;
+  size_t used;
+} shareArena;
+
+static void *shareBase=NULL;
+static size_t shareSize=0;
+
+/* Positions of the samples of the model functions, in units of par->radius */
+static const double samplePoints[SHARE_NSAMPLE][DIM]={
+  { 0.01, 0.02, 0.03}, { 0.10,-0.05, 0.02}, {-0.20, 0.10, 0.30}, { 0.30, 0.40,-0.10},
+  {-0.50,-0.30, 0.20}, { 0.60, 0.10, 0.50}, {-0.10,-0.70,-0.40}, { 0.90, 0.00, 0.05}
+};
+
+static unsigned long long
+hashString(unsigned long long h, const char *str){
+  if(str==NULL) return hashBytes(h, "", 1);
+  return hashBytes(h, str, strlen(str)+1);
+}
+
+/* Hash of the contents of file name, or of the name only if it cannot be read */
+static unsigned long long
+hashFileContents(unsigned long long h, char *name){
+  unsigned long long fileHash,size;
+
+  if(name==NULL || hashFile(name, &fileHash, &size)) return hashString(h, name);
+  h=hashBytes(h, &fileHash, sizeof(fileHash));
+  return hashBytes(h, &size, sizeof(size));
+}
+
+/* Hash of the values of a model function at x */
+static unsigned long long
+hashModelFunction(unsigned long long h, void (*func)(double, double, double, double *), const double *x){
+  double val[SHARE_NVAL];
+  int k;
+
+  for(k=0;k<SHARE_NVAL;k++) val[k]=-1.;
+  func(x[0],x[1],x[2],val);
+  return hashBytes(h, val, sizeof(val));
+}
+
+/* Checksum of what the shared grid was computed from: parameters, data files and the model functions */
+static unsigned long long
+modelChecksum(inputPars *par){
+  unsigned long long h=FNV_OFFSET;
+  double x[DIM];
+  int i,k;
+
+  h=hashBytes(h, &par->radius, sizeof(par->radius));
+  h=hashBytes(h, &par->minScale, sizeof(par->minScale));
+  h=hashBytes(h, &par->tcmb, sizeof(par->tcmb));
+  h=hashBytes(h, &par->nSpecies, sizeof(par->nSpecies));
+  h=hashBytes(h, &par->sampling, sizeof(par->sampling));
+  h=hashBytes(h, &par->lte_only, sizeof(par->lte_only));
+  h=hashBytes(h, &par->lvg_only, sizeof(par->lvg_only));
+  h=hashBytes(h, &par->blend, sizeof(par->blend));
+  h=hashString(h, par->pregrid);
+  h=hashString(h, par->restart);
+  for(i=0;par->moldatfile!=NULL && i<par->nSpecies;i++) h=hashFileContents(h, par->moldatfile[i]);
+  h=hashFileContents(h, par->dust);
+
+  /* A pregrid or restart run may not define the model functions */
+  if(par->doPregrid || par->restart!=NULL) return h;
+  for(i=0;i<SHARE_NSAMPLE;i++){
+    for(k=0;k<DIM;k++) x[k]=samplePoints[i][k]*par->radius;
+    h=hashModelFunction(h, density, x);
+    h=hashModelFunction(h, temperature, x);
+    h=hashModelFunction(h, abundance, x);
+    h=hashModelFunction(h, doppler, x);
+    h=hashModelFunction(h, velocity, x);
+  }
+  return h;
+}
+
+static void *
+take(shareArena *a, size_t n){
+  void *p=(a->base!=NULL) ? a->base+a->used : NULL;
+
+  a->used+=(n+15)&~(size_t)15;
+  return p;
+}
+
+static void *
+copyTo(shareArena *a, const void *src, size_t n){
+  void *p;
+
+  if(src==NULL) return NULL;
+  p=take(a,n);
+  if(p!=NULL && n>0) memcpy(p,src,n);
+  return p;
+}
+
+/* Lays out (and with a->base set, fills) the segment: header, grid, molecular data, then the arrays they point to */
+static void
+layout(shareArena *a, inputPars *par, struct grid *g, molData *m){
+  shareHeader *h=take(a,sizeof(shareHeader));
+  struct grid *sg=take(a,sizeof(struct grid)*par->ncell),gp;
+  molData *sm=take(a,sizeof(molData)*par->nSpecies),mp;
+  struct populations pp;
+  int id,k,s;
+
+  for(id=0;id<par->ncell;id++){
+    /* A private copy of the point, with its pointers replaced by ones into the segment; the photon-only arrays are left out */
+    gp=g[id];
+    gp.a0=gp.a1=gp.a2=gp.a3=gp.a4=NULL;
+    gp.w=NULL;
+    gp.ds=NULL;
+    gp.dir=copyTo(a,g[id].dir,sizeof(point)*g[id].numNeigh);
+    gp.neigh=take(a,sizeof(struct grid *)*g[id].numNeigh);
+    if(gp.neigh!=NULL) for(k=0;k<g[id].numNeigh;k++) gp.neigh[k]=sg+(g[id].neigh[k]-g);
+    gp.dens=copyTo(a,g[id].dens,sizeof(double)*par->collPart);
+    gp.abun=copyTo(a,g[id].abun,sizeof(double)*par->nSpecies);
+    gp.nmol=copyTo(a,g[id].nmol,sizeof(double)*par->nSpecies);
+    gp.mol=take(a,sizeof(struct populations)*par->nSpecies);
+    for(s=0;s<par->nSpecies;s++){
+      pp=g[id].mol[s];
+      pp.pops=copyTo(a,g[id].mol[s].pops,sizeof(storeReal)*m[s].nlev);
+      pp.knu =copyTo(a,g[id].mol[s].knu, sizeof(storeReal)*m[s].nline);
+      pp.dust=copyTo(a,g[id].mol[s].dust,sizeof(storeReal)*m[s].nline);
+      pp.partner=NULL;
+      if(a->base!=NULL) gp.mol[s]=pp;
+    }
+    if(a->base!=NULL) sg[id]=gp;
+  }
+
+  for(s=0;s<par->nSpecies;s++){
+    mp=m[s];
+    mp.lal=copyTo(a,m[s].lal,sizeof(int)*m[s].nline);
+    mp.lau=copyTo(a,m[s].lau,sizeof(int)*m[s].nline);
+    mp.aeinst =copyTo(a,m[s].aeinst, sizeof(double)*m[s].nline);
+    mp.freq   =copyTo(a,m[s].freq,   sizeof(double)*m[s].nline);
+    mp.beinstu=copyTo(a,m[s].beinstu,sizeof(double)*m[s].nline);
+    mp.beinstl=copyTo(a,m[s].beinstl,sizeof(double)*m[s].nline);
+    mp.cmb      =copyTo(a,m[s].cmb,      sizeof(double)*m[s].nline);
+    mp.local_cmb=copyTo(a,m[s].local_cmb,sizeof(double)*m[s].nline);
+    mp.ntrans=mp.lcl=mp.lcu=NULL;
+    mp.up=mp.down=mp.eterm=mp.gstat=NULL;
+    mp.part=NULL;
+    if(a->base!=NULL) sm[s]=mp;
+  }
+
+  if(a->base!=NULL){
+    memset(h, 0, sizeof(shareHeader));
+    strcpy(h->magic, SHARE_MAGIC);
+    h->sizeGrid=sizeof(struct grid);
+    h->sizeMol=sizeof(molData);
+    h->sizeStore=sizeof(storeReal);
+    h->size=a->used;
+    h->base=a->base;
+    h->ncell=par->ncell;
+    h->pIntensity=par->pIntensity;
+    h->sinkPoints=par->sinkPoints;
+    h->nSpecies=par->nSpecies;
+    h->collPart=par->collPart;
+    h->radius=par->radius;
+    h->checksum=modelChecksum(par);
+    h->g=sg;
+    h->m=sm;
+  }
+}
+
+/* Writes the grid, populations and line data to par->gridShare, for later runs to attach */
+void
+publishGrid(inputPars *par, struct grid *g, molData *m){
+  shareArena a={NULL,0};
+  char *tmp;
+  void *base;
+  int fd;
+
+  if(limeOpts.rank!=0) return;
+  layout(&a,par,g,m);
+
+  tmp=malloc(strlen(par->gridShare)+16);
+  sprintf(tmp,"%s.%d",par->gridShare,(int)getpid());
+  if((fd=open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644))<0 || ftruncate(fd, a.used)!=0){
+    if(fd>=0) close(fd);
+    if(!silent) warning("Could not create the shared grid file");
+    free(tmp);
+    return;
+  }
+  base=mmap((void *)SHARE_BASE, a.used, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED_NOREPLACE, fd, 0);
+  close(fd);
+  if(base!=(void *)SHARE_BASE){
+    if(base!=MAP_FAILED) munmap(base, a.used);
+    unlink(tmp);
+    if(!silent) warning("Could not map the shared grid at its address; not published");
+    free(tmp);
+    return;
+  }
+
+  a.base=base;
+  a.used=0;
+  layout(&a,par,g,m);
+  munmap(base, a.used);
+  rename(tmp, par->gridShare);
+  free(tmp);
+}
+
+/* Maps par->gridShare read-only, if it holds a grid of this model, and returns 1; otherwise returns 0 and the model is built as usual */
+int
+attachGrid(inputPars *par, struct grid **g, molData **m){
+  shareHeader h;
+  void *base;
+  int fd;
+
+  if((fd=open(par->gridShare, O_RDONLY))<0) return 0;
+  if(pread(fd, &h, sizeof(h), 0)!=sizeof(h) || strcmp(h.magic, SHARE_MAGIC)
+     || h.sizeGrid!=sizeof(struct grid) || h.sizeMol!=sizeof(molData) || h.sizeStore!=sizeof(storeReal)
+     || h.base!=(void *)SHARE_BASE || h.nSpecies!=par->nSpecies
+     || (par->restart==NULL && (h.pIntensity!=par->pIntensity || h.sinkPoints!=par->sinkPoints || h.radius!=par->radius))
+     || h.checksum!=modelChecksum(par)){
+    close(fd);
+    if(!silent) warning("The shared grid file does not match this model; building it");
+    return 0;
+  }
+  base=mmap(h.base, h.size, PROT_READ, MAP_SHARED|MAP_FIXED_NOREPLACE, fd, 0);
+  close(fd);
+  if(base!=h.base){
+    if(base!=MAP_FAILED) munmap(base, h.size);
+    if(!silent) warning("Could not map the shared grid at its address; building it");
+    return 0;
+  }
+
+  shareBase=base;
+  shareSize=h.size;
+  par->ncell=h.ncell;
+  par->pIntensity=h.pIntensity;
+  par->sinkPoints=h.sinkPoints;
+  par->collPart=h.collPart;
+  par->radius=h.radius;
+  par->radiusSqu=h.radius*h.radius;
+  *g=h.g;
+  *m=h.m;
+  return 1;
+}
+
+void
+detachGrid(){
+  if(shareBase!=NULL) munmap(shareBase, shareSize);
+  shareBase=NULL;
+  shareSize=0;
+}
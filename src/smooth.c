@@ -12,12 +12,13 @@
 
 /* Based on Lloyds Algorithm (Lloyd, S. IEEE, 1982) */	
 void
-smooth(inputPars *par, struct grid *g){
+smooth(inputPars *par, struct grid *g, struct cell **dc, unsigned long *numCells){
   double mindist;	/* Distance to closest neighbor				*/
   int k=0,j,i;		/* counters									*/
   int sg;		/* counter for smoothing the grid			*/
   int cn;
   double move[3];	/* Auxillary array for smoothing the grid	*/
+  int timer=timerBegin("smoothing");
   double dist;		/* Distance to a neighbor					*/
   	
   for(sg=0;sg<N_SMOOTH_ITERS;sg++){
@@ -67,10 +68,11 @@ smooth(inputPars *par, struct grid *g){
       }	
     }
 		
-    qhull(par, g);	
+    qhull(par, g, (sg==N_SMOOTH_ITERS-1) ? dc : NULL, numCells);
     distCalc(par, g);	    
     if(!silent) progressbar((double)(sg+1)/(double)N_SMOOTH_ITERS, 5);	
   }	
+  timerEnd(timer);
 }
 
 
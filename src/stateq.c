@@ -17,6 +17,7 @@ stateq(int id, struct grid *g, molData *m, int ispec, inputPars *par, gridPointD
   int t,s,iter;
   double *opop, *oopop;
   double diff;
+  struct rates *rate;
 
   gsl_matrix *matrix = gsl_matrix_alloc(m[ispec].nlev+1, m[ispec].nlev+1);
   gsl_matrix *reduc  = gsl_matrix_alloc(m[ispec].nlev, m[ispec].nlev);
@@ -36,12 +37,19 @@ stateq(int id, struct grid *g, molData *m, int ispec, inputPars *par, gridPointD
     gsl_vector_set(oldpop,t,0.);
   }
   gsl_vector_set(oldpop,m[ispec].nlev-1,1.);
+
+  /* The collision rates depend only on the vertex temperature, so with shared rate tables they are interpolated once per call, into the room of the thread. */
+  if(m[ispec].part!=NULL){
+    rate=mp[ispec].rate;
+    interpCollRates(m,ispec,g[id].mol[ispec].partner,g[id].t[0],rate,mp[ispec].collScratch);
+  } else rate=g[id].mol[ispec].partner;
+
   diff=1;
   iter=0;
 
   while((diff>TOL && iter<MAXITER) || iter<5){
     getjbar(id,m,g,par,mp,halfFirstDs);
-    getmatrix(id,matrix,m,g,ispec,mp);
+    getmatrix(id,matrix,m,g,ispec,mp,rate);
     for(s=0;s<m[ispec].nlev;s++){
       for(t=0;t<m[ispec].nlev-1;t++){
         gsl_matrix_set(reduc,t,s,gsl_matrix_get(matrix,t,s));
@@ -53,6 +61,7 @@ stateq(int id, struct grid *g, molData *m, int ispec, inputPars *par, gridPointD
     if(gsl_linalg_LU_det(reduc,s) == 0){
       gsl_linalg_SV_decomp(reduc,svv, svs, work);
       gsl_linalg_SV_solve(reduc, svv, svs, oldpop, newpop);
+      COUNT(CNT_SVD_FALLBACKS, 1);
       if(!silent) warning("Matrix is singular. Switching to SVD.");
     } else gsl_linalg_LU_solve(reduc,p,oldpop,newpop);
 
@@ -73,6 +82,10 @@ stateq(int id, struct grid *g, molData *m, int ispec, inputPars *par, gridPointD
     }
     iter++;
   }
+  COUNT(CNT_STATEQ_CALLS, 1);
+  COUNT(CNT_STATEQ_ITERS, iter);
+  HIST(HIST_STATEQ_ITERS, iter);
+  g[id].cost.iters+=iter;
   gsl_matrix_free(matrix);
   gsl_matrix_free(reduc);
   gsl_matrix_free(svv);
@@ -85,9 +98,77 @@ stateq(int id, struct grid *g, molData *m, int ispec, inputPars *par, gridPointD
   free(oopop);
 }
 
+/* Room in mp[ispec] for the collision rates of species ispec interpolated by interpCollRates(), and its scratch, allocated once per thread; none is needed without rate tables */
+void
+pointRatesAlloc(molData *m, int ispec, gridPointData *mp){
+  int ipart,maxTrans=0;
+
+  mp[ispec].rate=NULL;
+  mp[ispec].collScratch=NULL;
+  if(m[ispec].part==NULL) return;
+  mp[ispec].rate=malloc(sizeof(struct rates)*m[ispec].npart);
+  for(ipart=0;ipart<m[ispec].npart;ipart++){
+    mp[ispec].rate[ipart].up  =malloc(sizeof(storeReal)*m[ispec].ntrans[ipart]);
+    mp[ispec].rate[ipart].down=malloc(sizeof(storeReal)*m[ispec].ntrans[ipart]);
+    if(m[ispec].ntrans[ipart]>maxTrans) maxTrans=m[ispec].ntrans[ipart];
+  }
+  mp[ispec].collScratch=malloc(sizeof(double)*2*maxTrans);
+}
+
+void
+freePointRates(molData *m, int ispec, gridPointData *mp){
+  int ipart;
+
+  if(mp[ispec].rate!=NULL){
+    for(ipart=0;ipart<m[ispec].npart;ipart++){
+      free(mp[ispec].rate[ipart].up);
+      free(mp[ispec].rate[ipart].down);
+    }
+  }
+  free(mp[ispec].rate);
+  free(mp[ispec].collScratch);
+  mp[ispec].rate=NULL;
+  mp[ispec].collScratch=NULL;
+}
+
+/* Interpolates the collision rates at temperature temp from the shared tables of species ispec, using the bins stored in vertexRates. scratch holds twice the largest number of transitions of a partner (see pointRatesAlloc()). */
+void
+interpCollRates(molData *m, int ispec, struct rates *vertexRates, double temp, struct rates *rate, double *scratch){
+  int ipart,t,ntrans;
+  double coeff,tinv,*lo,*hi,*dn,*boltz;
+  storeReal *up,*down;
+  struct rateTable *tab;
+
+  tinv=1./temp;
+  for(ipart=0;ipart<m[ispec].npart;ipart++){
+    tab=&m[ispec].part[ipart];
+    ntrans=m[ispec].ntrans[ipart];
+    coeff=vertexRates[ipart].interp_coeff;
+    lo=tab->down+vertexRates[ipart].t_binlow*ntrans;
+    hi=(tab->ntemp>1) ? lo+ntrans : lo;
+    up=rate[ipart].up;
+    down=rate[ipart].down;
+
+    /* The rates are computed in double and only then stored, possibly as float; the Boltzmann factors by the vector kernel. */
+    dn=scratch;
+    boltz=scratch+ntrans;
+#pragma omp simd
+    for(t=0;t<ntrans;t++){
+      dn[t]=lo[t]+coeff*(hi[t]-lo[t]);
+      boltz[t]=tab->ediff[t]*tinv;
+    }
+    vecExp(boltz,boltz,ntrans);
+#pragma omp simd
+    for(t=0;t<ntrans;t++){
+      down[t]=dn[t];
+      up[t]=tab->gfac[t]*dn[t]*boltz[t];
+    }
+  }
+}
+
 
 void
-getmatrix(int id, gsl_matrix *matrix, molData *m, struct grid *g, int ispec, gridPointData *mp){
+getmatrix(int id, gsl_matrix *matrix, molData *m, struct grid *g, int ispec, gridPointData *mp, struct rates *rate){
   int p,t,k,l,ipart;
   struct getmatrix {
     double *ctot;
@@ -125,8 +206,8 @@ getmatrix(int id, gsl_matrix *matrix, molData *m, struct grid *g, int ispec, gri
   /* Populate matrix with collisional transitions */
   for(ipart=0;ipart<m[ispec].npart;ipart++){
     for(t=0;t<m[ispec].ntrans[ipart];t++){
-      gsl_matrix_set(partner[ipart].colli, m[ispec].lcu[t], m[ispec].lcl[t], g[id].mol[ispec].partner[ipart].down[t]);
-      gsl_matrix_set(partner[ipart].colli, m[ispec].lcl[t], m[ispec].lcu[t], g[id].mol[ispec].partner[ipart].up[t]);
+      gsl_matrix_set(partner[ipart].colli, m[ispec].lcu[t], m[ispec].lcl[t], rate[ipart].down[t]);
+      gsl_matrix_set(partner[ipart].colli, m[ispec].lcl[t], m[ispec].lcu[t], rate[ipart].up[t]);
     }
 
     for(p=0;p<m[ispec].nlev;p++){
@@ -0,0 +1,837 @@
+/*
+ *  subdomain.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Domain decomposition of levelPops over MPI ranks (see ranks.c). The grid points are split into one spatially compact subdomain per rank by splitPoints(), and each rank solves its subdomain on a grid of its own, the subdomain grid (subdomainGrid()): the points of the rank first, with their Delaunay edges and velocity splines, then the halo, i.e. the neighbours of these points, and the representatives of their symmetry bins (see symmetry.c) that belong to other ranks, and last the sink points next to them. The halo points have only their position and model fields, and no edges (numNeigh is 0), except for the sink points next to points of the rank, whose edges lead to halo points of their own. The molecular data, populations, opacities and collision rates exist for the subdomain grid only. While it is solved, the whole grid keeps the positions and model fields of all points but has no edges, except at the sink points.
+
+The photons of a point are launched and traced on its own rank. When a photon comes to a halo point it is packed into a record, with its direction, velocity offset and the intensity, optical depth and exp(-tau) of each line so far, and sent to the rank of that point, which continues it (photonContinue()); this may happen several times before it leaves the model. The intensities of the photons that leave the model on another rank are sent back to the rank that launched them. The points of a rank are solved in batches of SUBDOMAIN_BATCH (sweepSubdomain()): the photons of a batch are launched, the records are exchanged between all ranks, in rounds, until no photon is left on its way, and then stateq() solves the batch, so that the photon buffers are only needed for one batch at a time. The only populations that cross subdomains are those of the ghost points, the representatives of other ranks, which are exchanged after each iteration (exchangePops()).
+
+Once levelPops has finished, mergeSubdomain() puts the edges and splines back into the whole grid and sets up the molecular data of all its points, with the populations, convergence flags and costs of the points of each rank, which the ranks broadcast in turn. The ray-tracer and the output then work on the whole grid, as without MPI. Since the whole grid is built (with qhull) and merged on every rank, the decomposition does not lower the peak memory of a rank below that of a single-process run; it divides the work of levelPops and replaces the exchange of all populations after each iteration by that of the photons which cross the subdomain boundaries.
+
+Nested levelPops runs on other grids (see multilevel.c and refine.c) have subdomain grids of their own, which are kept in a stack; wholeGrid() and wholeId() give the whole grid of a subdomain grid, for the starting populations that are taken from it.
+*/
+
+#include "lime.h"
+#ifdef USE_MPI
+#include <limits.h>
+#include <mpi.h>
+#endif
+
+#define SUBDOMAIN_BATCH 2048	/* points whose photons are traced together, before their populations are solved */
+#define PHOTON_HEAD 10		/* fields of a photon record before its binv and lines: rank, origin rank, slot, iphot, here, deltav, inidir, nsteps */
+#define RESULT_HEAD 4		/* fields of a result record before its intensities: rank, slot, iphot, nsteps */
+#define RECORD_HEAD 6		/* fields of a point record of mergeSubdomain() before its densities and populations */
+
+typedef struct subdomain {
+  inputPars par,lpar;		/* parameters of the whole grid and of the subdomain grid */
+  struct grid *g,*lg;		/* the whole grid and the subdomain grid */
+  int nOwn;			/* points of this rank, lg[0..nOwn-1] */
+  int *gid;			/* id in g of each point of lg */
+  int *ghostCount,*ghostIds;	/* ghost points of lg, grouped by rank */
+  int *sendCount,*sendIds;	/* points of this rank that are ghosts of other ranks, grouped by rank */
+  char *checkpoint;
+  struct subdomain *outer;	/* subdomain grid of the run this one is nested in */
+} subdomain;
+
+static subdomain *current=NULL;
+
+/* Records of photons or results on their way to other ranks, len doubles each, the rank in the first field */
+typedef struct {
+  double *rec;
+  size_t n,size;
+} recordQueue;
+
+static subdomain *
+subdomainOf(struct grid *g){
+  subdomain *s;
+
+  for(s=current;s!=NULL;s=s->outer) if(s->lg==g) return s;
+  return NULL;
+}
+
+/* 1 if g is a subdomain grid */
+int
+isSubdomain(struct grid *g){
+  return subdomainOf(g)!=NULL;
+}
+
+/* The whole grid of which g is the subdomain grid, with its parameters in *wpar (if not NULL); g itself with par if it is not a subdomain grid */
+struct grid *
+wholeGrid(inputPars *par, struct grid *g, inputPars *wpar){
+  subdomain *s=subdomainOf(g);
+
+  if(s==NULL){
+    if(wpar!=NULL) *wpar=*par;
+    return g;
+  }
+  if(wpar!=NULL) *wpar=s->par;
+  return s->g;
+}
+
+/* Id in the whole grid of point id of g */
+int
+wholeId(struct grid *g, int id){
+  subdomain *s=subdomainOf(g);
+
+  return (s==NULL) ? id : s->gid[id];
+}
+
+/* Number of points of g whose convergence levelPops follows on this rank: those of its subdomain, which come first in a subdomain grid, or all of them */
+int
+subdomainPoints(inputPars *par, struct grid *g){
+  subdomain *s=subdomainOf(g);
+
+  return (s==NULL) ? par->pIntensity : s->nOwn;
+}
+
+static int
+compareInt(const void *a, const void *b){
+  return *(const int *)a-*(const int *)b;
+}
+
+/* Id in the subdomain grid of point id of the whole grid, which must belong to this rank */
+static int
+localId(subdomain *s, int id){
+  int *p=bsearch(&id, s->gid, s->nOwn, sizeof(int), compareInt);
+
+  if(p==NULL){
+    if(!silent) bail_out("Subdomain error: a photon was sent to a point of another rank");
+    exit(1);
+  }
+  return (int)(p-s->gid);
+}
+
+static void *
+copyArray(void *src, size_t size){
+  void *dst;
+
+  if(src==NULL) return NULL;
+  dst=malloc(size);
+  memcpy(dst, src, size);
+  return dst;
+}
+
+/* Copies the position and model fields of point src of the whole grid into point l of the subdomain grid. The arrays of the model fields are shared with the whole grid. */
+static void
+copySkeleton(struct grid *dst, struct grid *src, int l){
+  memset(dst, 0, sizeof(struct grid));
+  dst->id=l;
+  memcpy(dst->x,   src->x,   sizeof(src->x));
+  memcpy(dst->vel, src->vel, sizeof(src->vel));
+  dst->dens=src->dens;
+  dst->abun=src->abun;
+  dst->nmol=src->nmol;
+  dst->t[0]=src->t[0];
+  dst->t[1]=src->t[1];
+  dst->dopb=src->dopb;
+  dst->sink=src->sink;
+  dst->nphot=src->nphot;
+  dst->rank=src->rank;
+  dst->rep=l;
+}
+
+#ifdef USE_MPI
+/* Works out which populations the ghost exchange of exchangePops() sends and receives */
+static void
+ghostLists(subdomain *s, inputPars *lpar){
+  int l,r,n=0,nSend=0,*mark,*next,*sendDispl,*recvDispl,*gids,*recvGids;
+  struct grid *lg=s->lg;
+
+  s->ghostCount=calloc(limeOpts.nRanks, sizeof(int));
+  s->sendCount=malloc(sizeof(int)*limeOpts.nRanks);
+  mark=calloc(lpar->pIntensity, sizeof(int));
+  for(l=0;l<s->nOwn;l++){
+    if(lg[l].rep>=s->nOwn && !mark[lg[l].rep]){
+      mark[lg[l].rep]=1;
+      s->ghostCount[lg[lg[l].rep].rank]++;
+      n++;
+    }
+  }
+
+  /* The ghosts of each rank, in the order of their ids */
+  s->ghostIds=malloc(sizeof(int)*(n+1));
+  next=malloc(sizeof(int)*limeOpts.nRanks);
+  recvDispl=malloc(sizeof(int)*limeOpts.nRanks);
+  sendDispl=malloc(sizeof(int)*limeOpts.nRanks);
+  recvDispl[0]=0;
+  for(r=1;r<limeOpts.nRanks;r++) recvDispl[r]=recvDispl[r-1]+s->ghostCount[r-1];
+  for(r=0;r<limeOpts.nRanks;r++) next[r]=recvDispl[r];
+  for(l=s->nOwn;l<lpar->pIntensity;l++) if(mark[l]) s->ghostIds[next[lg[l].rank]++]=l;
+
+  /* The rank of each ghost is told its id in the whole grid */
+  MPI_Alltoall(s->ghostCount, 1, MPI_INT, s->sendCount, 1, MPI_INT, MPI_COMM_WORLD);
+  sendDispl[0]=0;
+  for(r=0;r<limeOpts.nRanks;r++){
+    if(r>0) sendDispl[r]=sendDispl[r-1]+s->sendCount[r-1];
+    nSend+=s->sendCount[r];
+  }
+  gids=malloc(sizeof(int)*(n+1));
+  for(l=0;l<n;l++) gids[l]=s->gid[s->ghostIds[l]];
+  recvGids=malloc(sizeof(int)*(nSend+1));
+  MPI_Alltoallv(gids, s->ghostCount, recvDispl, MPI_INT, recvGids, s->sendCount, sendDispl, MPI_INT, MPI_COMM_WORLD);
+  s->sendIds=malloc(sizeof(int)*(nSend+1));
+  for(l=0;l<nSend;l++) s->sendIds[l]=localId(s, recvGids[l]);
+
+  free(mark);
+  free(next);
+  free(recvDispl);
+  free(sendDispl);
+  free(gids);
+  free(recvGids);
+}
+#endif
+
+/*
+Builds the subdomain grid of this rank from the whole grid g, with its parameters in *lpar, and returns it. The edges, neighbour lists and splines of the points of this rank are moved to the subdomain grid, and those of all other points, except the sink points, are freed. A warm start (see sweep.c) takes the molecular data and populations of the whole grid along, and frees them there.
+*/
+struct grid *
+subdomainGrid(inputPars *par, molData *m, struct grid *g, inputPars *lpar, int warmStart){
+  enum {NONE=-1, HALO=-2, SINK_EDGES=-3, SINK=-4};
+  subdomain *s;
+  struct grid *lg,*src,*dst;
+  int id,j,k,l,ispec,nOwn=0,nHalo=0,nSink=0,next,nextSink,*local,*edges;
+
+  s=calloc(1, sizeof(subdomain));
+  s->par=*par;
+  s->g=g;
+  symmetryReduce(par,g);
+  splitPoints(par,g);
+
+  local=malloc(sizeof(int)*par->ncell);
+  for(id=0;id<par->ncell;id++) local[id]=NONE;
+  for(id=0;id<par->pIntensity;id++) if(g[id].rank==limeOpts.rank) local[id]=nOwn++;
+
+  /* The halo: the neighbours and representatives of the points of this rank, and the neighbours of the sink points among them */
+  for(id=0;id<par->pIntensity;id++){
+    if(g[id].rank!=limeOpts.rank) continue;
+    for(k=0;k<g[id].numNeigh;k++){
+      j=g[id].neigh[k]->id;
+      if(g[j].sink){
+        if(local[j]==NONE || local[j]==SINK) local[j]=SINK_EDGES;
+      } else if(local[j]==NONE) local[j]=HALO;
+    }
+    if(local[g[id].rep]==NONE) local[g[id].rep]=HALO;
+  }
+  for(id=par->pIntensity;id<par->ncell;id++){
+    if(local[id]!=SINK_EDGES) continue;
+    for(k=0;k<g[id].numNeigh;k++){
+      j=g[id].neigh[k]->id;
+      if(local[j]==NONE) local[j]=g[j].sink ? SINK : HALO;
+    }
+  }
+  for(id=0;id<par->ncell;id++){
+    if(local[id]==HALO) nHalo++;
+    else if(local[id]==SINK_EDGES || local[id]==SINK) nSink++;
+  }
+
+  *lpar=*par;
+  lpar->pIntensity=nOwn+nHalo;
+  lpar->sinkPoints=nSink;
+  lpar->ncell=lpar->pIntensity+nSink;
+  lpar->outputfile=NULL;
+  lpar->binoutputfile=NULL;
+  lpar->gridfile=NULL;
+  s->lpar=*lpar;
+  if(par->checkpoint!=NULL){
+    /* Each rank has a checkpoint of its own (see checkpoint.c) */
+    s->checkpoint=malloc(strlen(par->checkpoint)+16);
+    sprintf(s->checkpoint, "%s.%d", par->checkpoint, limeOpts.rank);
+    lpar->checkpoint=s->checkpoint;
+    s->lpar.checkpoint=s->checkpoint;
+  }
+
+  lg=malloc(sizeof(struct grid)*lpar->ncell);
+  s->gid=malloc(sizeof(int)*lpar->ncell);
+  edges=calloc(lpar->ncell, sizeof(int));
+  next=nOwn;
+  nextSink=lpar->pIntensity;
+  for(id=0;id<par->ncell;id++){
+    if(local[id]>=0) l=local[id];
+    else if(local[id]==HALO) l=local[id]=next++;
+    else if(local[id]==SINK_EDGES || local[id]==SINK){
+      edges[nextSink]=(local[id]==SINK_EDGES);
+      l=local[id]=nextSink++;
+    } else continue;
+    s->gid[l]=id;
+    copySkeleton(&lg[l], &g[id], l);
+    if(l<nOwn) edges[l]=1;
+  }
+  s->nOwn=nOwn;
+  s->lg=lg;
+
+  for(l=0;l<lpar->ncell;l++){
+    if(!edges[l]) continue;
+    src=&g[s->gid[l]];
+    dst=&lg[l];
+    dst->numNeigh=src->numNeigh;
+    dst->neigh=malloc(sizeof(struct grid *)*src->numNeigh);
+    for(k=0;k<src->numNeigh;k++) dst->neigh[k]=&lg[local[src->neigh[k]->id]];
+    if(l<nOwn){
+      dst->rep=local[src->rep];
+      dst->dir=src->dir;
+      dst->ds=src->ds;
+      dst->a0=src->a0;
+      dst->a1=src->a1;
+      dst->a2=src->a2;
+      dst->a3=src->a3;
+      dst->a4=src->a4;
+      src->dir=NULL;
+      src->ds=NULL;
+      src->a0=src->a1=src->a2=src->a3=src->a4=NULL;
+    } else {
+      /* The sink points stay in the whole grid as they are */
+      dst->dir=copyArray(src->dir, sizeof(point)*src->numNeigh);
+      dst->ds=copyArray(src->ds, sizeof(double)*src->numNeigh);
+      dst->a0=copyArray(src->a0, sizeof(storeReal)*src->numNeigh);
+      dst->a1=copyArray(src->a1, sizeof(storeReal)*src->numNeigh);
+      dst->a2=copyArray(src->a2, sizeof(storeReal)*src->numNeigh);
+      dst->a3=copyArray(src->a3, sizeof(storeReal)*src->numNeigh);
+      dst->a4=copyArray(src->a4, sizeof(storeReal)*src->numNeigh);
+    }
+  }
+  free(edges);
+
+  for(id=0;id<par->pIntensity;id++){
+    free(g[id].neigh);
+    free(g[id].dir);
+    free(g[id].ds);
+    free(g[id].a0);
+    free(g[id].a1);
+    free(g[id].a2);
+    free(g[id].a3);
+    free(g[id].a4);
+    g[id].neigh=NULL;
+    g[id].dir=NULL;
+    g[id].ds=NULL;
+    g[id].a0=g[id].a1=g[id].a2=g[id].a3=g[id].a4=NULL;
+    g[id].numNeigh=0;
+  }
+  free(local);
+
+  if(warmStart){
+    popsAlloc(lpar,lg);
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      if(par->lte_only==0) ratesAlloc(lpar,m,lg,ispec,0);
+      popsAllocSpecies(lpar,lg,ispec,m[ispec].nlev,m[ispec].nline);
+      for(l=0;l<lpar->ncell;l++)
+        memcpy(lg[l].mol[ispec].pops, g[s->gid[l]].mol[ispec].pops, sizeof(storeReal)*m[ispec].nlev);
+    }
+    freePopulation(par,g);
+  }
+
+#ifdef USE_MPI
+  if(par->symmetry) ghostLists(s,lpar);
+#endif
+  s->outer=current;
+  current=s;
+  return lg;
+}
+
+/* Replaces the populations of the ghost points of subdomain grid g by those their ranks have just solved */
+void
+exchangeGhosts(inputPars *par, molData *m, struct grid *g){
+#ifdef USE_MPI
+  subdomain *s=subdomainOf(g);
+  int r,i,ispec,ilev,nlevTot=0,nSend=0,nRecv=0,*sendDispl,*recvDispl;
+  storeReal *sendBuf,*recvBuf,*p;
+  MPI_Datatype type=(sizeof(storeReal)==sizeof(float)) ? MPI_FLOAT : MPI_DOUBLE, pointType;
+
+  if(s==NULL || s->ghostCount==NULL) return;
+  for(ispec=0;ispec<par->nSpecies;ispec++) nlevTot+=m[ispec].nlev;
+  MPI_Type_contiguous(nlevTot, type, &pointType);
+  MPI_Type_commit(&pointType);
+
+  sendDispl=malloc(sizeof(int)*limeOpts.nRanks);
+  recvDispl=malloc(sizeof(int)*limeOpts.nRanks);
+  for(r=0;r<limeOpts.nRanks;r++){
+    sendDispl[r]=nSend;
+    recvDispl[r]=nRecv;
+    nSend+=s->sendCount[r];
+    nRecv+=s->ghostCount[r];
+  }
+  sendBuf=malloc(sizeof(storeReal)*((size_t)nSend*nlevTot+1));
+  recvBuf=malloc(sizeof(storeReal)*((size_t)nRecv*nlevTot+1));
+
+  p=sendBuf;
+  for(i=0;i<nSend;i++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(ilev=0;ilev<m[ispec].nlev;ilev++) *p++=g[s->sendIds[i]].mol[ispec].pops[ilev];
+    }
+  }
+  MPI_Alltoallv(sendBuf, s->sendCount, sendDispl, pointType, recvBuf, s->ghostCount, recvDispl, pointType, MPI_COMM_WORLD);
+
+  p=recvBuf;
+  for(i=0;i<nRecv;i++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      for(ilev=0;ilev<m[ispec].nlev;ilev++) g[s->ghostIds[i]].mol[ispec].pops[ilev]=*p++;
+    }
+  }
+
+  MPI_Type_free(&pointType);
+  free(sendBuf);
+  free(recvBuf);
+  free(sendDispl);
+  free(recvDispl);
+#endif
+}
+
+static double *
+queueAdd(recordQueue *q, int len){
+  if(q->n==q->size){
+    q->size=(q->size>0) ? 2*q->size : 64;
+    q->rec=realloc(q->rec, sizeof(double)*len*q->size);
+  }
+  return q->rec+(q->n++)*len;
+}
+
+/* Sum of n over the ranks */
+static long
+sumOverRanks(long n){
+#ifdef USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, &n, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  return n;
+}
+
+/* Sends the records in the queues q[0..nq-1], of len doubles each, to the ranks in their first fields, and empties the queues. Returns the records sent to this rank, *n of them. */
+static double *
+exchangeRecords(recordQueue *q, int nq, int len, int *n){
+  int i,r,nSend=0,*sendCount,*recvCount,*sendDispl,*recvDispl,*next;
+  size_t j;
+  double *sendBuf,*recvBuf;
+
+  sendCount=calloc(limeOpts.nRanks, sizeof(int));
+  recvCount=malloc(sizeof(int)*limeOpts.nRanks);
+  sendDispl=malloc(sizeof(int)*limeOpts.nRanks);
+  recvDispl=malloc(sizeof(int)*limeOpts.nRanks);
+  next=malloc(sizeof(int)*limeOpts.nRanks);
+  for(i=0;i<nq;i++){
+    for(j=0;j<q[i].n;j++) sendCount[(int)q[i].rec[j*len]]++;
+  }
+  for(r=0;r<limeOpts.nRanks;r++){
+    sendDispl[r]=next[r]=nSend;
+    nSend+=sendCount[r];
+  }
+  sendBuf=malloc(sizeof(double)*((size_t)nSend*len+1));
+  for(i=0;i<nq;i++){
+    for(j=0;j<q[i].n;j++)
+      memcpy(sendBuf+(size_t)(next[(int)q[i].rec[j*len]]++)*len, q[i].rec+j*len, sizeof(double)*len);
+    q[i].n=0;
+  }
+
+#ifdef USE_MPI
+  {
+    MPI_Datatype recType;
+
+    MPI_Type_contiguous(len, MPI_DOUBLE, &recType);
+    MPI_Type_commit(&recType);
+    MPI_Alltoall(sendCount, 1, MPI_INT, recvCount, 1, MPI_INT, MPI_COMM_WORLD);
+    *n=0;
+    for(r=0;r<limeOpts.nRanks;r++){
+      recvDispl[r]=*n;
+      *n+=recvCount[r];
+    }
+    recvBuf=malloc(sizeof(double)*((size_t)*n*len+1));
+    MPI_Alltoallv(sendBuf, sendCount, sendDispl, recType, recvBuf, recvCount, recvDispl, recType, MPI_COMM_WORLD);
+    MPI_Type_free(&recType);
+    free(sendBuf);
+  }
+#else
+  /* Without MPI all records are for this rank */
+  recvBuf=sendBuf;
+  *n=nSend;
+#endif
+
+  free(sendCount);
+  free(recvCount);
+  free(sendDispl);
+  free(recvDispl);
+  free(next);
+  return recvBuf;
+}
+
+/* Packs photon p, at point p->here of subdomain s, which was launched by slot of rank origin, into a record for the rank of p->here */
+static void
+packPhoton(subdomain *s, photonState *p, int nSpecies, double origin, double slot, double iphot, double *rec){
+  int i;
+
+  rec[0]=s->lg[p->here].rank;
+  rec[1]=origin;
+  rec[2]=slot;
+  rec[3]=iphot;
+  rec[4]=s->gid[p->here];
+  rec[5]=p->deltav;
+  for(i=0;i<3;i++) rec[6+i]=p->inidir[i];
+  rec[9]=(double)p->nsteps;
+  rec+=PHOTON_HEAD;
+  for(i=0;i<nSpecies;i++) *rec++=p->binv[i];
+  for(i=0;i<p->nlinetot;i++){
+    *rec++=p->phot[i];
+    *rec++=p->tau[i];
+    *rec++=p->expTau[i];
+  }
+}
+
+static void
+unpackPhoton(subdomain *s, photonState *p, int nSpecies, double *rec){
+  int i;
+
+  p->here=localId(s, (int)rec[4]);
+  p->deltav=rec[5];
+  for(i=0;i<3;i++) p->inidir[i]=rec[6+i];
+  p->nsteps=(unsigned long long)rec[9];
+  rec+=PHOTON_HEAD;
+  for(i=0;i<nSpecies;i++) p->binv[i]=*rec++;
+  for(i=0;i<p->nlinetot;i++){
+    p->phot[i]=*rec++;
+    p->tau[i]=*rec++;
+    p->expTau[i]=*rec++;
+  }
+}
+
+/*
+One iteration of levelPops on subdomain grid g: the photons of each batch of the points this rank solves are traced, on this rank and on others, and the populations of the batch are solved with stateq(). All ranks go through the same number of batches and rounds, since these end with collective calls. photonBusy and stateqBusy get the time each thread spends on the photons and on stateq(), and nOwned is the number of points this rank solves, for the progress bar.
+*/
+void
+sweepSubdomain(inputPars *par, molData *m, struct grid *g, blend *matrix, gsl_rng **threadRans, int nOwned, double *photonBusy, double *stateqBusy){
+  subdomain *s=subdomainOf(g);
+  int id,i,nSolve=0,nBatch,batch,first,n,nIn,nDone=0,nlinetot,nline0=m[0].nline,threadI,*solve,*counta,*countb;
+  int photonLen,resultLen;
+  size_t *photOff,*vfacOff;
+  unsigned long long *steps;
+  storeReal *photBuf;
+  double *vfacBuf,*halfBuf,*in;
+  recordQueue *photons,*results;
+
+  lineCount(par->nSpecies, m, &counta, &countb, &nlinetot);
+  free(counta);
+  free(countb);
+  photonLen=PHOTON_HEAD+par->nSpecies+3*nlinetot;
+  resultLen=RESULT_HEAD+nline0;
+  photons=calloc(par->nThreads, sizeof(recordQueue));
+  results=calloc(par->nThreads, sizeof(recordQueue));
+
+  solve=malloc(sizeof(int)*(s->nOwn+1));
+  for(id=0;id<s->nOwn;id++) if(g[id].rep==id) solve[nSolve++]=id;
+  nBatch=(nSolve+SUBDOMAIN_BATCH-1)/SUBDOMAIN_BATCH;
+#ifdef USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, &nBatch, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+#endif
+
+  photOff=malloc(sizeof(size_t)*(SUBDOMAIN_BATCH+1));
+  vfacOff=malloc(sizeof(size_t)*(SUBDOMAIN_BATCH+1));
+  steps=malloc(sizeof(unsigned long long)*SUBDOMAIN_BATCH);
+
+  for(batch=0;batch<nBatch;batch++){
+    first=batch*SUBDOMAIN_BATCH;
+    n=(first<nSolve) ? gsl_min(SUBDOMAIN_BATCH, nSolve-first) : 0;
+
+    /* The photon buffers of the batch: those of point solve[first+i] start at photOff[i] and vfacOff[i] */
+    photOff[0]=vfacOff[0]=0;
+    for(i=0;i<n;i++){
+      photOff[i+1]=photOff[i]+(size_t)g[solve[first+i]].nphot*nline0;
+      vfacOff[i+1]=vfacOff[i]+(size_t)g[solve[first+i]].nphot;
+      steps[i]=0;
+    }
+    photBuf=malloc(sizeof(storeReal)*(photOff[n]+1));
+    vfacBuf=malloc(sizeof(double)*(vfacOff[n]*par->nSpecies+1));
+    halfBuf=malloc(sizeof(double)*(vfacOff[n]+1));
+
+    /* Launch the photons of the batch; those that come to a halo point are queued for its rank */
+    omp_set_dynamic(0);
+#pragma omp parallel private(i,id,threadI) num_threads(par->nThreads)
+    {
+      double t0;
+      int iphot,iline,l;
+      photonState p;
+      gridPointData *mp;
+
+      threadI=omp_get_thread_num();
+      photonAlloc(par,m,&p);
+      mp=malloc(sizeof(gridPointData)*par->nSpecies);
+#pragma omp for schedule(dynamic)
+      for(i=0;i<n;i++){
+        id=solve[first+i];
+#pragma omp atomic
+        ++nDone;
+        if(threadI==0){
+          if(!silent) progressbar((double)nDone/nOwned,10);
+        }
+        if(g[id].dens[0] > 0 && g[id].t[0] > 0){
+          t0=wallTime();
+          for(l=0;l<par->nSpecies;l++) mp[l].vfac=vfacBuf+vfacOff[n]*l+vfacOff[i];
+          for(iphot=0;iphot<g[id].nphot;iphot++){
+            photonLaunch(id,iphot,g,threadRans[threadI],par,&p);
+            if(photonTrace(&p,1,iphot,g,m,threadRans[threadI],par,matrix,mp,halfBuf+vfacOff[i])){
+              photonFinish(&p,m);
+              steps[i]+=p.nsteps;
+              for(iline=0;iline<nline0;iline++) photBuf[photOff[i]+iline+iphot*nline0]=p.phot[iline];
+            } else packPhoton(s,&p,par->nSpecies,limeOpts.rank,i,iphot,queueAdd(&photons[threadI],photonLen));
+          }
+          COUNT(CNT_PHOTONS, g[id].nphot);
+          photonBusy[threadI]+=wallTime()-t0;
+          g[id].cost.time+=wallTime()-t0;
+        }
+        if(threadI==0){
+          if(!silent) warning("");
+        }
+      }
+      free(mp);
+      photonFree(&p);
+      MERGE_COUNTERS(PHASE_LEVELPOPS);
+    }
+
+    /* Rounds of exchanges, until no photon of the batch is on its way */
+    for(;;){
+      long pending=0;
+
+      for(i=0;i<par->nThreads;i++) pending+=photons[i].n+results[i].n;
+      if(sumOverRanks(pending)==0) break;
+
+      in=exchangeRecords(results,par->nThreads,resultLen,&nIn);
+      for(i=0;i<nIn;i++){
+        double *rec=in+(size_t)i*resultLen;
+        int slot=(int)rec[1],iphot=(int)rec[2],iline;
+
+        steps[slot]+=(unsigned long long)rec[3];
+        for(iline=0;iline<nline0;iline++) photBuf[photOff[slot]+iline+iphot*nline0]=rec[RESULT_HEAD+iline];
+      }
+      free(in);
+
+      in=exchangeRecords(photons,par->nThreads,photonLen,&nIn);
+#pragma omp parallel private(i,threadI) num_threads(par->nThreads)
+      {
+        double t0,*rec,*res;
+        int iline,slot,iphot;
+        photonState p;
+
+        threadI=omp_get_thread_num();
+        photonAlloc(par,m,&p);
+        t0=wallTime();
+#pragma omp for schedule(dynamic,64)
+        for(i=0;i<nIn;i++){
+          rec=in+(size_t)i*photonLen;
+          unpackPhoton(s,&p,par->nSpecies,rec);
+          if(photonContinue(&p,g,m,threadRans[threadI],par,matrix)){
+            photonFinish(&p,m);
+            slot=(int)rec[2];
+            iphot=(int)rec[3];
+            if((int)rec[1]==limeOpts.rank){
+#pragma omp atomic
+              steps[slot]+=p.nsteps;
+              for(iline=0;iline<nline0;iline++) photBuf[photOff[slot]+iline+iphot*nline0]=p.phot[iline];
+            } else {
+              res=queueAdd(&results[threadI],resultLen);
+              res[0]=rec[1];
+              res[1]=slot;
+              res[2]=iphot;
+              res[3]=(double)p.nsteps;
+              for(iline=0;iline<nline0;iline++) res[RESULT_HEAD+iline]=p.phot[iline];
+            }
+          } else packPhoton(s,&p,par->nSpecies,rec[1],rec[2],rec[3],queueAdd(&photons[threadI],photonLen));
+        }
+        photonBusy[threadI]+=wallTime()-t0;
+        photonFree(&p);
+        MERGE_COUNTERS(PHASE_LEVELPOPS);
+      }
+      free(in);
+    }
+
+    /* Solve the batch */
+#pragma omp parallel private(i,id,threadI) num_threads(par->nThreads)
+    {
+      double t0,t1;
+      int ispec,l;
+      gridPointData *mp;
+
+      threadI=omp_get_thread_num();
+      mp=malloc(sizeof(gridPointData)*par->nSpecies);
+      for(l=0;l<par->nSpecies;l++){
+        mp[l].jbar=malloc(sizeof(double)*m[l].nline);
+        pointRatesAlloc(m,l,mp);
+      }
+#pragma omp for schedule(dynamic)
+      for(i=0;i<n;i++){
+        id=solve[first+i];
+        if(g[id].dens[0] > 0 && g[id].t[0] > 0){
+          t0=wallTime();
+          for(l=0;l<par->nSpecies;l++){
+            mp[l].phot=photBuf+photOff[i];
+            mp[l].vfac=vfacBuf+vfacOff[n]*l+vfacOff[i];
+          }
+          for(ispec=0;ispec<par->nSpecies;ispec++) stateq(id,g,m,ispec,par,mp,halfBuf+vfacOff[i]);
+          t1=wallTime();
+          stateqBusy[threadI]+=t1-t0;
+          g[id].cost.time+=t1-t0;
+          g[id].cost.steps+=steps[i];
+          COUNT(CNT_PHOTON_STEPS, steps[i]);
+          HIST(HIST_VERTEX_STEPS, steps[i]);
+        }
+      }
+      for(l=0;l<par->nSpecies;l++){
+        freePointRates(m,l,mp);
+        free(mp[l].jbar);
+      }
+      free(mp);
+      MERGE_COUNTERS(PHASE_LEVELPOPS);
+    }
+
+    free(photBuf);
+    free(vfacBuf);
+    free(halfBuf);
+  }
+
+  for(i=0;i<par->nThreads;i++){
+    free(photons[i].rec);
+    free(results[i].rec);
+  }
+  free(photons);
+  free(results);
+  free(solve);
+  free(photOff);
+  free(vfacOff);
+  free(steps);
+}
+
+#ifdef USE_MPI
+/* Broadcasts n records of len doubles each from rank root, in chunks of at most INT_MAX records, since MPI counts are ints */
+static void
+bcastRecords(double *buf, long n, int len, int root){
+  MPI_Datatype recType;
+  long done;
+  int count;
+
+  MPI_Type_contiguous(len, MPI_DOUBLE, &recType);
+  MPI_Type_commit(&recType);
+  for(done=0;done<n;done+=count){
+    count=(n-done>INT_MAX) ? INT_MAX : (int)(n-done);
+    MPI_Bcast(buf+done*len, count, recType, root, MPI_COMM_WORLD);
+  }
+  MPI_Type_free(&recType);
+}
+#endif
+
+static void
+splineArrays(struct grid *gp, storeReal **a){
+  a[0]=gp->a0;
+  a[1]=gp->a1;
+  a[2]=gp->a2;
+  a[3]=gp->a3;
+  a[4]=gp->a4;
+}
+
+/*
+Puts the solution on the subdomain grids of all ranks together in the whole grid g, with parameters par, and frees the subdomain grid of this rank. The ranks take turns to broadcast the points of their subdomains, one record of RECORD_HEAD+nSpecies+nlevTot values per point (its id, number of neighbours, convergence flag, costs, molecular densities and populations), and one of 1+nCoef values per edge (the id of the neighbour and the spline coefficients), as records of an MPI datatype (bcastRecords()), so that no rank needs room for more than one subdomain at a time.
+*/
+void
+mergeSubdomain(inputPars *par, molData *m, struct grid *g){
+  subdomain *s=current;
+  struct grid *lg=s->lg;
+  int r,l,k,id,ispec,ilev,nlevTot=0,nCoef=par->doPregrid ? 2 : 5,pointLen,edgeLen=1+nCoef;
+  long len[2];
+  double *points,*edges,*p,*e;
+  storeReal *a[5];
+
+  for(ispec=0;ispec<par->nSpecies;ispec++) nlevTot+=m[ispec].nlev;
+  pointLen=RECORD_HEAD+par->nSpecies+nlevTot;
+
+  popsAlloc(par,g);
+  for(ispec=0;ispec<par->nSpecies;ispec++) molGrid(m,par,g,ispec);
+
+  for(r=0;r<limeOpts.nRanks;r++){
+    if(r==limeOpts.rank){
+      len[0]=s->nOwn;
+      len[1]=0;
+      for(l=0;l<s->nOwn;l++) len[1]+=lg[l].numNeigh;
+    }
+#ifdef USE_MPI
+    MPI_Bcast(len, 2, MPI_LONG, r, MPI_COMM_WORLD);
+#endif
+    points=malloc(sizeof(double)*(len[0]*pointLen+1));
+    edges=malloc(sizeof(double)*(len[1]*edgeLen+1));
+    if(r==limeOpts.rank){
+      p=points;
+      e=edges;
+      for(l=0;l<s->nOwn;l++){
+        *p++=s->gid[l];
+        *p++=lg[l].numNeigh;
+        *p++=lg[l].conv;
+        *p++=(double)lg[l].cost.steps;
+        *p++=lg[l].cost.iters;
+        *p++=lg[l].cost.time;
+        for(ispec=0;ispec<par->nSpecies;ispec++) *p++=lg[l].nmol[ispec];
+        for(ispec=0;ispec<par->nSpecies;ispec++){
+          for(ilev=0;ilev<m[ispec].nlev;ilev++) *p++=lg[l].mol[ispec].pops[ilev];
+        }
+        splineArrays(&lg[l],a);
+        for(k=0;k<lg[l].numNeigh;k++){
+          *e++=s->gid[lg[l].neigh[k]->id];
+          for(ilev=0;ilev<nCoef;ilev++) *e++=a[ilev][k];
+        }
+      }
+    }
+#ifdef USE_MPI
+    bcastRecords(points, len[0], pointLen, r);
+    bcastRecords(edges, len[1], edgeLen, r);
+#endif
+
+    p=points;
+    e=edges;
+    for(l=0;l<len[0];l++){
+      id=(int)*p++;
+      g[id].numNeigh=(int)*p++;
+      g[id].conv=(int)*p++;
+      g[id].cost.steps=(unsigned long long)*p++;
+      g[id].cost.iters=(int)*p++;
+      g[id].cost.time=*p++;
+      for(ispec=0;ispec<par->nSpecies;ispec++) g[id].nmol[ispec]=*p++;
+      for(ispec=0;ispec<par->nSpecies;ispec++){
+        for(ilev=0;ilev<m[ispec].nlev;ilev++) g[id].mol[ispec].pops[ilev]=*p++;
+      }
+      g[id].neigh=malloc(sizeof(struct grid *)*g[id].numNeigh);
+      g[id].a0=malloc(sizeof(storeReal)*g[id].numNeigh);
+      g[id].a1=malloc(sizeof(storeReal)*g[id].numNeigh);
+      if(nCoef>2){
+        g[id].a2=malloc(sizeof(storeReal)*g[id].numNeigh);
+        g[id].a3=malloc(sizeof(storeReal)*g[id].numNeigh);
+        g[id].a4=malloc(sizeof(storeReal)*g[id].numNeigh);
+      }
+      splineArrays(&g[id],a);
+      for(k=0;k<g[id].numNeigh;k++){
+        g[id].neigh[k]=&g[(int)*e++];
+        for(ilev=0;ilev<nCoef;ilev++) a[ilev][k]=*e++;
+      }
+      distCalcPoint(g,id);
+    }
+    free(points);
+    free(edges);
+  }
+  for(id=par->pIntensity;id<par->ncell;id++){
+    g[id].conv=0;
+    g[id].cost.steps=0;
+    g[id].cost.iters=0;
+    g[id].cost.time=0.;
+  }
+
+  /* The model fields belong to the whole grid */
+  for(l=0;l<s->lpar.ncell;l++){
+    lg[l].dens=NULL;
+    lg[l].abun=NULL;
+    lg[l].nmol=NULL;
+  }
+  freeGrid(&s->lpar,m,lg);
+  free(s->gid);
+  free(s->ghostCount);
+  free(s->ghostIds);
+  free(s->sendCount);
+  free(s->sendIds);
+  free(s->checkpoint);
+  current=s->outer;
+  free(s);
+}
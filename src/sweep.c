@@ -0,0 +1,152 @@
+/*
+ *  sweep.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Parameter sweeps: the same grid is solved and imaged for par->nSweep parameter sets. Before each set the model function sweepSet() changes the model parameters, and possibly the images, and returns which of the model fields (SWEEP_DENSITY etc.) have changed. The grid, the velocity splines and the molecular data are kept; only the changed fields are evaluated again, and levelPops() is started from the populations of the nearest of the last par->sweepKeep solutions (in terms of the par->nSweepParams parameters returned by sweepSet()) and run for par->sweepIter iterations. If no field has changed (e.g. only the inclination of the images), the model is just imaged again.
+*/
+
+#include "lime.h"
+
+typedef struct {
+  int iset;
+  double params[MAX_SWEEP_PARAMS];
+  storeReal *pops;
+} sweepSolution;
+
+static double
+paramDistance(double *a, double *b, int n){
+  int k;
+  double d,scale,sum=0.;
+
+  for(k=0;k<n;k++){
+    scale=fmax(fabs(a[k]),fabs(b[k]));
+    if(scale>0.){
+      d=(a[k]-b[k])/scale;
+      sum+=d*d;
+    }
+  }
+  return sum;
+}
+
+/* Copies the populations of all species between the grid and a flat array */
+static void
+copyPops(inputPars *par, struct grid *g, molData *m, storeReal *pops, int toGrid){
+  int id,ispec;
+  long off=0;
+
+  for(id=0;id<par->ncell;id++){
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      if(toGrid) memcpy(g[id].mol[ispec].pops, &pops[off], sizeof(storeReal)*m[ispec].nlev);
+      else memcpy(&pops[off], g[id].mol[ispec].pops, sizeof(storeReal)*m[ispec].nlev);
+      off+=m[ispec].nlev;
+    }
+  }
+}
+
+static void
+sweepFilename(char *buf, size_t size, const char *base, int iset){
+  const char *ext=strrchr(base,'.');
+
+  if(ext!=NULL && !strcmp(ext,".fits")) snprintf(buf,size,"%.*s_%04d.fits",(int)(ext-base),base,iset);
+  else snprintf(buf,size,"%s_%04d",base,iset);
+}
+
+void
+runSweep(inputPars *par, struct grid *g, molData *m, image *img, struct cell *dc, unsigned long numCells){
+  int iset,i,id,ispec,changed,popsdone=0,nSol=0,next=0,nearest,k;
+  long totLev=0;
+  double params[MAX_SWEEP_PARAMS],d,dmin;
+  sweepSolution *sol;
+  char **baseNames,**names;
+
+  if(par->doPregrid || par->restart){
+    if(!silent) bail_out("Error: a sweep needs a grid built from the model functions");
+    exit(1);
+  }
+  for(i=0;i<par->nImages;i++){
+    if(img[i].doline==0){
+      if(!silent) bail_out("Error: a sweep can only make line images");
+      exit(1);
+    }
+  }
+
+  sol=malloc(sizeof(sweepSolution)*par->sweepKeep);
+  for(k=0;k<par->sweepKeep;k++) sol[k].pops=NULL;
+  baseNames=malloc(sizeof(char *)*par->nImages);
+  names=malloc(sizeof(char *)*par->nImages);
+  for(i=0;i<par->nImages;i++){
+    baseNames[i]=img[i].filename;
+    names[i]=malloc(strlen(baseNames[i])+16);
+  }
+
+  for(iset=0;iset<par->nSweep;iset++){
+    if(!silent) sweepmesg(iset, par->nSweep);
+    for(k=0;k<MAX_SWEEP_PARAMS;k++) params[k]=0.;
+    changed=sweepSet(iset, params, img);
+
+    /* For the first set, the changes are with respect to the model the grid was built with */
+    if(changed){
+      for(id=0;id<par->pIntensity;id++){
+        if(changed & SWEEP_DENSITY)     density(    g[id].x[0],g[id].x[1],g[id].x[2], g[id].dens);
+        if(changed & SWEEP_TEMPERATURE) temperature(g[id].x[0],g[id].x[1],g[id].x[2], g[id].t);
+        if(changed & SWEEP_DOPPLER)     doppler(    g[id].x[0],g[id].x[1],g[id].x[2],&g[id].dopb);
+        if(changed & SWEEP_ABUNDANCE)   abundance(  g[id].x[0],g[id].x[1],g[id].x[2], g[id].abun);
+      }
+    }
+
+    if(iset==0){
+      /* The first set is a normal run, except for the collision rates being kept in tables */
+      levelPops(m,par,g,&popsdone,0);
+      dumpGrid(par,g,m,dc,numCells);
+      for(ispec=0;ispec<par->nSpecies;ispec++) totLev+=m[ispec].nlev;
+    } else if(changed){
+      /* Start from the nearest solution; on a tie, the most recent one */
+      nearest=-1;
+      dmin=0.;
+      for(k=0;k<nSol;k++){
+        i=(next-1-k+par->sweepKeep)%par->sweepKeep;
+        d=paramDistance(params, sol[i].params, par->nSweepParams);
+        if(nearest<0 || d<dmin){
+          nearest=i;
+          dmin=d;
+        }
+      }
+      if(nearest>=0) copyPops(par,g,m,sol[nearest].pops,1);
+
+      levelPops(m,par,g,&popsdone,1);
+    }
+
+    /* Keep the solution of this set, replacing the oldest one if the store is full */
+    if(iset==0 || changed){
+      if(sol[next].pops==NULL) sol[next].pops=malloc(sizeof(storeReal)*totLev*par->ncell);
+      sol[next].iset=iset;
+      memcpy(sol[next].params, params, sizeof(params));
+      copyPops(par,g,m,sol[next].pops,0);
+      next=(next+1)%par->sweepKeep;
+      if(nSol<par->sweepKeep) nSol++;
+    }
+
+    for(i=0;i<par->nImages;i++){
+      rotationMatrix(&img[i]);
+      sweepFilename(names[i], strlen(baseNames[i])+16, baseNames[i], iset);
+      img[i].filename=names[i];
+      raytrace(i,par,g,m,img);
+      writefits(i,par,m,img);
+    }
+  }
+
+  for(i=0;i<par->nImages;i++){
+    img[i].filename=baseNames[i];
+    free(names[i]);
+  }
+  free(names);
+  free(baseNames);
+  for(k=0;k<par->sweepKeep;k++) free(sol[k].pops);
+  free(sol);
+}
@@ -0,0 +1,121 @@
+/*
+ *  symmetry.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Symmetry-reduced solution of the level populations (par->symmetry). In a spherically symmetric model the populations depend only on the radius r, and in an axisymmetric one (about the z axis) only on the cylindrical radius R and on z. The grid points are then binned in these reduced coordinates, with equal numbers of points per bin: in r, or first in R and then each R bin in z. Each bin has one representative point, the one closest to the mean position of the bin in the reduced coordinates, and levelPops only solves the representatives. Their photons are still traced through the full 3D grid. After each iteration every other point of a bin takes the populations of its representative (symmetryFill()), so the whole grid is ready for the next iteration and for the ray-tracer.
+
+g[id].rep is the representative of point id; without symmetry it is id itself. With several MPI ranks every point still has a rank, that of the subdomain it lies in (see splitPoints()), but the ranks only solve the representatives among their points; the populations of a representative that other ranks need are sent to them after each iteration (see exchangeGhosts()).
+*/
+
+#include "lime.h"
+
+static double *sortKey;
+
+static int
+compareKey(const void *a, const void *b){
+  double ka=sortKey[*(const int *)a], kb=sortKey[*(const int *)b];
+
+  if(ka<kb) return -1;
+  if(ka>kb) return 1;
+  return *(const int *)a-*(const int *)b;
+}
+
+/* Gives the n points ids[] the representative closest to their mean (u,v) */
+static void
+setRep(struct grid *g, int *ids, int n, double *u, double *v){
+  double um=0.,vm=0.,d,best=1e300;
+  int i,rep=ids[0];
+
+  for(i=0;i<n;i++){
+    um+=u[ids[i]];
+    vm+=v[ids[i]];
+  }
+  um/=n;
+  vm/=n;
+  for(i=0;i<n;i++){
+    d=(u[ids[i]]-um)*(u[ids[i]]-um)+(v[ids[i]]-vm)*(v[ids[i]]-vm);
+    if(d<best){
+      best=d;
+      rep=ids[i];
+    }
+  }
+  for(i=0;i<n;i++) g[ids[i]].rep=rep;
+}
+
+/* Sets the representative point g[id].rep of every grid point */
+void
+symmetryReduce(inputPars *par, struct grid *g){
+  int id,i,j,n,nRep,nu,nv,lo,hi,lo2,hi2,*ids;
+  double *u,*v;
+
+  for(id=0;id<par->ncell;id++) g[id].rep=id;
+  if(par->symmetry==0) return;
+
+  nRep=par->symmetryPoints;
+  if(nRep<=0) nRep=(par->symmetry==1) ? 500 : 5000;
+  if(nRep>par->pIntensity) nRep=par->pIntensity;
+  if(par->symmetry==1){
+    nu=nRep;
+    nv=1;
+  } else {
+    nu=(int)sqrt((double)nRep);
+    nv=nRep/gsl_max(nu,1);
+  }
+
+  u=malloc(sizeof(double)*par->pIntensity);
+  v=malloc(sizeof(double)*par->pIntensity);
+  ids=malloc(sizeof(int)*par->pIntensity);
+  n=0;
+  for(id=0;id<par->pIntensity;id++){
+    if(par->symmetry==1){
+      u[id]=sqrt(g[id].x[0]*g[id].x[0]+g[id].x[1]*g[id].x[1]+g[id].x[2]*g[id].x[2]);
+      v[id]=0.;
+    } else {
+      u[id]=sqrt(g[id].x[0]*g[id].x[0]+g[id].x[1]*g[id].x[1]);
+      v[id]=g[id].x[2];
+    }
+    if(!g[id].sink) ids[n++]=id;
+  }
+
+  /* Equal-count bins in u, each cut into equal-count bins in v */
+  sortKey=u;
+  qsort(ids, n, sizeof(int), compareKey);
+  for(i=0;i<nu;i++){
+    lo=(int)((long)n*i/nu);
+    hi=(int)((long)n*(i+1)/nu);
+    if(hi<=lo) continue;
+    sortKey=v;
+    qsort(ids+lo, hi-lo, sizeof(int), compareKey);
+    for(j=0;j<nv;j++){
+      lo2=lo+(int)((long)(hi-lo)*j/nv);
+      hi2=lo+(int)((long)(hi-lo)*(j+1)/nv);
+      if(hi2<=lo2) continue;
+      setRep(g, ids+lo2, hi2-lo2, u, v);
+    }
+  }
+
+  free(u);
+  free(v);
+  free(ids);
+}
+
+/* Copies the populations of the representatives to the other points of their bins */
+void
+symmetryFill(inputPars *par, molData *m, struct grid *g){
+  int id,ispec,ilev;
+
+  if(par->symmetry==0) return;
+  for(id=0;id<par->pIntensity;id++){
+    if(g[id].rep==id) continue;
+    for(ispec=0;ispec<par->nSpecies;ispec++){
+      if(g[id].mol[ispec].pops==NULL) continue;
+      for(ilev=0;ilev<m[ispec].nlev;ilev++) g[id].mol[ispec].pops[ilev]=g[g[id].rep].mol[ispec].pops[ilev];
+    }
+  }
+}
@@ -0,0 +1,90 @@
+/*
+ *  timers.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Wall-clock timers for the phases of a LIME run. Each call of timerBegin() opens a new record, numbered per phase name in order of appearance (e.g. the 3rd qhull call is "qhull" index 2). Records are only opened and closed from serial code; parallel regions collect their per-thread busy times in a local array and hand it to timerThreads() afterwards. The records are written out by report().
+*/
+
+#include "lime.h"
+
+static timerRecord *records=NULL;
+static int nRecords=0, maxRecords=0;
+
+double
+wallTime(){
+  return omp_get_wtime();
+}
+
+int
+timerBegin(const char *phase){
+  int i,index=0;
+
+  for(i=0;i<nRecords;i++) if(!strcmp(records[i].phase, phase)) index++;
+  if(nRecords==maxRecords){
+    maxRecords=(maxRecords==0) ? 64 : 2*maxRecords;
+    records=realloc(records, sizeof(timerRecord)*maxRecords);
+  }
+  strncpy(records[nRecords].phase, phase, sizeof(records[nRecords].phase)-1);
+  records[nRecords].phase[sizeof(records[nRecords].phase)-1]='\0';
+  records[nRecords].index=index;
+  records[nRecords].start=wallTime();
+  records[nRecords].wall=0.;
+  records[nRecords].busy=0.;
+  records[nRecords].idle=0.;
+  records[nRecords].nThreads=1;
+  return nRecords++;
+}
+
+void
+timerEnd(int rec){
+  records[rec].wall=wallTime()-records[rec].start;
+  if(records[rec].nThreads==1) records[rec].busy=records[rec].wall;
+}
+
+/* Thread accounting for a record that covered a parallel region: busy[] holds the time each thread spent working, the rest of the wall time of the record counts as idle. Call after timerEnd(). */
+void
+timerThreads(int rec, int nThreads, double *busy){
+  int i;
+
+  records[rec].nThreads=nThreads;
+  records[rec].busy=0.;
+  for(i=0;i<nThreads;i++) records[rec].busy+=busy[i];
+  records[rec].idle=nThreads*records[rec].wall-records[rec].busy;
+  if(records[rec].idle<0.) records[rec].idle=0.;
+}
+
+/* A sub-phase accumulated inside a parallel region, e.g. the photon() part of a levelPops iteration. Its wall time is that of the slowest thread. */
+void
+timerAddThreads(const char *phase, int nThreads, double *busy){
+  int i,rec;
+  double wall=0.;
+
+  rec=timerBegin(phase);
+  for(i=0;i<nThreads;i++) if(busy[i]>wall) wall=busy[i];
+  records[rec].wall=wall;
+  timerThreads(rec, nThreads, busy);
+}
+
+int
+timerCount(){
+  return nRecords;
+}
+
+timerRecord *
+timerGet(int rec){
+  return &records[rec];
+}
+
+void
+freeTimers(){
+  free(records);
+  records=NULL;
+  nRecords=0;
+  maxRecords=0;
+}
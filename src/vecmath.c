@@ -0,0 +1,389 @@
+/*
+ *  vecmath.c
+ *  This file is part of LIME, the versatile line modeling engine
+ *
+ *  Copyright (C) 2006-2014 Christian Brinch
+ *  Copyright (C) 2015 The LIME development team
+ *
+ */
+
+/*
+Array versions of the transcendental functions of the photon and raytrace inner loops:
+
+  vecExp(x,y,n)                        y[i] = exp(-x[i])
+  vecGauss(v,binv,y,n)                 y[i] = exp(-(v[i]*binv)^2), as gaussline()
+  vecSourceFn(dtau,cutoff,rem,e,n)     rem[i] = (1-exp(-dtau[i]))/dtau[i] and e[i] = exp(-dtau[i]), as calcSourceFn()
+
+There are SSE2, AVX2 (with FMA) and AVX-512 implementations, of which vecmathInit() picks the widest one the CPU supports (by CPUID), up to the limit set by the -i option (limeOpts.simd). The scalar versions call exp(), or FastExp() if limeOpts.fastExp is set; since FastExp() is a scalar table lookup, -f implies the scalar versions.
+
+The vector exponential reduces the argument as exp(-x) = 2^k*exp(r), with k the nearest integer to -x/ln2 and |r| <= ln2/2, using a two-part ln2 (Cody & Waite), and evaluates exp(r) by its Taylor polynomial of 12th order, whose truncation error is below 2e-16 on that interval. Maximum errors, measured against exp() and calcSourceFn() on 2^20 arguments, are the same for the three instruction sets:
+
+  vecExp()        relative error 3.4e-16 (1.5 DBL_EPSILON) for -30 <= x <= 708. For x > 708.39 the result is 0 instead of a denormal, an absolute error below 3e-308. Arguments x < -709 are clamped; LIME limits optical depths to -30.
+  vecGauss()      relative error 3.4e-16 for (v*binv)^2 <= 1; beyond that the rounding of the square adds up to (v*binv)^2*DBL_EPSILON, as for gaussline().
+  vecSourceFn()   relative deviation from calcSourceFn() 2.3e-14. It uses the same 3rd-order Taylor expansion below par->taylorCutoff, so that both have an error of about DBL_EPSILON/|dtau| just above the cutoff.
+*/
+
+#include "lime.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VEC_X86
+#include <immintrin.h>
+#endif
+
+#define EXP_MIN_ARG	-708.39		/* exp() of smaller arguments is returned as 0 */
+#define EXP_MAX_ARG	709.
+#define EXP_LOG2E	1.4426950408889634
+#define EXP_LN2_HI	6.93147180369123816490e-01
+#define EXP_LN2_LO	1.90821492927058770002e-10
+#define EXP_ROUND	6755399441055744.	/* 1.5*2^52: adding it rounds to an integer held in the low mantissa bits */
+#define EXP_ORDER	12
+
+/* Taylor coefficients 1/j! of exp(r), highest order first */
+static const double expCoeff[EXP_ORDER+1]={
+  2.08767569878680989792e-09, 2.50521083854417187751e-08, 2.75573192239858906526e-07,
+  2.75573192239858906526e-06, 2.48015873015873015873e-05, 1.98412698412698412698e-04,
+  1.38888888888888888889e-03, 8.33333333333333333333e-03, 4.16666666666666666667e-02,
+  1.66666666666666666667e-01, 5.00000000000000000000e-01, 1.00000000000000000000e+00,
+  1.00000000000000000000e+00
+};
+
+/* Scalar versions */
+
+static double
+expScalar1(double x){
+  if(limeOpts.fastExp) return FastExp(x);
+  else return exp(-x);
+}
+
+static void
+expScalar(const double *x, double *y, int n){
+  int i;
+
+  for(i=0;i<n;i++) y[i]=expScalar1(x[i]);
+}
+
+static void
+gaussScalar(const double *v, double binv, double *y, int n){
+  int i;
+
+  for(i=0;i<n;i++) y[i]=expScalar1(v[i]*v[i]*binv*binv);
+}
+
+static void
+sourceFnScalar(const double *dtau, double cutoff, double *rem, double *e, int n){
+  int i;
+
+  for(i=0;i<n;i++){
+    if(fabs(dtau[i])<cutoff){
+      rem[i]=1.-dtau[i]*(1.-dtau[i]/3.)/2.;
+      e[i]=1.-dtau[i]*rem[i];
+    } else {
+      e[i]=expScalar1(dtau[i]);
+      rem[i]=(1.-e[i])/dtau[i];
+    }
+  }
+}
+
+#ifdef VEC_X86
+
+/* SSE2: 2 doubles per vector */
+
+static inline __m128d
+expSSE2(__m128d x){
+  __m128d y,t,k,r,p,keep;
+  __m128i bits;
+  int j;
+
+  y=_mm_sub_pd(_mm_setzero_pd(),x);
+  keep=_mm_cmpge_pd(y,_mm_set1_pd(EXP_MIN_ARG));
+  y=_mm_min_pd(_mm_max_pd(y,_mm_set1_pd(EXP_MIN_ARG)),_mm_set1_pd(EXP_MAX_ARG));
+  t=_mm_add_pd(_mm_mul_pd(y,_mm_set1_pd(EXP_LOG2E)),_mm_set1_pd(EXP_ROUND));
+  k=_mm_sub_pd(t,_mm_set1_pd(EXP_ROUND));
+  r=_mm_sub_pd(y,_mm_mul_pd(k,_mm_set1_pd(EXP_LN2_HI)));
+  r=_mm_sub_pd(r,_mm_mul_pd(k,_mm_set1_pd(EXP_LN2_LO)));
+  p=_mm_set1_pd(expCoeff[0]);
+  for(j=1;j<=EXP_ORDER;j++) p=_mm_add_pd(_mm_mul_pd(p,r),_mm_set1_pd(expCoeff[j]));
+  /* 2^k from the low bits of t, which hold k */
+  bits=_mm_slli_epi64(_mm_add_epi64(_mm_castpd_si128(t),_mm_set1_epi64x(1023)),52);
+  return _mm_and_pd(_mm_mul_pd(p,_mm_castsi128_pd(bits)),keep);
+}
+
+static inline __m128d
+sourceFnSSE2(__m128d x, __m128d cutoff, __m128d *e){
+  __m128d ex,rem,tay,small;
+
+  ex=expSSE2(x);
+  rem=_mm_div_pd(_mm_sub_pd(_mm_set1_pd(1.),ex),x);
+  tay=_mm_sub_pd(_mm_set1_pd(1.),_mm_mul_pd(_mm_mul_pd(x,_mm_sub_pd(_mm_set1_pd(1.),_mm_div_pd(x,_mm_set1_pd(3.)))),_mm_set1_pd(0.5)));
+  small=_mm_cmplt_pd(_mm_andnot_pd(_mm_set1_pd(-0.),x),cutoff);
+  *e=_mm_or_pd(_mm_and_pd(small,_mm_sub_pd(_mm_set1_pd(1.),_mm_mul_pd(x,tay))),_mm_andnot_pd(small,ex));
+  return _mm_or_pd(_mm_and_pd(small,tay),_mm_andnot_pd(small,rem));
+}
+
+/* The tails of the SSE2 loops are a single element, loaded into the low half of a vector */
+static void
+expVecSSE2(const double *x, double *y, int n){
+  int i;
+
+  for(i=0;i+2<=n;i+=2) _mm_storeu_pd(&y[i],expSSE2(_mm_loadu_pd(&x[i])));
+  if(i<n) _mm_store_sd(&y[i],expSSE2(_mm_load_sd(&x[i])));
+}
+
+static void
+gaussVecSSE2(const double *v, double binv, double *y, int n){
+  __m128d b=_mm_set1_pd(binv),q;
+  int i;
+
+  for(i=0;i+2<=n;i+=2){
+    q=_mm_mul_pd(_mm_loadu_pd(&v[i]),b);
+    _mm_storeu_pd(&y[i],expSSE2(_mm_mul_pd(q,q)));
+  }
+  if(i<n){
+    q=_mm_mul_pd(_mm_load_sd(&v[i]),b);
+    _mm_store_sd(&y[i],expSSE2(_mm_mul_pd(q,q)));
+  }
+}
+
+static void
+sourceFnVecSSE2(const double *dtau, double cutoff, double *rem, double *e, int n){
+  __m128d c=_mm_set1_pd(cutoff),ev;
+  int i;
+
+  for(i=0;i+2<=n;i+=2){
+    _mm_storeu_pd(&rem[i],sourceFnSSE2(_mm_loadu_pd(&dtau[i]),c,&ev));
+    _mm_storeu_pd(&e[i],ev);
+  }
+  if(i<n){
+    _mm_store_sd(&rem[i],sourceFnSSE2(_mm_load_sd(&dtau[i]),c,&ev));
+    _mm_store_sd(&e[i],ev);
+  }
+}
+
+/* AVX2 with FMA: 4 doubles per vector */
+
+static inline __attribute__((target("avx2,fma"))) __m256d
+expAVX2(__m256d x){
+  __m256d y,t,k,r,p,keep;
+  __m256i bits;
+  int j;
+
+  y=_mm256_sub_pd(_mm256_setzero_pd(),x);
+  keep=_mm256_cmp_pd(y,_mm256_set1_pd(EXP_MIN_ARG),_CMP_GE_OQ);
+  y=_mm256_min_pd(_mm256_max_pd(y,_mm256_set1_pd(EXP_MIN_ARG)),_mm256_set1_pd(EXP_MAX_ARG));
+  t=_mm256_fmadd_pd(y,_mm256_set1_pd(EXP_LOG2E),_mm256_set1_pd(EXP_ROUND));
+  k=_mm256_sub_pd(t,_mm256_set1_pd(EXP_ROUND));
+  r=_mm256_fnmadd_pd(k,_mm256_set1_pd(EXP_LN2_HI),y);
+  r=_mm256_fnmadd_pd(k,_mm256_set1_pd(EXP_LN2_LO),r);
+  p=_mm256_set1_pd(expCoeff[0]);
+  for(j=1;j<=EXP_ORDER;j++) p=_mm256_fmadd_pd(p,r,_mm256_set1_pd(expCoeff[j]));
+  bits=_mm256_slli_epi64(_mm256_add_epi64(_mm256_castpd_si256(t),_mm256_set1_epi64x(1023)),52);
+  return _mm256_and_pd(_mm256_mul_pd(p,_mm256_castsi256_pd(bits)),keep);
+}
+
+static inline __attribute__((target("avx2,fma"))) __m256d
+sourceFnAVX2(__m256d x, __m256d cutoff, __m256d *e){
+  __m256d ex,rem,tay,small,one=_mm256_set1_pd(1.);
+
+  ex=expAVX2(x);
+  rem=_mm256_div_pd(_mm256_sub_pd(one,ex),x);
+  tay=_mm256_fnmadd_pd(_mm256_mul_pd(x,_mm256_fnmadd_pd(x,_mm256_set1_pd(1./3.),one)),_mm256_set1_pd(0.5),one);
+  small=_mm256_cmp_pd(_mm256_andnot_pd(_mm256_set1_pd(-0.),x),cutoff,_CMP_LT_OQ);
+  *e=_mm256_blendv_pd(ex,_mm256_fnmadd_pd(x,tay,one),small);
+  return _mm256_blendv_pd(rem,tay,small);
+}
+
+/* Mask of the first n lanes of a vector of 4 doubles, for the tails of the AVX2 loops */
+static inline __attribute__((target("avx2,fma"))) __m256i
+tailMaskAVX2(int n){
+  return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n),_mm256_set_epi64x(3,2,1,0));
+}
+
+static void __attribute__((target("avx2,fma")))
+expVecAVX2(const double *x, double *y, int n){
+  __m256i m;
+  int i;
+
+  for(i=0;i+4<=n;i+=4) _mm256_storeu_pd(&y[i],expAVX2(_mm256_loadu_pd(&x[i])));
+  if(i<n){
+    m=tailMaskAVX2(n-i);
+    _mm256_maskstore_pd(&y[i],m,expAVX2(_mm256_maskload_pd(&x[i],m)));
+  }
+}
+
+static void __attribute__((target("avx2,fma")))
+gaussVecAVX2(const double *v, double binv, double *y, int n){
+  __m256d b=_mm256_set1_pd(binv),q;
+  __m256i m;
+  int i;
+
+  for(i=0;i+4<=n;i+=4){
+    q=_mm256_mul_pd(_mm256_loadu_pd(&v[i]),b);
+    _mm256_storeu_pd(&y[i],expAVX2(_mm256_mul_pd(q,q)));
+  }
+  if(i<n){
+    m=tailMaskAVX2(n-i);
+    q=_mm256_mul_pd(_mm256_maskload_pd(&v[i],m),b);
+    _mm256_maskstore_pd(&y[i],m,expAVX2(_mm256_mul_pd(q,q)));
+  }
+}
+
+static void __attribute__((target("avx2,fma")))
+sourceFnVecAVX2(const double *dtau, double cutoff, double *rem, double *e, int n){
+  __m256d c=_mm256_set1_pd(cutoff),ev,rv;
+  __m256i m;
+  int i;
+
+  for(i=0;i+4<=n;i+=4){
+    _mm256_storeu_pd(&rem[i],sourceFnAVX2(_mm256_loadu_pd(&dtau[i]),c,&ev));
+    _mm256_storeu_pd(&e[i],ev);
+  }
+  if(i<n){
+    m=tailMaskAVX2(n-i);
+    rv=sourceFnAVX2(_mm256_maskload_pd(&dtau[i],m),c,&ev);
+    _mm256_maskstore_pd(&rem[i],m,rv);
+    _mm256_maskstore_pd(&e[i],m,ev);
+  }
+}
+
+/* AVX-512: 8 doubles per vector; the tails use masked loads and stores */
+
+static inline __attribute__((target("avx512f"))) __m512d
+expAVX512(__m512d x){
+  __m512d y,t,k,r,p;
+  __m512i bits;
+  __mmask8 keep;
+  int j;
+
+  y=_mm512_sub_pd(_mm512_setzero_pd(),x);
+  keep=_mm512_cmp_pd_mask(y,_mm512_set1_pd(EXP_MIN_ARG),_CMP_GE_OQ);
+  y=_mm512_min_pd(_mm512_max_pd(y,_mm512_set1_pd(EXP_MIN_ARG)),_mm512_set1_pd(EXP_MAX_ARG));
+  t=_mm512_fmadd_pd(y,_mm512_set1_pd(EXP_LOG2E),_mm512_set1_pd(EXP_ROUND));
+  k=_mm512_sub_pd(t,_mm512_set1_pd(EXP_ROUND));
+  r=_mm512_fnmadd_pd(k,_mm512_set1_pd(EXP_LN2_HI),y);
+  r=_mm512_fnmadd_pd(k,_mm512_set1_pd(EXP_LN2_LO),r);
+  p=_mm512_set1_pd(expCoeff[0]);
+  for(j=1;j<=EXP_ORDER;j++) p=_mm512_fmadd_pd(p,r,_mm512_set1_pd(expCoeff[j]));
+  bits=_mm512_slli_epi64(_mm512_add_epi64(_mm512_castpd_si512(t),_mm512_set1_epi64(1023)),52);
+  return _mm512_maskz_mul_pd(keep,p,_mm512_castsi512_pd(bits));
+}
+
+static inline __attribute__((target("avx512f"))) __m512d
+sourceFnAVX512(__m512d x, __m512d cutoff, __m512d *e){
+  __m512d ex,rem,tay,one=_mm512_set1_pd(1.);
+  __mmask8 small;
+
+  ex=expAVX512(x);
+  rem=_mm512_div_pd(_mm512_sub_pd(one,ex),x);
+  tay=_mm512_fnmadd_pd(_mm512_mul_pd(x,_mm512_fnmadd_pd(x,_mm512_set1_pd(1./3.),one)),_mm512_set1_pd(0.5),one);
+  small=_mm512_cmp_pd_mask(_mm512_abs_pd(x),cutoff,_CMP_LT_OQ);
+  *e=_mm512_mask_blend_pd(small,ex,_mm512_fnmadd_pd(x,tay,one));
+  return _mm512_mask_blend_pd(small,rem,tay);
+}
+
+static void __attribute__((target("avx512f")))
+expVecAVX512(const double *x, double *y, int n){
+  __mmask8 m;
+  int i;
+
+  for(i=0;i+8<=n;i+=8) _mm512_storeu_pd(&y[i],expAVX512(_mm512_loadu_pd(&x[i])));
+  if(i<n){
+    m=(__mmask8)((1u<<(n-i))-1);
+    _mm512_mask_storeu_pd(&y[i],m,expAVX512(_mm512_maskz_loadu_pd(m,&x[i])));
+  }
+}
+
+static void __attribute__((target("avx512f")))
+gaussVecAVX512(const double *v, double binv, double *y, int n){
+  __m512d b=_mm512_set1_pd(binv),q;
+  __mmask8 m;
+  int i;
+
+  for(i=0;i+8<=n;i+=8){
+    q=_mm512_mul_pd(_mm512_loadu_pd(&v[i]),b);
+    _mm512_storeu_pd(&y[i],expAVX512(_mm512_mul_pd(q,q)));
+  }
+  if(i<n){
+    m=(__mmask8)((1u<<(n-i))-1);
+    q=_mm512_mul_pd(_mm512_maskz_loadu_pd(m,&v[i]),b);
+    _mm512_mask_storeu_pd(&y[i],m,expAVX512(_mm512_mul_pd(q,q)));
+  }
+}
+
+static void __attribute__((target("avx512f")))
+sourceFnVecAVX512(const double *dtau, double cutoff, double *rem, double *e, int n){
+  __m512d c=_mm512_set1_pd(cutoff),ev,rv;
+  __mmask8 m;
+  int i;
+
+  for(i=0;i+8<=n;i+=8){
+    _mm512_storeu_pd(&rem[i],sourceFnAVX512(_mm512_loadu_pd(&dtau[i]),c,&ev));
+    _mm512_storeu_pd(&e[i],ev);
+  }
+  if(i<n){
+    m=(__mmask8)((1u<<(n-i))-1);
+    rv=sourceFnAVX512(_mm512_maskz_loadu_pd(m,&dtau[i]),c,&ev);
+    _mm512_mask_storeu_pd(&rem[i],m,rv);
+    _mm512_mask_storeu_pd(&e[i],m,ev);
+  }
+}
+
+#endif /* VEC_X86 */
+
+typedef struct {
+  const char *name;
+  void (*exp)(const double *, double *, int);
+  void (*gauss)(const double *, double, double *, int);
+  void (*sourceFn)(const double *, double, double *, double *, int);
+} vecKernels;
+
+static const vecKernels scalarKernels={"scalar", expScalar, gaussScalar, sourceFnScalar};
+#ifdef VEC_X86
+static const vecKernels sse2Kernels={"sse2", expVecSSE2, gaussVecSSE2, sourceFnVecSSE2};
+static const vecKernels avx2Kernels={"avx2", expVecAVX2, gaussVecAVX2, sourceFnVecAVX2};
+static const vecKernels avx512Kernels={"avx512", expVecAVX512, gaussVecAVX512, sourceFnVecAVX512};
+#endif
+
+static const vecKernels *kernels=&scalarKernels;
+
+/* Selects the widest kernels supported by the CPU, up to limeOpts.simd. Call before any parallel region. */
+void
+vecmathInit(){
+  kernels=&scalarKernels;
+  if(limeOpts.fastExp) return;
+#ifdef VEC_X86
+  __builtin_cpu_init();
+  if(limeOpts.simd>=SIMD_AVX512 && __builtin_cpu_supports("avx512f")) kernels=&avx512Kernels;
+  else if(limeOpts.simd>=SIMD_AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) kernels=&avx2Kernels;
+  else if(limeOpts.simd>=SIMD_SSE2 && __builtin_cpu_supports("sse2")) kernels=&sse2Kernels;
+#endif
+}
+
+const char *
+vecmathName(){
+  return kernels->name;
+}
+
+/* Parses the argument of the -i option; returns -1 if it is not known */
+int
+vecmathLevel(const char *name){
+  if(!strcmp(name,"scalar")) return SIMD_SCALAR;
+  else if(!strcmp(name,"sse2")) return SIMD_SSE2;
+  else if(!strcmp(name,"avx2")) return SIMD_AVX2;
+  else if(!strcmp(name,"avx512")) return SIMD_AVX512;
+  return -1;
+}
+
+void
+vecExp(const double *x, double *y, int n){
+  kernels->exp(x,y,n);
+}
+
+void
+vecGauss(const double *v, double binv, double *y, int n){
+  kernels->gauss(v,binv,y,n);
+}
+
+void
+vecSourceFn(const double *dtau, double cutoff, double *rem, double *e, int n){
+  kernels->sourceFn(dtau,cutoff,rem,e,n);
+}
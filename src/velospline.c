@@ -9,55 +9,158 @@
 
 #include "lime.h"
 
+/*
+The velocity along each Delaunay edge of length ds is represented by a quartic in the reduced distance t=d/ds from the vertex,
+
+  v(t) = a0 + a1*t + a2*t^2 + a3*t^3 + a4*t^4,
+
+fitted to 5 samples of the projected velocity. Since the samples are always taken at t = {0,1/4,1/2,3/4,1}, the inverse of the Vandermonde matrix is fixed:
+
+        |   3     0     0     0    0 |
+        | -25    48   -36    16   -3 |
+  1/3 * |  70  -208   228  -112   22 |
+        | -80   288  -384   224  -48 |
+        |  32  -128   192  -128   32 |
+
+which gives the coefficients a_n (c_n below). Unlike the coefficients of d itself, a_n/ds^n, these are all of the order of the velocities, so that they can be stored in single precision (-DSINGLE_STORE).
+
+If the user supplies velocityGradient(), the derivatives g0 and g1 of the projected velocity with respect to t at the two ends of the edge replace the samples at t=1/4 and 3/4, and the fit is instead
+
+  c0 = v0
+  c1 = g0
+  c2 = -11*v0 - 4*g0 + 16*vm -  5*v1 +   g1
+  c3 =  18*v0 + 5*g0 - 32*vm + 14*v1 - 3*g1
+  c4 =  -8*v0 - 2*g0 + 16*vm -  8*v1 + 2*g1
+
+where vm is the sample at t=1/2. This needs only one call to velocity() per edge.
+
+The samples of the edge j->i are those of i->j in reverse order and with the opposite sign of the projection, so each edge is sampled only once and the coefficients of both directions are set from the same samples.
+*/
+
+double
+edgeGradient(double *grad, double *n){
+  /* Returns the derivative of the velocity component along n, in the direction n. */
+  int i,j;
+  double dvds=0.;
+
+  for(i=0;i<3;i++){
+    for(j=0;j<3;j++) dvds+=n[i]*grad[i*3+j]*n[j];
+  }
+  return dvds;
+}
+
+void
+setSplineCoeffs(struct grid *gp, int k, double *c){
+  gp->a0[k]=c[0];
+  gp->a1[k]=c[1];
+  gp->a2[k]=c[2];
+  gp->a3[k]=c[3];
+  gp->a4[k]=c[4];
+}
+
+/* Fits the spline of the edge from grid point i to its k'th neighbour, whose ends have the velocities vi and vj (and the gradients gi and gj if useGrad), to c, and that of the reversed edge to cr */
+void
+fitEdgeSpline(struct grid *g, int i, int k, double *vi, double *vj, double *gi, double *gj, int useGrad, double *c, double *cr){
+  int l,m;
+  double v[5],vel[3],x[3];
+
+  v[0]=veloproject(g[i].dir[k].xn,vi);
+  v[4]=veloproject(g[i].dir[k].xn,vj);
+
+  if(useGrad){
+    for(l=0;l<3;l++) x[l]=g[i].x[l]+g[i].dir[k].x[l]*0.5;
+    velocity(x[0],x[1],x[2],vel);
+    v[2]=veloproject(g[i].dir[k].xn,vel);
+    v[1]=g[i].ds[k]*edgeGradient(gi,g[i].dir[k].xn);
+    v[3]=g[i].ds[k]*edgeGradient(gj,g[i].dir[k].xn);
+
+    c[0]=v[0];
+    c[1]=v[1];
+    c[2]=-11.*v[0]-4.*v[1]+16.*v[2]- 5.*v[4]+   v[3];
+    c[3]= 18.*v[0]+5.*v[1]-32.*v[2]+14.*v[4]-3.*v[3];
+    c[4]= -8.*v[0]-2.*v[1]+16.*v[2]- 8.*v[4]+2.*v[3];
+
+    /* Reversed edge: the end values swap and change sign; the t-derivatives swap but keep their sign. */
+    cr[0]=-v[4];
+    cr[1]=v[3];
+    cr[2]= 11.*v[4]-4.*v[3]-16.*v[2]+ 5.*v[0]+   v[1];
+    cr[3]=-18.*v[4]+5.*v[3]+32.*v[2]-14.*v[0]-3.*v[1];
+    cr[4]=  8.*v[4]-2.*v[3]-16.*v[2]+ 8.*v[0]+2.*v[1];
+  } else {
+    for(l=1;l<4;l++){
+      for(m=0;m<3;m++) x[m]=g[i].x[m]+g[i].dir[k].x[m]*0.25*l;
+      velocity(x[0],x[1],x[2],vel);
+      v[l]=veloproject(g[i].dir[k].xn,vel);
+    }
+
+    c[0]=v[0];
+    c[1]=(-25.*v[0]+ 48.*v[1]- 36.*v[2]+ 16.*v[3]- 3.*v[4])/3.;
+    c[2]=( 70.*v[0]-208.*v[1]+228.*v[2]-112.*v[3]+22.*v[4])/3.;
+    c[3]=(-80.*v[0]+288.*v[1]-384.*v[2]+224.*v[3]-48.*v[4])/3.;
+    c[4]=( 32.*v[0]-128.*v[1]+192.*v[2]-128.*v[3]+32.*v[4])/3.;
+
+    /* Reversed edge: v'[l] = -v[4-l]. */
+    cr[0]=-v[4];
+    cr[1]=-(-25.*v[4]+ 48.*v[3]- 36.*v[2]+ 16.*v[1]- 3.*v[0])/3.;
+    cr[2]=-( 70.*v[4]-208.*v[3]+228.*v[2]-112.*v[1]+22.*v[0])/3.;
+    cr[3]=-(-80.*v[4]+288.*v[3]-384.*v[2]+224.*v[1]-48.*v[0])/3.;
+    cr[4]=-( 32.*v[4]-128.*v[3]+192.*v[2]-128.*v[1]+32.*v[0])/3.;
+  }
+}
+
 void
 getVelosplines(inputPars *par, struct grid *g){
-  int i,k,j,l,s;
-  double v[5], vel[3], x[3], d;
-  gsl_matrix *matrix = gsl_matrix_alloc(5,5);
-  gsl_vector *a = gsl_vector_alloc(5);
-  gsl_vector *y = gsl_vector_alloc(5);
-  gsl_permutation *p = gsl_permutation_alloc(5);
-  
+  int i,j,k,kr,useGrad;
+  double (*vertVel)[3],(*vertGrad)[9]=NULL;
+  int timer=timerBegin("velocity_splines");
+
+  useGrad=modelVelocityGradient();
+
+  /* The velocities (and gradients) at the vertices are needed by every edge which touches them, so we calculate them once. The sink points keep a nominal velocity of zero, but their splines are still fitted to the model velocity at the sink position. */
+  vertVel=malloc(sizeof(*vertVel)*par->ncell);
+  if(useGrad) vertGrad=malloc(sizeof(*vertGrad)*par->ncell);
+
+  for(i=0;i<par->ncell;i++){
+    g[i].a0=malloc(g[i].numNeigh*sizeof(storeReal));
+    g[i].a1=malloc(g[i].numNeigh*sizeof(storeReal));
+    g[i].a2=malloc(g[i].numNeigh*sizeof(storeReal));
+    g[i].a3=malloc(g[i].numNeigh*sizeof(storeReal));
+    g[i].a4=malloc(g[i].numNeigh*sizeof(storeReal));
+  }
+
+  omp_set_dynamic(0);
+#pragma omp parallel for private(i) num_threads(par->nThreads) schedule(dynamic,256)
+  for(i=0;i<par->ncell;i++){
+    velocity(g[i].x[0],g[i].x[1],g[i].x[2],vertVel[i]);
+    if(useGrad) velocityGradient(g[i].x[0],g[i].x[1],g[i].x[2],vertGrad[i]);
+  }
+
+#pragma omp parallel for private(i,j,k,kr) num_threads(par->nThreads) schedule(dynamic,64)
   for(i=0;i<par->pIntensity;i++){
-    g[i].a0=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a1=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a2=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a3=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a4=malloc(g[i].numNeigh*sizeof(double));	
-    velocity(g[i].x[0],g[i].x[1],g[i].x[2],g[i].vel);
-    
+    double c[5],cr[5];
+
+    for(j=0;j<3;j++) g[i].vel[j]=vertVel[i][j];
+
     for(k=0;k<g[i].numNeigh;k++){
-      for(j=0;j<3;j++) x[j]=g[i].x[j];		
-      for(l=0;l<5;l++){
-        velocity(x[0],x[1],x[2],vel);			
-        v[l]=veloproject(g[i].dir[k].xn,vel);
-        for(j=0;j<3;j++) x[j]=x[j]+(g[i].dir[k].xn[j]*g[i].ds[k])/4.;
-      }
-      for(j=0;j<5;j++){
-        d=g[i].ds[k]/4*j;
-        gsl_matrix_set(matrix,j,0,d*d*d*d);		
-        gsl_matrix_set(matrix,j,1,d*d*d);		
-        gsl_matrix_set(matrix,j,2,d*d);		
-        gsl_matrix_set(matrix,j,3,d);		
-        gsl_matrix_set(matrix,j,4,1.);		
+      j=g[i].neigh[k]->id;
+      if(j<par->pIntensity && j<i) continue; /* This edge is done from the other end. */
+
+      fitEdgeSpline(g,i,k,vertVel[i],vertVel[j],useGrad ? vertGrad[i] : NULL,useGrad ? vertGrad[j] : NULL,useGrad,c,cr);
+      setSplineCoeffs(&g[i],k,c);
+
+      if(j<par->pIntensity){
+        kr=0;
+        while(kr<g[j].numNeigh && g[j].neigh[kr]->id!=i) kr++;
+        if(kr==g[j].numNeigh){
+          if(!silent) bail_out("Velocity spline error: Delaunay neighbours are not symmetric");
+          exit(1);
+        }
+        setSplineCoeffs(&g[j],kr,cr);
       }
-      for(j=0;j<5;j++) gsl_vector_set(y,j,v[j]);	
-      gsl_linalg_LU_decomp (matrix, p, &s);
-      gsl_linalg_LU_solve (matrix, p, y, a);
-      g[i].a0[k]=gsl_vector_get(a,4);
-      g[i].a1[k]=gsl_vector_get(a,3);
-      g[i].a2[k]=gsl_vector_get(a,2);
-      g[i].a3[k]=gsl_vector_get(a,1);
-      g[i].a4[k]=gsl_vector_get(a,0);
-    }		
+    }
   }
-  
+
   for(i=par->pIntensity;i<par->ncell;i++){
-    g[i].a0=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a1=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a2=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a3=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a4=malloc(g[i].numNeigh*sizeof(double));
     for(j=0;j<3;j++) g[i].vel[j]=0.;
     for(j=0;j<g[i].numNeigh;j++){
       g[i].a0[j]=0.;
@@ -67,11 +170,10 @@ getVelosplines(inputPars *par, struct grid *g){
       g[i].a4[j]=0.;
     }
   }
-  
-  gsl_permutation_free (p);
-  gsl_vector_free (a);
-  gsl_vector_free (y);
-  gsl_matrix_free (matrix);
+
+  free(vertVel);
+  if(useGrad) free(vertGrad);
+  timerEnd(timer);
 }
 
 
@@ -79,25 +181,27 @@ void
 getVelosplines_lin(inputPars *par, struct grid *g){
   int i,k,j;
   double v[2];
+  int timer=timerBegin("velocity_splines");
   
   for(i=0;i<par->pIntensity;i++){
-    g[i].a0=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a1=malloc(g[i].numNeigh*sizeof(double));		
+    g[i].a0=malloc(g[i].numNeigh*sizeof(storeReal));
+    g[i].a1=malloc(g[i].numNeigh*sizeof(storeReal));		
     for(k=0;k<g[i].numNeigh;k++){
       v[0]=veloproject(g[i].dir[k].xn,g[i].vel);
       v[1]=veloproject(g[i].dir[k].xn,g[i].neigh[k]->vel);
-      g[i].a1[k]=(v[0]-v[1])/(0-g[i].ds[k]);
+      g[i].a1[k]=v[1]-v[0];
       g[i].a0[k]=v[0];
     }		
   }
   
   for(i=par->pIntensity;i<par->ncell;i++){
-    g[i].a0=malloc(g[i].numNeigh*sizeof(double));
-    g[i].a1=malloc(g[i].numNeigh*sizeof(double));
+    g[i].a0=malloc(g[i].numNeigh*sizeof(storeReal));
+    g[i].a1=malloc(g[i].numNeigh*sizeof(storeReal));
     for(j=0;j<3;j++) g[i].vel[j]=0.;
     for(j=0;j<g[i].numNeigh;j++){
       g[i].a0[j]=0.;
       g[i].a1[j]=0.;
     }
   }	
+  timerEnd(timer);
 }
@@ -24,6 +24,11 @@ writefits(int im, inputPars *par, molData *m, image *img){
   long int fpixels[3],lpixels[3];
   char negfile[100]="! ";
 
+  /* Only rank 0 writes the output of an MPI run (see ranks.c) */
+  if(limeOpts.rank!=0) return;
+
+  int timer=timerBegin("writefits");
+
   row = malloc(sizeof(*row)*img[im].pxls);
 
   naxes[0]=img[im].pxls;
@@ -117,9 +122,35 @@ writefits(int im, inputPars *par, molData *m, image *img){
       fits_write_subset(fptr, TFLOAT, fpixels, lpixels, row, &status);
     }
   }
+
+  /* Cost of each pixel in raytrace(): cells crossed and wall time, as two planes of an image extension */
+  if(par->costMap){
+    naxes[2]=2;
+    fits_create_img(fptr, FLOAT_IMG, naxis, naxes, &status);
+    fits_write_key(fptr, TSTRING, "EXTNAME ", &"COST    ",    "", &status);
+    fits_write_key(fptr, TSTRING, "PLANE1  ", &"CELLS   ",    "Grid cells crossed by the rays", &status);
+    fits_write_key(fptr, TSTRING, "PLANE2  ", &"TIME    ",    "Wall time of the rays [s]", &status);
+    for(py=0;py<img[im].pxls;py++){
+      for(ichan=0;ichan<2;ichan++){
+        for(px=0;px<img[im].pxls;px++){
+          if(ichan==0) row[px]=(float) img[im].pixel[px+py*img[im].pxls].cells;
+          else row[px]=(float) img[im].pixel[px+py*img[im].pxls].time;
+        }
+        fpixels[0]=1;
+        fpixels[1]=py+1;
+        fpixels[2]=ichan+1;
+        lpixels[0]=img[im].pxls;
+        lpixels[1]=py+1;
+        lpixels[2]=ichan+1;
+        fits_write_subset(fptr, TFLOAT, fpixels, lpixels, row, &status);
+      }
+    }
+  }
+
   fits_close_file(fptr, &status);
 
   free(row);
+  timerEnd(timer);
 
   if(!silent) done(13);
 }